@@ -43,6 +43,41 @@ static const int host_bigendian = 1;
 
 #include "alac.h"
 
+/* SIMD versions of the hot loops are picked once at runtime (NEON when the
+ * compiler targets it). They give the very same bits as the scalar code,
+ * which is the reference and the fallback. Define ALAC_NO_SIMD to use the
+ * scalar code only, or call alac_simd() to limit what is used at runtime */
+#if !defined(ALAC_NO_SIMD) && (defined(__GNUC__) || defined(_MSC_VER)) && \
+    (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define USE_X86_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif !defined(ALAC_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__)) && \
+      (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define USE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__)
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define SIMD_TARGET(isa)
+#define ALWAYS_INLINE static __forceinline
+#else
+#define SIMD_TARGET(isa)
+#define ALWAYS_INLINE static inline
+#endif
+
+#if defined(USE_X86_SIMD) || defined(USE_NEON)
+enum { SIMD_NONE, SIMD_SSE41, SIMD_AVX2, SIMD_NEON };
+static int simd = SIMD_NONE;
+static int simd_cpu = -1; /* what the cpu has, once detected */
+#endif
+static int simd_limit = ALAC_SIMD_AUTO;
+
 #define _fprintf fprintf
 
 #define _Swap32(v) do { \
@@ -58,6 +93,8 @@ static const int host_bigendian = 1;
 struct {signed int x:24;} se_struct_24;
 #define SignExtend24(val) (se_struct_24.x = val)
 
+static void select_decoder(alac_file *alac);
+
 void allocate_buffers(alac_file *alac)
 {
     alac->predicterror_buffer_a = malloc(alac->setinfo_max_samples_per_frame * 4);
@@ -68,6 +105,9 @@ void allocate_buffers(alac_file *alac)
 
     alac->uncompressed_bytes_buffer_a = malloc(alac->setinfo_max_samples_per_frame * 4);
     alac->uncompressed_bytes_buffer_b = malloc(alac->setinfo_max_samples_per_frame * 4);
+
+    /* format is known now */
+    select_decoder(alac);
 }
 
 void alac_set_info(alac_file *alac, char *inputbuffer)
@@ -119,84 +159,78 @@ void alac_set_info(alac_file *alac, char *inputbuffer)
 
 /* stream reading */
 
-/* supports reading 1 to 16 bits, in big endian format */
-static uint32_t readbits_16(alac_file *alac, int bits)
-{
-    uint32_t result;
-    int new_accumulator;
-
-    result = (alac->input_buffer[0] << 16) |
-             (alac->input_buffer[1] << 8) |
-             (alac->input_buffer[2]);
-
-    /* shift left by the number of bits we've already read,
-     * so that the top 'n' bits of the 24 bits we read will
-     * be the return bits */
-    result = result << alac->input_buffer_bitaccumulator;
+/* the next bits of input are cached msb first, the cache is refilled with
+ * whole bytes, never beyond input_end. Reading past the end gives zeros and
+ * flags the error so that the frame can be rejected */
 
-    result = result & 0x00ffffff;
-
-    /* and then only want the top 'n' bits from that, where
-     * n is 'bits' */
-    result = result >> (24 - bits);
-
-    new_accumulator = (alac->input_buffer_bitaccumulator + bits);
+static uint64_t load_be64(const unsigned char *ptr)
+{
+    uint64_t word;
 
-    /* increase the buffer pointer if we've read over n bytes. */
-    alac->input_buffer += (new_accumulator >> 3);
+    memcpy(&word, ptr, 8);
 
-    /* and the remainder goes back into the bit accumulator */
-    alac->input_buffer_bitaccumulator = (new_accumulator & 7);
+    if (host_bigendian)
+        return word;
 
-    return result;
+#if defined(__GNUC__)
+    return __builtin_bswap64(word);
+#elif defined(_MSC_VER)
+    return _byteswap_uint64(word);
+#else
+    return ((uint64_t)ptr[0] << 56) | ((uint64_t)ptr[1] << 48) | ((uint64_t)ptr[2] << 40) | ((uint64_t)ptr[3] << 32) |
+           ((uint64_t)ptr[4] << 24) | ((uint64_t)ptr[5] << 16) | ((uint64_t)ptr[6] << 8) | ptr[7];
+#endif
 }
 
-/* supports reading 1 to 32 bits, in big endian format */
-static uint32_t readbits(alac_file *alac, int bits)
+static void refill(alac_file *alac)
 {
-    int32_t result = 0;
-
-    if (bits > 16)
+    if (alac->input_end - alac->input_buffer >= 8)
     {
-        bits -= 16;
-        result = readbits_16(alac, 16) << bits;
-    }
+        /* bits of a partial byte below the cached ones are loaded again
+         * next time, so or-ing them twice is harmless */
+        int bytes = (64 - alac->input_cached) >> 3;
 
-    result |= readbits_16(alac, bits);
+        alac->input_cache |= load_be64(alac->input_buffer) >> alac->input_cached;
+        alac->input_buffer += bytes;
+        alac->input_cached += bytes * 8;
+        return;
+    }
 
-    return result;
+    while (alac->input_cached <= 56 && alac->input_buffer < alac->input_end)
+    {
+        alac->input_cache |= (uint64_t)*alac->input_buffer++ << (56 - alac->input_cached);
+        alac->input_cached += 8;
+    }
 }
 
-/* reads a single bit */
-static int readbit(alac_file *alac)
+/* makes sure 'bits' (up to 57) are cached */
+static void ensurebits(alac_file *alac, int bits)
 {
-    int result;
-    int new_accumulator;
-
-    result = alac->input_buffer[0];
-
-    result = result << alac->input_buffer_bitaccumulator;
-
-    result = result >> 7 & 1;
-
-    new_accumulator = (alac->input_buffer_bitaccumulator + 1);
-
-    alac->input_buffer += (new_accumulator / 8);
+    if (alac->input_cached >= bits) return;
 
-    alac->input_buffer_bitaccumulator = (new_accumulator % 8);
+    refill(alac);
 
-    return result;
+    if (alac->input_cached < bits)
+    {
+        /* cache is zero below what has been loaded */
+        alac->input_error = 1;
+        alac->input_cached = bits;
+    }
 }
 
-static void unreadbits(alac_file *alac, int bits)
+/* supports reading 0 to 32 bits, in big endian format */
+static uint32_t readbits(alac_file *alac, int bits)
 {
-    int new_accumulator = (alac->input_buffer_bitaccumulator - bits);
+    uint32_t result;
 
-    alac->input_buffer += (new_accumulator >> 3);
+    if (!bits) return 0;
 
-    alac->input_buffer_bitaccumulator = (new_accumulator & 7);
-    if (alac->input_buffer_bitaccumulator < 0)
-        alac->input_buffer_bitaccumulator *= -1;
+    ensurebits(alac, bits);
+    result = (uint32_t)(alac->input_cache >> (64 - bits));
+    alac->input_cache <<= bits;
+    alac->input_cached -= bits;
+
+    return result;
 }
 
 /* various implementations of count_leading_zero:
@@ -226,7 +260,7 @@ static int count_leading_zeros(int32_t input)
  */
 static int count_leading_zeros(int input)
 {
-    return __builtin_clz(input);
+    return input ? __builtin_clz(input) : 32;
 }
 #elif (defined(_MSC_VER) || defined (__BORLANDC__)) && defined(_M_IX86)
 static int count_leading_zeros(int input)
@@ -291,52 +325,79 @@ found:
 #endif
 
 #define RICE_THRESHOLD 8 // maximum number of bits for a rice prefix.
+#define RICE_KMAX 16 // maximum rice parameter (it's never above kmodifier)
+
+/* a rice prefix is never more than RICE_THRESHOLD + 1 bits, so looking at
+ * the top of the cache is enough (the low bit set avoids clz of 0) */
+static int count_leading_ones(uint64_t input)
+{
+    return count_leading_zeros((int)(~(uint32_t)(input >> 32) | 1));
+}
 
-static int32_t entropy_decode_value(alac_file* alac,
+ALWAYS_INLINE int32_t entropy_decode_value(alac_file* alac,
                              int readSampleSize,
 							 int k,
                              int rice_kmodifier_mask)
 {
-    int32_t x = 0; // decoded value
+    int32_t x; // decoded value
+    uint64_t cache;
+    int used;
 
-    // read x, number of 1s before 0 represent the rice value.
-    while (x <= RICE_THRESHOLD && readbit(alac))
-    {
-        x++;
-    }
+    // prefix and k bits are then always in the cache (k is at most RICE_KMAX)
+    if (alac->input_cached < RICE_THRESHOLD + 1 + RICE_KMAX)
+        refill(alac);
+
+    cache = alac->input_cache;
+
+    // x, number of 1s before 0 represent the rice value, are counted at once
+    x = count_leading_ones(cache);
 
     if (x > RICE_THRESHOLD)
     {
         // read the number from the bit stream (raw value)
-        int32_t value;
-
-        value = readbits(alac, readSampleSize);
-
-        // mask value
-        value &= (((uint32_t)0xffffffff) >> (32 - readSampleSize));
-
-        x = value;
+        used = RICE_THRESHOLD + 1 + readSampleSize;
+        if (alac->input_cached < used)
+        {
+            refill(alac);
+            cache = alac->input_cache;
+        }
+        x = (uint32_t)((cache << (RICE_THRESHOLD + 1)) >> (64 - readSampleSize));
     }
     else
     {
+        used = x + 1;
+
         if (k != 1)
         {
-            int extraBits = readbits(alac, k);
+            int extraBits = (int)((cache << used) >> (64 - k));
 
             // x = x * (2^k - 1)
             x *= (((1 << k) - 1) & rice_kmodifier_mask);
 
+            // last bit belongs to next value when extra bits are 0 or 1
             if (extraBits > 1)
+            {
                 x += extraBits - 1;
+                used += k;
+            }
             else
-                unreadbits(alac, 1);
+                used += k - 1;
         }
     }
 
+    if (used > alac->input_cached)
+    {
+        alac->input_error = 1;
+        used = alac->input_cached;
+    }
+
+    alac->input_cache <<= used;
+    alac->input_cached -= used;
+
     return x;
 }
 
-static void entropy_rice_decode(alac_file* alac,
+ALWAYS_INLINE void entropy_rice_decode(alac_file* alac,
                          int32_t* outputBuffer,
                          int outputSize,
                          int readSampleSize,
@@ -364,9 +425,8 @@ static void entropy_rice_decode(alac_file* alac,
         decodedValue = entropy_decode_value(alac, readSampleSize, k, 0xFFFFFFFF);
 
         decodedValue += signModifier;
-        finalValue = (decodedValue + 1) / 2; // inc by 1 and shift out sign bit
-        if (decodedValue & 1) // the sign is stored in the low bit
-            finalValue *= -1;
+        // the sign is stored in the low bit, odd values are -(value + 1) / 2
+        finalValue = (decodedValue >> 1) ^ -(decodedValue & 1);
 
         outputBuffer[outputCount] = finalValue;
 
@@ -391,6 +451,13 @@ static void entropy_rice_decode(alac_file* alac,
 			// note: blockSize is always 16bit
             blockSize = entropy_decode_value(alac, 16, k, rice_kmodifier_mask);
 
+            // can't have more 0s than what is left
+            if (blockSize > outputSize - outputCount - 1)
+            {
+                alac->input_error = 1;
+                return;
+            }
+
             // got blockSize 0s
             if (blockSize > 0)
             {
@@ -406,13 +473,515 @@ static void entropy_rice_decode(alac_file* alac,
     }
 }
 
-#define SIGN_EXTENDED32(val, bits) ((val << (32 - bits)) >> (32 - bits))
+#define SIGN_EXTENDED32(val, bits) ((int32_t)((uint32_t)(val) << (32 - bits)) >> (32 - bits))
+
+/* what frames say is used in shifts, so it must be in range before anything
+ * is decoded. Quantitization is used as (1 << (q - 1)) except when there is
+ * no prediction (0 coefs) or with the 1st order shortcut (31 coefs) */
+#define PREDICTOR_VALID(coef_num, quantitization) \
+                     ((coef_num) == 0 || (coef_num) == 0x1f || (quantitization) > 0)
+#define INTERLACING_SHIFT_MAX 31
 
 #define SIGN_ONLY(v) \
                      ((v < 0) ? (-1) : \
                                 ((v > 0) ? (1) : \
                                            (0)))
 
+#if defined(USE_X86_SIMD) || defined(USE_NEON)
+/* one sample of the adaptive fir, once the dot product is known. Coefs are
+ * in reverse order and start at 1, so that coefs[m] applies to buffer_out[m]
+ * and can be loaded along with the samples */
+ALWAYS_INLINE void fir_adapt_step(int32_t *buffer_out, int error_val, int sum,
+                                  int readsamplesize, int16_t *coefs,
+                                  int predictor_coef_num,
+                                  int predictor_quantitization)
+{
+    int m;
+    int outval;
+
+    outval = (1 << (predictor_quantitization-1)) + sum;
+    outval = outval >> predictor_quantitization;
+    outval = outval + buffer_out[0] + error_val;
+    outval = SIGN_EXTENDED32(outval, readsamplesize);
+
+    buffer_out[predictor_coef_num+1] = outval;
+
+    /* adaptation depends on previous step, it stays serial */
+    if (error_val > 0)
+    {
+        for (m = 1; m <= predictor_coef_num && error_val > 0; m++)
+        {
+            int val = buffer_out[0] - buffer_out[m];
+            int sign = SIGN_ONLY(val);
+
+            coefs[m] -= sign;
+            val *= sign; /* absolute value */
+            error_val -= (val >> predictor_quantitization) * m;
+        }
+    }
+    else if (error_val < 0)
+    {
+        for (m = 1; m <= predictor_coef_num && error_val < 0; m++)
+        {
+            int val = buffer_out[0] - buffer_out[m];
+            int sign = - SIGN_ONLY(val);
+
+            coefs[m] -= sign;
+            val *= sign; /* neg value */
+            error_val -= (val >> predictor_quantitization) * m;
+        }
+    }
+}
+#endif
+
+#if defined(USE_X86_SIMD)
+/* sum of (buffer_out[m] - buffer_out[0]) * coefs[m] for m in [from, num],
+ * products and sum wrap around like the scalar int arithmetic */
+SIMD_TARGET("sse4.1")
+static inline int fir_dot_sse41(const int32_t *buffer_out, const int16_t *coefs,
+                                int from, int num, __m128i acc)
+{
+    __m128i base = _mm_set1_epi32(buffer_out[0]);
+    int m, sum;
+
+    for (m = from; m + 3 <= num; m += 4)
+    {
+        __m128i samples = _mm_sub_epi32(_mm_loadu_si128((const __m128i*) (buffer_out + m)), base);
+        __m128i k = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i*) (coefs + m)));
+        acc = _mm_add_epi32(acc, _mm_mullo_epi32(samples, k));
+    }
+
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+    sum = _mm_cvtsi128_si32(acc);
+
+    for (; m <= num; m++)
+        sum += (buffer_out[m] - buffer_out[0]) * coefs[m];
+
+    return sum;
+}
+
+SIMD_TARGET("avx2")
+static inline int fir_dot_avx2(const int32_t *buffer_out, const int16_t *coefs, int num)
+{
+    __m256i base = _mm256_set1_epi32(buffer_out[0]);
+    __m256i acc = _mm256_setzero_si256();
+    int m;
+
+    for (m = 1; m + 7 <= num; m += 8)
+    {
+        __m256i samples = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*) (buffer_out + m)), base);
+        __m256i k = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) (coefs + m)));
+        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(samples, k));
+    }
+
+    return fir_dot_sse41(buffer_out, coefs, m, num,
+                         _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+}
+
+SIMD_TARGET("sse4.1")
+static void fir_adapt_sse41(int32_t *error_buffer, int32_t *buffer_out, int output_size,
+                            int readsamplesize, int16_t *coefs, int num, int quant)
+{
+    int i;
+    for (i = num + 1; i < output_size; i++, buffer_out++)
+    {
+        int sum = fir_dot_sse41(buffer_out, coefs, 1, num, _mm_setzero_si128());
+        fir_adapt_step(buffer_out, error_buffer[i], sum, readsamplesize, coefs, num, quant);
+    }
+}
+
+SIMD_TARGET("avx2")
+static void fir_adapt_avx2(int32_t *error_buffer, int32_t *buffer_out, int output_size,
+                           int readsamplesize, int16_t *coefs, int num, int quant)
+{
+    int i;
+    for (i = num + 1; i < output_size; i++, buffer_out++)
+    {
+        int sum = fir_dot_avx2(buffer_out, coefs, num);
+        fir_adapt_step(buffer_out, error_buffer[i], sum, readsamplesize, coefs, num, quant);
+    }
+}
+
+/* orders 4 and 8 (the common ones) keep samples and coefs in registers, as
+ * one or two blocks of 4. Adaptation stops when error_val reaches the prefix
+ * sum of its decrements, so it becomes a mask. Sums cannot overflow for
+ * samples up to 20 bits */
+SIMD_TARGET("sse4.1")
+ALWAYS_INLINE void fir_adapt_blocks_sse41(int32_t *error_buffer, int32_t *buffer_out,
+                                          int output_size, int readsamplesize,
+                                          int16_t *coefs, int blocks, int quant)
+{
+    __m128i window[2], k[2], index[2];
+    __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi32(1);
+    __m128i shift = _mm_cvtsi32_si128(quant);
+    int32_t base = buffer_out[0], kept[8];
+    int i, b;
+
+    for (b = 0; b < blocks; b++)
+    {
+        window[b] = _mm_loadu_si128((const __m128i*) (buffer_out + 1 + b*4));
+        k[b] = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i*) (coefs + 1 + b*4)));
+        index[b] = _mm_setr_epi32(1 + b*4, 2 + b*4, 3 + b*4, 4 + b*4);
+    }
+
+    for (i = blocks*4 + 1; i < output_size; i++)
+    {
+        __m128i vbase = _mm_set1_epi32(base), acc = zero, d[2];
+        int error_val = error_buffer[i];
+        int outval;
+
+        for (b = 0; b < blocks; b++)
+        {
+            d[b] = _mm_sub_epi32(window[b], vbase);
+            acc = _mm_add_epi32(acc, _mm_mullo_epi32(d[b], k[b]));
+        }
+
+        acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+        acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+
+        outval = (1 << (quant-1)) + _mm_cvtsi128_si32(acc);
+        outval = outval >> quant;
+        outval = outval + base + error_val;
+        outval = SIGN_EXTENDED32(outval, readsamplesize);
+
+        buffer_out[i] = outval;
+
+        if (error_val)
+        {
+            __m128i limit = _mm_set1_epi32(error_val > 0 ? error_val : -error_val);
+            __m128i carry = zero;
+
+            for (b = 0; b < blocks; b++)
+            {
+                __m128i magnitude = _mm_abs_epi32(d[b]);
+                __m128i step = _mm_sign_epi32(one, d[b]);
+                __m128i used, before;
+
+                if (error_val > 0)
+                {
+                    used = _mm_sra_epi32(magnitude, shift);
+                }
+                else
+                {
+                    used = _mm_sub_epi32(zero, _mm_sra_epi32(_mm_sub_epi32(zero, magnitude), shift));
+                    step = _mm_sub_epi32(zero, step);
+                }
+                used = _mm_mullo_epi32(used, index[b]);
+
+                /* what has been taken from error_val before each coef */
+                used = _mm_add_epi32(used, _mm_slli_si128(used, 4));
+                used = _mm_add_epi32(used, _mm_slli_si128(used, 8));
+                before = _mm_add_epi32(_mm_slli_si128(used, 4), carry);
+                carry = _mm_add_epi32(carry, _mm_shuffle_epi32(used, 0xff));
+
+                /* coefs are int16 */
+                k[b] = _mm_add_epi32(k[b], _mm_and_si128(step, _mm_cmpgt_epi32(limit, before)));
+                k[b] = _mm_srai_epi32(_mm_slli_epi32(k[b], 16), 16);
+            }
+        }
+
+        base = _mm_cvtsi128_si32(window[0]);
+        if (blocks == 2)
+        {
+            window[0] = _mm_alignr_epi8(window[1], window[0], 4);
+            window[1] = _mm_alignr_epi8(_mm_cvtsi32_si128(outval), window[1], 4);
+        }
+        else
+            window[0] = _mm_alignr_epi8(_mm_cvtsi32_si128(outval), window[0], 4);
+    }
+
+    for (b = 0; b < blocks; b++)
+        _mm_storeu_si128((__m128i*) (kept + b*4), k[b]);
+    for (i = 0; i < blocks*4; i++)
+        coefs[i + 1] = kept[i];
+}
+
+SIMD_TARGET("sse4.1")
+static void fir_adapt4_sse41(int32_t *error_buffer, int32_t *buffer_out, int output_size,
+                             int readsamplesize, int16_t *coefs, int quant)
+{
+    fir_adapt_blocks_sse41(error_buffer, buffer_out, output_size, readsamplesize, coefs, 1, quant);
+}
+
+SIMD_TARGET("sse4.1")
+static void fir_adapt8_sse41(int32_t *error_buffer, int32_t *buffer_out, int output_size,
+                             int readsamplesize, int16_t *coefs, int quant)
+{
+    fir_adapt_blocks_sse41(error_buffer, buffer_out, output_size, readsamplesize, coefs, 2, quant);
+}
+
+/* order 31 is a running sum, sign extension of the sum modulo 2^readsamplesize
+ * is the same as sign extending at every step */
+SIMD_TARGET("sse4.1")
+static void fir_delta_sse41(int32_t *error_buffer, int32_t *buffer_out,
+                            int output_size, int readsamplesize)
+{
+    __m128i carry = _mm_set1_epi32(buffer_out[0]);
+    __m128i shift = _mm_cvtsi32_si128(32 - readsamplesize);
+    int i;
+
+    for (i = 1; i + 3 < output_size; i += 4)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*) (error_buffer + i));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi32(x, carry);
+        x = _mm_sra_epi32(_mm_sll_epi32(x, shift), shift);
+        _mm_storeu_si128((__m128i*) (buffer_out + i), x);
+        carry = _mm_shuffle_epi32(x, 0xff);
+    }
+
+    for (; i < output_size; i++)
+        buffer_out[i] = SIGN_EXTENDED32((buffer_out[i-1] + error_buffer[i]), readsamplesize);
+}
+
+/* 16 bits stereo frames are one 32 bits word, left in the low half (little
+ * endian), so narrowing is a mask and a shift that truncate like int16 casts */
+SIMD_TARGET("sse4.1")
+static int deinterlace_16_sse41(int32_t *buffer_a, int32_t *buffer_b, int16_t *buffer_out,
+                                int numsamples, uint8_t interlacing_shift,
+                                uint8_t interlacing_leftweight)
+{
+    __m128i weight = _mm_set1_epi32(interlacing_leftweight);
+    __m128i shift = _mm_cvtsi32_si128(interlacing_shift);
+    __m128i mask = _mm_set1_epi32(0xffff);
+    int i;
+
+    for (i = 0; i + 3 < numsamples; i += 4)
+    {
+        __m128i left = _mm_loadu_si128((const __m128i*) (buffer_a + i));
+        __m128i right = _mm_loadu_si128((const __m128i*) (buffer_b + i));
+
+        if (interlacing_leftweight)
+        {
+            __m128i difference = right;
+            right = _mm_sub_epi32(left, _mm_sra_epi32(_mm_mullo_epi32(difference, weight), shift));
+            left = _mm_add_epi32(right, difference);
+        }
+
+        _mm_storeu_si128((__m128i*) (buffer_out + i*2),
+                         _mm_or_si128(_mm_and_si128(left, mask), _mm_slli_epi32(right, 16)));
+    }
+
+    return i;
+}
+
+SIMD_TARGET("avx2")
+static int deinterlace_16_avx2(int32_t *buffer_a, int32_t *buffer_b, int16_t *buffer_out,
+                               int numsamples, uint8_t interlacing_shift,
+                               uint8_t interlacing_leftweight)
+{
+    __m256i weight = _mm256_set1_epi32(interlacing_leftweight);
+    __m128i shift = _mm_cvtsi32_si128(interlacing_shift);
+    __m256i mask = _mm256_set1_epi32(0xffff);
+    int i;
+
+    for (i = 0; i + 7 < numsamples; i += 8)
+    {
+        __m256i left = _mm256_loadu_si256((const __m256i*) (buffer_a + i));
+        __m256i right = _mm256_loadu_si256((const __m256i*) (buffer_b + i));
+
+        if (interlacing_leftweight)
+        {
+            __m256i difference = right;
+            right = _mm256_sub_epi32(left, _mm256_sra_epi32(_mm256_mullo_epi32(difference, weight), shift));
+            left = _mm256_add_epi32(right, difference);
+        }
+
+        _mm256_storeu_si256((__m256i*) (buffer_out + i*2),
+                            _mm256_or_si256(_mm256_and_si256(left, mask), _mm256_slli_epi32(right, 16)));
+    }
+
+    return i + deinterlace_16_sse41(buffer_a + i, buffer_b + i, buffer_out + i*2, numsamples - i,
+                                    interlacing_shift, interlacing_leftweight);
+}
+#endif
+
+#if defined(USE_NEON)
+static inline int hsum_neon(int32x4_t acc)
+{
+#if defined(__aarch64__)
+    return vaddvq_s32(acc);
+#else
+    int32x2_t pair = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    return vget_lane_s32(vpadd_s32(pair, pair), 0);
+#endif
+}
+
+static inline int fir_dot_neon(const int32_t *buffer_out, const int16_t *coefs, int num)
+{
+    int32x4_t base = vdupq_n_s32(buffer_out[0]);
+    int32x4_t acc = vdupq_n_s32(0);
+    int m, sum;
+
+    for (m = 1; m + 3 <= num; m += 4)
+    {
+        int32x4_t samples = vsubq_s32(vld1q_s32(buffer_out + m), base);
+        acc = vmlaq_s32(acc, samples, vmovl_s16(vld1_s16(coefs + m)));
+    }
+
+    sum = hsum_neon(acc);
+
+    for (; m <= num; m++)
+        sum += (buffer_out[m] - buffer_out[0]) * coefs[m];
+
+    return sum;
+}
+
+/* see fir_adapt_blocks_sse41 */
+static void fir_adapt_blocks_neon(int32_t *error_buffer, int32_t *buffer_out,
+                                  int output_size, int readsamplesize,
+                                  int16_t *coefs, int blocks, int quant)
+{
+    static const int32_t indexes[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    int32x4_t window[2], k[2], index[2];
+    int32x4_t zero = vdupq_n_s32(0);
+    int32x4_t shift = vdupq_n_s32(-quant);
+    int32_t base = buffer_out[0], kept[8];
+    int i, b;
+
+    for (b = 0; b < blocks; b++)
+    {
+        window[b] = vld1q_s32(buffer_out + 1 + b*4);
+        k[b] = vmovl_s16(vld1_s16(coefs + 1 + b*4));
+        index[b] = vld1q_s32(indexes + b*4);
+    }
+
+    for (i = blocks*4 + 1; i < output_size; i++)
+    {
+        int32x4_t vbase = vdupq_n_s32(base), acc = zero, d[2];
+        int error_val = error_buffer[i];
+        int outval;
+
+        for (b = 0; b < blocks; b++)
+        {
+            d[b] = vsubq_s32(window[b], vbase);
+            acc = vmlaq_s32(acc, d[b], k[b]);
+        }
+
+        outval = (1 << (quant-1)) + hsum_neon(acc);
+        outval = outval >> quant;
+        outval = outval + base + error_val;
+        outval = SIGN_EXTENDED32(outval, readsamplesize);
+
+        buffer_out[i] = outval;
+
+        if (error_val)
+        {
+            int32x4_t limit = vdupq_n_s32(error_val > 0 ? error_val : -error_val);
+            int32x4_t carry = zero;
+
+            for (b = 0; b < blocks; b++)
+            {
+                int32x4_t magnitude = vabsq_s32(d[b]);
+                /* comparisons are -1 when true */
+                int32x4_t step = vsubq_s32(vreinterpretq_s32_u32(vcltq_s32(d[b], zero)),
+                                           vreinterpretq_s32_u32(vcgtq_s32(d[b], zero)));
+                int32x4_t used, before;
+
+                if (error_val > 0)
+                {
+                    used = vshlq_s32(magnitude, shift);
+                }
+                else
+                {
+                    used = vnegq_s32(vshlq_s32(vnegq_s32(magnitude), shift));
+                    step = vnegq_s32(step);
+                }
+                used = vmulq_s32(used, index[b]);
+
+                used = vaddq_s32(used, vextq_s32(zero, used, 3));
+                used = vaddq_s32(used, vextq_s32(zero, used, 2));
+                before = vaddq_s32(vextq_s32(zero, used, 3), carry);
+                carry = vaddq_s32(carry, vdupq_n_s32(vgetq_lane_s32(used, 3)));
+
+                k[b] = vaddq_s32(k[b], vandq_s32(step, vreinterpretq_s32_u32(vcgtq_s32(limit, before))));
+                k[b] = vshrq_n_s32(vshlq_n_s32(k[b], 16), 16);
+            }
+        }
+
+        base = vgetq_lane_s32(window[0], 0);
+        if (blocks == 2)
+        {
+            window[0] = vextq_s32(window[0], window[1], 1);
+            window[1] = vextq_s32(window[1], vdupq_n_s32(outval), 1);
+        }
+        else
+            window[0] = vextq_s32(window[0], vdupq_n_s32(outval), 1);
+    }
+
+    for (b = 0; b < blocks; b++)
+        vst1q_s32(kept + b*4, k[b]);
+    for (i = 0; i < blocks*4; i++)
+        coefs[i + 1] = kept[i];
+}
+
+static void fir_adapt_neon(int32_t *error_buffer, int32_t *buffer_out, int output_size,
+                           int readsamplesize, int16_t *coefs, int num, int quant)
+{
+    int i;
+    for (i = num + 1; i < output_size; i++, buffer_out++)
+    {
+        int sum = fir_dot_neon(buffer_out, coefs, num);
+        fir_adapt_step(buffer_out, error_buffer[i], sum, readsamplesize, coefs, num, quant);
+    }
+}
+
+static void fir_delta_neon(int32_t *error_buffer, int32_t *buffer_out,
+                           int output_size, int readsamplesize)
+{
+    int32x4_t carry = vdupq_n_s32(buffer_out[0]);
+    int32x4_t zero = vdupq_n_s32(0);
+    int32x4_t up = vdupq_n_s32(32 - readsamplesize), down = vdupq_n_s32(readsamplesize - 32);
+    int i;
+
+    for (i = 1; i + 3 < output_size; i += 4)
+    {
+        int32x4_t x = vld1q_s32(error_buffer + i);
+        x = vaddq_s32(x, vextq_s32(zero, x, 3));
+        x = vaddq_s32(x, vextq_s32(zero, x, 2));
+        x = vaddq_s32(x, carry);
+        x = vshlq_s32(vshlq_s32(x, up), down);
+        vst1q_s32(buffer_out + i, x);
+        carry = vdupq_n_s32(vgetq_lane_s32(x, 3));
+    }
+
+    for (; i < output_size; i++)
+        buffer_out[i] = SIGN_EXTENDED32((buffer_out[i-1] + error_buffer[i]), readsamplesize);
+}
+
+static int deinterlace_16_neon(int32_t *buffer_a, int32_t *buffer_b, int16_t *buffer_out,
+                               int numsamples, uint8_t interlacing_shift,
+                               uint8_t interlacing_leftweight)
+{
+    int32x4_t weight = vdupq_n_s32(interlacing_leftweight);
+    int32x4_t shift = vdupq_n_s32(-interlacing_shift);
+    int i;
+
+    for (i = 0; i + 3 < numsamples; i += 4)
+    {
+        int32x4_t left = vld1q_s32(buffer_a + i);
+        int32x4_t right = vld1q_s32(buffer_b + i);
+        int16x4x2_t frames;
+
+        if (interlacing_leftweight)
+        {
+            int32x4_t difference = right;
+            right = vsubq_s32(left, vshlq_s32(vmulq_s32(difference, weight), shift));
+            left = vaddq_s32(right, difference);
+        }
+
+        /* narrowing truncates like int16 casts */
+        frames.val[0] = vmovn_s32(left);
+        frames.val[1] = vmovn_s32(right);
+        vst2_s16(buffer_out + i*2, frames);
+    }
+
+    return i;
+}
+#endif
+
 static void predictor_decompress_fir_adapt(int32_t *error_buffer,
                                            int32_t *buffer_out,
                                            int output_size,
@@ -438,6 +1007,17 @@ static void predictor_decompress_fir_adapt(int32_t *error_buffer,
 	   * error describes a small difference from the previous sample only
        */
         if (output_size <= 1) return;
+#if defined(USE_X86_SIMD) || defined(USE_NEON)
+        if (simd != SIMD_NONE && readsamplesize > 0 && readsamplesize <= 32)
+        {
+#if defined(USE_X86_SIMD)
+            fir_delta_sse41(error_buffer, buffer_out, output_size, readsamplesize);
+#else
+            fir_delta_neon(error_buffer, buffer_out, output_size, readsamplesize);
+#endif
+            return;
+        }
+#endif
         for (i = 0; i < output_size - 1; i++)
         {
             int32_t prev_value;
@@ -466,24 +1046,47 @@ static void predictor_decompress_fir_adapt(int32_t *error_buffer,
         }
     }
 
-#if 0
-    /* 4 and 8 are very common cases (the only ones i've seen). these
-     * should be unrolled and optimised
-     */
-    if (predictor_coef_num == 4)
+#if defined(USE_X86_SIMD) || defined(USE_NEON)
+    /* 4 and 8 are very common cases (the only ones i've seen), they have
+     * their own version, others use a vector dot product */
+    if (simd != SIMD_NONE && predictor_coef_num > 0)
     {
-        /* FIXME: optimised general case */
-        return;
-    }
+        int16_t coefs[32]; /* 1 to predictor_coef_num */
+        int fixed = (predictor_coef_num == 4 || predictor_coef_num == 8) &&
+                    readsamplesize <= 20 && output_size > predictor_coef_num + 1;
+        int j;
+
+        for (j = 0; j < predictor_coef_num; j++)
+            coefs[predictor_coef_num - j] = predictor_coef_table[j];
+
+#if defined(USE_X86_SIMD)
+        if (fixed && predictor_coef_num == 4)
+            fir_adapt4_sse41(error_buffer, buffer_out, output_size, readsamplesize,
+                             coefs, predictor_quantitization);
+        else if (fixed)
+            fir_adapt8_sse41(error_buffer, buffer_out, output_size, readsamplesize,
+                             coefs, predictor_quantitization);
+        else if (simd == SIMD_AVX2)
+            fir_adapt_avx2(error_buffer, buffer_out, output_size, readsamplesize,
+                           coefs, predictor_coef_num, predictor_quantitization);
+        else
+            fir_adapt_sse41(error_buffer, buffer_out, output_size, readsamplesize,
+                            coefs, predictor_coef_num, predictor_quantitization);
+#else
+        if (fixed)
+            fir_adapt_blocks_neon(error_buffer, buffer_out, output_size, readsamplesize,
+                                  coefs, predictor_coef_num / 4, predictor_quantitization);
+        else
+            fir_adapt_neon(error_buffer, buffer_out, output_size, readsamplesize,
+                           coefs, predictor_coef_num, predictor_quantitization);
+#endif
 
-    if (predictor_coef_table == 8)
-    {
-        /* FIXME: optimised general case */
+        for (j = 0; j < predictor_coef_num; j++)
+            predictor_coef_table[j] = coefs[predictor_coef_num - j];
         return;
     }
 #endif
 
-
     /* general case */
     if (predictor_coef_num > 0)
     {
@@ -562,6 +1165,28 @@ static void deinterlace_16(int32_t *buffer_a, int32_t *buffer_b,
     int i;
     if (numsamples <= 0) return;
 
+#if defined(USE_X86_SIMD) || defined(USE_NEON)
+    if (simd != SIMD_NONE && numchannels == 2)
+    {
+#if defined(USE_X86_SIMD)
+        if (simd == SIMD_AVX2)
+            i = deinterlace_16_avx2(buffer_a, buffer_b, buffer_out, numsamples,
+                                    interlacing_shift, interlacing_leftweight);
+        else
+            i = deinterlace_16_sse41(buffer_a, buffer_b, buffer_out, numsamples,
+                                     interlacing_shift, interlacing_leftweight);
+#else
+        i = deinterlace_16_neon(buffer_a, buffer_b, buffer_out, numsamples,
+                                interlacing_shift, interlacing_leftweight);
+#endif
+        /* scalar code does the remaining samples */
+        buffer_a += i;
+        buffer_b += i;
+        buffer_out += i * 2;
+        numsamples -= i;
+    }
+#endif
+
     /* weighted interlacing */
     if (interlacing_leftweight)
     {
@@ -690,16 +1315,25 @@ static void deinterlace_24(int32_t *buffer_a, int32_t *buffer_b,
 
 }
 
-void decode_frame(alac_file *alac,
-                  unsigned char *inbuffer,
-                  void *outbuffer, int *outputsize)
+static int decode_frame_generic(alac_file *alac,
+                                unsigned char *inbuffer, int inputsize,
+                                void *outbuffer, int *outputsize)
 {
     int channels;
     int32_t outputsamples = alac->setinfo_max_samples_per_frame;
 
     /* setup the stream */
     alac->input_buffer = inbuffer;
-    alac->input_buffer_bitaccumulator = 0;
+    alac->input_end = inbuffer + inputsize;
+    alac->input_cache = 0;
+    alac->input_cached = 0;
+    alac->input_error = 0;
+
+    /* a null kmodifier would read values with k = 0, and only 16 and 24 bits
+     * samples are output (20 and 32 are not implemented) */
+    if (alac->setinfo_rice_kmodifier < 1 || alac->setinfo_rice_kmodifier > RICE_KMAX ||
+        (alac->setinfo_sample_size != 16 && alac->setinfo_sample_size != 24))
+        goto invalid;
 
     channels = readbits(alac, 3);
 
@@ -737,6 +1371,11 @@ void decode_frame(alac_file *alac,
             *outputsize = outputsamples * alac->bytespersample;
         }
 
+        /* buffers are sized for setinfo, and some bits must be compressed */
+        if ((uint32_t)outputsamples > alac->setinfo_max_samples_per_frame ||
+            (!isnotcompressed && uncompressed_bytes * 8 >= alac->setinfo_sample_size))
+            goto invalid;
+
         readsamplesize = alac->setinfo_sample_size - (uncompressed_bytes * 8);
 
         if (!isnotcompressed)
@@ -764,6 +1403,9 @@ void decode_frame(alac_file *alac,
                 predictor_coef_table[i] = (int16_t)readbits(alac, 16);
             }
 
+            if (!PREDICTOR_VALID(predictor_coef_num, prediction_quantitization))
+                goto invalid;
+
 			if (uncompressed_bytes)
             {
                 int i;
@@ -794,13 +1436,13 @@ void decode_frame(alac_file *alac,
             }
             else
             {
-                _fprintf(stderr, "FIXME: unhandled predicition type: %i\n", prediction_type);
                 /* i think the only other prediction type (or perhaps this is just a
                  * boolean?) runs adaptive fir twice.. like:
                  * predictor_decompress_fir_adapt(predictor_error, tempout, ...)
                  * predictor_decompress_fir_adapt(predictor_error, outputsamples ...)
-                 * little strange..
+                 * little strange.. there would be no samples, so it's an error
                  */
+                goto invalid;
             }
 
         }
@@ -914,6 +1556,11 @@ void decode_frame(alac_file *alac,
             *outputsize = outputsamples * alac->bytespersample;
         }
 
+        /* buffers are sized for setinfo, and some bits must be compressed */
+        if ((uint32_t)outputsamples > alac->setinfo_max_samples_per_frame ||
+            (!isnotcompressed && uncompressed_bytes * 8 >= alac->setinfo_sample_size))
+            goto invalid;
+
         readsamplesize = alac->setinfo_sample_size - (uncompressed_bytes * 8) + 1;
 
         if (!isnotcompressed)
@@ -961,6 +1608,11 @@ void decode_frame(alac_file *alac,
                 predictor_coef_table_b[i] = (int16_t)readbits(alac, 16);
             }
 
+            if (interlacing_shift > INTERLACING_SHIFT_MAX ||
+                !PREDICTOR_VALID(predictor_coef_num_a, prediction_quantitization_a) ||
+                !PREDICTOR_VALID(predictor_coef_num_b, prediction_quantitization_b))
+                goto invalid;
+
             /*********************/
             if (uncompressed_bytes)
             { /* see mono case */
@@ -994,7 +1646,7 @@ void decode_frame(alac_file *alac,
             }
             else
             { /* see mono case */
-                _fprintf(stderr, "FIXME: unhandled predicition type: %i\n", prediction_type_a);
+                goto invalid;
             }
 
             /* channel 2 */
@@ -1019,7 +1671,7 @@ void decode_frame(alac_file *alac,
             }
             else
             {
-                _fprintf(stderr, "FIXME: unhandled predicition type: %i\n", prediction_type_b);
+                goto invalid;
             }
         }
         else
@@ -1104,13 +1756,224 @@ void decode_frame(alac_file *alac,
 
         break;
     }
+    default:
+        goto invalid;
     }
+
+    if (!alac->input_error)
+        return 0;
+
+invalid:
+    *outputsize = 0;
+    return -1;
+}
+
+/* decoders specialised for the usual formats (16 bits stereo), where frame
+ * size and rice parameters are constants that the compiler can fold. Frames
+ * with anything unusual (other channel count, not compressed, uncompressed
+ * bytes or unknown prediction) are read again by the generic decoder */
+ALWAYS_INLINE int decode_stereo16(alac_file *alac,
+                                  unsigned char *inbuffer, int inputsize,
+                                  int16_t *outbuffer, int *outputsize,
+                                  int32_t *predicterror_a, int32_t *predicterror_b,
+                                  int32_t *outputsamples_a, int32_t *outputsamples_b,
+                                  const uint32_t frames,
+                                  const int rice_historymult,
+                                  const int rice_initialhistory,
+                                  const int rice_kmodifier)
+{
+    int16_t predictor_coef_table[2][32];
+    int predictor_coef_num[2];
+    int prediction_type[2];
+    int prediction_quantitization[2];
+    int ricemodifier[2];
+    uint8_t interlacing_shift, interlacing_leftweight;
+    uint32_t outputsamples = frames;
+    uint32_t header;
+    int ch, i;
+
+    alac->input_buffer = inbuffer;
+    alac->input_end = inbuffer + inputsize;
+    alac->input_cache = 0;
+    alac->input_cached = 0;
+    alac->input_error = 0;
+
+    /* channels:3, unknown:4+12, hassize:1, uncompressed_bytes:2, isnotcompressed:1 */
+    header = readbits(alac, 23);
+    if ((header >> 20) != 1 || (header & 0x7))
+        return decode_frame_generic(alac, inbuffer, inputsize, outbuffer, outputsize);
+
+    if (header & 0x8)
+    {
+        outputsamples = readbits(alac, 32);
+        if (outputsamples > frames)
+            goto invalid;
+    }
+
+    interlacing_shift = readbits(alac, 8);
+    interlacing_leftweight = readbits(alac, 8);
+
+    for (ch = 0; ch < 2; ch++)
+    {
+        prediction_type[ch] = readbits(alac, 4);
+        prediction_quantitization[ch] = readbits(alac, 4);
+        ricemodifier[ch] = readbits(alac, 3);
+        predictor_coef_num[ch] = readbits(alac, 5);
+
+        for (i = 0; i < predictor_coef_num[ch]; i++)
+            predictor_coef_table[ch][i] = (int16_t)readbits(alac, 16);
+    }
+
+    if (prediction_type[0] || prediction_type[1])
+        return decode_frame_generic(alac, inbuffer, inputsize, outbuffer, outputsize);
+
+    if (interlacing_shift > INTERLACING_SHIFT_MAX ||
+        !PREDICTOR_VALID(predictor_coef_num[0], prediction_quantitization[0]) ||
+        !PREDICTOR_VALID(predictor_coef_num[1], prediction_quantitization[1]))
+        goto invalid;
+
+    for (ch = 0; ch < 2; ch++)
+    {
+        int32_t *predicterror = ch ? predicterror_b : predicterror_a;
+        int32_t *samples = ch ? outputsamples_b : outputsamples_a;
+
+        entropy_rice_decode(alac, predicterror, outputsamples, 16 + 1,
+                            rice_initialhistory, rice_kmodifier,
+                            ricemodifier[ch] * rice_historymult / 4,
+                            (1 << rice_kmodifier) - 1);
+
+        predictor_decompress_fir_adapt(predicterror, samples, outputsamples, 16 + 1,
+                                       predictor_coef_table[ch],
+                                       predictor_coef_num[ch],
+                                       prediction_quantitization[ch]);
+    }
+
+    if (alac->input_error)
+        goto invalid;
+
+    deinterlace_16(outputsamples_a, outputsamples_b, outbuffer, 2, outputsamples,
+                   interlacing_shift, interlacing_leftweight);
+
+    *outputsize = outputsamples * 4;
+    return 0;
+
+invalid:
+    *outputsize = 0;
+    return -1;
+}
+
+/* AirPlay default fmtp, buffers are small enough for the stack */
+static int decode_stereo16_352(alac_file *alac,
+                               unsigned char *inbuffer, int inputsize,
+                               void *outbuffer, int *outputsize)
+{
+    int32_t buffers[4][352];
+    return decode_stereo16(alac, inbuffer, inputsize, outbuffer, outputsize,
+                           buffers[0], buffers[1], buffers[2], buffers[3],
+                           352, 40, 10, 14);
+}
+
+static int decode_stereo16_352_rice(alac_file *alac,
+                                    unsigned char *inbuffer, int inputsize,
+                                    void *outbuffer, int *outputsize)
+{
+    int32_t buffers[4][352];
+    return decode_stereo16(alac, inbuffer, inputsize, outbuffer, outputsize,
+                           buffers[0], buffers[1], buffers[2], buffers[3],
+                           352, alac->setinfo_rice_historymult,
+                           alac->setinfo_rice_initialhistory,
+                           alac->setinfo_rice_kmodifier);
+}
+
+/* default of files, too large for the stack */
+static int decode_stereo16_4096(alac_file *alac,
+                                unsigned char *inbuffer, int inputsize,
+                                void *outbuffer, int *outputsize)
+{
+    return decode_stereo16(alac, inbuffer, inputsize, outbuffer, outputsize,
+                           alac->predicterror_buffer_a, alac->predicterror_buffer_b,
+                           alac->outputsamples_buffer_a, alac->outputsamples_buffer_b,
+                           4096, 40, 10, 14);
+}
+
+static void select_decoder(alac_file *alac)
+{
+    int defaults = alac->setinfo_rice_historymult == 40 &&
+                   alac->setinfo_rice_initialhistory == 10 &&
+                   alac->setinfo_rice_kmodifier == 14;
+
+    alac->decoder = decode_frame_generic;
+
+    if (alac->numchannels != 2 || alac->setinfo_sample_size != 16 ||
+        alac->setinfo_rice_kmodifier < 1 || alac->setinfo_rice_kmodifier > RICE_KMAX)
+        return;
+
+    if (alac->setinfo_max_samples_per_frame == 352)
+        alac->decoder = defaults ? decode_stereo16_352 : decode_stereo16_352_rice;
+    else if (alac->setinfo_max_samples_per_frame == 4096 && defaults)
+        alac->decoder = decode_stereo16_4096;
+}
+
+int decode_frame(alac_file *alac,
+                 unsigned char *inbuffer, int inputsize,
+                 void *outbuffer, int *outputsize)
+{
+    return alac->decoder(alac, inbuffer, inputsize, outbuffer, outputsize);
+}
+
+static void simd_select(void)
+{
+#if defined(USE_X86_SIMD) || defined(USE_NEON)
+    if (simd_cpu < 0)
+    {
+        simd_cpu = SIMD_NONE;
+#if defined(USE_X86_SIMD) && defined(__GNUC__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) simd_cpu = SIMD_AVX2;
+        else if (__builtin_cpu_supports("sse4.1")) simd_cpu = SIMD_SSE41;
+#elif defined(USE_X86_SIMD)
+        int info[4];
+
+        __cpuid(info, 1);
+        if (info[2] & (1 << 19)) simd_cpu = SIMD_SSE41;
+
+        /* avx2 also needs the os to save ymm registers */
+        if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6)
+        {
+            __cpuidex(info, 7, 0);
+            if (info[1] & (1 << 5)) simd_cpu = SIMD_AVX2;
+        }
+#elif defined(USE_NEON)
+        simd_cpu = SIMD_NEON;
+#endif
+    }
+
+    simd = simd_cpu;
+    if (simd_limit == ALAC_SIMD_NONE)
+        simd = SIMD_NONE;
+    else if (simd_limit == ALAC_SIMD_BASE && simd == SIMD_AVX2)
+        simd = SIMD_SSE41;
+#endif
+}
+
+int alac_simd(int level)
+{
+    simd_limit = level;
+    simd_select();
+
+#if defined(USE_X86_SIMD) || defined(USE_NEON)
+    if (simd == SIMD_AVX2) return ALAC_SIMD_WIDE;
+    if (simd != SIMD_NONE) return ALAC_SIMD_BASE;
+#endif
+    return ALAC_SIMD_NONE;
 }
 
 alac_file *create_alac(int samplesize, int numchannels)
 {
 	alac_file *newfile = malloc(sizeof(alac_file));
 
+	simd_select();
+
 	newfile->samplesize = samplesize;
 	newfile->numchannels = numchannels;
 	newfile->bytespersample = (samplesize / 8) * numchannels;
@@ -5,22 +5,36 @@ typedef struct alac_file alac_file;
 
 alac_file *create_alac(int samplesize, int numchannels);
 void delete_alac(alac_file *alac);
-void decode_frame(alac_file *alac,
-                  unsigned char *inbuffer,
-                  void *outbuffer, int *outputsize);
+/* returns 0, or -1 when frame is truncated or malformed (then outputsize is 0) */
+int decode_frame(alac_file *alac,
+                 unsigned char *inbuffer, int inputsize,
+                 void *outbuffer, int *outputsize);
 void alac_set_info(alac_file *alac, char *inputbuffer);
 void allocate_buffers(alac_file *alac);
 
+/* limits SIMD used by all decoders (scalar only, SSE4.1 or NEON, AVX2) to
+ * what the cpu has, AUTO being the best. Returns the level now in use. Not
+ * to be changed while frames are decoded */
+enum { ALAC_SIMD_AUTO = -1, ALAC_SIMD_NONE, ALAC_SIMD_BASE, ALAC_SIMD_WIDE };
+int alac_simd(int level);
+
 struct alac_file
 {
-    unsigned char *input_buffer;
-    int input_buffer_bitaccumulator; /* used so we can do arbitary
-                                        bit reads */
+    const unsigned char *input_buffer, *input_end;
+    uint64_t input_cache; /* next bits of input, msb first, so we
+                             can do arbitary bit reads */
+    int input_cached;
+    int input_error; /* read past input_end or inconsistent data */
 
     int samplesize;
     int numchannels;
     int bytespersample;
 
+    /* specialised for the format by allocate_buffers, or generic */
+    int (*decoder)(alac_file *alac,
+                   unsigned char *inbuffer, int inputsize,
+                   void *outbuffer, int *outputsize);
+
 
     /* buffers */
     int32_t *predicterror_buffer_a;
@@ -0,0 +1,380 @@
+/*
+ * ALAC encoder for 16 bits stereo, counterpart of alac.c
+ *
+ * Everything mirrors what the decoder does, prediction, adaptation of its
+ * coefficients and rice coding history, so that both sides stay in step.
+ * One vectorized pass de-interleaves samples, mixes them and estimates the
+ * cost of left/right vs. mid/side from the sum of first differences (that
+ * is also what fast mode sends as residuals)
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "alac_enc.h"
+
+#if !defined(ALAC_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define USE_SSE2 1
+#include <emmintrin.h>
+#elif !defined(ALAC_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define USE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define CHAN_SIZE		17				// bits of mixed samples (side needs one more)
+#define KMODIFIER		14
+#define HISTORY_MULT	40
+#define INIT_HISTORY	10
+#define RICE_MODIFIER	4				// history multiplier is HISTORY_MULT * RICE_MODIFIER / 4
+#define QUANT			9
+#define ORDER			4
+#define FIRST_ORDER		31				// decoder's shortcut for fixed 1st order prediction
+#define MIX_SHIFT		1				// mid/side with weight 1
+#define ID_END			7
+#define HEADER_BITS		(3 + 4 + 12 + 1 + 2 + 1)
+
+#define SIGN_EXTEND(v)	((int32_t) ((uint32_t) (v) << (32 - CHAN_SIZE)) >> (32 - CHAN_SIZE))
+
+enum { LEFT, RIGHT, MID, SIDE };
+
+typedef struct alacenc_s {
+	int frames;
+	bool fast;
+	int16_t coefs[2][ORDER];		// carried from one packet to the next
+	int32_t *samples[4];			// or residuals in fast mode
+	int32_t *residuals[2];
+} alacenc_t;
+
+typedef struct {
+	uint8_t *data, *end;
+	uint64_t cache;					// pending bits, msb first
+	int bits;
+	bool overflow;
+} writer_t;
+
+/*---------------------------------------------------------------------------*/
+static inline int clz(uint32_t v) {
+	if (!v) return 32;
+#if defined(__GNUC__)
+	return __builtin_clz(v);
+#elif defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse(&index, v);
+	return 31 - index;
+#else
+	int n = 0;
+	while (!(v & 0x80000000)) { v <<= 1; n++; }
+	return n;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+static inline void put_bits(writer_t *w, uint32_t value, int n) {
+	w->cache |= (uint64_t) (value & ((1ULL << n) - 1)) << (64 - w->bits - n);
+	for (w->bits += n; w->bits >= 8; w->bits -= 8, w->cache <<= 8) {
+		if (w->data < w->end) *w->data++ = w->cache >> 56;
+		else w->overflow = true;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void put_end(writer_t *w) {
+	put_bits(w, ID_END, 3);
+	if (w->bits) put_bits(w, 0, 8 - w->bits);
+}
+
+/*---------------------------------------------------------------------------*/
+static void put_header(writer_t *w, int frames, bool hassize, bool verbatim) {
+	put_bits(w, 1, 3);				// stereo
+	put_bits(w, 0, 4 + 12);
+	put_bits(w, hassize, 1);
+	put_bits(w, 0, 2);				// no uncompressed bytes
+	put_bits(w, verbatim, 1);
+	if (hassize) put_bits(w, frames, 32);
+}
+
+/*---------------------------------------------------------------------------*/
+// one value as entropy_decode_value() reads it
+static inline void put_value(writer_t *w, uint32_t value, int k, int size, uint32_t mask) {
+	uint32_t m = ((1 << k) - 1) & mask;
+
+	if (k == 1) {
+		// plain unary then
+		if (value <= 8) {
+			put_bits(w, (1 << (value + 1)) - 2, value + 1);
+			return;
+		}
+	} else if (value / m <= 8) {
+		uint32_t q = value / m, r = value % m;
+		put_bits(w, (1 << (q + 1)) - 2, q + 1);
+		// a null remainder takes one bit less
+		if (r) put_bits(w, r + 1, k);
+		else put_bits(w, 0, k - 1);
+		return;
+	}
+
+	// escape
+	put_bits(w, 0x1ff, 9);
+	put_bits(w, value, size);
+}
+
+/*---------------------------------------------------------------------------*/
+// same history as entropy_rice_decode() so that k needs not be sent
+static void put_residuals(writer_t *w, const int32_t *e, int n) {
+	int history = INIT_HISTORY, mult = HISTORY_MULT * RICE_MODIFIER / 4;
+	uint32_t sign_modifier = 0;
+
+	for (int i = 0; i < n && !w->overflow; i++) {
+		int k = 31 - KMODIFIER - clz((history >> 9) + 3);
+		uint32_t value = ((uint32_t) e[i] << 1) ^ (e[i] >> 31);
+
+		put_value(w, value - sign_modifier, k < 0 ? k + KMODIFIER : KMODIFIER, CHAN_SIZE, 0xffffffff);
+		sign_modifier = 0;
+
+		history += value * mult - ((history * mult) >> 9);
+		if (value > 0xffff) history = 0xffff;
+
+		// small history means a run of zeros is coming, sent as a count
+		if (history < 128 && i + 1 < n) {
+			int run;
+
+			k = clz(history) + ((history + 16) >> 6) - 24;
+			for (run = 0; i + 1 + run < n && !e[i + 1 + run]; run++);
+			put_value(w, run, k, 16, (1 << KMODIFIER) - 1);
+
+			i += run;
+			sign_modifier = 1;
+			history = 0;
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+// same prediction and adaptation as predictor_decompress_fir_adapt()
+static void fir_residuals(const int32_t *x, int32_t *e, int n, int16_t *coefs) {
+	int i;
+
+	for (i = 0; i <= ORDER && i < n; i++) e[i] = SIGN_EXTEND(x[i] - (i ? x[i - 1] : 0));
+
+	for (; i < n; i++) {
+		const int32_t *h = x + i - ORDER - 1;
+		int sum = 0, error;
+
+		for (int j = 0; j < ORDER; j++) sum += (h[ORDER - j] - h[0]) * coefs[j];
+		error = e[i] = SIGN_EXTEND(x[i] - (((1 << (QUANT - 1)) + sum) >> QUANT) - h[0]);
+
+		// decoder walks coefficients from the oldest sample while error keeps its sign
+		for (int j = ORDER - 1, positive = error > 0; j >= 0 && error && (error > 0) == positive; j--) {
+			int val = h[0] - h[ORDER - j];
+			int sign = positive ? (val > 0) - (val < 0) : (val < 0) - (val > 0);
+
+			coefs[j] -= sign;
+			val *= sign;
+			error -= (val >> QUANT) * (ORDER - j);
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/*
+ De-interleaves into left, right, mid and side and sums the absolute first
+ differences of each as a cost estimate. In fast mode, these differences are
+ stored instead of samples as they are the residuals of 1st order prediction
+*/
+static void split(alacenc_t *enc, const uint8_t *pcm, int n, uint32_t cost[4]) {
+	int32_t **s = enc->samples;
+	int i = 0;
+
+	memset(cost, 0, 4 * sizeof(uint32_t));
+
+#if USE_SSE2
+	__m128i last[4], acc[4];
+
+	for (int c = 0; c < 4; c++) last[c] = acc[c] = _mm_setzero_si128();
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (pcm + i * 4)), x[4];
+
+		x[LEFT] = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+		x[RIGHT] = _mm_srai_epi32(v, 16);
+		x[SIDE] = _mm_sub_epi32(x[LEFT], x[RIGHT]);
+		x[MID] = _mm_add_epi32(x[RIGHT], _mm_srai_epi32(x[SIDE], MIX_SHIFT));
+
+		for (int c = 0; c < 4; c++) {
+			__m128i d = _mm_sub_epi32(x[c], _mm_or_si128(_mm_slli_si128(x[c], 4), _mm_srli_si128(last[c], 12)));
+			__m128i sign = _mm_srai_epi32(d, 31);
+
+			acc[c] = _mm_add_epi32(acc[c], _mm_sub_epi32(_mm_xor_si128(d, sign), sign));
+			last[c] = x[c];
+			if (enc->fast) x[c] = _mm_srai_epi32(_mm_slli_epi32(d, 32 - CHAN_SIZE), 32 - CHAN_SIZE);
+			_mm_storeu_si128((__m128i*) (s[c] + i), x[c]);
+		}
+	}
+
+	for (int c = 0; c < 4; c++) {
+		acc[c] = _mm_add_epi32(acc[c], _mm_shuffle_epi32(acc[c], _MM_SHUFFLE(1, 0, 3, 2)));
+		acc[c] = _mm_add_epi32(acc[c], _mm_shuffle_epi32(acc[c], _MM_SHUFFLE(2, 3, 0, 1)));
+		cost[c] = _mm_cvtsi128_si32(acc[c]);
+	}
+#elif USE_NEON
+	int32x4_t last[4], acc[4];
+
+	for (int c = 0; c < 4; c++) last[c] = acc[c] = vdupq_n_s32(0);
+
+	for (; i + 4 <= n; i += 4) {
+		int16x4x2_t v = vld2_s16((const int16_t*) (pcm + i * 4));
+		int32x4_t x[4];
+
+		x[LEFT] = vmovl_s16(v.val[0]);
+		x[RIGHT] = vmovl_s16(v.val[1]);
+		x[SIDE] = vsubq_s32(x[LEFT], x[RIGHT]);
+		x[MID] = vaddq_s32(x[RIGHT], vshrq_n_s32(x[SIDE], MIX_SHIFT));
+
+		for (int c = 0; c < 4; c++) {
+			int32x4_t prev = vextq_s32(last[c], x[c], 3);
+
+			acc[c] = vaddq_s32(acc[c], vabdq_s32(x[c], prev));
+			last[c] = x[c];
+			if (enc->fast) x[c] = vshrq_n_s32(vshlq_n_s32(vsubq_s32(x[c], prev), 32 - CHAN_SIZE), 32 - CHAN_SIZE);
+			vst1q_s32(s[c] + i, x[c]);
+		}
+	}
+
+	for (int c = 0; c < 4; c++) {
+		int32x2_t sum = vadd_s32(vget_low_s32(acc[c]), vget_high_s32(acc[c]));
+		cost[c] = vget_lane_s32(vpadd_s32(sum, sum), 0);
+	}
+#endif
+
+	// what vectors did not do, previous samples are always needed
+	int32_t prev[4] = { 0 };
+
+	if (i) {
+		const uint8_t *p = pcm + (i - 1) * 4;
+		prev[LEFT] = (int16_t) (p[0] | (p[1] << 8));
+		prev[RIGHT] = (int16_t) (p[2] | (p[3] << 8));
+		prev[SIDE] = prev[LEFT] - prev[RIGHT];
+		prev[MID] = prev[RIGHT] + (prev[SIDE] >> MIX_SHIFT);
+	}
+
+	for (; i < n; i++) {
+		const uint8_t *p = pcm + i * 4;
+		int32_t x[4];
+
+		x[LEFT] = (int16_t) (p[0] | (p[1] << 8));
+		x[RIGHT] = (int16_t) (p[2] | (p[3] << 8));
+		x[SIDE] = x[LEFT] - x[RIGHT];
+		x[MID] = x[RIGHT] + (x[SIDE] >> MIX_SHIFT);
+
+		for (int c = 0; c < 4; c++) {
+			int32_t d = x[c] - prev[c];
+
+			cost[c] += d < 0 ? -d : d;
+			s[c][i] = enc->fast ? SIGN_EXTEND(d) : x[c];
+			prev[c] = x[c];
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void put_verbatim(writer_t *w, const uint8_t *pcm, int frames, bool hassize) {
+	put_header(w, frames, hassize, true);
+	for (int i = 0; i < frames * 2; i++, pcm += 2) put_bits(w, pcm[0] | (pcm[1] << 8), 16);
+	put_end(w);
+}
+
+/*---------------------------------------------------------------------------*/
+struct alacenc_s *alacenc_create(int frames, bool fast) {
+	alacenc_t *enc;
+
+	if (frames <= 0 || frames > ALACENC_MAX_FRAMES || (enc = calloc(1, sizeof(alacenc_t))) == NULL) return NULL;
+
+	enc->frames = frames;
+	enc->fast = fast;
+
+	for (int c = 0; c < 4; c++) enc->samples[c] = malloc(frames * sizeof(int32_t));
+	for (int c = 0; c < 2; c++) {
+		enc->residuals[c] = malloc(frames * sizeof(int32_t));
+		// start as 1st order predictor (x[n-1]), adaptation does the rest
+		enc->coefs[c][0] = 1 << QUANT;
+	}
+
+	for (int c = 0; c < 4; c++) if (!enc->samples[c] || (c < 2 && !enc->residuals[c])) {
+		alacenc_delete(enc);
+		return NULL;
+	}
+
+	return enc;
+}
+
+/*---------------------------------------------------------------------------*/
+void alacenc_delete(struct alacenc_s *enc) {
+	for (int c = 0; c < 4; c++) free(enc->samples[c]);
+	for (int c = 0; c < 2; c++) free(enc->residuals[c]);
+	free(enc);
+}
+
+/*---------------------------------------------------------------------------*/
+size_t alacenc_max_size(int frames) {
+	return (HEADER_BITS + 32 + frames * 32 + 3 + 7) / 8;
+}
+
+/*---------------------------------------------------------------------------*/
+size_t alacenc_encode(struct alacenc_s *enc, const uint8_t *pcm, int frames, uint8_t *out) {
+	bool hassize = frames != enc->frames;
+	writer_t w = { .data = out, .end = out + alacenc_max_size(frames) - 1 };
+	int16_t coefs[2][ORDER];
+	uint32_t cost[4];
+	int ch[2];
+
+	if (frames <= 0 || frames > enc->frames) return 0;
+
+	split(enc, pcm, frames, cost);
+
+	// mid/side only when it is worth it
+	bool mixed = (uint64_t) cost[MID] + cost[SIDE] < (uint64_t) cost[LEFT] + cost[RIGHT];
+	ch[0] = mixed ? MID : LEFT;
+	ch[1] = mixed ? SIDE : RIGHT;
+
+	// coefficients sent are the ones before this packet's adaptation
+	memcpy(coefs, enc->coefs, sizeof(coefs));
+
+	// compressed frame stops as soon as it is not smaller than uncompressed
+	put_header(&w, frames, hassize, false);
+	put_bits(&w, mixed ? MIX_SHIFT : 0, 8);
+	put_bits(&w, mixed ? 1 : 0, 8);
+
+	for (int c = 0; c < 2; c++) {
+		put_bits(&w, 0, 4);
+		put_bits(&w, QUANT, 4);
+		put_bits(&w, RICE_MODIFIER, 3);
+		put_bits(&w, enc->fast ? FIRST_ORDER : ORDER, 5);
+		for (int j = 0; j < (enc->fast ? FIRST_ORDER : ORDER); j++) put_bits(&w, enc->fast ? 0 : coefs[c][j], 16);
+	}
+
+	for (int c = 0; c < 2 && !w.overflow; c++) {
+		if (enc->fast) {
+			put_residuals(&w, enc->samples[ch[c]], frames);
+		} else {
+			fir_residuals(enc->samples[ch[c]], enc->residuals[c], frames, enc->coefs[c]);
+			put_residuals(&w, enc->residuals[c], frames);
+		}
+	}
+
+	put_end(&w);
+	if (!w.overflow) return w.data - out;
+
+	w = (writer_t) { .data = out, .end = out + alacenc_max_size(frames) };
+	put_verbatim(&w, pcm, frames, hassize);
+
+	return w.data - out;
+}
@@ -0,0 +1,31 @@
+/*
+ * ALAC encoder for 16 bits stereo, counterpart of alac.c
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// parameters to announce in fmtp: <frames> 0 16 40 10 14 2 255 0 0 <rate>
+#define ALACENC_MAX_FRAMES	4096
+
+/*
+ Not thread-safe, caller must serialize. Normal mode uses an order 4 adaptive
+ predictor whose coefficients carry from one packet to the next. Fast mode
+ uses the fixed 1st order one, where residuals are computed with vectors
+ but that costs 124 bytes of (null) coefficients per packet. Packets that
+ would not be smaller than uncompressed ones are sent uncompressed
+*/
+struct alacenc_s*	alacenc_create(int frames, bool fast);
+void				alacenc_delete(struct alacenc_s *enc);
+// size of uncompressed packets, that no packet can exceed
+size_t				alacenc_max_size(int frames);
+// encodes little endian interleaved samples into out, returns size or 0 when frames is too large
+size_t				alacenc_encode(struct alacenc_s *enc, const uint8_t *pcm, int frames, uint8_t *out);
@@ -33,6 +33,8 @@
 #include "cross_ssl.h"
 #include "cross_util.h"
 #include "cross_log.h"
+#include "raop_log.h"
+#include "raop_lock.h"
 
 #define RAOP_SEC(ntp) ((uint32_t) ((ntp) >> 32))
 #define RAOP_FRAC(ntp) ((uint32_t) (ntp))
@@ -79,12 +81,16 @@ static int print_usage(char *argv[])
 			   "\t[-e] audio payload encryption\n"
 			   "\t[-u] for authentication (only if crypto present in TXT record)\n"
    			   "\t[-a] send ALAC compressed audio\n"
+			   "\t[-af] send ALAC compressed audio, fast mode (less CPU, more bandwidth)\n"
 			   "\t[-s <secret>] (valid secret for AppleTV)\n"
 			   "\t[-P <password>] (device password)\n"
 			   "\t[-r] do AppleTV pairing\n"
 			   "\t[-t <et>] (et field in mDNS - 4 for airport-express and used to detect MFi)\n"
 			   "\t[-m <[0][,1][,2]>] (md in mDNS: metadata capabilties 0=text, 1=artwork, 2=progress)\n"
 			   "\t[-d <debug level>] (0 = silent)\n"
+			   "\t[-A] asynchronous logging (log calls do not wait for output)\n"
+			   "\t[-L] profile RAOP lock, wait and hold times are printed on exit\n"
+			   "\t[-S <runs>] connect <runs> times to each <server_ip> (comma separated) and print startup steps percentiles\n"
 			   "\t[-i] (interactive commands: 'p'=pause, 'r'=(re)start, 's'=stop, 'q'=exit, ' '=block)\n",
 			   name);
 	return -1;
@@ -147,6 +153,7 @@ static void init_platform(bool interactive) {
 
 /*----------------------------------------------------------------------------*/
 static void close_platform(bool interactive) {
+	raoplog_stop();
 	netsock_close();
 #if !WIN
 	if (interactive) set_termio(true);
@@ -154,6 +161,105 @@ static void close_platform(bool interactive) {
 	cross_ssl_free();
 }
 
+/*----------------------------------------------------------------------------*/
+static void print_locks(struct raopcl_s *raopcl) {
+	raop_lock_stats_t stats;
+
+	raopcl_lock_stats(raopcl, &stats);
+	printf("lock site                          count  contended  wait avg/max (us)  hold avg/max (us)\n");
+
+	for (int i = 0; i < stats.count; i++) {
+		raop_lock_site_t *site = stats.sites + i;
+		char name[64];
+
+		snprintf(name, sizeof(name), "%s:%d", site->func, site->line);
+		printf("%-32s %8u %10u %8u/%-8u %8u/%-8u\n", name, site->count, site->contended,
+			   (uint32_t) (site->wait_total / site->count), site->wait_max,
+			   (uint32_t) (site->hold_total / site->count), site->hold_max);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static int compare_u32(const void *a, const void *b) {
+	return *(uint32_t*) a < *(uint32_t*) b ? -1 : *(uint32_t*) a > *(uint32_t*) b;
+}
+
+/*----------------------------------------------------------------------------*/
+static void print_startup(char *name, raop_startup_t *traces, int count) {
+	uint32_t *values = malloc(count * sizeof(uint32_t));
+
+	printf("%s: %d connections (ms)\n%-10s %8s %8s %8s %8s\n", name, count, "step", "p50", "p90", "p99", "max");
+
+	for (int step = 0; step <= RAOP_STEPS; step++) {
+		for (int i = 0; i < count; i++) values[i] = step < RAOP_STEPS ? traces[i].steps[step] : traces[i].total;
+		qsort(values, count, sizeof(uint32_t), compare_u32);
+		printf("%-10s %8.1f %8.1f %8.1f %8.1f\n", step < RAOP_STEPS ? raopcl_step_name(step) : "total",
+			   values[count * 50 / 100] / 1000.0, values[count * 90 / 100] / 1000.0,
+			   values[count * 99 / 100] / 1000.0, values[count - 1] / 1000.0);
+	}
+
+	free(values);
+}
+
+/*----------------------------------------------------------------------------*/
+// play silence until first packet is sent, for each player, <runs> times
+static void startup_bench(struct raopcl_s *raopcl, char *players, int port, int runs) {
+	uint8_t silence[DEFAULT_FRAMES_PER_CHUNK * 4] = { 0 };
+	char *list = strdup(players), *name;
+	int count = 0;
+
+	for (name = list; name; name = strchr(name, ',')) {
+		if (*name == ',') *name++ = '\0';
+		count++;
+	}
+
+	raop_startup_t *traces = calloc(count * runs, sizeof(raop_startup_t));
+	int *done = calloc(count, sizeof(int));
+
+	for (int run = 0; run < runs; run++) {
+		name = list;
+		for (int i = 0; i < count; i++, name += strlen(name) + 1) {
+			struct hostent *hostent = gethostbyname(name);
+			struct in_addr addr;
+			uint32_t start = gettime_ms();
+			uint64_t playtime;
+
+			if (!hostent) {
+				LOG_ERROR("Cannot resolve name %s", name);
+				continue;
+			}
+
+			memcpy(&addr.s_addr, hostent->h_addr_list[0], hostent->h_length);
+
+			if (!raopcl_connect(raopcl, addr, port, true)) {
+				LOG_ERROR("Cannot connect to AirPlay device %s:%hu", inet_ntoa(addr), port);
+				continue;
+			}
+
+			// don't wait forever for a player that does not flush
+			while (!raopcl_startup(raopcl).complete && gettime_ms() - start < 10000) {
+				if (raopcl_accept_frames(raopcl)) raopcl_send_chunk(raopcl, silence, DEFAULT_FRAMES_PER_CHUNK, &playtime);
+				else usleep(1000);
+			}
+
+			if (raopcl_startup(raopcl).complete) traces[i * runs + done[i]++] = raopcl_startup(raopcl);
+			else LOG_WARN("%s did not start streaming", name);
+
+			raopcl_stop(raopcl);
+			raopcl_disconnect(raopcl);
+		}
+	}
+
+	name = list;
+	for (int i = 0; i < count; i++, name += strlen(name) + 1) {
+		if (done[i]) print_startup(name, traces + i * runs, done[i]);
+	}
+
+	free(done);
+	free(traces);
+	free(list);
+}
+
 /*----------------------------------------------------------------------------*/
 /*																			  */
 /*----------------------------------------------------------------------------*/
@@ -170,11 +276,12 @@ int main(int argc, char *argv[]) {
 	} player = { 0 };
 	int infile;
 	uint8_t *buf;
-	int i, n = -1, level = 2;
+	int i, n = -1, level = 2, runs = 0;
 	enum {STOPPED, PAUSED, PLAYING } status;
 	raop_crypto_t crypto = RAOP_CLEAR;
 	uint64_t start = 0, start_at = 0, last = 0, frames = 0;
-	bool interactive = false, alac = false, pairing = false;
+	bool interactive = false, pairing = false, async_log = false, lock_profile = false;
+	raop_codec_t codec = RAOP_PCM;
 	char *secret = NULL, *md = NULL, *et = NULL;
 	bool auth = false;
 	struct in_addr host = { INADDR_ANY };
@@ -208,7 +315,9 @@ int main(int argc, char *argv[]) {
 		} else if (!strcmp(argv[i], "-u")) {
 			auth = true;
 		} else if (!strcmp(argv[i],"-a")) {
-			alac = true;
+			codec = RAOP_ALAC;
+		} else if (!strcmp(argv[i],"-af")) {
+			codec = RAOP_ALAC_FAST;
 		} else if (!strcmp(argv[i], "-r")) {
 			pairing = true;
 		} else if(!strcmp(argv[i],"-n")) {
@@ -226,6 +335,12 @@ int main(int argc, char *argv[]) {
 			if (level >= sizeof(debug) / sizeof(struct debug_s)) {
 				level = sizeof(debug) / sizeof(struct debug_s) - 1;
 			}
+		} else if (!strcmp(argv[i], "-A")) {
+			async_log = true;
+		} else if (!strcmp(argv[i], "-L")) {
+			lock_profile = true;
+		} else if (!strcmp(argv[i], "-S")) {
+			runs = atoi(argv[++i]);
 		} else if(!strcmp(argv[i],"-e")) {
 			crypto = RAOP_RSA;
 			continue;
@@ -247,9 +362,13 @@ int main(int argc, char *argv[]) {
 	main_log = debug[level].main;
 
 	if (!player.name && !pairing) return print_usage(argv);
-	if (!fname && !pairing) return print_usage(argv);
+	if (!fname && !pairing && !runs) return print_usage(argv);
 
-	if (!strcmp(fname, "-")) {
+	// no audio input in startup measurement mode (silence is sent)
+	if (runs) {
+		infile = -1;
+		interactive = false;
+	} else if (!strcmp(fname, "-")) {
 		infile = fileno(stdin);
 		interactive = false;
 	} else if ((infile = open(fname, O_RDONLY)) == -1) {
@@ -259,16 +378,18 @@ int main(int argc, char *argv[]) {
 	}
 
 #if WIN
-	setmode(infile, O_BINARY);
+	if (infile != -1) setmode(infile, O_BINARY);
 #endif
 
 	init_platform(interactive);
+	if (async_log && !raoplog_start(0)) LOG_WARN("cannot start asynchronous logging");
+	raop_lock_profile(lock_profile);
 
 	// if required, pair with appleTV
 	if (pairing) AppleTVpairing(NULL, NULL, &secret);
 	
 	// create the raop context
-	if ((raopcl = raopcl_create(host, 0, 0, NULL, NULL, alac ? RAOP_ALAC : RAOP_PCM, DEFAULT_FRAMES_PER_CHUNK,
+	if ((raopcl = raopcl_create(host, 0, 0, NULL, NULL, codec, DEFAULT_FRAMES_PER_CHUNK,
 								latency, crypto, auth, secret, passwd, et, md,
 								44100, 16, 2,
 								raopcl_float_volume(volume))) == NULL) {
@@ -277,6 +398,11 @@ int main(int argc, char *argv[]) {
 		exit(1);
 	}
 
+	if (runs) {
+		startup_bench(raopcl, player.name, port, runs);
+		goto exit;
+	}
+
 	// get player's address
 	player.hostent = gethostbyname(player.name);
 	if (!player.hostent) {
@@ -366,6 +492,7 @@ int main(int argc, char *argv[]) {
 				break;
 			case 'q':
 				raopcl_disconnect(raopcl);
+				if (lock_profile) print_locks(raopcl);
 				raopcl_destroy(raopcl);
 				free(buf);
 				close_platform(interactive);
@@ -383,6 +510,7 @@ int main(int argc, char *argv[]) {
 	raopcl_disconnect(raopcl);
 
 exit:
+	if (lock_profile) print_locks(raopcl);
 	raopcl_destroy(raopcl);
 	close_platform(interactive);
 	return 0;
@@ -0,0 +1,276 @@
+/*
+ * RAOP : artwork store shared by all servers, keyed by content
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <pthread.h>
+
+#include "platform.h"
+#include "raop_artwork.h"
+#include "raop_reactor.h"
+
+#include "cross_net.h"
+#include "cross_log.h"
+#include "cross_util.h"
+
+#define TTL		3600		// seconds an image stays on pico server, republished when used
+
+extern log_level 	raop_loglevel;
+static log_level 	*loglevel = &raop_loglevel;
+
+typedef struct {
+	uint8_t *data;
+	size_t len;
+	char *url;					// as returned by pico server
+} image_t;
+
+typedef struct artwork_s {
+	struct artwork_s *next;
+	uint64_t hash;
+	image_t image, scaled;
+	char mime[32];
+	int refs;
+	uint32_t used, published;
+} artwork_t;
+
+static struct {
+	pthread_mutex_t mutex;
+	artwork_t *list;
+	size_t budget, unused;		// unused is bytes held by unreferenced images
+	artwork_scale_cb_t scale;
+	struct reactor_event_s *timer;	// keeps referenced images published, only when there are some
+} store = { PTHREAD_MUTEX_INITIALIZER, NULL, ARTWORK_BUDGET };
+
+/*---------------------------------------------------------------------------*/
+static uint64_t hash64(const uint8_t *data, size_t len) {
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; i++) hash = (hash ^ data[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+/*---------------------------------------------------------------------------*/
+static size_t footprint(artwork_t *artwork) {
+	return artwork->image.len + artwork->scaled.len;
+}
+
+/*---------------------------------------------------------------------------*/
+static void image_path(artwork_t *artwork, image_t *image, char *path, size_t size) {
+	const char *ext = strstr(artwork->mime, "png") ? ".png" : strstr(artwork->mime, "jpeg") ? ".jpg" : "";
+	snprintf(path, size, "/%016" PRIx64 "%s%s", artwork->hash, image == &artwork->scaled ? "-s" : "", ext);
+}
+
+/*---------------------------------------------------------------------------*/
+static void unpublish(artwork_t *artwork, image_t *image) {
+	char path[48];
+
+	if (!image->url) return;
+
+	image_path(artwork, image, path, sizeof(path));
+	http_pico_del_source(path);
+	NFREE(image->url);
+}
+
+/*---------------------------------------------------------------------------*/
+static void publish(artwork_t *artwork, image_t *image) {
+	char path[48];
+
+	if (!image->data) return;
+
+	// replace, don't stack copies on pico server
+	unpublish(artwork, image);
+	image_path(artwork, image, path, sizeof(path));
+	image->url = http_pico_add_source(path, artwork->mime, image->data, image->len, TTL);
+}
+
+/*---------------------------------------------------------------------------*/
+// oldest unused images go first, must be called locked
+static void evict(void) {
+	while (store.unused > store.budget) {
+		artwork_t **oldest = NULL;
+
+		for (artwork_t **p = &store.list; *p; p = &(*p)->next) {
+			if (!(*p)->refs && (!oldest || (int32_t) ((*p)->used - (*oldest)->used) < 0)) oldest = p;
+		}
+
+		if (!oldest) break;
+
+		artwork_t *artwork = *oldest;
+		*oldest = artwork->next;
+		store.unused -= footprint(artwork);
+
+		LOG_DEBUG("evicting artwork %016" PRIx64 " (%zu bytes)", artwork->hash, artwork->image.len);
+		unpublish(artwork, &artwork->image);
+		unpublish(artwork, &artwork->scaled);
+		free(artwork->image.data);
+		free(artwork->scaled.data);
+		free(artwork);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+void artwork_config(size_t budget, artwork_scale_cb_t scale) {
+	pthread_mutex_lock(&store.mutex);
+	store.budget = budget;
+	store.scale = scale;
+	evict();
+	pthread_mutex_unlock(&store.mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called locked
+static artwork_t *lookup(uint64_t hash, const uint8_t *data, size_t len) {
+	artwork_t *artwork;
+
+	for (artwork = store.list; artwork; artwork = artwork->next) {
+		if (artwork->hash == hash && artwork->image.len == len && !memcmp(artwork->image.data, data, len)) break;
+	}
+
+	return artwork;
+}
+
+/*---------------------------------------------------------------------------*/
+// make sure it's still on pico server, must be called locked
+static void refresh(artwork_t *artwork, uint32_t now) {
+	if (now - artwork->published > TTL * 1000 / 2) {
+		publish(artwork, &artwork->image);
+		publish(artwork, &artwork->scaled);
+		artwork->published = now;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static uint32_t refresh_tick(void *owner) {
+	struct reactor_event_s *timer = NULL;
+	uint32_t now = gettime_ms();
+	bool used = false;
+
+	pthread_mutex_lock(&store.mutex);
+
+	for (artwork_t *artwork = store.list; artwork; artwork = artwork->next) {
+		if (!artwork->refs) continue;
+		refresh(artwork, now);
+		used = true;
+	}
+
+	// next get will re-arm, removing ourselves does not wait
+	if (!used) {
+		timer = store.timer;
+		store.timer = NULL;
+	}
+
+	pthread_mutex_unlock(&store.mutex);
+
+	if (timer) reactor_remove(timer);
+	return used ? TTL * 1000 / 4 : REACTOR_NEVER;
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called locked
+static void take(artwork_t *artwork, uint32_t now) {
+	if (!artwork->refs) store.unused -= footprint(artwork);
+	refresh(artwork, now);
+	artwork->refs++;
+	artwork->used = now;
+	if (!store.timer) store.timer = reactor_timer(TTL * 1000 / 4, refresh_tick, &store);
+}
+
+/*---------------------------------------------------------------------------*/
+struct artwork_s *artwork_get(const uint8_t *data, size_t len, const char *mime) {
+	uint64_t hash = hash64(data, len);
+	uint32_t now = gettime_ms();
+	artwork_t *artwork, *created;
+
+	pthread_mutex_lock(&store.mutex);
+
+	artwork_scale_cb_t scale = store.scale;
+
+	if ((artwork = lookup(hash, data, len)) != NULL) {
+		take(artwork, now);
+		LOG_DEBUG("artwork %016" PRIx64 " already stored (refs:%d)", hash, artwork->refs);
+		pthread_mutex_unlock(&store.mutex);
+		return artwork;
+	}
+
+	pthread_mutex_unlock(&store.mutex);
+
+	// copy and scale unlocked, scaler can take a while
+	if ((created = calloc(1, sizeof(artwork_t))) == NULL) return NULL;
+
+	if ((created->image.data = malloc(len)) == NULL) {
+		free(created);
+		return NULL;
+	}
+
+	created->hash = hash;
+	created->image.len = len;
+	memcpy(created->image.data, data, len);
+	snprintf(created->mime, sizeof(created->mime), "%s", mime);
+
+	// scaled version is only built once, at creation
+	if (!scale || !scale(data, len, &created->scaled.data, &created->scaled.len)) {
+		created->scaled.data = NULL;
+		created->scaled.len = 0;
+	}
+
+	pthread_mutex_lock(&store.mutex);
+
+	// another session might have stored the same image meanwhile
+	if ((artwork = lookup(hash, data, len)) == NULL) {
+		artwork = created;
+		created = NULL;
+		publish(artwork, &artwork->image);
+		publish(artwork, &artwork->scaled);
+		artwork->published = now;
+		artwork->next = store.list;
+		store.list = artwork;
+		LOG_INFO("storing artwork %016" PRIx64 " (%zu bytes, scaled:%zu)", hash, len, artwork->scaled.len);
+	}
+
+	take(artwork, now);
+
+	pthread_mutex_unlock(&store.mutex);
+
+	if (created) {
+		free(created->image.data);
+		free(created->scaled.data);
+		free(created);
+	}
+
+	return artwork;
+}
+
+/*---------------------------------------------------------------------------*/
+void artwork_release(struct artwork_s *artwork) {
+	if (!artwork) return;
+
+	pthread_mutex_lock(&store.mutex);
+	if (--artwork->refs == 0) {
+		store.unused += footprint(artwork);
+		evict();
+	}
+	pthread_mutex_unlock(&store.mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+char *artwork_url(struct artwork_s *artwork, bool scaled) {
+	char *url = NULL;
+
+	if (!artwork) return NULL;
+
+	pthread_mutex_lock(&store.mutex);
+	if (scaled && artwork->scaled.url) url = strdup(artwork->scaled.url);
+	else if (artwork->image.url) url = strdup(artwork->image.url);
+	pthread_mutex_unlock(&store.mutex);
+
+	return url;
+}
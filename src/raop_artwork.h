@@ -0,0 +1,35 @@
+/*
+ * RAOP : artwork store shared by all servers, keyed by content
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// bytes kept for images no session references anymore (referenced ones are never evicted)
+#ifndef ARTWORK_BUDGET
+#define ARTWORK_BUDGET	(4*1024*1024)
+#endif
+
+// scaled image must be malloc'ed, return false to use original
+typedef bool (*artwork_scale_cb_t)(const uint8_t *image, size_t len, uint8_t **scaled, size_t *scaled_len);
+
+/*
+ Identical images (same hash, length and content) are stored and published on
+ the HTTP pico server once, whatever the number of sessions and tracks using
+ them. Each get takes a reference that must be released. When a scaler is set,
+ it runs when an image is first stored (unlocked, a racing copy is discarded).
+ Referenced images are re-published before the pico server expires them
+*/
+void				artwork_config(size_t budget, artwork_scale_cb_t scale);
+struct artwork_s*	artwork_get(const uint8_t *data, size_t len, const char *mime);
+void				artwork_release(struct artwork_s *artwork);
+// url on pico server, scaled version if any and asked for, must be freed
+char*				artwork_url(struct artwork_s *artwork, bool scaled);
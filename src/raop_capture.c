@@ -0,0 +1,160 @@
+/*
+ * RAOP : capture of what a streamer receives, for offline replay
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#include "raop_capture.h"
+
+#define MAGIC		"RAOPCAP"
+#define VERSION		1
+#define HEADER_LEN	12
+
+typedef struct capture_s {
+	pthread_mutex_t mutex;
+	FILE *file;
+	uint8_t *buffer;			// reading only
+	uint32_t count;
+} capture_t;
+
+/*---------------------------------------------------------------------------*/
+void capture_put(uint8_t *p, uint64_t v, int bytes) {
+	for (int i = 0; i < bytes; i++, v >>= 8) p[i] = v;
+}
+
+/*---------------------------------------------------------------------------*/
+uint64_t capture_get(uint8_t *p, int bytes) {
+	uint64_t v = 0;
+	for (int i = bytes - 1; i >= 0; i--) v = (v << 8) | p[i];
+	return v;
+}
+
+/*---------------------------------------------------------------------------*/
+struct capture_s *capture_create(void) {
+	capture_t *cap = calloc(1, sizeof(capture_t));
+	if (cap) pthread_mutex_init(&cap->mutex, NULL);
+	return cap;
+}
+
+/*---------------------------------------------------------------------------*/
+void capture_delete(struct capture_s *cap) {
+	if (!cap) return;
+	capture_stop(cap);
+	pthread_mutex_destroy(&cap->mutex);
+	free(cap->buffer);
+	free(cap);
+}
+
+/*---------------------------------------------------------------------------*/
+bool capture_start(struct capture_s *cap, const char *path) {
+	uint8_t header[8] = MAGIC;
+
+	// session key is in there, so nobody else can read it
+#if defined(_WIN32)
+	FILE *file = fopen(path, "wb");
+#else
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	FILE *file = NULL;
+	// an existing file keeps its mode otherwise
+	if (fd >= 0 && (fchmod(fd, 0600) || (file = fdopen(fd, "wb")) == NULL)) close(fd);
+#endif
+
+	if (!file) return false;
+
+	header[7] = VERSION;
+	fwrite(header, sizeof(header), 1, file);
+
+	pthread_mutex_lock(&cap->mutex);
+	if (cap->file) fclose(cap->file);
+	cap->file = file;
+	cap->count = 0;
+	pthread_mutex_unlock(&cap->mutex);
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+void capture_stop(struct capture_s *cap) {
+	pthread_mutex_lock(&cap->mutex);
+	if (cap->file) fclose(cap->file);
+	cap->file = NULL;
+	pthread_mutex_unlock(&cap->mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+bool capture_active(struct capture_s *cap) {
+	return cap->file != NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+void capture_write(struct capture_s *cap, capture_type_t type, uint8_t channel, uint64_t time, const void *data, uint16_t len) {
+	uint8_t header[HEADER_LEN];
+
+	header[0] = type;
+	header[1] = channel;
+	capture_put(header + 2, len, 2);
+	capture_put(header + 4, time, 8);
+
+	pthread_mutex_lock(&cap->mutex);
+	if (cap->file) {
+		fwrite(header, HEADER_LEN, 1, cap->file);
+		if (len) fwrite(data, len, 1, cap->file);
+		// don't lose too much in case of crash
+		if (!(++cap->count & 0xff)) fflush(cap->file);
+	}
+	pthread_mutex_unlock(&cap->mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+struct capture_s *capture_open(const char *path) {
+	FILE *file = fopen(path, "rb");
+	uint8_t header[8];
+
+	if (!file) return NULL;
+
+	if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, MAGIC, 7) || header[7] != VERSION) {
+		fclose(file);
+		return NULL;
+	}
+
+	capture_t *cap = capture_create();
+
+	if (!cap || (cap->buffer = malloc(UINT16_MAX)) == NULL) {
+		capture_delete(cap);
+		fclose(file);
+		return NULL;
+	}
+
+	cap->file = file;
+	return cap;
+}
+
+/*---------------------------------------------------------------------------*/
+bool capture_read(struct capture_s *cap, capture_record_t *record) {
+	uint8_t header[HEADER_LEN];
+
+	if (fread(header, HEADER_LEN, 1, cap->file) != 1) return false;
+
+	record->type = header[0];
+	record->channel = header[1];
+	record->len = capture_get(header + 2, 2);
+	record->time = capture_get(header + 4, 8);
+	record->data = cap->buffer;
+
+	return !record->len || fread(cap->buffer, record->len, 1, cap->file) == 1;
+}
@@ -0,0 +1,49 @@
+/*
+ * RAOP : capture of what a streamer receives, for offline replay
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CAPTURE_EXT		".rcap"
+
+// parameter is text (volume, progress), metadata is DMAP, artwork is its size only and teardown is empty
+typedef enum { CAPTURE_SESSION = 1, CAPTURE_PACKET, CAPTURE_RECORD, CAPTURE_FLUSH,
+			   CAPTURE_PARAMETER, CAPTURE_METADATA, CAPTURE_ARTWORK, CAPTURE_TEARDOWN } capture_type_t;
+
+typedef struct capture_record_s {
+	uint8_t type;
+	uint8_t channel;		// socket for packets
+	uint16_t len;
+	uint64_t time;			// local us when received
+	uint8_t *data;			// valid until next read
+} capture_record_t;
+
+/*
+ A capture is created idle and can be started/stopped anytime, records written
+ while idle are ignored. Writing is thread-safe, each record is kept whole.
+ File is a header followed by records (type, channel, len, time) + payload, all
+ little endian. It holds the session's AES key and IV in clear, so it is only
+ readable by its owner (where the platform allows)
+*/
+struct capture_s*	capture_create(void);
+void				capture_delete(struct capture_s *cap);
+bool				capture_start(struct capture_s *cap, const char *path);
+void				capture_stop(struct capture_s *cap);
+bool				capture_active(struct capture_s *cap);
+void				capture_write(struct capture_s *cap, capture_type_t type, uint8_t channel, uint64_t time, const void *data, uint16_t len);
+
+// reading side, a capture opened for reading can't be written
+struct capture_s*	capture_open(const char *path);
+bool				capture_read(struct capture_s *cap, capture_record_t *record);
+
+// little endian helpers for payloads
+void				capture_put(uint8_t *p, uint64_t v, int bytes);
+uint64_t			capture_get(uint8_t *p, int bytes);
@@ -0,0 +1,343 @@
+/*
+ * RAOP : AES-128-CBC on batches of independent packets
+ *
+ * RAOP restarts CBC from the session IV for every packet, so a batch holds
+ * many short independent chains. Encryption is serial within a chain, so
+ * lanes each follow one packet and are refilled as packets end. Decryption
+ * is not, so blocks of all packets are simply taken 8 at a time, keeping the
+ * previous ciphertext as the next block's chaining value
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/crypto.h>
+
+#include "aes.h"
+#include "raop_cbc.h"
+
+#if !defined(CBC_NO_SIMD) && (defined(__GNUC__) || defined(_MSC_VER)) && \
+	(defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define USE_AESNI 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif !defined(CBC_NO_SIMD) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#define USE_ARMV8 1
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__)
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMD_TARGET(isa)
+#endif
+
+#define LANES	8
+#define ROUNDS	10
+
+typedef struct cbc_key_s {
+	uint8_t enc[ROUNDS + 1][16];		// round keys for instructions
+	uint8_t dec[ROUNDS + 1][16];		// same, for equivalent inverse cipher
+	uint8_t iv[16];
+	aes_context ctx;					// without instructions
+} cbc_key_t;
+
+static enum { NONE, UNKNOWN, HARDWARE } accel = UNKNOWN;
+
+#if USE_AESNI
+/*---------------------------------------------------------------------------*/
+SIMD_TARGET("aes,sse2") static void dec_keys_aesni(cbc_key_t *key) {
+	_mm_storeu_si128((__m128i*) key->dec[0], _mm_loadu_si128((__m128i*) key->enc[ROUNDS]));
+	for (int r = 1; r < ROUNDS; r++) {
+		_mm_storeu_si128((__m128i*) key->dec[r], _mm_aesimc_si128(_mm_loadu_si128((__m128i*) key->enc[ROUNDS - r])));
+	}
+	_mm_storeu_si128((__m128i*) key->dec[ROUNDS], _mm_loadu_si128((__m128i*) key->enc[0]));
+}
+
+/*---------------------------------------------------------------------------*/
+SIMD_TARGET("aes,sse2") static void encrypt_aesni(cbc_packet_t *packets, int count) {
+	struct {
+		const __m128i *rk;
+		uint8_t *data;
+		int blocks;
+		__m128i chain;
+	} lane[LANES];
+	int active = 0;
+
+	while (1) {
+		// refill lanes, packets without a whole block have nothing to do
+		for (; active < LANES && count; packets++, count--) {
+			if (packets->len < 16) continue;
+			lane[active].rk = (const __m128i*) packets->key->enc;
+			lane[active].data = packets->data;
+			lane[active].blocks = packets->len / 16;
+			lane[active++].chain = _mm_loadu_si128((__m128i*) packets->key->iv);
+		}
+
+		if (!active) break;
+
+		__m128i x[LANES];
+		for (int l = 0; l < active; l++) {
+			x[l] = _mm_xor_si128(_mm_loadu_si128((__m128i*) lane[l].data), lane[l].chain);
+			x[l] = _mm_xor_si128(x[l], _mm_loadu_si128(lane[l].rk));
+		}
+
+		for (int r = 1; r < ROUNDS; r++) {
+			for (int l = 0; l < active; l++) x[l] = _mm_aesenc_si128(x[l], _mm_loadu_si128(lane[l].rk + r));
+		}
+
+		for (int l = 0; l < active; l++) {
+			lane[l].chain = _mm_aesenclast_si128(x[l], _mm_loadu_si128(lane[l].rk + ROUNDS));
+			_mm_storeu_si128((__m128i*) lane[l].data, lane[l].chain);
+			lane[l].data += 16;
+		}
+
+		// retire lanes whose packet is done
+		for (int l = 0; l < active;) {
+			if (--lane[l].blocks) l++;
+			else lane[l] = lane[--active];
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+SIMD_TARGET("aes,sse2") static void decrypt_aesni(cbc_packet_t *packets, int count) {
+	const __m128i *rk[LANES];
+	uint8_t *data[LANES];
+	__m128i x[LANES], chain[LANES], last = _mm_setzero_si128();
+	int block = 0;
+
+	while (1) {
+		int n = 0;
+
+		// gather next blocks, whatever packet they belong to
+		while (n < LANES && count) {
+			if (block >= packets->len / 16) {
+				packets++;
+				count--;
+				block = 0;
+				continue;
+			}
+			data[n] = packets->data + block * 16;
+			rk[n] = (const __m128i*) packets->key->dec;
+			chain[n] = block++ ? last : _mm_loadu_si128((__m128i*) packets->key->iv);
+			last = _mm_loadu_si128((__m128i*) data[n]);
+			x[n] = _mm_xor_si128(last, _mm_loadu_si128(rk[n]));
+			n++;
+		}
+
+		if (!n) break;
+
+		for (int r = 1; r < ROUNDS; r++) {
+			for (int l = 0; l < n; l++) x[l] = _mm_aesdec_si128(x[l], _mm_loadu_si128(rk[l] + r));
+		}
+
+		for (int l = 0; l < n; l++) {
+			x[l] = _mm_aesdeclast_si128(x[l], _mm_loadu_si128(rk[l] + ROUNDS));
+			_mm_storeu_si128((__m128i*) data[l], _mm_xor_si128(x[l], chain[l]));
+		}
+	}
+}
+#endif
+
+#if USE_ARMV8
+/*---------------------------------------------------------------------------*/
+static void dec_keys_armv8(cbc_key_t *key) {
+	vst1q_u8(key->dec[0], vld1q_u8(key->enc[ROUNDS]));
+	for (int r = 1; r < ROUNDS; r++) vst1q_u8(key->dec[r], vaesimcq_u8(vld1q_u8(key->enc[ROUNDS - r])));
+	vst1q_u8(key->dec[ROUNDS], vld1q_u8(key->enc[0]));
+}
+
+/*---------------------------------------------------------------------------*/
+static void encrypt_armv8(cbc_packet_t *packets, int count) {
+	struct {
+		const uint8_t (*rk)[16];
+		uint8_t *data;
+		int blocks;
+		uint8x16_t chain;
+	} lane[LANES];
+	int active = 0;
+
+	while (1) {
+		// refill lanes, packets without a whole block have nothing to do
+		for (; active < LANES && count; packets++, count--) {
+			if (packets->len < 16) continue;
+			lane[active].rk = (const uint8_t (*)[16]) packets->key->enc;
+			lane[active].data = packets->data;
+			lane[active].blocks = packets->len / 16;
+			lane[active++].chain = vld1q_u8(packets->key->iv);
+		}
+
+		if (!active) break;
+
+		// AESE does AddRoundKey first, so last key is added alone
+		uint8x16_t x[LANES];
+		for (int l = 0; l < active; l++) x[l] = veorq_u8(vld1q_u8(lane[l].data), lane[l].chain);
+
+		for (int r = 0; r < ROUNDS - 1; r++) {
+			for (int l = 0; l < active; l++) x[l] = vaesmcq_u8(vaeseq_u8(x[l], vld1q_u8(lane[l].rk[r])));
+		}
+
+		for (int l = 0; l < active; l++) {
+			x[l] = vaeseq_u8(x[l], vld1q_u8(lane[l].rk[ROUNDS - 1]));
+			lane[l].chain = veorq_u8(x[l], vld1q_u8(lane[l].rk[ROUNDS]));
+			vst1q_u8(lane[l].data, lane[l].chain);
+			lane[l].data += 16;
+		}
+
+		// retire lanes whose packet is done
+		for (int l = 0; l < active;) {
+			if (--lane[l].blocks) l++;
+			else lane[l] = lane[--active];
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void decrypt_armv8(cbc_packet_t *packets, int count) {
+	const uint8_t (*rk[LANES])[16];
+	uint8_t *data[LANES];
+	uint8x16_t x[LANES], chain[LANES], last = vdupq_n_u8(0);
+	int block = 0;
+
+	while (1) {
+		int n = 0;
+
+		// gather next blocks, whatever packet they belong to
+		while (n < LANES && count) {
+			if (block >= packets->len / 16) {
+				packets++;
+				count--;
+				block = 0;
+				continue;
+			}
+			data[n] = packets->data + block * 16;
+			rk[n] = (const uint8_t (*)[16]) packets->key->dec;
+			chain[n] = block++ ? last : vld1q_u8(packets->key->iv);
+			x[n] = last = vld1q_u8(data[n]);
+			n++;
+		}
+
+		if (!n) break;
+
+		for (int r = 0; r < ROUNDS - 1; r++) {
+			for (int l = 0; l < n; l++) x[l] = vaesimcq_u8(vaesdq_u8(x[l], vld1q_u8(rk[l][r])));
+		}
+
+		for (int l = 0; l < n; l++) {
+			x[l] = veorq_u8(vaesdq_u8(x[l], vld1q_u8(rk[l][ROUNDS - 1])), vld1q_u8(rk[l][ROUNDS]));
+			vst1q_u8(data[l], veorq_u8(x[l], chain[l]));
+		}
+	}
+}
+#endif
+
+#if !USE_ARMV8
+/*---------------------------------------------------------------------------*/
+static void encrypt_soft(cbc_packet_t *packets, int count) {
+	for (; count; packets++, count--) {
+		uint8_t *chain = packets->key->iv;
+
+		for (uint8_t *p = packets->data; p + 16 <= packets->data + packets->len; chain = p, p += 16) {
+			for (int i = 0; i < 16; i++) p[i] ^= chain[i];
+			aes_encrypt(&packets->key->ctx, p, p);
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void decrypt_soft(cbc_packet_t *packets, int count) {
+	for (; count; packets++, count--) {
+		uint8_t chain[16], next[16];
+
+		memcpy(chain, packets->key->iv, 16);
+		for (uint8_t *p = packets->data; p + 16 <= packets->data + packets->len; p += 16) {
+			memcpy(next, p, 16);
+			aes_decrypt(&packets->key->ctx, p, p);
+			for (int i = 0; i < 16; i++) p[i] ^= chain[i];
+			memcpy(chain, next, 16);
+		}
+	}
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+static void accel_select(void) {
+#if USE_AESNI && defined(__GNUC__)
+	__builtin_cpu_init();
+	accel = __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2") ? HARDWARE : NONE;
+#elif USE_AESNI
+	int info[4];
+	__cpuid(info, 1);
+	accel = (info[2] & (1 << 25)) && (info[3] & (1 << 26)) ? HARDWARE : NONE;
+#elif USE_ARMV8
+	accel = HARDWARE;
+#else
+	accel = NONE;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+struct cbc_key_s *cbc_create(uint8_t key[16], uint8_t iv[16]) {
+	cbc_key_t *cbc = calloc(1, sizeof(cbc_key_t));
+
+	if (!cbc) return NULL;
+	if (accel == UNKNOWN) accel_select();
+
+	aes_set_key(&cbc->ctx, key, 128);
+	memcpy(cbc->iv, iv, 16);
+
+	// instructions want round keys as bytes
+	for (int i = 0; i < 4 * (ROUNDS + 1); i++) {
+		uint32_t w = cbc->ctx.erk[i];
+		uint8_t *p = cbc->enc[i / 4] + (i % 4) * 4;
+		p[0] = w >> 24; p[1] = w >> 16; p[2] = w >> 8; p[3] = w;
+	}
+
+#if USE_AESNI
+	if (accel == HARDWARE) dec_keys_aesni(cbc);
+#elif USE_ARMV8
+	dec_keys_armv8(cbc);
+#endif
+
+	return cbc;
+}
+
+/*---------------------------------------------------------------------------*/
+void cbc_delete(struct cbc_key_s *key) {
+	if (!key) return;
+	// don't leave key schedule in freed memory
+	OPENSSL_cleanse(key, sizeof(cbc_key_t));
+	free(key);
+}
+
+/*---------------------------------------------------------------------------*/
+void cbc_encrypt(cbc_packet_t *packets, int count) {
+#if USE_AESNI
+	if (accel == HARDWARE) encrypt_aesni(packets, count);
+	else encrypt_soft(packets, count);
+#elif USE_ARMV8
+	encrypt_armv8(packets, count);
+#else
+	encrypt_soft(packets, count);
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+void cbc_decrypt(cbc_packet_t *packets, int count) {
+#if USE_AESNI
+	if (accel == HARDWARE) decrypt_aesni(packets, count);
+	else decrypt_soft(packets, count);
+#elif USE_ARMV8
+	decrypt_armv8(packets, count);
+#else
+	decrypt_soft(packets, count);
+#endif
+}
@@ -0,0 +1,29 @@
+/*
+ * RAOP : AES-128-CBC on batches of independent packets
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct cbc_packet_s {
+	struct cbc_key_s *key;
+	uint8_t *data;
+	int len;				// only whole blocks are processed, the rest stays clear
+} cbc_packet_t;
+
+/*
+ Every packet is its own chain that starts from its key's IV, packets can have
+ different keys (several sessions). Chains are interleaved so that AES-NI or
+ ARMv8 crypto extensions work on up to 8 blocks at once, done in place. Keys
+ are read-only once created, so they can be shared between threads
+*/
+struct cbc_key_s*	cbc_create(uint8_t key[16], uint8_t iv[16]);
+void				cbc_delete(struct cbc_key_s *key);
+void				cbc_encrypt(cbc_packet_t *packets, int count);
+void				cbc_decrypt(cbc_packet_t *packets, int count);
@@ -21,13 +21,17 @@
 #include <limits.h>
 
 #include "alac_wrapper.h"
+#include "alac_enc.h"
 #include "cross_net.h"
 #include "cross_log.h"
+#include "raop_log.h"
 #include "cross_util.h"
 
 #include "rtsp_client.h"
 #include "raop_client.h"
-#include "aes.h"
+#include "raop_cbc.h"
+#include "raop_lock.h"
+#include "raop_trace.h"
 
 #define MAX_BACKLOG 512
 
@@ -150,23 +154,28 @@ typedef struct raopcl_s {
 	} backlog[MAX_BACKLOG];
 	// int ajstatus, ajtype;
 	float volume;
-	aes_context ctx;
+	struct cbc_key_s *cbc;
 	int size_in_aex;
 	bool encrypt;
 	bool first_pkt;
 	uint64_t head_ts, pause_ts, start_ts, first_ts;
 	uint64_t started_ts;
+	struct {
+		raop_startup_t trace;
+		uint64_t start, mark;	// in us
+	} startup;
 	bool flushing;
 	uint16_t   seq_number;
 	unsigned long ssrc;
 	uint32_t latency_frames;
 	int chunk_len;
 	pthread_t time_thread, ctrl_thread;
-	pthread_mutex_t mutex;
+	raop_lock_t mutex;
 	bool time_running, ctrl_running;
 	int sample_rate, sample_size, channels;
 	raop_codec_t codec;
 	struct alac_codec_s *alac_codec;
+	struct alacenc_s *alac_encoder;
 	raop_crypto_t crypto;
 	bool auth;
 	char secret[SECRET_SIZE + 1];
@@ -187,6 +196,71 @@ static void 	_raopcl_send_sync(struct raopcl_s *p, bool first);
 static bool 	_raopcl_send_audio(struct raopcl_s *p, rtp_audio_pkt_t *packet, int size);
 static bool 	_raopcl_disconnect(struct raopcl_s *p, bool force);
 
+/*----------------------------------------------------------------------------*/
+// must be called with p->mutex locked
+static void _startup_step(struct raopcl_s *p, raop_step_t step)
+{
+	uint64_t now = gettime_us();
+
+	// only the first connection steps and first streaming count
+	if (!p->startup.start || p->startup.trace.complete) return;
+
+	p->startup.trace.steps[step] = now - p->startup.mark;
+	p->startup.mark = now;
+}
+
+/*----------------------------------------------------------------------------*/
+static void startup_step(struct raopcl_s *p, raop_step_t step)
+{
+	raop_lock(&p->mutex);
+	_startup_step(p, step);
+	raop_unlock(&p->mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+// must be called with p->mutex locked
+static void startup_done(struct raopcl_s *p, uint64_t now, uint64_t playtime)
+{
+	char buf[256];
+	int len = 0;
+
+	if (!p->startup.start || p->startup.trace.complete) return;
+
+	// what is left is the player's latency before first sample can be heard
+	p->startup.trace.steps[RAOP_STEP_LATENCY] = playtime > now ? (((playtime - now) >> 16) * 1000000) >> 16 : 0;
+	p->startup.trace.total = gettime_us() - p->startup.start + p->startup.trace.steps[RAOP_STEP_LATENCY];
+	p->startup.trace.complete = true;
+
+	for (int i = 0; i < RAOP_STEPS && len < sizeof(buf); i++) {
+		len += snprintf(buf + len, sizeof(buf) - len, "%s:%.1f ", raopcl_step_name(i), p->startup.trace.steps[i] / 1000.0);
+	}
+
+	LOG_INFO("[%p]: startup (ms) %stotal:%.1f", p, buf, p->startup.trace.total / 1000.0);
+}
+
+/*----------------------------------------------------------------------------*/
+const char *raopcl_step_name(raop_step_t step)
+{
+	static const char *names[] = { "connect", "verify", "auth", "announce", "setup",
+								   "record", "volume", "flush", "latency" };
+
+	return step < RAOP_STEPS ? names[step] : "unknown";
+}
+
+/*----------------------------------------------------------------------------*/
+raop_startup_t raopcl_startup(struct raopcl_s *p)
+{
+	raop_startup_t trace = { 0 };
+
+	if (!p) return trace;
+
+	raop_lock(&p->mutex);
+	trace = p->startup.trace;
+	raop_unlock(&p->mutex);
+
+	return trace;
+}
+
 /*----------------------------------------------------------------------------*/
 raop_state_t raopcl_state(struct raopcl_s *p)
 {
@@ -253,9 +327,9 @@ bool raopcl_is_connected(struct raopcl_s *p)
 
 	if (!p) return false;
 
-	pthread_mutex_lock(&p->mutex);
+	raop_lock(&p->mutex);
 	rc = rtspcl_is_connected(p->rtspcl);
-	pthread_mutex_unlock(&p->mutex);
+	raop_unlock(&p->mutex);
 
 	return rc;
 }
@@ -314,31 +388,10 @@ static int rsa_encrypt(uint8_t *text, int len, uint8_t *res)
 /*----------------------------------------------------------------------------*/
 static int raopcl_encrypt(raopcl_data_t *raopcld, uint8_t *data, int size)
 {
-	uint8_t *buf;
-	uint8_t nv[16];
-	int i=0,j;
-	memcpy(nv,raopcld->iv,16);
-	while(i+16<=size){
-		buf=data+i;
-		for(j=0;j<16;j++) buf[j] ^= nv[j];
-		aes_encrypt(&raopcld->ctx, buf, buf);
-		memcpy(nv,buf,16);
-		i+=16;
-	}
-#if 0
-	if(i<size){
-		uint8_t tmp[16];
-		LOG_INFO("[%p]: a block less than 16 bytes(%d) is not encrypted", raopcld, size-i);
-		memset(tmp,0,16);
-		memcpy(tmp,data+i,size-i);
-		for(j=0;j<16;j++) tmp[j] ^= nv[j];
-		aes_encrypt(&raopcld->ctx, tmp, tmp);
-		memcpy(nv,tmp,16);
-		memcpy(data+i,tmp,16);
-		i+=16;
-	}
-#endif
-	return i;
+	// a block less than 16 bytes is not encrypted
+	cbc_packet_t packet = { raopcld->cbc, data, size };
+	cbc_encrypt(&packet, 1);
+	return size & ~0xf;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -351,12 +404,12 @@ void raopcl_pause(struct raopcl_s *p)
 {
 	if (!p || p->state != RAOP_STREAMING) return;
 
-	pthread_mutex_lock(&p->mutex);
+	raop_lock(&p->mutex);
 
 	p->pause_ts = p->head_ts;
 	p->flushing = true;
 
-	pthread_mutex_unlock(&p->mutex);
+	raop_unlock(&p->mutex);
 
 	LOG_INFO("[%p]: set pause %" PRIu64 "", p, p->pause_ts);
 }
@@ -366,11 +419,11 @@ bool raopcl_start_at(struct raopcl_s *p, uint64_t start_time)
 {
 	if (!p) return false;
 
-	pthread_mutex_lock(&p->mutex);
+	raop_lock(&p->mutex);
 
 	p->start_ts = NTP2TS(start_time, p->sample_rate);
 
-	pthread_mutex_unlock(&p->mutex);
+	raop_unlock(&p->mutex);
 
 	LOG_INFO("[%p]: set start time %u.%u (ts:%" PRIu64 ")", p, RAOP_SEC(start_time), RAOP_FRAC(start_time), p->start_ts);
 
@@ -382,12 +435,12 @@ void raopcl_stop(struct raopcl_s *p)
 {
 	if (!p) return;
 
-	pthread_mutex_lock(&p->mutex);
+	raop_lock(&p->mutex);
 
 	p->flushing = true;
 	p->pause_ts = 0;
 
-	pthread_mutex_unlock(&p->mutex);
+	raop_unlock(&p->mutex);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -398,7 +451,7 @@ bool raopcl_accept_frames(struct raopcl_s *p)
 
 	if (!p) return 0;
 
-	pthread_mutex_lock(&p->mutex);
+	raop_lock(&p->mutex);
 
 	// a flushing is pending
 	if (p->flushing) {
@@ -408,7 +461,7 @@ bool raopcl_accept_frames(struct raopcl_s *p)
 
 		// Not flushed yet, but we have time to wait, so pretend we are full
 		if (p->state != RAOP_FLUSHED && (!p->start_ts || p->start_ts > now_ts + raopcl_latency(p))) {
-			pthread_mutex_unlock(&p->mutex);
+			raop_unlock(&p->mutex);
 			return false;
 		 }
 
@@ -417,6 +470,7 @@ bool raopcl_accept_frames(struct raopcl_s *p)
 			p->first_pkt = first_pkt = true;
 			LOG_INFO("[%p]: begining to stream hts:%" PRIu64 " n:%u.%u", p, p->head_ts, RAOP_SECNTP(now));
 			p->state = RAOP_STREAMING;
+			_startup_step(p, RAOP_STEP_FLUSH);
 		}
 
 		// unpausing ...
@@ -490,7 +544,7 @@ bool raopcl_accept_frames(struct raopcl_s *p)
 
 	if (now_ts >= p->head_ts + p->chunk_len) accept = true;
 
-	pthread_mutex_unlock(&p->mutex);
+	raop_unlock(&p->mutex);
 
 	return accept;
 }
@@ -509,7 +563,17 @@ bool raopcl_send_chunk(struct raopcl_s *p, uint8_t *sample, int frames, uint64_t
 		return false;
 	}
 
-	pthread_mutex_lock(&p->mutex);
+	raop_lock(&p->mutex);
+
+	// encoders and backlog are sized for a chunk
+	if (frames <= 0 || frames > p->chunk_len) {
+		raop_unlock(&p->mutex);
+		LOG_ERROR("[%p]: can't send %d frames (chunk is %d)", p, frames, p->chunk_len);
+		return false;
+	}
+
+	// sequence number is the one this chunk will get, so that encoding is covered
+	RAOP_TRACE(chunk, (uint16_t) (p->seq_number + 1), (uint32_t) p->head_ts);
 
 	/*
 	 Move to streaming state only when really flushed. In most cases, this is
@@ -520,12 +584,18 @@ bool raopcl_send_chunk(struct raopcl_s *p, uint8_t *sample, int frames, uint64_t
 		p->first_pkt = true;
 		LOG_INFO("[%p]: begining to stream (LATE) hts:%" PRIu64 " n:%u.%u", p, p->head_ts, RAOP_SECNTP(now));
 		p->state = RAOP_STREAMING;
+		_startup_step(p, RAOP_STEP_FLUSH);
 		_raopcl_send_sync(p, true);
 	}
 
 	switch (p->codec) {
 		case RAOP_ALAC:
-			pcm_to_alac(p->alac_codec, sample, frames, &encoded, &size);
+		case RAOP_ALAC_FAST:
+			// native encoder writes directly in packet, size is the maximum for now
+			if (p->alac_encoder) {
+				encoded = NULL;
+				size = alacenc_max_size(frames);
+			} else pcm_to_alac(p->alac_codec, sample, frames, &encoded, &size);
 			break;
 		case RAOP_ALAC_RAW:
 			pcm_to_alac_raw(sample, frames, &encoded, &size, p->chunk_len);
@@ -541,25 +611,40 @@ bool raopcl_send_chunk(struct raopcl_s *p, uint8_t *sample, int frames, uint64_t
 			break;
 		}
 		default:
+			raop_unlock(&p->mutex);
 			LOG_ERROR("[%p]: don't know what we're doing here", p);
 			return false;
 	}
 
 	if ((buffer = malloc(sizeof(rtp_header_t) + sizeof(rtp_audio_pkt_t) + size)) == NULL) {
-		pthread_mutex_unlock(&p->mutex);
+		raop_unlock(&p->mutex);
 		if (encoded) free(encoded);
 		LOG_ERROR("[%p]: cannot allocate buffer",p);
 		return false;
 	}
 
 	*playtime = TS2NTP(p->head_ts + raopcl_latency(p), p->sample_rate);
+	if (p->state == RAOP_STREAMING) startup_done(p, now, *playtime);
 
 	LOG_SDEBUG("[%p]: sending audio ts:%" PRIu64 " (pt:%u.%u now:%" PRIu64 ") ", p, p->head_ts, RAOP_SEC(*playtime), RAOP_FRAC(*playtime), raopcl_get_ntp(NULL));
 
-	p->seq_number++;
-
 	// packet is after re-transmit header
 	packet = (rtp_audio_pkt_t *) (buffer + sizeof(rtp_header_t));
+
+	if (encoded) memcpy((uint8_t*) packet + sizeof(rtp_audio_pkt_t), encoded, size);
+	else size = alacenc_encode(p->alac_encoder, sample, frames, (uint8_t*) packet + sizeof(rtp_audio_pkt_t));
+
+	// an empty packet would be sent and kept for re-transmit
+	if (!size) {
+		raop_unlock(&p->mutex);
+		if (encoded) free(encoded);
+		free(buffer);
+		LOG_ERROR("[%p]: can't encode %d frames", p, frames);
+		return false;
+	}
+
+	p->seq_number++;
+
 	packet->hdr.proto = 0x80;
 	packet->hdr.type = 0x60 | (p->first_pkt ? 0x80 : 0);
 	p->first_pkt = false;
@@ -567,11 +652,13 @@ bool raopcl_send_chunk(struct raopcl_s *p, uint8_t *sample, int frames, uint64_t
 	packet->hdr.seq[1] = p->seq_number & 0xff;
 	packet->timestamp = htonl(p->head_ts);
 	packet->ssrc = htonl(p->ssrc);
-
-	memcpy((uint8_t*) packet + sizeof(rtp_audio_pkt_t), encoded, size);
+	RAOP_TRACE(encoded, p->seq_number, (uint32_t) p->head_ts);
 
 	// with newer airport express, don't use encryption (??)
-	if (p->encrypt) raopcl_encrypt(p, (uint8_t*) packet + sizeof(rtp_audio_pkt_t), size);
+	if (p->encrypt) {
+		raopcl_encrypt(p, (uint8_t*) packet + sizeof(rtp_audio_pkt_t), size);
+		RAOP_TRACE(encrypted, p->seq_number, (uint32_t) p->head_ts);
+	}
 
 	n = p->seq_number % MAX_BACKLOG;
 	p->backlog[n].seq_number = p->seq_number;
@@ -584,7 +671,7 @@ bool raopcl_send_chunk(struct raopcl_s *p, uint8_t *sample, int frames, uint64_t
 
 	_raopcl_send_audio(p, packet, sizeof(rtp_audio_pkt_t) + size);
 
-	pthread_mutex_unlock(&p->mutex);
+	raop_unlock(&p->mutex);
 
 	if (NTP2MS(*playtime) % 60000 < 8) {
 		LOG_INFO("[%p]: check n:%u p:%u ts:%" PRIu64 " sn:%u\n               "
@@ -645,8 +732,10 @@ bool _raopcl_send_audio(struct raopcl_s *p, rtp_audio_pkt_t *packet, int size)
 			LOG_DEBUG("[%p]: error sending audio packet", p);
 			ret = false;
 			p->sane.audio.send++;
+		} else {
+			RAOP_TRACE(sent, (packet->hdr.seq[0] << 8) | packet->hdr.seq[1], ntohl(packet->timestamp));
+			p->sane.audio.send = 0;
 		}
-		else p->sane.audio.send = 0;
 		p->sane.audio.avail = 0;
 	}
 	else {
@@ -709,21 +798,33 @@ struct raopcl_s *raopcl_create(struct in_addr host, uint16_t port_base, uint16_t
 		return NULL;
 	}
 
-	if (codec == RAOP_ALAC && (raopcld->alac_codec = alac_create_encoder(raopcld->chunk_len, sample_rate, sample_size, channels)) == NULL) {
+	// native encoder only does 16 bits stereo, otherwise there is no fast mode
+	if ((codec == RAOP_ALAC || codec == RAOP_ALAC_FAST) && sample_size == 16 && channels == 2) {
+		raopcld->alac_encoder = alacenc_create(raopcld->chunk_len, codec == RAOP_ALAC_FAST);
+	}
+
+	if (!raopcld->alac_encoder && codec == RAOP_ALAC_FAST) raopcld->codec = RAOP_ALAC;
+
+	if (raopcld->codec == RAOP_ALAC && !raopcld->alac_encoder &&
+		(raopcld->alac_codec = alac_create_encoder(raopcld->chunk_len, sample_rate, sample_size, channels)) == NULL) {
 		LOG_WARN("[%p]: cannot create ALAC codec", raopcld);
 		raopcld->codec = RAOP_ALAC_RAW;
 	}
 
-	LOG_INFO("[%p]: using %s coding", raopcld, raopcld->alac_codec ? "ALAC" : "PCM");
+	LOG_INFO("[%p]: using %s coding", raopcld, raopcld->codec == RAOP_ALAC_FAST ? "fast ALAC" :
+			 raopcld->alac_encoder || raopcld->alac_codec ? "ALAC" : "PCM");
 
-	pthread_mutex_init(&raopcld->mutex, NULL);
+	raop_lock_init(&raopcld->mutex);
 
 	RAND_bytes(raopcld->iv, sizeof(raopcld->iv));
 	VALGRIND_MAKE_MEM_DEFINED(raopcld->iv, sizeof(raopcld->iv));
 	RAND_bytes(raopcld->key, sizeof(raopcld->key));
 	VALGRIND_MAKE_MEM_DEFINED(raopcld->key, sizeof(raopcld->key));
 
-	aes_set_key(&raopcld->ctx, raopcld->key, 128);
+	// connection is refused if encryption is needed but this failed
+	if ((raopcld->cbc = cbc_create(raopcld->key, raopcld->iv)) == NULL) {
+		LOG_WARN("[%p]: cannot create AES context", raopcld);
+	}
 
 	raopcl_sanitize(raopcld);
 
@@ -841,7 +942,8 @@ static bool raopcl_set_sdp(struct raopcl_s *p, char *sdp)
 	switch (p->codec) {
 
 		case RAOP_ALAC_RAW:
-		case RAOP_ALAC: {
+		case RAOP_ALAC:
+		case RAOP_ALAC_FAST: {
 			char buf[256];
 
 			sprintf(buf,
@@ -981,10 +1083,19 @@ bool raopcl_connect(struct raopcl_s *p, struct in_addr peer, uint16_t destport,
 	if (peer.s_addr != INADDR_ANY) p->peer_addr.s_addr = peer.s_addr;
 	if (destport != 0) p->rtsp_port = destport;
 
+	raop_lock(&p->mutex);
+	memset(&p->startup, 0, sizeof(p->startup));
+	p->startup.start = p->startup.mark = gettime_us();
+	raop_unlock(&p->mutex);
+
 	RAND_bytes((uint8_t*) &p->ssrc, sizeof(p->ssrc));
 	VALGRIND_MAKE_MEM_DEFINED(&p->ssrc, sizeof(p->ssrc));
 
 	p->encrypt = (p->crypto != RAOP_CLEAR);
+	if (p->encrypt && !p->cbc) {
+		LOG_ERROR("[%p]: encryption required but no AES context", p);
+		return false;
+	}
 	memset(&p->sane, 0, sizeof(p->sane));
 	p->retransmit = 0;
 
@@ -1000,14 +1111,21 @@ bool raopcl_connect(struct raopcl_s *p, struct in_addr peer, uint16_t destport,
 
 	// RTSP connect
 	if (!rtspcl_connect(p->rtspcl, p->host_addr, peer, destport, sid)) goto erexit;
+	startup_step(p, RAOP_STEP_CONNECT);
 
 	LOG_INFO("[%p]: local interface %s", p, rtspcl_local_ip(p->rtspcl));
 
 	// RTSP pairing verify for AppleTV
-	if (*p->secret && !rtspcl_pair_verify(p->rtspcl, p->secret)) goto erexit;
+	if (*p->secret) {
+		if (!rtspcl_pair_verify(p->rtspcl, p->secret)) goto erexit;
+		startup_step(p, RAOP_STEP_VERIFY);
+	}
 
 	// Send pubkey for MFi devices
-	if (strchr(p->et, '4')) rtspcl_auth_setup(p->rtspcl);
+	if (strchr(p->et, '4')) {
+		rtspcl_auth_setup(p->rtspcl);
+		startup_step(p, RAOP_STEP_AUTH);
+	}
 
 	// build sdp parameter
 	buf = strdup(inet_ntoa(peer));
@@ -1046,6 +1164,8 @@ bool raopcl_connect(struct raopcl_s *p, struct in_addr peer, uint16_t destport,
 		goto erexit;
 	}
 
+	startup_step(p, RAOP_STEP_ANNOUNCE);
+
 	// open RTP sockets, need local ports here before sending SETUP
 	do {
 		p->rtp_ports.ctrl.lport = p->port_base + ((port.offset + port.count++) % p->port_range);
@@ -1062,6 +1182,7 @@ bool raopcl_connect(struct raopcl_s *p, struct in_addr peer, uint16_t destport,
 	if (!rtspcl_setup(p->rtspcl, &p->rtp_ports, kd)) goto erexit;
 	if (!raopcl_analyse_setup(p, kd)) goto erexit;
 	kd_free(kd);
+	startup_step(p, RAOP_STEP_SETUP);
 
 	LOG_DEBUG( "[%p]:opened audio socket   l:%5d r:%d", p, p->rtp_ports.audio.lport, p->rtp_ports.audio.rport );
 	LOG_DEBUG( "[%p]:opened timing socket  l:%5d r:%d", p, p->rtp_ports.time.lport, p->rtp_ports.time.rport );
@@ -1075,20 +1196,31 @@ bool raopcl_connect(struct raopcl_s *p, struct in_addr peer, uint16_t destport,
 		p->latency_frames = max((uint32_t) latency, p->latency_frames);
 	}
 	kd_free(kd);
+	startup_step(p, RAOP_STEP_RECORD);
 
 	p->ctrl_running = true;
 	pthread_create(&p->ctrl_thread, NULL, _rtp_control_thread, (void*) p);
 
-	pthread_mutex_lock(&p->mutex);
-	// as connect might take time, state might already have been set
-	if (p->state == RAOP_DOWN) p->state = RAOP_FLUSHED;
-	pthread_mutex_unlock(&p->mutex);
+	// volume is sent before state is visible, so that no FLUSH can come before it
+	float volume = p->volume;
 
 	if (set_volume) {
-		LOG_INFO("[%p]: setting volume as part of connect %.2f", p, p->volume);
-		raopcl_set_volume(p, p->volume);
+		char a[128];
+
+		LOG_INFO("[%p]: setting volume as part of connect %.2f", p, volume);
+		sprintf(a, "volume: %f\r\n", volume);
+		rtspcl_set_parameter(p->rtspcl, a);
+		startup_step(p, RAOP_STEP_VOLUME);
 	}
 
+	raop_lock(&p->mutex);
+	// as connect might take time, state might already have been set
+	if (p->state == RAOP_DOWN) p->state = RAOP_FLUSHED;
+	raop_unlock(&p->mutex);
+
+	// a volume set meanwhile has only been memorized
+	if (set_volume && p->volume != volume) raopcl_set_volume(p, p->volume);
+
 	if (sac) free(sac);
 	return true;
 
@@ -1109,21 +1241,21 @@ bool raopcl_flush(struct raopcl_s *p)
 
 	if (!p || p->state != RAOP_STREAMING) return false;
 
-	pthread_mutex_lock(&p->mutex);
+	raop_lock(&p->mutex);
 	p->state = RAOP_FLUSHING;
 	p->retransmit = 0;
 	seq_number = p->seq_number;
 	timestamp = p->head_ts;
-	pthread_mutex_unlock(&p->mutex);
+	raop_unlock(&p->mutex);
 
-	LOG_INFO("[%p]: flushing up to s:%u ts:%" PRIu64 "", p, seq_number, timestamp);
+	LOG_INFO("[%p]: flushing up to s:%u ts:%u", p, seq_number, timestamp);
 
 	// everything BELOW these values should be FLUSHED ==> the +1 is mandatory
 	rc = rtspcl_flush(p->rtspcl, seq_number + 1, timestamp + 1);
 
-	pthread_mutex_lock(&p->mutex);
+	raop_lock(&p->mutex);
 	p->state = RAOP_FLUSHED;
-	pthread_mutex_unlock(&p->mutex);
+	raop_unlock(&p->mutex);
 
 	return rc;
 }
@@ -1135,10 +1267,10 @@ bool _raopcl_disconnect(struct raopcl_s *p, bool force)
 
 	if (!force && (!p || p->state == RAOP_DOWN)) return true;
 
-	pthread_mutex_lock(&p->mutex);
+	raop_lock(&p->mutex);
 	p->state = RAOP_DOWN;
 	p->last_keepalive = raopcl_get_ntp(NULL);
-	pthread_mutex_unlock(&p->mutex);
+	raop_unlock(&p->mutex);
 
 	_raopcl_terminate_rtp(p);
 
@@ -1162,9 +1294,9 @@ bool raopcl_repair(struct raopcl_s *p, bool set_volume)
 
 	if (!p) return false;
 
-	pthread_mutex_lock(&p->mutex);
+	raop_lock(&p->mutex);
 	p->state = RAOP_DOWN;
-	pthread_mutex_unlock(&p->mutex);
+	raop_unlock(&p->mutex);
 
 	_raopcl_terminate_rtp(p);
 
@@ -1189,7 +1321,7 @@ bool raopcl_destroy(struct raopcl_s *p)
 
 	rc = raopcl_disconnect(p);
 	rc &= rtspcl_destroy(p->rtspcl);
-	pthread_mutex_destroy(&p->mutex);
+	raop_lock_destroy(&p->mutex);
 
 	for (i = 0; i < MAX_BACKLOG; i++) {
 		if (p->backlog[i].buffer) {
@@ -1198,25 +1330,35 @@ bool raopcl_destroy(struct raopcl_s *p)
 	}
 
 	if (p->alac_codec) alac_delete_encoder(p->alac_codec);
+	if (p->alac_encoder) alacenc_delete(p->alac_encoder);
+	if (p->cbc) cbc_delete(p->cbc);
 
 	free(p);
 
 	return rc;
 }
 
+/*----------------------------------------------------------------------------*/
+void raopcl_lock_stats(struct raopcl_s *p, struct raop_lock_stats_s *stats)
+{
+	raop_lock(&p->mutex);
+	raop_lock_stats(&p->mutex, stats);
+	raop_unlock(&p->mutex);
+}
+
 /*----------------------------------------------------------------------------*/
 bool raopcl_sanitize(struct raopcl_s *p)
 {
 	if (!p) return false;
 
-	pthread_mutex_trylock(&p->mutex);
+	raop_trylock(&p->mutex);
 
 	p->state = RAOP_DOWN;
 	p->head_ts = p->pause_ts = p->start_ts = p->first_ts = 0;
 	p->first_pkt = false;
 	p->flushing = true;
 
-	pthread_mutex_unlock(&p->mutex);
+	raop_unlock(&p->mutex);
 
 	return true;
 }
@@ -1243,7 +1385,7 @@ void _raopcl_send_sync(struct raopcl_s *raopcld, bool first)
 	rsp.hdr.seq[1] = 7;
 
 	// first sync is called with mutex locked, so don't block
-	if (!first) pthread_mutex_lock(&raopcld->mutex);
+	if (!first) raop_lock(&raopcld->mutex);
 
 	timestamp = raopcld->head_ts;
 	now = TS2NTP(timestamp, raopcld->sample_rate);
@@ -1258,7 +1400,7 @@ void _raopcl_send_sync(struct raopcl_s *raopcld, bool first)
 
 	n = sendto(raopcld->rtp_ports.ctrl.fd, (void*) &rsp, sizeof(rsp), 0, (void*) &addr, sizeof(addr));
 
-	if (!first) pthread_mutex_unlock(&raopcld->mutex);
+	if (!first) raop_unlock(&raopcld->mutex);
 
 	LOG_DEBUG("[%p]: sync ntp:%u.%u (ts:%" PRIu64 ")", raopcld, RAOP_SEC(now), RAOP_FRAC(now), raopcld->head_ts);
 
@@ -1402,7 +1544,7 @@ void *_rtp_control_thread(void *args)
 			}
 			else raopcld->sane.ctrl = 0;
 
-			pthread_mutex_lock(&raopcld->mutex);
+			raop_lock(&raopcld->mutex);
 
 			for (missed = 0, i = 0; i < lost.n; i++) {
 				uint16_t index = (lost.seq_number + i) % MAX_BACKLOG;
@@ -1435,6 +1577,8 @@ void *_rtp_control_thread(void *args)
 					if (n == -1) {
 						LOG_WARN("[%p]: error resending lost packet sn:%u (n:%d)",
 								   raopcld, lost.seq_number + i, n);
+					} else {
+						RAOP_TRACE(resent, raopcld->backlog[index].seq_number, (uint32_t) raopcld->backlog[index].timestamp);
 					}
 				}
 				else {
@@ -1442,7 +1586,7 @@ void *_rtp_control_thread(void *args)
 				}
 			}
 
-			pthread_mutex_unlock(&raopcld->mutex);
+			raop_unlock(&raopcld->mutex);
 
 			LOG_DEBUG("[%p]: retransmit packet sn:%d nb:%d (mis:%d)",
 					  raopcld, lost.seq_number, lost.n, missed);
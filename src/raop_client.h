@@ -63,7 +63,7 @@
 #include "platform.h"
 
 #define DEFAULT_FRAMES_PER_CHUNK 352
-#define MAX_FRAMES_PER_CHUNK 4096 // must match alac_wrapper.h ALAC_MAX_FRAMES
+#define MAX_FRAMES_PER_CHUNK 4096 // must match alac_wrapper.h ALAC_MAX_FRAMES and alac_enc.h ALACENC_MAX_FRAMES
 #define RAOP_LATENCY_MIN 11025
 #define SECRET_SIZE	64
 
@@ -84,12 +84,23 @@ typedef struct raopcl_t {uint32_t dummy;} raopcl_t;
 
 struct raopcl_s;
 
+// RAOP_ALAC_FAST trades some bandwidth for much less CPU (16 bits stereo only)
 typedef enum raop_codec_s { RAOP_PCM = 0, RAOP_ALAC_RAW, RAOP_ALAC, RAOP_AAC,
-							RAOP_AAL_ELC } raop_codec_t;
+							RAOP_AAL_ELC, RAOP_ALAC_FAST } raop_codec_t;
 typedef enum raop_crypto_s { RAOP_CLEAR = 0, RAOP_RSA, RAOP_FAIRPLAY, RAOP_MFISAP,
 							 RAOP_FAIRPLAYSAP } raop_crypto_t;
 typedef enum raop_states_s { RAOP_DOWN = 0, RAOP_FLUSHING, RAOP_FLUSHED,
 							 RAOP_STREAMING } raop_state_t;
+// steps of raopcl_connect, then waiting to be flushed and player's latency
+typedef enum raop_step_s { RAOP_STEP_CONNECT = 0, RAOP_STEP_VERIFY, RAOP_STEP_AUTH, RAOP_STEP_ANNOUNCE,
+						   RAOP_STEP_SETUP, RAOP_STEP_RECORD, RAOP_STEP_VOLUME, RAOP_STEP_FLUSH,
+						   RAOP_STEP_LATENCY, RAOP_STEPS } raop_step_t;
+
+typedef struct {
+	bool complete;					// first audio packet has been sent
+	uint32_t steps[RAOP_STEPS];		// in us, 0 when skipped
+	uint32_t total;					// in us, from raopcl_connect to first sample audible
+} raop_startup_t;
 
 typedef struct {
 	int channels;
@@ -165,6 +176,13 @@ bool 	raopcl_is_connected(struct raopcl_s *p);
 bool 	raopcl_is_playing(struct raopcl_s *p);
 bool 	raopcl_sanitize(struct raopcl_s *p);
 
+// startup trace of last connection, also logged (info) once first audio packet is sent
+raop_startup_t	raopcl_startup(struct raopcl_s *p);
+const char*		raopcl_step_name(raop_step_t step);
+
+struct raop_lock_stats_s;	// see raop_lock.h, enabled by raop_lock_profile()
+void	raopcl_lock_stats(struct raopcl_s *p, struct raop_lock_stats_s *stats);
+
 uint64_t 	raopcl_time32_to_ntp(uint32_t time);
 
 struct mdnssd_handle_s;
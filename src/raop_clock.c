@@ -0,0 +1,189 @@
+/*
+ * RAOP : clock recovery, estimates remote clock offset and drift from timing exchanges
+ *
+ * Weighted linear regression of offset (remote - local) against local time
+ * over a window of recent exchanges. Exchanges with a round-trip much longer
+ * than the best recent one are rejected, others are weighted by how close to
+ * that best round-trip they are (less queuing, less asymmetry). Once enough
+ * data is there, exchanges too far from the regression line are rejected and
+ * a series of rejections is taken as a clock step and restarts the window
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "raop_clock.h"
+
+#define WINDOW			64
+#define LOCK_COUNT		8
+#define LOCK_PPM		20				// standard error of drift needed to use it
+#define RTT_MARGIN		2000			// accepted round-trip above best one, us
+#define RTT_SCALE		500.0			// weighting round-trip excess, us
+#define RESIDUAL_MIN	1000.0			// never reject closer than that, us
+#define RESIDUAL_K		4				// else reject beyond K * jitter
+#define STEP_COUNT		6				// consecutive rejections that mean a step
+
+typedef struct {
+	uint64_t local;
+	int64_t offset;
+	uint32_t rtt;
+} sample_t;
+
+typedef struct raopclk_s {
+	sample_t samples[WINDOW];
+	int first, count;
+	int rejects;				// consecutive
+	// regression result, offset = a + b * (local - origin)
+	uint64_t origin;
+	double a, b, jitter;
+	raopclk_status_t status;
+} raopclk_t;
+
+/*---------------------------------------------------------------------------*/
+struct raopclk_s *raopclk_create(void) {
+	return calloc(1, sizeof(raopclk_t));
+}
+
+/*---------------------------------------------------------------------------*/
+void raopclk_delete(struct raopclk_s *clock) {
+	free(clock);
+}
+
+/*---------------------------------------------------------------------------*/
+void raopclk_reset(struct raopclk_s *clock) {
+	memset(clock, 0, sizeof(raopclk_t));
+}
+
+/*---------------------------------------------------------------------------*/
+static sample_t *sample(raopclk_t *clock, int i) {
+	return clock->samples + (clock->first + i) % WINDOW;
+}
+
+/*---------------------------------------------------------------------------*/
+static int compare(const void *a, const void *b) {
+	double x = *(double*) a, y = *(double*) b;
+	return (x > y) - (x < y);
+}
+
+/*---------------------------------------------------------------------------*/
+static void fit(raopclk_t *clock) {
+	double W = 0, X = 0, Y = 0, Sxy = 0, Sxx = 0;
+	uint32_t rtt_min = UINT32_MAX;
+
+	for (int i = 0; i < clock->count; i++) rtt_min = sample(clock, i)->rtt < rtt_min ? sample(clock, i)->rtt : rtt_min;
+
+	clock->origin = sample(clock, 0)->local;
+	clock->status.rtt_min = rtt_min;
+
+	// weighted means, x in seconds and y in us so that slope is in ppm
+	for (int i = 0; i < clock->count; i++) {
+		sample_t *s = sample(clock, i);
+		double excess = (s->rtt - rtt_min) / RTT_SCALE;
+		double w = 1 / (1 + excess * excess);
+		W += w;
+		X += w * (s->local - clock->origin) / 1E6;
+		Y += w * s->offset;
+	}
+
+	X /= W;
+	Y /= W;
+
+	for (int i = 0; i < clock->count; i++) {
+		sample_t *s = sample(clock, i);
+		double excess = (s->rtt - rtt_min) / RTT_SCALE;
+		double w = 1 / (1 + excess * excess);
+		double x = (s->local - clock->origin) / 1E6 - X;
+		Sxy += w * x * (s->offset - Y);
+		Sxx += w * x * x;
+	}
+
+	double b = Sxx > 0 ? Sxy / Sxx : 0, a = Y - b * X;
+	double residuals[WINDOW];
+
+	// robust estimate of jitter (median of residuals) so that outliers don't inflate it
+	for (int i = 0; i < clock->count; i++) {
+		sample_t *s = sample(clock, i);
+		residuals[i] = fabs(s->offset - (a + b * (s->local - clock->origin) / 1E6));
+	}
+
+	qsort(residuals, clock->count, sizeof(double), compare);
+	clock->jitter = 1.4826 * residuals[clock->count / 2];
+
+	// slope is only used once it is accurate enough (with hysteresis), before that just use average offset
+	double limit = clock->status.locked ? 2 * LOCK_PPM : LOCK_PPM;
+	clock->status.locked = clock->count >= LOCK_COUNT && Sxx > 0 && clock->jitter / sqrt(Sxx) < limit;
+	clock->b = clock->status.locked ? b : 0;
+	clock->a = clock->status.locked ? a : Y;
+
+	clock->status.ppm = clock->b;
+	clock->status.jitter = clock->jitter;
+}
+
+/*---------------------------------------------------------------------------*/
+bool raopclk_add(struct raopclk_s *clock, uint64_t local, uint64_t remote, uint32_t rtt) {
+	int64_t offset = (int64_t) (remote - local);
+
+	clock->status.rtt_last = rtt;
+
+	if (clock->count) {
+		double residual = (double) (offset - raopclk_offset(clock, local));
+		double limit = clock->jitter * RESIDUAL_K;
+		bool reject;
+
+		// much longer round-trip than best recent one means queuing somewhere
+		reject = rtt > 2 * clock->status.rtt_min + RTT_MARGIN;
+
+		// too far from what we expect
+		if (clock->count >= LOCK_COUNT && fabs(residual) > (limit > RESIDUAL_MIN ? limit : RESIDUAL_MIN)) reject = true;
+
+		// unless this happens too often (clock has stepped or network has changed)
+		if (reject) {
+			clock->status.rejected++;
+			if (++clock->rejects < STEP_COUNT) return false;
+			clock->first = clock->count = 0;
+			clock->status.locked = false;
+		}
+	}
+
+	clock->rejects = 0;
+	clock->status.accepted++;
+
+	// store and drop oldest if needed
+	if (clock->count == WINDOW) {
+		clock->first = (clock->first + 1) % WINDOW;
+		clock->count--;
+	}
+
+	sample_t *s = sample(clock, clock->count++);
+	s->local = local;
+	s->offset = offset;
+	s->rtt = rtt;
+
+	fit(clock);
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+int64_t raopclk_offset(struct raopclk_s *clock, uint64_t local) {
+	if (!clock->count) return 0;
+	return (int64_t) (clock->a + clock->b * ((int64_t) (local - clock->origin)) / 1E6);
+}
+
+/*---------------------------------------------------------------------------*/
+raopclk_status_t raopclk_status(struct raopclk_s *clock) {
+	return clock->status;
+}
+
+/*---------------------------------------------------------------------------*/
+uint32_t raopclk_interval(struct raopclk_s *clock) {
+	// fast at start to get a good offset, then slowing down as estimate settles
+	if (clock->count < LOCK_COUNT) return 250;
+	if (!clock->status.locked || clock->jitter > RESIDUAL_MIN) return 1000;
+	return 3000;
+}
@@ -0,0 +1,32 @@
+/*
+ * RAOP : clock recovery, estimates remote clock offset and drift from timing exchanges
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct raopclk_status_s {
+	bool locked;			// drift estimate can be used
+	double ppm;				// remote clock rate vs ours (positive when remote is faster)
+	double jitter;			// rms of residuals of accepted exchanges, in us
+	uint32_t accepted, rejected;
+	uint32_t rtt_min, rtt_last;	// in us
+} raopclk_status_t;
+
+struct raopclk_s*	raopclk_create(void);
+void				raopclk_delete(struct raopclk_s *clock);
+void				raopclk_reset(struct raopclk_s *clock);
+// local is when remote time was valid (mid-point of exchange), returns false when sample is rejected
+bool				raopclk_add(struct raopclk_s *clock, uint64_t local, uint64_t remote, uint32_t rtt);
+// filtered offset (remote - local) at a given local time, all in us
+int64_t				raopclk_offset(struct raopclk_s *clock, uint64_t local);
+raopclk_status_t	raopclk_status(struct raopclk_s *clock);
+// delay in ms before next exchange is worth doing
+uint32_t			raopclk_interval(struct raopclk_s *clock);
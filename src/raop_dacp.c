@@ -0,0 +1,283 @@
+/*
+ * RAOP : directory of DACP remotes shared by all servers
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "platform.h"
+#include "mdnssd.h"
+#include "raop_dacp.h"
+
+#include "cross_net.h"
+#include "cross_log.h"
+#include "cross_util.h"
+
+extern log_level 	raop_loglevel;
+static log_level 	*loglevel = &raop_loglevel;
+
+typedef struct remote_s {
+	struct remote_s *next;
+	char *name;					// contains DACP-ID
+	struct in_addr host;
+	uint16_t port;
+	pthread_mutex_t mutex;		// owns the connection
+	int sock;
+	int users;
+	bool gone;					// not in directory anymore, freed by last user
+} remote_t;
+
+static struct {
+	pthread_mutex_t mutex, lifecycle;
+	pthread_t thread;
+	struct mdnssd_handle_s *handle;
+	remote_t *list;
+	int users;
+	bool running;
+} directory = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+
+/*---------------------------------------------------------------------------*/
+static void remote_free(remote_t *remote) {
+	if (remote->sock >= 0) closesocket(remote->sock);
+	pthread_mutex_destroy(&remote->mutex);
+	free(remote->name);
+	free(remote);
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called locked
+static void remote_remove(remote_t **p) {
+	remote_t *remote = *p;
+
+	*p = remote->next;
+	remote->gone = true;
+	if (!remote->users) remote_free(remote);
+}
+
+/*---------------------------------------------------------------------------*/
+static bool browse_cb(mdnssd_service_t *slist, void *cookie, bool *stop) {
+	pthread_mutex_lock(&directory.mutex);
+
+	for (mdnssd_service_t *s = slist; s; s = s->next) {
+		remote_t **p;
+
+		if (!s->name) continue;
+		for (p = &directory.list; *p && strcasecmp((*p)->name, s->name); p = &(*p)->next);
+
+		// already known and unchanged
+		if (*p && !s->expired && (*p)->host.s_addr == s->addr.s_addr && (*p)->port == s->port) continue;
+
+		// a remote that moves is a new one, so that its connection is not re-used
+		if (*p) {
+			LOG_INFO("remote %s at %s:%hu is gone", (*p)->name, inet_ntoa((*p)->host), (*p)->port);
+			remote_remove(p);
+		}
+
+		if (s->expired) continue;
+
+		remote_t *remote = calloc(1, sizeof(remote_t));
+		remote->name = strdup(s->name);
+		remote->host = s->addr;
+		remote->port = s->port;
+		remote->sock = -1;
+		pthread_mutex_init(&remote->mutex, NULL);
+		remote->next = directory.list;
+		directory.list = remote;
+
+		LOG_INFO("found remote %s at %s:%hu", remote->name, inet_ntoa(remote->host), remote->port);
+	}
+
+	*stop = !directory.running;
+	pthread_mutex_unlock(&directory.mutex);
+
+	// let caller clear list
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+static void *browse_thread(void *arg) {
+	mdnssd_query(directory.handle, "_dacp._tcp.local", false, 0, &browse_cb, NULL);
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+bool dacp_open(struct in_addr host) {
+	bool rc = true;
+
+	pthread_mutex_lock(&directory.lifecycle);
+
+	// first user starts browsing
+	if (directory.users++ == 0) {
+		directory.handle = mdnssd_init(false, host, true);
+		directory.running = directory.handle != NULL;
+		if (directory.running) pthread_create(&directory.thread, NULL, browse_thread, NULL);
+		else LOG_ERROR("cannot start DACP browser", NULL);
+	}
+
+	rc = directory.running;
+	pthread_mutex_unlock(&directory.lifecycle);
+
+	return rc;
+}
+
+/*---------------------------------------------------------------------------*/
+void dacp_close(void) {
+	pthread_mutex_lock(&directory.lifecycle);
+
+	if (--directory.users == 0 && directory.running) {
+		pthread_mutex_lock(&directory.mutex);
+		directory.running = false;
+		pthread_mutex_unlock(&directory.mutex);
+
+		// closing handle makes query return
+		mdnssd_close(directory.handle);
+		pthread_join(directory.thread, NULL);
+		directory.handle = NULL;
+
+		pthread_mutex_lock(&directory.mutex);
+		while (directory.list) remote_remove(&directory.list);
+		pthread_mutex_unlock(&directory.mutex);
+	}
+
+	pthread_mutex_unlock(&directory.lifecycle);
+}
+
+/*---------------------------------------------------------------------------*/
+static remote_t *acquire(const char *dacp_id) {
+	remote_t *remote;
+
+	if (!dacp_id || !*dacp_id) return NULL;
+
+	pthread_mutex_lock(&directory.mutex);
+	for (remote = directory.list; remote && !strcasestr(remote->name, dacp_id); remote = remote->next);
+	if (remote) remote->users++;
+	pthread_mutex_unlock(&directory.mutex);
+
+	return remote;
+}
+
+/*---------------------------------------------------------------------------*/
+static void release(remote_t *remote) {
+	pthread_mutex_lock(&directory.mutex);
+	if (--remote->users == 0 && remote->gone) remote_free(remote);
+	pthread_mutex_unlock(&directory.mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+bool dacp_resolve(const char *dacp_id, struct in_addr *host, uint16_t *port) {
+	remote_t *remote = acquire(dacp_id);
+
+	if (!remote) return false;
+
+	*host = remote->host;
+	*port = remote->port;
+	release(remote);
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool remote_connect(remote_t *remote) {
+	struct sockaddr_in addr;
+#if WIN
+	DWORD timeout = DACP_TIMEOUT;
+#else
+	struct timeval timeout = { DACP_TIMEOUT / 1000, (DACP_TIMEOUT % 1000) * 1000 };
+#endif
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr = remote->host;
+	addr.sin_port = htons(remote->port);
+
+	remote->sock = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(remote->sock, SOL_SOCKET, SO_RCVTIMEO, (char*) &timeout, sizeof(timeout));
+
+	if (connect(remote->sock, (struct sockaddr*) &addr, sizeof(addr))) {
+		LOG_WARN("cannot connect to remote %s: %s", remote->name, strerror(errno));
+		closesocket(remote->sock);
+		remote->sock = -1;
+		return false;
+	}
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+// reads a whole response so that connection can be re-used, returns status or -1
+static int remote_response(remote_t *remote, bool *keep) {
+	char buf[1024], *body;
+	int len = 0, n, status = -1, length = 0;
+
+	// read until end of headers
+	do {
+		if ((n = recv(remote->sock, buf + len, sizeof(buf) - 1 - len, 0)) <= 0) return -1;
+		len += n;
+		buf[len] = '\0';
+	} while ((body = strstr(buf, "\r\n\r\n")) == NULL && len < (int) sizeof(buf) - 1);
+
+	if (!body || sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1) return -1;
+
+	char *p = strcasestr(buf, "\r\nContent-Length:");
+	if (p && p < body) length = atoi(p + strlen("\r\nContent-Length:"));
+
+	// HTTP/1.1 keeps connection unless told otherwise
+	*keep = strncmp(buf, "HTTP/1.0", 8);
+	if ((p = strcasestr(buf, "\r\nConnection:")) != NULL && p < body) {
+		char *eol = strstr(p + 2, "\r\n");
+		p = strcasestr(p, "close");
+		if (p && p < eol) *keep = false;
+	}
+
+	// then drain body
+	for (length -= len - (body + 4 - buf); length > 0; length -= n) {
+		if ((n = recv(remote->sock, buf, min(length, (int) sizeof(buf)), 0)) <= 0) return -1;
+	}
+
+	return status;
+}
+
+/*---------------------------------------------------------------------------*/
+int dacp_command(const char *dacp_id, const char *active_remote, const char *command) {
+	remote_t *remote = acquire(dacp_id);
+	char request[512];
+	int status = -1, len;
+
+	if (!remote) return -1;
+
+	len = snprintf(request, sizeof(request), "GET /ctrl-int/1/%s HTTP/1.1\r\nHost: %s:%hu\r\nActive-Remote: %s\r\n\r\n",
+				   command, inet_ntoa(remote->host), remote->port, active_remote);
+
+	pthread_mutex_lock(&remote->mutex);
+
+	// a kept-alive connection might have been closed by remote meanwhile, then retry on a new one
+	for (int i = 0; i < 2 && status < 0; i++) {
+		bool fresh = remote->sock < 0, keep = false;
+
+		if (fresh && !remote_connect(remote)) break;
+
+		if (send(remote->sock, request, len, 0) == len) status = remote_response(remote, &keep);
+
+		if (!keep || status < 0) {
+			closesocket(remote->sock);
+			remote->sock = -1;
+		}
+
+		if (fresh) break;
+	}
+
+	LOG_INFO("remote %s command %s => %d", remote->name, command, status);
+
+	pthread_mutex_unlock(&remote->mutex);
+	release(remote);
+
+	return status;
+}
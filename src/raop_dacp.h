@@ -0,0 +1,32 @@
+/*
+ * RAOP : directory of DACP remotes shared by all servers
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "platform.h"
+
+// ms to wait for a remote to answer a command
+#ifndef DACP_TIMEOUT
+#define DACP_TIMEOUT	2000
+#endif
+
+/*
+ One mDNS browser runs while at least one user has the directory open (it
+ browses on the interface of the first one) and keeps track of all remotes
+ announced on the network, so that a DACP-ID resolves at once. Commands to a
+ remote go over a kept-alive HTTP connection, re-opened when remote closed it
+*/
+bool	dacp_open(struct in_addr host);
+void	dacp_close(void);
+bool	dacp_resolve(const char *dacp_id, struct in_addr *host, uint16_t *port);
+// returns HTTP status or -1 when remote is unknown or does not answer
+int		dacp_command(const char *dacp_id, const char *active_remote, const char *command);
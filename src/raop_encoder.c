@@ -0,0 +1,284 @@
+/*
+ * RAOP : encoder stage of the streamer, runs codecs in a pool of workers
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "platform.h"
+#include "encoder.h"
+#include "ring.h"
+#include "raop_encoder.h"
+
+#include "cross_net.h"
+#include "cross_log.h"
+#include "cross_util.h"
+
+#define PCM_RING_FRAMES		32
+#define ENCODED_RING_SIZE	(256*1024)
+#define JOB_MAX_FRAMES		8		// frames encoded in a row before letting other jobs run
+
+extern log_level 	raop_loglevel;
+static log_level 	*loglevel = &raop_loglevel;
+
+typedef struct raopenc_s {
+	struct encoder_s *encoder;
+	ring_t pcm, encoded;	// producer/consumer is the HTTP thread, worker is the other end
+	uint32_t gen;			// stream generation, data of previous generations are stale
+	uint32_t encoder_gen;
+	bool opened;
+	bool scheduled, busy;
+	struct raopenc_s *next;
+	struct {
+		uint8_t *buffer;
+		size_t size;
+	} in, out;
+	raop_timing_t timing;
+	uint32_t overflow;
+} raopenc_t;
+
+static struct {
+	pthread_mutex_t mutex, lifecycle;
+	pthread_cond_t cond, idle;
+	pthread_t threads[ENCODER_WORKERS];
+	bool running;
+	int users;
+	raopenc_t *first, *last;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void*	worker_thread(void *arg);
+
+/*---------------------------------------------------------------------------*/
+static uint8_t *reserve(uint8_t **buffer, size_t *size, size_t len) {
+	if (len > *size) {
+		*buffer = realloc(*buffer, len);
+		*size = len;
+	}
+	return *buffer;
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called with pool mutex locked
+static void schedule(raopenc_t *job) {
+	job->scheduled = true;
+	job->next = NULL;
+	if (pool.last) pool.last->next = job;
+	else pool.first = job;
+	pool.last = job;
+}
+
+/*---------------------------------------------------------------------------*/
+void raop_timing_add(raop_timing_t *timing, uint32_t us) {
+	timing->count++;
+	timing->total += us;
+	if (us > timing->max) timing->max = us;
+}
+
+/*---------------------------------------------------------------------------*/
+struct raopenc_s *raopenc_create(struct encoder_s *encoder, size_t frame_bytes) {
+	raopenc_t *job = calloc(1, sizeof(raopenc_t));
+
+	if (!job) return NULL;
+
+	job->encoder = encoder;
+
+	if (!ring_init(&job->pcm, PCM_RING_FRAMES * (frame_bytes + 2 * sizeof(uint32_t))) ||
+		!ring_init(&job->encoded, ENCODED_RING_SIZE)) {
+		ring_free(&job->pcm);
+		ring_free(&job->encoded);
+		free(job);
+		return NULL;
+	}
+
+	// first user starts the workers
+	pthread_mutex_lock(&pool.lifecycle);
+	if (!pool.users++) {
+		pool.running = true;
+		for (int i = 0; i < ENCODER_WORKERS; i++) pthread_create(pool.threads + i, NULL, worker_thread, NULL);
+		LOG_INFO("started %d encoder workers", ENCODER_WORKERS);
+	}
+	pthread_mutex_unlock(&pool.lifecycle);
+
+	return job;
+}
+
+/*---------------------------------------------------------------------------*/
+void raopenc_delete(struct raopenc_s *job) {
+	if (!job) return;
+
+	pthread_mutex_lock(&pool.mutex);
+
+	// wait for a worker to finish with us (it might re-schedule us)
+	while (job->busy) pthread_cond_wait(&pool.idle, &pool.mutex);
+
+	// then unlink from work list
+	if (job->scheduled) {
+		raopenc_t **p = &pool.first, *prev = NULL;
+		while (*p != job) prev = *p, p = &(*p)->next;
+		*p = job->next;
+		if (pool.last == job) pool.last = prev;
+	}
+
+	pthread_mutex_unlock(&pool.mutex);
+
+	// last user stops the workers
+	pthread_mutex_lock(&pool.lifecycle);
+	if (!--pool.users) {
+		pthread_mutex_lock(&pool.mutex);
+		pool.running = false;
+		pthread_cond_broadcast(&pool.cond);
+		pthread_mutex_unlock(&pool.mutex);
+		for (int i = 0; i < ENCODER_WORKERS; i++) pthread_join(pool.threads[i], NULL);
+	}
+	pthread_mutex_unlock(&pool.lifecycle);
+
+	LOG_INFO("[%p]: encoder overflows:%u, encoded %u frames in %u us (avg:%u max:%u)", job, job->overflow, job->timing.count,
+			 (uint32_t) job->timing.total, job->timing.count ? (uint32_t) (job->timing.total / job->timing.count) : 0, job->timing.max);
+
+	ring_free(&job->pcm);
+	ring_free(&job->encoded);
+	free(job->in.buffer);
+	free(job->out.buffer);
+	free(job);
+}
+
+/*---------------------------------------------------------------------------*/
+void raopenc_restart(struct raopenc_s *job) {
+	// caller serializes restarts, so a load/store is enough
+	ring_store(&job->gen, ring_load(&job->gen) + 1);
+}
+
+/*---------------------------------------------------------------------------*/
+bool raopenc_full(struct raopenc_s *job) {
+	return ring_used(&job->pcm) > job->pcm.size / 2;
+}
+
+/*---------------------------------------------------------------------------*/
+bool raopenc_pending(struct raopenc_s *job) {
+	return ring_used(&job->pcm) || ring_used(&job->encoded);
+}
+
+/*---------------------------------------------------------------------------*/
+bool raopenc_put(struct raopenc_s *job, int16_t *pcm, size_t bytes) {
+	uint32_t gen = ring_load(&job->gen);
+
+	if (!ring_putv(&job->pcm, &gen, sizeof(gen), pcm, bytes)) return false;
+
+	// schedule unless already waiting or running (worker will re-check the ring)
+	pthread_mutex_lock(&pool.mutex);
+	if (!job->scheduled && !job->busy) {
+		schedule(job);
+		pthread_cond_signal(&pool.cond);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+uint8_t *raopenc_get(struct raopenc_s *job, size_t *bytes) {
+	uint32_t len;
+
+	while ((len = ring_peek(&job->encoded)) != 0) {
+		uint8_t *p = reserve(&job->out.buffer, &job->out.size, len);
+		ring_get(&job->encoded, p);
+
+		// ignore what has been encoded before a restart
+		if (*(uint32_t*) p != ring_load(&job->gen)) continue;
+
+		*bytes = len - sizeof(uint32_t);
+		return p + sizeof(uint32_t);
+	}
+
+	*bytes = 0;
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+raop_timing_t raopenc_timing(struct raopenc_s *job) {
+	pthread_mutex_lock(&pool.mutex);
+	raop_timing_t timing = job->timing;
+	pthread_mutex_unlock(&pool.mutex);
+	return timing;
+}
+
+/*---------------------------------------------------------------------------*/
+static void encode_job(raopenc_t *job, raop_timing_t *timing) {
+	uint32_t len;
+
+	for (int n = 0; n < JOB_MAX_FRAMES && (len = ring_peek(&job->pcm)) != 0; n++) {
+		uint8_t *p = reserve(&job->in.buffer, &job->in.size, len);
+		uint32_t gen;
+		size_t bytes;
+
+		ring_get(&job->pcm, p);
+		gen = *(uint32_t*) p;
+
+		// stale frame, no need to encode it
+		if (gen != ring_load(&job->gen)) continue;
+
+		// new stream, re-open encoder so that headers are re-sent
+		if (!job->opened || gen != job->encoder_gen) {
+			if (job->opened) encoder_close(job->encoder);
+			encoder_open(job->encoder);
+			job->encoder_gen = gen;
+			job->opened = true;
+		}
+
+		uint64_t now = gettime_us();
+		uint8_t *data = encoder_encode(job->encoder, (int16_t*) (p + sizeof(uint32_t)), (len - sizeof(uint32_t)) / 4, &bytes);
+		raop_timing_add(timing, gettime_us() - now);
+
+		if (bytes && !ring_putv(&job->encoded, &gen, sizeof(gen), data, bytes)) {
+			if (!job->overflow++) LOG_WARN("[%p]: encoded ring overflow", job);
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void *worker_thread(void *arg) {
+	pthread_mutex_lock(&pool.mutex);
+
+	while (pool.running) {
+		raopenc_t *job = pool.first;
+
+		if (!job) {
+			pthread_cond_wait(&pool.cond, &pool.mutex);
+			continue;
+		}
+
+		pool.first = job->next;
+		if (!pool.first) pool.last = NULL;
+		job->scheduled = false;
+		job->busy = true;
+
+		raop_timing_t timing = { 0 };
+
+		pthread_mutex_unlock(&pool.mutex);
+		encode_job(job, &timing);
+		pthread_mutex_lock(&pool.mutex);
+
+		// stats read timing with pool mutex
+		job->timing.count += timing.count;
+		job->timing.total += timing.total;
+		job->timing.max = max(job->timing.max, timing.max);
+		job->busy = false;
+
+		// more data might have arrived while we were busy (or we yielded)
+		if (ring_used(&job->pcm)) schedule(job);
+
+		pthread_cond_broadcast(&pool.idle);
+	}
+
+	pthread_mutex_unlock(&pool.mutex);
+
+	return NULL;
+}
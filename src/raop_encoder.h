@@ -0,0 +1,39 @@
+/*
+ * RAOP : encoder stage of the streamer, runs codecs in a pool of workers
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// number of threads shared by all sessions to run encoders
+#ifndef ENCODER_WORKERS
+#define ENCODER_WORKERS 2
+#endif
+
+typedef struct raop_timing_s {
+	uint32_t count, max;	// in us
+	uint64_t total;
+} raop_timing_t;
+
+struct encoder_s;
+
+struct raopenc_s*	raopenc_create(struct encoder_s *encoder, size_t frame_bytes);
+void				raopenc_delete(struct raopenc_s *job);
+// all data queued before are discarded and encoder is re-opened at next frame
+void				raopenc_restart(struct raopenc_s *job);
+bool				raopenc_full(struct raopenc_s *job);
+bool				raopenc_pending(struct raopenc_s *job);
+bool				raopenc_put(struct raopenc_s *job, int16_t *pcm, size_t bytes);
+// returned data are valid until next call
+uint8_t*			raopenc_get(struct raopenc_s *job, size_t *bytes);
+raop_timing_t		raopenc_timing(struct raopenc_s *job);
+
+void				raop_timing_add(raop_timing_t *timing, uint32_t us);
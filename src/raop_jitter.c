@@ -0,0 +1,194 @@
+/*
+ * RAOP : adaptive jitter buffer depth, from observed network conditions
+ *
+ * Lateness of arrivals (vs. when frames must be played), loss bursts and time
+ * taken by resend answers are gathered in the current window while previous
+ * window is kept, so that a spike is remembered between one and two windows.
+ * Decisions grow at once when conditions get worse, but shrinking requires
+ * the need to stay well below current value for a whole window. Frames that
+ * still had to be played as silence push the resend deadline up
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "raop_jitter.h"
+
+#define PREFILL_MIN		20			// ms, a couple of frames
+#define DEADLINE_MIN	200			// ms, room for a few requests with backoff
+#define MARGIN			1.25
+#define SHRINK			0.75		// need must be below that part of current value to shrink
+#define ESCALATE		1.5			// deadline growth when frames are still lost
+#define NONE			INT32_MIN
+
+typedef struct {
+	uint32_t start;
+	int32_t late;
+	uint32_t burst, recovery, lost;
+} window_t;
+
+typedef struct jitter_s {
+	double frame;				// ms
+	uint32_t prefill_max, deadline_max;
+	window_t windows[2];		// current and previous
+	bool started;
+	struct {
+		bool valid;
+		uint32_t rtptime, now;
+	} last;						// previous arrival
+	uint32_t changed;			// when last shrink or growth happened
+	uint32_t lost;				// frames lost since last decision
+	jitter_status_t status;
+} jitter_t;
+
+/*---------------------------------------------------------------------------*/
+static void window_clear(window_t *window, uint32_t start) {
+	memset(window, 0, sizeof(window_t));
+	window->start = start;
+	window->late = NONE;
+}
+
+/*---------------------------------------------------------------------------*/
+static void roll(jitter_t *js, uint32_t now) {
+	if (!js->started) {
+		window_clear(js->windows, now);
+		window_clear(js->windows + 1, now);
+		js->changed = now;
+		js->started = true;
+	} else if (now - js->windows[0].start >= 2 * JITTER_WINDOW) {
+		// nothing happened for long, previous window is as old as it gets
+		window_clear(js->windows + 1, now);
+		window_clear(js->windows, now);
+	} else if (now - js->windows[0].start >= JITTER_WINDOW) {
+		js->windows[1] = js->windows[0];
+		window_clear(js->windows, now);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+struct jitter_s *jitter_create(int frame_size, uint32_t prefill_max, uint32_t deadline_max) {
+	jitter_t *js = calloc(1, sizeof(jitter_t));
+
+	if (!js) return NULL;
+
+	js->frame = frame_size * 1000.0 / 44100;
+	js->prefill_max = prefill_max > PREFILL_MIN ? prefill_max : PREFILL_MIN;
+	js->deadline_max = deadline_max > DEADLINE_MIN ? deadline_max : DEADLINE_MIN;
+	jitter_reset(js);
+
+	return js;
+}
+
+/*---------------------------------------------------------------------------*/
+void jitter_delete(struct jitter_s *js) {
+	free(js);
+}
+
+/*---------------------------------------------------------------------------*/
+void jitter_reset(struct jitter_s *js) {
+	uint32_t decisions = js->status.decisions;
+
+	memset(&js->status, 0, sizeof(jitter_status_t));
+	js->status.prefill = js->prefill_max;
+	js->status.deadline = js->deadline_max;
+	js->status.decisions = decisions;
+	js->started = js->last.valid = false;
+	js->lost = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+void jitter_restart(struct jitter_s *js) {
+	js->last.valid = false;
+}
+
+/*---------------------------------------------------------------------------*/
+void jitter_arrival(struct jitter_s *js, uint32_t rtptime, uint32_t now, uint32_t playtime) {
+	roll(js, now);
+
+	// difference of transit times between consecutive arrivals
+	if (js->last.valid) {
+		double d = (int32_t) (now - js->last.now) - (int32_t) (rtptime - js->last.rtptime) * 1000.0 / 44100;
+		js->status.jitter += (fabs(d) - js->status.jitter) / 16;
+	}
+
+	js->last.rtptime = rtptime;
+	js->last.now = now;
+	js->last.valid = true;
+
+	if (playtime && (int32_t) (now - playtime) > js->windows[0].late) js->windows[0].late = now - playtime;
+}
+
+/*---------------------------------------------------------------------------*/
+void jitter_loss(struct jitter_s *js, int frames) {
+	if ((uint32_t) frames > js->windows[0].burst) js->windows[0].burst = frames;
+}
+
+/*---------------------------------------------------------------------------*/
+void jitter_recovered(struct jitter_s *js, uint32_t waited) {
+	if (waited > js->windows[0].recovery) js->windows[0].recovery = waited;
+}
+
+/*---------------------------------------------------------------------------*/
+void jitter_lost(struct jitter_s *js) {
+	js->windows[0].lost++;
+	js->status.lost++;
+	js->lost++;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool adjust(uint32_t *value, uint32_t need, bool settled) {
+	if (need > *value || (settled && need < *value * SHRINK)) {
+		*value = need;
+		return true;
+	}
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+bool jitter_decide(struct jitter_s *js, uint32_t now) {
+	window_t *cur = js->windows, *prev = js->windows + 1;
+
+	roll(js, now);
+
+	int32_t late = cur->late > prev->late ? cur->late : prev->late;
+	uint32_t burst = cur->burst > prev->burst ? cur->burst : prev->burst;
+	uint32_t recovery = cur->recovery > prev->recovery ? cur->recovery : prev->recovery;
+	bool settled = now - js->changed >= JITTER_WINDOW && !cur->lost && !prev->lost;
+
+	js->status.late = late == NONE ? 0 : late;
+	js->status.burst = burst;
+	js->status.recovery = recovery;
+
+	// prefill must cover frames arriving after their playtime
+	uint32_t prefill = late > 0 ? late * MARGIN + js->frame : PREFILL_MIN;
+
+	// a burst is known when next frame arrives, then answers need their time
+	uint32_t deadline = (recovery + burst * js->frame) * MARGIN;
+	if (deadline < DEADLINE_MIN) deadline = DEADLINE_MIN;
+	if (js->lost && deadline < js->status.deadline * ESCALATE) deadline = js->status.deadline * ESCALATE;
+
+	if (prefill > js->prefill_max) prefill = js->prefill_max;
+	if (deadline > js->deadline_max) deadline = js->deadline_max;
+
+	bool changed = adjust(&js->status.prefill, prefill, settled);
+	changed |= adjust(&js->status.deadline, deadline, settled);
+	js->lost = 0;
+
+	if (changed) {
+		js->status.decisions++;
+		js->changed = now;
+	}
+
+	return changed;
+}
+
+/*---------------------------------------------------------------------------*/
+jitter_status_t jitter_status(struct jitter_s *js) {
+	return js->status;
+}
@@ -0,0 +1,50 @@
+/*
+ * RAOP : adaptive jitter buffer depth, from observed network conditions
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ms, conditions are the worst seen during the last one to two windows
+#ifndef JITTER_WINDOW
+#define JITTER_WINDOW	10000
+#endif
+
+typedef struct jitter_status_s {
+	double jitter;				// ms, inter-arrival jitter (RFC 3550)
+	int32_t late;				// ms, worst arrival after playtime (negative when all are early)
+	uint32_t burst;				// frames, longest loss burst
+	uint32_t recovery;			// ms, slowest answer to a resend request
+	uint32_t lost;				// frames played as silence because they were missing
+	uint32_t prefill, deadline;	// ms, current decision
+	uint32_t decisions;
+} jitter_status_t;
+
+/*
+ Not thread-safe, caller must serialize (streamer uses its buffer mutex).
+ Prefill is the smallest one that would have absorbed late arrivals and the
+ deadline is what resend answers needed. Both start at their ceiling, grow as
+ soon as needed and only shrink after a whole window with a lower need
+*/
+struct jitter_s*	jitter_create(int frame_size, uint32_t prefill_max, uint32_t deadline_max);
+void				jitter_delete(struct jitter_s *js);
+// forget conditions and go back to ceilings (new peer)
+void				jitter_reset(struct jitter_s *js);
+// stream restarted, timing of previous arrivals is not a reference anymore
+void				jitter_restart(struct jitter_s *js);
+// in-order frame has arrived, playtime (local ms) is 0 when not known yet
+void				jitter_arrival(struct jitter_s *js, uint32_t rtptime, uint32_t now, uint32_t playtime);
+void				jitter_loss(struct jitter_s *js, int frames);
+// a missing frame was answered waited ms after it was found missing
+void				jitter_recovered(struct jitter_s *js, uint32_t waited);
+void				jitter_lost(struct jitter_s *js);
+// returns true when prefill or deadline has changed, must be called regularly
+bool				jitter_decide(struct jitter_s *js, uint32_t now);
+jitter_status_t		jitter_status(struct jitter_s *js);
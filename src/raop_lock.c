@@ -0,0 +1,142 @@
+/*
+ * RAOP : mutex with per call site wait and hold time profiling
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+#include "raop_lock.h"
+
+#include "cross_net.h"
+
+// can be changed at any time while locks are used
+#if defined(_MSC_VER)
+static volatile uint32_t profiling;
+#define profiling_get() profiling
+#define profiling_set(v) (profiling = (v))
+#else
+static uint32_t profiling;
+#define profiling_get() __atomic_load_n(&profiling, __ATOMIC_RELAXED)
+#define profiling_set(v) __atomic_store_n(&profiling, (v), __ATOMIC_RELAXED)
+#endif
+
+/*---------------------------------------------------------------------------*/
+static int bucket(uint32_t us) {
+	int n = 0;
+	while (us && n < RAOP_LOCK_BUCKETS - 1) us >>= 1, n++;
+	return n;
+}
+
+/*---------------------------------------------------------------------------*/
+static raop_lock_site_t *site_get(raop_lock_stats_t *stats, const char *func, int line) {
+	int i;
+
+	for (i = 0; i < stats->count; i++) {
+		if (stats->sites[i].line == line && stats->sites[i].func == func) return stats->sites + i;
+	}
+
+	// the last one is reserved for all sites that have no room
+	if (i >= RAOP_LOCK_SITES - 1) {
+		i = RAOP_LOCK_SITES - 1;
+		if (stats->count == i) {
+			stats->count++;
+			stats->sites[i].func = "(others)";
+			stats->sites[i].line = 0;
+		}
+		return stats->sites + i;
+	}
+
+	stats->count++;
+	stats->sites[i].func = func;
+	stats->sites[i].line = line;
+	return stats->sites + i;
+}
+
+/*---------------------------------------------------------------------------*/
+static void acquired(raop_lock_t *lock, const char *func, int line, uint64_t start, bool contended) {
+	raop_lock_site_t *site = site_get(&lock->stats, func, line);
+	uint32_t wait = contended ? lock->since - start : 0;
+
+	site->count++;
+	if (contended) site->contended++;
+	site->wait[bucket(wait)]++;
+	site->wait_total += wait;
+	if (wait > site->wait_max) site->wait_max = wait;
+
+	lock->owner = site;
+}
+
+/*---------------------------------------------------------------------------*/
+void raop_lock_profile(bool enable) {
+	profiling_set(enable);
+}
+
+/*---------------------------------------------------------------------------*/
+void raop_lock_init(raop_lock_t *lock) {
+	memset(lock, 0, sizeof(raop_lock_t));
+	pthread_mutex_init(&lock->mutex, NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+void raop_lock_destroy(raop_lock_t *lock) {
+	pthread_mutex_destroy(&lock->mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+void raop_lock_acquire(raop_lock_t *lock, const char *func, int line) {
+	if (!profiling_get()) {
+		pthread_mutex_lock(&lock->mutex);
+		lock->since = 0;
+		return;
+	}
+
+	// only measure waiting when there is some
+	if (!pthread_mutex_trylock(&lock->mutex)) {
+		lock->since = gettime_us();
+		acquired(lock, func, line, lock->since, false);
+	} else {
+		uint64_t start = gettime_us();
+		pthread_mutex_lock(&lock->mutex);
+		lock->since = gettime_us();
+		acquired(lock, func, line, start, true);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+bool raop_lock_try(raop_lock_t *lock, const char *func, int line) {
+	if (pthread_mutex_trylock(&lock->mutex)) return false;
+
+	if (profiling_get()) {
+		lock->since = gettime_us();
+		acquired(lock, func, line, lock->since, false);
+	} else lock->since = 0;
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+void raop_lock_release(raop_lock_t *lock) {
+	// acquired before profiling was enabled does not count
+	if (lock->since) {
+		raop_lock_site_t *site = lock->owner;
+		uint32_t hold = gettime_us() - lock->since;
+
+		site->hold[bucket(hold)]++;
+		site->hold_total += hold;
+		if (hold > site->hold_max) site->hold_max = hold;
+		lock->since = 0;
+	}
+
+	pthread_mutex_unlock(&lock->mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+void raop_lock_stats(raop_lock_t *lock, raop_lock_stats_t *stats) {
+	memcpy(stats, &lock->stats, sizeof(raop_lock_stats_t));
+}
@@ -0,0 +1,58 @@
+/*
+ * RAOP : mutex with per call site wait and hold time profiling
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+#define RAOP_LOCK_SITES		16	// last one collects all sites that don't fit
+#define RAOP_LOCK_BUCKETS	14	// 0 is below 1us, then [2^(n-1), 2^n) us and last is open
+
+typedef struct raop_lock_site_s {
+	const char *func;
+	int line;
+	uint32_t count, contended;			// contended is when lock was already taken
+	uint32_t wait_max, hold_max;		// in us
+	uint64_t wait_total, hold_total;	// in us
+	uint32_t wait[RAOP_LOCK_BUCKETS], hold[RAOP_LOCK_BUCKETS];
+} raop_lock_site_t;
+
+typedef struct raop_lock_stats_s {
+	int count;
+	raop_lock_site_t sites[RAOP_LOCK_SITES];
+} raop_lock_stats_t;
+
+typedef struct raop_lock_s {
+	pthread_mutex_t mutex;
+	uint64_t since;				// when owner got it, 0 when not profiled
+	raop_lock_site_t *owner;
+	raop_lock_stats_t stats;
+} raop_lock_t;
+
+/*
+ A plain mutex until profiling is enabled (for all locks, can be changed at any
+ time). Then acquiring costs a trylock and a clock read, and release another
+ clock read. Hold time is counted for the site that acquired the lock.
+ Statistics are updated by the owner, so reading them requires holding the
+ lock as well
+*/
+void	raop_lock_profile(bool enable);
+void	raop_lock_init(raop_lock_t *lock);
+void	raop_lock_destroy(raop_lock_t *lock);
+void	raop_lock_acquire(raop_lock_t *lock, const char *func, int line);
+bool	raop_lock_try(raop_lock_t *lock, const char *func, int line);
+void	raop_lock_release(raop_lock_t *lock);
+void	raop_lock_stats(raop_lock_t *lock, raop_lock_stats_t *stats);
+
+#define raop_lock(lock) raop_lock_acquire((lock), __FUNCTION__, __LINE__)
+#define raop_trylock(lock) raop_lock_try((lock), __FUNCTION__, __LINE__)
+#define raop_unlock(lock) raop_lock_release(lock)
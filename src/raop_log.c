@@ -0,0 +1,473 @@
+/*
+ * RAOP : asynchronous backend for cross_log macros
+ *
+ * Each thread that logs gets its own single producer ring, so producers never
+ * wait for each other nor for the writer. Records hold the format pointer and
+ * arguments as the format says they are, the writer walks the format again to
+ * read them back and prints conversions one by one. Only registering a new
+ * thread and the writer's walk through threads take a mutex. An idle writer
+ * sleeps on a condition that producers signal only when it is sleeping. A
+ * message with a string too long for a record (RTSP dumps) is written
+ * synchronously, so it is never cut
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "platform.h"
+#include "ring.h"
+#include "cross_log.h"
+#include "raop_log.h"
+
+#define RECORD_MAX	1024
+#define TEXT_MAX	1024
+#define IDLE_WAIT	1000			// ms, writer wakes-up anyway (should not be needed)
+
+#if defined(_MSC_VER)
+#define log_increment(p) InterlockedIncrement((volatile LONG*) (p))
+#define log_fence() MemoryBarrier()
+#else
+#define log_increment(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define log_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+typedef enum { ARG_NONE, ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_INTMAX, ARG_PTRDIFF,
+			   ARG_DOUBLE, ARG_LDOUBLE, ARG_PTR, ARG_STR } arg_t;
+
+typedef struct {
+	int64_t time;					// ms, wall clock
+	const char *func, *fmt;
+	int line;
+} record_t;
+
+typedef struct producer_s {
+	struct producer_s *next;
+	ring_t ring;
+	uint32_t dropped;				// written by producer only
+	uint32_t reported;				// by writer only
+	uint32_t gone;					// thread has exited, freed once drained
+} producer_t;
+
+static struct {
+	pthread_mutex_t mutex;			// protects list only
+	pthread_mutex_t wake_mutex;
+	pthread_cond_t wake;
+	uint32_t posted, sleeping;		// records put and writer waiting for more
+	pthread_t thread;
+	pthread_key_t key;
+	bool has_key;
+	producer_t *list;
+	size_t size;
+	uint32_t running;
+	uint32_t dropped;				// of producers that are gone
+} logger = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/*---------------------------------------------------------------------------*/
+// parses one conversion from just after '%', returns what follows it. Precision is
+// -1 when there is none and -2 when it is the last '*' argument
+static const char *parse_spec(const char *p, int *stars, int *precision, arg_t *kind) {
+	arg_t size = ARG_INT;
+
+	*stars = 0;
+	*precision = -1;
+	while (*p && strchr("-+ #0'", *p)) p++;
+	if (*p == '*') (*stars)++, p++;
+	else while (isdigit((unsigned char) *p)) p++;
+	if (*p == '.') {
+		if (*++p == '*') {
+			(*stars)++, p++;
+			*precision = -2;
+		} else {
+			for (*precision = 0; isdigit((unsigned char) *p); p++) *precision = *precision * 10 + *p - '0';
+		}
+	}
+
+	switch (*p) {
+	case 'h': p += p[1] == 'h' ? 2 : 1; break;
+	case 'l': size = p[1] == 'l' ? ARG_LLONG : ARG_LONG; p += p[1] == 'l' ? 2 : 1; break;
+	case 'z': size = ARG_SIZE; p++; break;
+	case 'j': size = ARG_INTMAX; p++; break;
+	case 't': size = ARG_PTRDIFF; p++; break;
+	case 'L': size = ARG_LDOUBLE; p++; break;
+	case 'I':
+		// Microsoft's I64, I32 and I
+		if (!strncmp(p, "I64", 3)) size = ARG_LLONG, p += 3;
+		else if (!strncmp(p, "I32", 3)) p += 3;
+		else size = ARG_SIZE, p++;
+		break;
+	}
+
+	switch (*p) {
+	case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+		*kind = size == ARG_LDOUBLE ? ARG_INT : size;
+		break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+		*kind = size == ARG_LDOUBLE ? ARG_LDOUBLE : ARG_DOUBLE;
+		break;
+	case 'p': *kind = ARG_PTR; break;
+	case 's': *kind = ARG_STR; break;
+	default: *kind = ARG_NONE; break;
+	}
+
+	return *p ? p + 1 : p;
+}
+
+/*---------------------------------------------------------------------------*/
+static size_t arg_size(arg_t kind) {
+	switch (kind) {
+	case ARG_INT: return sizeof(int);
+	case ARG_LONG: return sizeof(long);
+	case ARG_LLONG: return sizeof(long long);
+	case ARG_SIZE: return sizeof(size_t);
+	case ARG_INTMAX: return sizeof(intmax_t);
+	case ARG_PTRDIFF: return sizeof(ptrdiff_t);
+	case ARG_DOUBLE: return sizeof(double);
+	case ARG_LDOUBLE: return sizeof(long double);
+	case ARG_PTR: return sizeof(void*);
+	default: return 0;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+// copies arguments after the record header, returns total length or 0 if it does not fit
+static uint32_t serialize(uint8_t *buf, const char *fmt, va_list args) {
+	uint8_t *p = buf + sizeof(record_t), *end = buf + RECORD_MAX;
+
+	while ((fmt = strchr(fmt, '%')) != NULL) {
+		int stars, precision;
+		arg_t kind;
+		union { int i; long l; long long ll; size_t z; intmax_t j; ptrdiff_t t; double d; long double ld; void *p; } v;
+
+		fmt = parse_spec(fmt + 1, &stars, &precision, &kind);
+
+		for (; stars; stars--) {
+			v.i = va_arg(args, int);
+			if (p + sizeof(int) > end) return 0;
+			memcpy(p, &v.i, sizeof(int));
+			p += sizeof(int);
+			// precision is the last star, a negative one is like none
+			if (stars == 1 && precision == -2) precision = v.i >= 0 ? v.i : -1;
+		}
+
+		switch (kind) {
+		case ARG_INT: v.i = va_arg(args, int); break;
+		case ARG_LONG: v.l = va_arg(args, long); break;
+		case ARG_LLONG: v.ll = va_arg(args, long long); break;
+		case ARG_SIZE: v.z = va_arg(args, size_t); break;
+		case ARG_INTMAX: v.j = va_arg(args, intmax_t); break;
+		case ARG_PTRDIFF: v.t = va_arg(args, ptrdiff_t); break;
+		case ARG_DOUBLE: v.d = va_arg(args, double); break;
+		case ARG_LDOUBLE: v.ld = va_arg(args, long double); break;
+		case ARG_PTR: v.p = va_arg(args, void*); break;
+		case ARG_STR: {
+			// strings might not live long enough, so they are copied (and might not be terminated)
+			const char *s = va_arg(args, const char*);
+			uint16_t len;
+			size_t room = end - p >= (ptrdiff_t) sizeof(len) ? end - p - sizeof(len) : 0;
+			size_t max = precision >= 0 && (size_t) precision <= room ? (size_t) precision : room + 1;
+
+			if (!s) s = "(null)";
+			if (strnlen(s, max) > room) return 0;
+			len = strnlen(s, max);
+			memcpy(p, &len, sizeof(len));
+			memcpy(p + sizeof(len), s, len);
+			p += sizeof(len) + len;
+			continue;
+		}
+		default:
+			continue;
+		}
+
+		if (p + arg_size(kind) > end) return 0;
+		memcpy(p, &v, arg_size(kind));
+		p += arg_size(kind);
+	}
+
+	return p - buf;
+}
+
+/*---------------------------------------------------------------------------*/
+// formats a record back, conversion by conversion
+static void deserialize(const uint8_t *buf, char *line, size_t size) {
+	const record_t *record = (const record_t*) buf;
+	const uint8_t *p = buf + sizeof(record_t);
+	const char *fmt = record->fmt;
+	size_t n = 0;
+
+	while (*fmt && n < size - 1) {
+		const char *start = fmt;
+		char spec[64], str[RECORD_MAX];
+		int stars, precision, len = 0, k = 0;
+		uint16_t slen;
+		arg_t kind;
+
+		if (*fmt != '%') {
+			line[n++] = *fmt++;
+			continue;
+		}
+
+		fmt = parse_spec(fmt + 1, &stars, &precision, &kind);
+
+		// rebuild conversion with '*' replaced by their values
+		for (const char *q = start; q < fmt && k < (int) sizeof(spec) - 16; q++) {
+			if (*q == '*') {
+				int v;
+				memcpy(&v, p, sizeof(int));
+				p += sizeof(int);
+				k += sprintf(spec + k, "%d", v);
+			} else spec[k++] = *q;
+		}
+		spec[k] = '\0';
+
+		switch (kind) {
+		case ARG_INT: { int v; memcpy(&v, p, sizeof(v)); len = snprintf(line + n, size - n, spec, v); break; }
+		case ARG_LONG: { long v; memcpy(&v, p, sizeof(v)); len = snprintf(line + n, size - n, spec, v); break; }
+		case ARG_LLONG: { long long v; memcpy(&v, p, sizeof(v)); len = snprintf(line + n, size - n, spec, v); break; }
+		case ARG_SIZE: { size_t v; memcpy(&v, p, sizeof(v)); len = snprintf(line + n, size - n, spec, v); break; }
+		case ARG_INTMAX: { intmax_t v; memcpy(&v, p, sizeof(v)); len = snprintf(line + n, size - n, spec, v); break; }
+		case ARG_PTRDIFF: { ptrdiff_t v; memcpy(&v, p, sizeof(v)); len = snprintf(line + n, size - n, spec, v); break; }
+		case ARG_DOUBLE: { double v; memcpy(&v, p, sizeof(v)); len = snprintf(line + n, size - n, spec, v); break; }
+		case ARG_LDOUBLE: { long double v; memcpy(&v, p, sizeof(v)); len = snprintf(line + n, size - n, spec, v); break; }
+		case ARG_PTR: { void *v; memcpy(&v, p, sizeof(v)); len = snprintf(line + n, size - n, spec, v); break; }
+		case ARG_STR:
+			memcpy(&slen, p, sizeof(slen));
+			memcpy(str, p + sizeof(slen), slen);
+			str[slen] = '\0';
+			p += sizeof(slen) + slen;
+			len = snprintf(line + n, size - n, spec, str);
+			break;
+		default:
+			// "%%" or something we don't know, which is printed as is
+			if (!strcmp(spec, "%%")) line[n++] = '%';
+			else len = snprintf(line + n, size - n, "%s", spec);
+			break;
+		}
+
+		p += arg_size(kind);
+		n += len > 0 ? len : 0;
+		if (n > size - 1) n = size - 1;
+	}
+
+	line[n] = '\0';
+}
+
+/*---------------------------------------------------------------------------*/
+static void write_record(const uint8_t *buf) {
+	const record_t *record = (const record_t*) buf;
+	char line[TEXT_MAX], stamp[16];
+	time_t secs = record->time / 1000;
+	struct tm *tm = localtime(&secs);
+
+	deserialize(buf, line, sizeof(line));
+	strftime(stamp, sizeof(stamp), "%H:%M:%S", tm);
+	logprint("[%s.%03d] %s:%d %s\n", stamp, (int) (record->time % 1000), record->func, record->line, line);
+}
+
+/*---------------------------------------------------------------------------*/
+// drains all rings, returns true if something was written
+static bool drain(void) {
+	uint64_t buf[RECORD_MAX / sizeof(uint64_t)];
+	bool written = false;
+
+	pthread_mutex_lock(&logger.mutex);
+
+	for (producer_t **pp = &logger.list; *pp;) {
+		producer_t *producer = *pp;
+		bool gone = ring_load(&producer->gone);
+		uint32_t dropped = ring_load(&producer->dropped);
+
+		while (ring_peek(&producer->ring)) {
+			ring_get(&producer->ring, buf);
+			write_record((uint8_t*) buf);
+			written = true;
+		}
+
+		if (dropped != producer->reported) {
+			logprint("%s logger dropped %u messages\n", logtime(), dropped - producer->reported);
+			producer->reported = dropped;
+		}
+
+		// nothing can be added once the thread is gone
+		if (gone) {
+			*pp = producer->next;
+			logger.dropped += dropped;
+			ring_free(&producer->ring);
+			free(producer);
+		} else pp = &producer->next;
+	}
+
+	pthread_mutex_unlock(&logger.mutex);
+
+	return written;
+}
+
+/*---------------------------------------------------------------------------*/
+static void *writer_thread(void *arg) {
+	while (ring_load(&logger.running)) {
+		uint32_t posted = ring_load(&logger.posted);
+		struct timespec ts;
+
+		if (drain()) continue;
+
+		// producers signal only when they see us sleeping, so check what they posted meanwhile
+		pthread_mutex_lock(&logger.wake_mutex);
+		ring_store(&logger.sleeping, 1);
+		log_fence();
+		if (ring_load(&logger.posted) == posted && ring_load(&logger.running)) {
+			timespec_get(&ts, TIME_UTC);
+			ts.tv_sec += IDLE_WAIT / 1000;
+			pthread_cond_timedwait(&logger.wake, &logger.wake_mutex, &ts);
+		}
+		ring_store(&logger.sleeping, 0);
+		pthread_mutex_unlock(&logger.wake_mutex);
+	}
+
+	// what producers have put before stop
+	drain();
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static void writer_wake(void) {
+	pthread_mutex_lock(&logger.wake_mutex);
+	pthread_cond_signal(&logger.wake);
+	pthread_mutex_unlock(&logger.wake_mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+static void producer_exit(void *arg) {
+	producer_t *producer = arg;
+	ring_store(&producer->gone, 1);
+}
+
+/*---------------------------------------------------------------------------*/
+static producer_t *producer_get(void) {
+	producer_t *producer = pthread_getspecific(logger.key);
+
+	if (producer) return producer;
+
+	// first message of that thread
+	if ((producer = calloc(1, sizeof(producer_t))) == NULL) return NULL;
+	if (!ring_init(&producer->ring, logger.size)) {
+		free(producer);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&logger.mutex);
+	producer->next = logger.list;
+	logger.list = producer;
+	pthread_mutex_unlock(&logger.mutex);
+
+	pthread_setspecific(logger.key, producer);
+	return producer;
+}
+
+/*---------------------------------------------------------------------------*/
+bool raoplog_start(size_t ring_size) {
+	if (ring_load(&logger.running)) return true;
+
+	// key is kept so that threads that still have a ring can re-use it
+	if (!logger.has_key && pthread_key_create(&logger.key, producer_exit)) return false;
+	logger.has_key = true;
+	logger.size = ring_size ? ring_size : 64 * 1024;
+
+	ring_store(&logger.running, 1);
+	if (pthread_create(&logger.thread, NULL, writer_thread, NULL)) {
+		ring_store(&logger.running, 0);
+		return false;
+	}
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+void raoplog_stop(void) {
+	if (!ring_load(&logger.running)) return;
+
+	// rings are kept as producers might be about to write in them
+	ring_store(&logger.running, 0);
+	writer_wake();
+	pthread_join(logger.thread, NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+uint32_t raoplog_dropped(void) {
+	uint32_t dropped;
+
+	pthread_mutex_lock(&logger.mutex);
+	dropped = logger.dropped;
+	for (producer_t *producer = logger.list; producer; producer = producer->next) dropped += ring_load(&producer->dropped);
+	pthread_mutex_unlock(&logger.mutex);
+
+	return dropped;
+}
+
+/*---------------------------------------------------------------------------*/
+static void print_sync(const char *func, int line, const char *fmt, va_list args) {
+	char text[TEXT_MAX], *buf = text;
+	va_list copy;
+	int len;
+
+	// long messages (RTSP dumps) are written whole
+	va_copy(copy, args);
+	len = vsnprintf(text, sizeof(text), fmt, copy);
+	va_end(copy);
+
+	if (len >= (int) sizeof(text) && (buf = malloc(len + 1)) != NULL) vsnprintf(buf, len + 1, fmt, args);
+	logprint("%s %s:%d %s\n", logtime(), func, line, buf ? buf : text);
+
+	if (buf && buf != text) free(buf);
+}
+
+/*---------------------------------------------------------------------------*/
+void raoplog_print(const char *func, int line, const char *fmt, ...) {
+	producer_t *producer;
+	va_list args;
+
+	va_start(args, fmt);
+
+	if (ring_load(&logger.running) && (producer = producer_get()) != NULL) {
+		uint64_t buf[RECORD_MAX / sizeof(uint64_t)];
+		record_t *record = (record_t*) buf;
+		struct timespec ts;
+		uint32_t len;
+		va_list copy;
+
+		timespec_get(&ts, TIME_UTC);
+		record->time = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+		record->func = func;
+		record->fmt = fmt;
+		record->line = line;
+
+		va_copy(copy, args);
+		len = serialize((uint8_t*) buf, fmt, copy);
+		va_end(copy);
+
+		if (!len) {
+			// too big for a record, better out of order than cut
+			print_sync(func, line, fmt, args);
+		} else if (!ring_put(&producer->ring, buf, len)) {
+			ring_store(&producer->dropped, producer->dropped + 1);
+		} else {
+			// writer is only woken-up when it sleeps, this is the common case
+			log_increment(&logger.posted);
+			if (ring_load(&logger.sleeping)) writer_wake();
+		}
+	} else {
+		print_sync(func, line, fmt, args);
+	}
+
+	va_end(args);
+}
@@ -0,0 +1,47 @@
+/*
+ * RAOP : asynchronous backend for cross_log macros
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(__GNUC__)
+#define RAOPLOG_FORMAT __attribute__((format(printf, 3, 4)))
+#else
+#define RAOPLOG_FORMAT
+#endif
+
+/*
+ Once started, log calls only copy format pointer and arguments (strings are
+ copied, truncated when too long) into a lock-free ring of calling thread and
+ a background thread formats and writes them through logprint(). A full ring
+ drops the message and counts it, it never blocks. Until started or after it
+ is stopped, messages are written synchronously as before. Time is taken when
+ message is logged and printed as [hh:mm:ss.mmm]
+*/
+bool		raoplog_start(size_t ring_size);
+void		raoplog_stop(void);
+uint32_t	raoplog_dropped(void);
+void		raoplog_print(const char *func, int line, const char *fmt, ...) RAOPLOG_FORMAT;
+
+// must come after cross_log.h, only in modules that have hot paths
+#ifndef RAOPLOG_SYNC
+#undef LOG_ERROR
+#undef LOG_WARN
+#undef LOG_INFO
+#undef LOG_DEBUG
+#undef LOG_SDEBUG
+#define LOG_ERROR(fmt, ...) if (*loglevel >= lERROR) raoplog_print(__FUNCTION__, __LINE__, fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...) if (*loglevel >= lWARN) raoplog_print(__FUNCTION__, __LINE__, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...) if (*loglevel >= lINFO) raoplog_print(__FUNCTION__, __LINE__, fmt, ##__VA_ARGS__)
+#define LOG_DEBUG(fmt, ...) if (*loglevel >= lDEBUG) raoplog_print(__FUNCTION__, __LINE__, fmt, ##__VA_ARGS__)
+#define LOG_SDEBUG(fmt, ...) if (*loglevel >= lSDEBUG) raoplog_print(__FUNCTION__, __LINE__, fmt, ##__VA_ARGS__)
+#endif
@@ -0,0 +1,542 @@
+/*
+ * RAOP : reactor shared by all servers and sessions for sockets and timers
+ *
+ * With one virtual device per renderer, a thread (or three) per server and
+ * session that mostly sleeps in select() is what costs, so a single thread
+ * waits for everything and a few workers run what is ready. Sockets are armed
+ * one-shot and re-armed when their callback returns and a worker never picks
+ * an event whose owner is already being run by another one. Events that can
+ * block have their own queue and threads, so that workers are always free.
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "platform.h"
+
+#if LINUX
+#include <sys/epoll.h>
+#elif WIN
+#define poll WSAPoll
+#endif
+
+#include "raop_reactor.h"
+
+#include "cross_net.h"
+#include "cross_log.h"
+#include "cross_util.h"
+
+#define MAX_EVENTS	64			// returned by one wait
+#define THREADS		(REACTOR_WORKERS + REACTOR_JOBS)
+
+extern log_level 	raop_loglevel;
+static log_level 	*loglevel = &raop_loglevel;
+
+typedef enum { EVENT_ARMED, EVENT_QUEUED, EVENT_RUNNING, EVENT_DEAD } event_state_t;
+enum { POOL_WORKERS, POOL_JOBS, POOLS };
+
+typedef struct reactor_event_s {
+	void *owner;
+	event_state_t state;
+	struct reactor_event_s *prev, *next;	// list of all events
+	struct reactor_event_s *queue;			// in ready queue or graveyard
+	reactor_io_cb_t io_cb;
+	int sock, events, ready;
+	int pool;
+	reactor_timer_cb_t timer_cb;
+	uint32_t due, delay;		// delay is set while callback runs
+	bool armed;
+} event_t;
+
+static struct {
+	pthread_mutex_t mutex, lifecycle;
+	pthread_cond_t cond[POOLS], idle;
+	pthread_t thread, workers[THREADS];	// job threads come after workers
+	bool running, started;
+	int users;
+	event_t *events;
+	event_t *first[POOLS], *last[POOLS];	// ready to run
+	event_t *graveyard;					// removed, freed when reactor can't see them anymore
+	void *busy[THREADS];				// owner being run by each thread
+	bool waiting, forever, woken;
+	uint32_t wait_until;
+	int wake;							// loopback socket to interrupt a wait
+	struct sockaddr_in wake_addr;
+#if LINUX
+	int epoll;
+#endif
+} reactor = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, { PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER }, PTHREAD_COND_INITIALIZER };
+
+static void*	reactor_thread(void *arg);
+static void*	worker_thread(void *arg);
+
+/*---------------------------------------------------------------------------*/
+// all functions below must be called with mutex locked
+static void wake_up(void) {
+	if (!reactor.waiting || reactor.woken) return;
+	reactor.woken = true;
+	sendto(reactor.wake, "", 1, 0, (struct sockaddr*) &reactor.wake_addr, sizeof(reactor.wake_addr));
+}
+
+/*---------------------------------------------------------------------------*/
+static void arm(event_t *event, bool add) {
+#if LINUX
+	struct epoll_event ev = { EPOLLONESHOT, { .ptr = event } };
+	if (event->events & REACTOR_READ) ev.events |= EPOLLIN;
+	if (event->events & REACTOR_WRITE) ev.events |= EPOLLOUT;
+	epoll_ctl(reactor.epoll, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, event->sock, &ev);
+#else
+	// list of sockets to poll is rebuilt at each wait
+	wake_up();
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+static void set_timer(event_t *event, uint32_t delay) {
+	event->armed = delay != REACTOR_NEVER;
+	if (!event->armed) return;
+
+	event->due = gettime_ms() + delay;
+	if (reactor.forever || (int32_t) (event->due - reactor.wait_until) < 0) wake_up();
+}
+
+/*---------------------------------------------------------------------------*/
+static void enqueue(event_t *event) {
+	int pool = event->pool;
+
+	event->state = EVENT_QUEUED;
+	event->queue = NULL;
+	if (reactor.last[pool]) reactor.last[pool]->queue = event;
+	else reactor.first[pool] = event;
+	reactor.last[pool] = event;
+	pthread_cond_signal(&reactor.cond[pool]);
+}
+
+/*---------------------------------------------------------------------------*/
+static void dequeue(event_t *event, event_t *prev) {
+	int pool = event->pool;
+
+	if (prev) prev->queue = event->queue;
+	else reactor.first[pool] = event->queue;
+	if (reactor.last[pool] == event) reactor.last[pool] = prev;
+}
+
+/*---------------------------------------------------------------------------*/
+// an owner can be run by a worker or a job thread, never both
+static bool is_busy(void *owner) {
+	for (int i = 0; owner && i < THREADS; i++) if (reactor.busy[i] == owner) return true;
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool is_worker(void) {
+	for (int i = 0; i < THREADS; i++) if (pthread_equal(reactor.workers[i], pthread_self())) return true;
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+static void bury(void) {
+	while (reactor.graveyard) {
+		event_t *event = reactor.graveyard;
+		reactor.graveyard = event->queue;
+		free(event);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called with lifecycle locked
+static bool reactor_start(void) {
+	struct in_addr lo = { htonl(INADDR_LOOPBACK) };
+	unsigned short port = 0;
+
+	reactor.wake = bind_socket(lo, &port, SOCK_DGRAM);
+	if (reactor.wake < 0) return false;
+
+#if WIN
+	u_long mode = 1;
+	ioctlsocket(reactor.wake, FIONBIO, &mode);
+#else
+	fcntl(reactor.wake, F_SETFL, fcntl(reactor.wake, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+	memset(&reactor.wake_addr, 0, sizeof(reactor.wake_addr));
+	reactor.wake_addr.sin_family = AF_INET;
+	reactor.wake_addr.sin_addr = lo;
+	reactor.wake_addr.sin_port = htons(port);
+
+#if LINUX
+	struct epoll_event ev = { EPOLLIN, { .ptr = NULL } };
+	reactor.epoll = epoll_create1(0);
+	epoll_ctl(reactor.epoll, EPOLL_CTL_ADD, reactor.wake, &ev);
+#endif
+
+	reactor.running = reactor.started = true;
+	pthread_create(&reactor.thread, NULL, reactor_thread, NULL);
+	for (int i = 0; i < THREADS; i++) pthread_create(reactor.workers + i, NULL, worker_thread, (void*) (intptr_t) i);
+
+	LOG_INFO("started reactor with %d workers and %d job threads", REACTOR_WORKERS, REACTOR_JOBS);
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called with lifecycle locked
+static void reactor_stop(void) {
+	pthread_mutex_lock(&reactor.mutex);
+	reactor.running = false;
+	wake_up();
+	for (int i = 0; i < POOLS; i++) pthread_cond_broadcast(&reactor.cond[i]);
+	pthread_mutex_unlock(&reactor.mutex);
+
+	pthread_join(reactor.thread, NULL);
+	for (int i = 0; i < THREADS; i++) pthread_join(reactor.workers[i], NULL);
+
+#if LINUX
+	close(reactor.epoll);
+#endif
+	closesocket(reactor.wake);
+	bury();
+
+	reactor.started = false;
+	LOG_INFO("stopped reactor", NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+static event_t *event_create(void *owner, int pool) {
+	event_t *event = calloc(1, sizeof(event_t));
+
+	if (!event) return NULL;
+
+	// first user starts the threads
+	pthread_mutex_lock(&reactor.lifecycle);
+	if (!reactor.started && !reactor_start()) {
+		LOG_ERROR("can't start reactor", NULL);
+		pthread_mutex_unlock(&reactor.lifecycle);
+		free(event);
+		return NULL;
+	}
+	reactor.users++;
+	pthread_mutex_unlock(&reactor.lifecycle);
+
+	event->owner = owner;
+	event->pool = pool;
+	event->state = EVENT_ARMED;
+
+	return event;
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called with mutex locked
+static void event_link(event_t *event) {
+	event->prev = NULL;
+	event->next = reactor.events;
+	if (reactor.events) reactor.events->prev = event;
+	reactor.events = event;
+}
+
+/*---------------------------------------------------------------------------*/
+struct reactor_event_s *reactor_io(int sock, int events, reactor_io_cb_t cb, void *owner) {
+	event_t *event = event_create(owner, (events & REACTOR_BLOCKING) ? POOL_JOBS : POOL_WORKERS);
+
+	if (!event) return NULL;
+
+	event->io_cb = cb;
+	event->sock = sock;
+	event->events = events & (REACTOR_READ | REACTOR_WRITE);
+
+	pthread_mutex_lock(&reactor.mutex);
+	event_link(event);
+	arm(event, true);
+	pthread_mutex_unlock(&reactor.mutex);
+
+	return event;
+}
+
+/*---------------------------------------------------------------------------*/
+static event_t *timer_event(uint32_t delay, reactor_timer_cb_t cb, void *owner, int pool) {
+	event_t *event = event_create(owner, pool);
+
+	if (!event) return NULL;
+
+	event->timer_cb = cb;
+
+	pthread_mutex_lock(&reactor.mutex);
+	event_link(event);
+	set_timer(event, delay);
+	pthread_mutex_unlock(&reactor.mutex);
+
+	return event;
+}
+
+/*---------------------------------------------------------------------------*/
+struct reactor_event_s *reactor_timer(uint32_t delay, reactor_timer_cb_t cb, void *owner) {
+	return timer_event(delay, cb, owner, POOL_WORKERS);
+}
+
+/*---------------------------------------------------------------------------*/
+struct reactor_event_s *reactor_job(reactor_timer_cb_t cb, void *owner) {
+	return timer_event(REACTOR_NEVER, cb, owner, POOL_JOBS);
+}
+
+/*---------------------------------------------------------------------------*/
+void reactor_io_events(struct reactor_event_s *event, int events) {
+	pthread_mutex_lock(&reactor.mutex);
+	event->events = events & (REACTOR_READ | REACTOR_WRITE);
+	// otherwise, it will be done when callback returns
+	if (event->state == EVENT_ARMED) arm(event, false);
+	pthread_mutex_unlock(&reactor.mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+void reactor_timer_delay(struct reactor_event_s *event, uint32_t delay) {
+	pthread_mutex_lock(&reactor.mutex);
+	// a queued timer is about to run anyway
+	if (event->state == EVENT_RUNNING) event->delay = min(event->delay, delay);
+	else if (event->state == EVENT_ARMED) set_timer(event, delay);
+	pthread_mutex_unlock(&reactor.mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called with mutex locked, returns with no callback of owner running but ours
+static void wait_owner(void *owner) {
+	bool busy;
+
+	do {
+		busy = false;
+		for (int i = 0; i < THREADS; i++) {
+			if (reactor.busy[i] == owner && !pthread_equal(reactor.workers[i], pthread_self())) busy = true;
+		}
+		if (busy) pthread_cond_wait(&reactor.idle, &reactor.mutex);
+	} while (busy);
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called with mutex locked
+static void detach(event_t *event) {
+	if (event->state == EVENT_QUEUED) {
+		event_t *prev = NULL;
+		for (event_t *p = reactor.first[event->pool]; p != event; p = p->queue) prev = p;
+		dequeue(event, prev);
+	}
+
+#if LINUX
+	if (event->io_cb) epoll_ctl(reactor.epoll, EPOLL_CTL_DEL, event->sock, NULL);
+#endif
+
+	if (event->prev) event->prev->next = event->next;
+	else reactor.events = event->next;
+	if (event->next) event->next->prev = event->prev;
+
+	// when running, worker will bury it when callback returns
+	if (event->state != EVENT_RUNNING) {
+		event->queue = reactor.graveyard;
+		reactor.graveyard = event;
+	}
+
+	event->state = EVENT_DEAD;
+}
+
+/*---------------------------------------------------------------------------*/
+static void release(int count) {
+	// last user stops the threads, but a worker can't wait for itself
+	pthread_mutex_lock(&reactor.lifecycle);
+	reactor.users -= count;
+	if (!reactor.users && reactor.started && !is_worker()) reactor_stop();
+	pthread_mutex_unlock(&reactor.lifecycle);
+}
+
+/*---------------------------------------------------------------------------*/
+void reactor_remove(struct reactor_event_s *event) {
+	if (!event) return;
+
+	pthread_mutex_lock(&reactor.mutex);
+	wait_owner(event->owner);
+	detach(event);
+	pthread_mutex_unlock(&reactor.mutex);
+
+	release(1);
+}
+
+/*---------------------------------------------------------------------------*/
+void reactor_remove_all(void *owner) {
+	int count = 0;
+
+	pthread_mutex_lock(&reactor.mutex);
+	wait_owner(owner);
+
+	for (event_t *event = reactor.events, *next; event; event = next) {
+		next = event->next;
+		if (event->owner != owner) continue;
+		detach(event);
+		count++;
+	}
+
+	pthread_mutex_unlock(&reactor.mutex);
+
+	if (count) release(count);
+}
+
+/*---------------------------------------------------------------------------*/
+static void dispatch(event_t *event, bool in, bool out, bool error) {
+	// removed since wait started or modified to wait for nothing
+	if (event->state != EVENT_ARMED || !event->events) return;
+
+	event->ready = (in ? REACTOR_READ : 0) | (out ? REACTOR_WRITE : 0);
+	// let the callback find out what the error is
+	if (error) event->ready = event->events;
+	event->ready &= event->events;
+
+	if (event->ready) enqueue(event);
+	else arm(event, false);
+}
+
+/*---------------------------------------------------------------------------*/
+static void *reactor_thread(void *arg) {
+#if LINUX
+	struct epoll_event ready[MAX_EVENTS];
+#else
+	struct pollfd *fds = NULL;
+	event_t **polled = NULL;
+	int size = 0, count = 0;
+#endif
+	int n = 0;
+
+	pthread_mutex_lock(&reactor.mutex);
+
+	while (reactor.running) {
+		// sockets found ready by last wait
+#if LINUX
+		for (int i = 0; i < n; i++) {
+			uint32_t flags = ready[i].events;
+			if (ready[i].data.ptr) dispatch(ready[i].data.ptr, flags & EPOLLIN, flags & EPOLLOUT, flags & (EPOLLERR | EPOLLHUP));
+		}
+#else
+		for (int i = 1; n > 0 && i < count; i++) {
+			short flags = fds[i].revents;
+			if (flags) dispatch(polled[i], flags & POLLIN, flags & POLLOUT, flags & (POLLERR | POLLHUP | POLLNVAL));
+		}
+#endif
+
+		// nothing refers to removed events anymore
+		bury();
+
+		// run timers that are due and find out how long we can wait
+		uint32_t now = gettime_ms();
+		int timeout = -1;
+
+		for (event_t *event = reactor.events; event; event = event->next) {
+			if (!event->timer_cb || event->state != EVENT_ARMED || !event->armed) continue;
+			int32_t wait = event->due - now;
+			if (wait <= 0) enqueue(event);
+			else if (timeout < 0 || wait < timeout) timeout = wait;
+		}
+
+#if !LINUX
+		count = 1;
+		for (event_t *event = reactor.events; event; event = event->next) {
+			if (!event->io_cb || event->state != EVENT_ARMED || !event->events) continue;
+			if (count >= size) {
+				size = size ? size * 2 : 32;
+				fds = realloc(fds, size * sizeof(struct pollfd));
+				polled = realloc(polled, size * sizeof(event_t*));
+			}
+			fds[count].fd = event->sock;
+			fds[count].events = ((event->events & REACTOR_READ) ? POLLIN : 0) | ((event->events & REACTOR_WRITE) ? POLLOUT : 0);
+			fds[count].revents = 0;
+			polled[count++] = event;
+		}
+		if (!fds) fds = malloc((size = 1) * sizeof(struct pollfd));
+		fds[0].fd = reactor.wake;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+#endif
+
+		reactor.waiting = true;
+		reactor.forever = timeout < 0;
+		reactor.wait_until = now + timeout;
+
+		pthread_mutex_unlock(&reactor.mutex);
+#if LINUX
+		n = epoll_wait(reactor.epoll, ready, MAX_EVENTS, timeout);
+#else
+		n = poll(fds, count, timeout);
+#endif
+		pthread_mutex_lock(&reactor.mutex);
+
+		reactor.waiting = false;
+
+		if (reactor.woken) {
+			char buf[16];
+			while (recv(reactor.wake, buf, sizeof(buf), 0) > 0);
+			reactor.woken = false;
+		}
+	}
+
+	pthread_mutex_unlock(&reactor.mutex);
+
+#if !LINUX
+	free(fds);
+	free(polled);
+#endif
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static void *worker_thread(void *arg) {
+	int id = (intptr_t) arg;
+	int pool = id < REACTOR_WORKERS ? POOL_WORKERS : POOL_JOBS;
+
+	pthread_mutex_lock(&reactor.mutex);
+
+	while (reactor.running) {
+		event_t *event, *prev = NULL;
+
+		// first ready event whose owner is not already being served
+		for (event = reactor.first[pool]; event && is_busy(event->owner); event = event->queue) prev = event;
+
+		if (!event) {
+			pthread_cond_wait(&reactor.cond[pool], &reactor.mutex);
+			continue;
+		}
+
+		dequeue(event, prev);
+		event->state = EVENT_RUNNING;
+		event->delay = REACTOR_NEVER;
+		reactor.busy[id] = event->owner;
+
+		pthread_mutex_unlock(&reactor.mutex);
+
+		uint32_t delay = REACTOR_NEVER;
+		if (event->timer_cb) delay = event->timer_cb(event->owner);
+		else event->io_cb(event->owner, event->sock, event->ready);
+
+		pthread_mutex_lock(&reactor.mutex);
+
+		reactor.busy[id] = NULL;
+
+		if (event->state == EVENT_DEAD) {
+			event->queue = reactor.graveyard;
+			reactor.graveyard = event;
+		} else {
+			event->state = EVENT_ARMED;
+			if (event->io_cb) arm(event, false);
+			else set_timer(event, min(delay, event->delay));
+		}
+
+		// wake-up whoever waits for this event and threads held by this owner
+		pthread_cond_broadcast(&reactor.idle);
+		for (int i = 0; i < POOLS; i++) if (reactor.first[i]) pthread_cond_broadcast(&reactor.cond[i]);
+	}
+
+	pthread_mutex_unlock(&reactor.mutex);
+
+	return NULL;
+}
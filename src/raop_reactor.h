@@ -0,0 +1,53 @@
+/*
+ * RAOP : reactor shared by all servers and sessions for sockets and timers
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// number of threads shared by all servers and sessions to run callbacks
+#ifndef REACTOR_WORKERS
+#define REACTOR_WORKERS 4
+#endif
+
+// threads for callbacks that can block (owner's callbacks, RSA...), apart from workers
+#ifndef REACTOR_JOBS
+#define REACTOR_JOBS 2
+#endif
+
+#define REACTOR_READ		0x01
+#define REACTOR_WRITE		0x02
+#define REACTOR_BLOCKING	0x04		// set at creation, callback runs on job threads
+#define REACTOR_NEVER		UINT32_MAX	// timer is idle until its delay is set again
+
+typedef void		(*reactor_io_cb_t)(void *owner, int sock, int events);
+typedef uint32_t	(*reactor_timer_cb_t)(void *owner);	// returns delay (ms) before next call
+
+/*
+ One thread waits for all sockets and timers (epoll on Linux, poll elsewhere)
+ and hands what is ready to a pool of workers. Callbacks of the same owner never
+ run concurrently and a socket is not watched while its callback runs, so an
+ owner needs no locking between its own callbacks. Removing an event waits for
+ callbacks of its owner to return, unless called from one of them. A socket must
+ be removed before being closed. Threads are started with the first event and
+ stopped when the last one is removed. Callbacks that might block must not run
+ on workers, or all sessions wait: they are given to job threads and are still
+ serialized with other callbacks of their owner
+*/
+struct reactor_event_s*	reactor_io(int sock, int events, reactor_io_cb_t cb, void *owner);
+struct reactor_event_s*	reactor_timer(uint32_t delay, reactor_timer_cb_t cb, void *owner);
+// a timer run by job threads, idle until its delay is set
+struct reactor_event_s*	reactor_job(reactor_timer_cb_t cb, void *owner);
+void					reactor_io_events(struct reactor_event_s *event, int events);
+// when timer callback is running, earliest of this and what it returns is used
+void					reactor_timer_delay(struct reactor_event_s *event, uint32_t delay);
+void					reactor_remove(struct reactor_event_s *event);
+// all events of owner at once, so that none of its callbacks can sneak in between
+void					reactor_remove_all(void *owner);
@@ -0,0 +1,255 @@
+/*
+ * RAOP : resend scheduler, tracks missing frames and paces resend requests
+ *
+ * Missing frames are flagged in a bitmap when a gap is detected and cleared
+ * when they arrive, so nothing has to walk the jitter buffer. Each missing
+ * frame sits in a slot of a timer wheel until its next request is due, then
+ * it is asked again with an exponential backoff as long as an answer can
+ * still arrive before the frame must be played. Frames that become due
+ * together are mostly consecutive and are requested as ranges
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "raop_resend.h"
+
+#define WHEEL_TICK		8				// ms, must be a power of 2
+#define WHEEL_SLOTS		64				// must be a power of 2
+#define BACKOFF_MIN		40				// first retry interval, ms
+#define MAX_ATTEMPTS	5
+#define NONE			-1
+
+typedef struct {
+	uint16_t seqno;
+	uint8_t attempts, slot;
+	uint32_t due, deadline;
+	uint32_t missed;			// when it was found missing
+	int16_t prev, next;			// in wheel slot
+} entry_t;
+
+typedef struct resend_s {
+	int frames;
+	uint64_t *missing;			// bitmap, indexed like the jitter buffer
+	entry_t *entries;
+	int count;
+	struct {
+		int16_t head, tail;
+	} slots[WHEEL_SLOTS];
+	uint32_t tick;				// time of next slot to process
+	bool started;
+	resend_stats_t stats;
+} resend_t;
+
+#define IDX(rs, seqno) ((seqno) & ((rs)->frames - 1))
+#define SLOT(time) (((time) / WHEEL_TICK) & (WHEEL_SLOTS - 1))
+
+/*---------------------------------------------------------------------------*/
+static bool is_missing(resend_t *rs, int i) {
+	return (rs->missing[i >> 6] >> (i & 63)) & 1;
+}
+
+/*---------------------------------------------------------------------------*/
+static void set_missing(resend_t *rs, int i, bool missing) {
+	if (missing) rs->missing[i >> 6] |= 1ULL << (i & 63);
+	else rs->missing[i >> 6] &= ~(1ULL << (i & 63));
+}
+
+/*---------------------------------------------------------------------------*/
+static void unlink_entry(resend_t *rs, int i) {
+	entry_t *entry = rs->entries + i;
+	int slot = entry->slot;
+
+	if (entry->prev != NONE) rs->entries[entry->prev].next = entry->next;
+	else rs->slots[slot].head = entry->next;
+	if (entry->next != NONE) rs->entries[entry->next].prev = entry->prev;
+	else rs->slots[slot].tail = entry->prev;
+}
+
+/*---------------------------------------------------------------------------*/
+static void link_entry(resend_t *rs, int i, uint32_t due, uint32_t first) {
+	entry_t *entry = rs->entries + i;
+	uint32_t when = due;
+
+	// can't be before first slot still to visit and can't be beyond wheel, will be re-linked
+	if ((int32_t) (when - first) < 0) when = first;
+	else if (when - first >= WHEEL_SLOTS * WHEEL_TICK) when = first + (WHEEL_SLOTS - 1) * WHEEL_TICK;
+
+	// remember real due time and where we are
+	int slot = SLOT(when);
+	entry->due = due;
+	entry->slot = slot;
+
+	// append so that frames marked together stay in sequence order
+	entry->next = NONE;
+	entry->prev = rs->slots[slot].tail;
+	if (entry->prev != NONE) rs->entries[entry->prev].next = i;
+	else rs->slots[slot].head = i;
+	rs->slots[slot].tail = i;
+}
+
+/*---------------------------------------------------------------------------*/
+static void forget(resend_t *rs, int i) {
+	unlink_entry(rs, i);
+	set_missing(rs, i, false);
+	rs->count--;
+}
+
+/*---------------------------------------------------------------------------*/
+struct resend_s *resend_create(int frames) {
+	resend_t *rs = calloc(1, sizeof(resend_t));
+
+	if (!rs) return NULL;
+
+	rs->frames = frames;
+	rs->missing = calloc((frames + 63) / 64, sizeof(uint64_t));
+	rs->entries = calloc(frames, sizeof(entry_t));
+
+	if (!rs->missing || !rs->entries) {
+		resend_delete(rs);
+		return NULL;
+	}
+
+	resend_reset(rs);
+	return rs;
+}
+
+/*---------------------------------------------------------------------------*/
+void resend_delete(struct resend_s *rs) {
+	if (!rs) return;
+	free(rs->missing);
+	free(rs->entries);
+	free(rs);
+}
+
+/*---------------------------------------------------------------------------*/
+void resend_reset(struct resend_s *rs) {
+	memset(rs->missing, 0, ((rs->frames + 63) / 64) * sizeof(uint64_t));
+	for (int i = 0; i < WHEEL_SLOTS; i++) rs->slots[i].head = rs->slots[i].tail = NONE;
+	rs->count = 0;
+	rs->started = false;
+}
+
+/*---------------------------------------------------------------------------*/
+void resend_missing(struct resend_s *rs, uint16_t seqno, uint32_t deadline, uint32_t now) {
+	int i = IDX(rs, seqno);
+
+	if (!rs->started) {
+		rs->tick = now & ~(WHEEL_TICK - 1);
+		rs->started = true;
+	}
+
+	// an older frame at the same place was never received nor cancelled
+	if (is_missing(rs, i)) {
+		if (rs->entries[i].seqno == seqno) return;
+		rs->stats.abandoned++;
+		forget(rs, i);
+	}
+
+	set_missing(rs, i, true);
+	rs->count++;
+	rs->stats.missing++;
+
+	rs->entries[i].seqno = seqno;
+	rs->entries[i].attempts = 0;
+	rs->entries[i].deadline = deadline;
+	rs->entries[i].missed = now;
+	link_entry(rs, i, now, rs->tick);
+}
+
+/*---------------------------------------------------------------------------*/
+bool resend_received(struct resend_s *rs, uint16_t seqno, uint32_t now, uint32_t *waited) {
+	int i = IDX(rs, seqno);
+
+	if (waited) *waited = 0;
+	if (!is_missing(rs, i) || rs->entries[i].seqno != seqno) return false;
+
+	if (rs->entries[i].attempts) {
+		rs->stats.recovered++;
+		if (waited) *waited = now - rs->entries[i].missed;
+	}
+	forget(rs, i);
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+void resend_cancel(struct resend_s *rs, uint16_t seqno) {
+	int i = IDX(rs, seqno);
+
+	if (!is_missing(rs, i) || rs->entries[i].seqno != seqno) return;
+
+	rs->stats.abandoned++;
+	forget(rs, i);
+}
+
+/*---------------------------------------------------------------------------*/
+void resend_poll(struct resend_s *rs, uint32_t now, uint32_t rtt, uint16_t floor, resend_cb_t send, void *owner) {
+	if (!rs->started || !rs->count) return;
+
+	// after a long pause, visiting each slot once is enough
+	if ((int32_t) (now - rs->tick) >= WHEEL_SLOTS * WHEEL_TICK) {
+		rs->tick = (now & ~(WHEEL_TICK - 1)) - (WHEEL_SLOTS - 1) * WHEEL_TICK;
+	}
+
+	uint32_t interval = rtt * 2 > BACKOFF_MIN ? rtt * 2 : BACKOFF_MIN;
+
+	for (; (int32_t) (now - rs->tick) >= 0; rs->tick += WHEEL_TICK) {
+		int slot = SLOT(rs->tick);
+		int i = rs->slots[slot].head;
+		int first = NONE, last = NONE;
+		uint32_t next_tick = rs->tick + WHEEL_TICK;
+
+		// detach the whole slot, entries are re-linked from next one
+		rs->slots[slot].head = rs->slots[slot].tail = NONE;
+
+		while (i != NONE) {
+			entry_t *entry = rs->entries + i;
+			int next = entry->next;
+
+			entry->prev = NONE;
+
+			if ((int32_t) (entry->due - now) > 0) {
+				// not due yet (was beyond wheel horizon or is later in this slot)
+				link_entry(rs, i, entry->due, next_tick);
+			} else if ((int16_t) (entry->seqno - floor) < 0 || entry->attempts >= MAX_ATTEMPTS ||
+					   (int32_t) (now + rtt - entry->deadline) > 0) {
+				// already played, too many attempts or answer would be too late
+				rs->stats.abandoned++;
+				set_missing(rs, i, false);
+				rs->count--;
+			} else {
+				// extend current range or send it and start a new one
+				if (last != NONE && (uint16_t) (rs->entries[last].seqno + 1) != entry->seqno) {
+					if (send(owner, rs->entries[first].seqno, rs->entries[last].seqno)) rs->stats.requests++;
+					first = NONE;
+				}
+				if (first == NONE) first = i;
+				last = i;
+
+				rs->stats.requested++;
+				if (entry->attempts++ == 1) rs->stats.retried++;
+				link_entry(rs, i, now + (interval << (entry->attempts - 1)), next_tick);
+			}
+
+			i = next;
+		}
+
+		if (first != NONE && send(owner, rs->entries[first].seqno, rs->entries[last].seqno)) rs->stats.requests++;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+int resend_pending(struct resend_s *rs) {
+	return rs->count;
+}
+
+/*---------------------------------------------------------------------------*/
+resend_stats_t resend_stats(struct resend_s *rs) {
+	return rs->stats;
+}
@@ -0,0 +1,46 @@
+/*
+ * RAOP : resend scheduler, tracks missing frames and paces resend requests
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct resend_stats_s {
+	uint32_t missing;		// frames detected missing
+	uint32_t requested;		// frames asked for (retries included)
+	uint32_t retried;		// frames asked for more than once
+	uint32_t requests;		// resend requests sent (one per range)
+	uint32_t recovered;		// missing frames that arrived in time
+	uint32_t abandoned;		// missing frames given up (deadline, attempts or skipped)
+} resend_stats_t;
+
+// called with a range of consecutive missing frames, returns false if not sent
+typedef bool (*resend_cb_t)(void *owner, uint16_t first, uint16_t last);
+
+/*
+ Not thread-safe, caller must serialize (streamer uses its buffer mutex).
+ All times are in ms, deadline is the latest time a frame can arrive and still
+ be played. Frames count must be a power of 2 (same as the jitter buffer)
+*/
+struct resend_s*	resend_create(int frames);
+void				resend_delete(struct resend_s *rs);
+// forget all missing frames (statistics are kept)
+void				resend_reset(struct resend_s *rs);
+// first request is due immediately, then with an exponential backoff
+void				resend_missing(struct resend_s *rs, uint16_t seqno, uint32_t deadline, uint32_t now);
+// returns true if frame was missing, waited is how long it took when it was asked for (0 otherwise)
+bool				resend_received(struct resend_s *rs, uint16_t seqno, uint32_t now, uint32_t *waited);
+// frame is not wanted anymore (played as silence)
+void				resend_cancel(struct resend_s *rs, uint16_t seqno);
+// send requests that are due, frames before floor are not wanted anymore
+void				resend_poll(struct resend_s *rs, uint32_t now, uint32_t rtt, uint16_t floor, resend_cb_t send, void *owner);
+// number of frames currently missing
+int					resend_pending(struct resend_s *rs);
+resend_stats_t		resend_stats(struct resend_s *rs);
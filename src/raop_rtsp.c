@@ -0,0 +1,341 @@
+/*
+ * RAOP : incremental RTSP request parser and response builder
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+#include "platform.h"
+#include "raop_rtsp.h"
+
+#define BUFFER_MIN	4096
+
+#if WIN
+#define SOCKET_WOULDBLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+#define SOCKET_WOULDBLOCK() (errno == EAGAIN || errno == EWOULDBLOCK)
+#endif
+
+static const char *methods[] = { "OPTIONS", "ANNOUNCE", "SETUP", "RECORD", "PAUSE", "FLUSH",
+								 "TEARDOWN", "GET_PARAMETER", "SET_PARAMETER" };
+
+static const char *headers[] = { "CSeq", "Content-Length", "Content-Type", "Transport", "RTP-Info",
+								 "Apple-Challenge", "DACP-ID", "Active-Remote" };
+
+/*---------------------------------------------------------------------------*/
+static bool same(const char *a, const char *b, size_t len) {
+	for (size_t i = 0; i < len; i++) if (tolower((unsigned char) a[i]) != tolower((unsigned char) b[i])) return false;
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+static rtsp_view_t trim(const char *p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t')) p++;
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+	return (rtsp_view_t) { p, end - p };
+}
+
+/*---------------------------------------------------------------------------*/
+static const char *find(rtsp_view_t view, const char *str) {
+	size_t len = strlen(str);
+	for (size_t i = 0; i + len <= view.len; i++) if (same(view.data + i, str, len)) return view.data + i;
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static void rebase(rtsp_request_t *request, uintptr_t offset) {
+	request->name.data = (const char*) ((uintptr_t) request->name.data + offset);
+	for (int i = 0; i < RTSP_HEADERS; i++) {
+		if (request->headers[i].data) request->headers[i].data = (const char*) ((uintptr_t) request->headers[i].data + offset);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+void rtsp_conn_reset(rtsp_conn_t *conn) {
+	conn->len = conn->scanned = conn->head = 0;
+	conn->output.len = conn->output.pos = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+void rtsp_conn_free(rtsp_conn_t *conn) {
+	free(conn->buffer);
+	free(conn->output.data);
+	memset(conn, 0, sizeof(rtsp_conn_t));
+}
+
+/*---------------------------------------------------------------------------*/
+int rtsp_receive(rtsp_conn_t *conn, int sock) {
+	size_t need = conn->len + BUFFER_MIN / 4;
+
+	// once head is known, make room for the whole body at once
+	if (conn->head && conn->head + conn->request.body.len > need) need = conn->head + conn->request.body.len;
+	if (need < BUFFER_MIN) need = BUFFER_MIN;
+
+	if (need > conn->size) {
+		// views of an already parsed head must follow, so they are offsets meanwhile
+		if (conn->head) rebase(&conn->request, -(uintptr_t) conn->buffer);
+		char *buffer = realloc(conn->buffer, need);
+		if (buffer) {
+			conn->buffer = buffer;
+			conn->size = need;
+		}
+		if (conn->head) rebase(&conn->request, (uintptr_t) conn->buffer);
+		if (!buffer) return -1;
+	}
+
+	int n = recv(sock, conn->buffer + conn->len, conn->size - conn->len, 0);
+	if (n > 0) conn->len += n;
+	else if (n < 0 && SOCKET_WOULDBLOCK()) n = 0;
+	else n = -1;
+	return n;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool parse_head(rtsp_conn_t *conn) {
+	rtsp_request_t *request = &conn->request;
+	const char *p = conn->buffer, *end = conn->buffer + conn->head - 2;
+	const char *eol = memchr(p, '\n', end - p);
+
+	memset(request, 0, sizeof(rtsp_request_t));
+
+	// request line is "METHOD uri RTSP/1.0"
+	const char *space = memchr(p, ' ', eol - p);
+	if (!space) return false;
+
+	request->name = (rtsp_view_t) { p, space - p };
+	request->method = RTSP_UNKNOWN;
+	for (int i = 0; i < RTSP_UNKNOWN; i++) {
+		if (strlen(methods[i]) == request->name.len && !memcmp(methods[i], p, request->name.len)) {
+			request->method = i;
+			break;
+		}
+	}
+
+	// then "Name: value" lines, indexed in one pass
+	for (p = eol + 1; p < end; p = eol + 1) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL) eol = end;
+		const char *colon = memchr(p, ':', eol - p);
+		if (!colon) continue;
+
+		rtsp_view_t name = trim(p, colon);
+		for (int i = 0; i < RTSP_HEADERS; i++) {
+			if (strlen(headers[i]) == name.len && same(headers[i], name.data, name.len)) {
+				request->headers[i] = trim(colon + 1, eol);
+				break;
+			}
+		}
+	}
+
+	size_t length = rtsp_uint(request->headers[RTSP_CONTENT_LENGTH]);
+	if (length > RTSP_BODY_MAX) return false;
+
+	request->body = (rtsp_view_t) { conn->buffer + conn->head, length };
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+bool rtsp_next(rtsp_conn_t *conn, rtsp_request_t **request) {
+	*request = NULL;
+
+	if (!conn->head) {
+		// only scan what has not been scanned, with overlap for a split terminator
+		size_t i = conn->scanned > 3 ? conn->scanned - 3 : 0;
+		for (; i + 4 <= conn->len; i++) {
+			if (conn->buffer[i] == '\r' && !memcmp(conn->buffer + i, "\r\n\r\n", 4)) break;
+		}
+
+		if (i + 4 > conn->len) {
+			conn->scanned = conn->len;
+			return conn->len < RTSP_HEAD_MAX;
+		}
+
+		conn->head = i + 4;
+		if (!parse_head(conn)) return false;
+	}
+
+	if (conn->len < conn->head + conn->request.body.len) return true;
+
+	// buffer might have moved since head was parsed
+	conn->request.body.data = conn->request.body.len ? conn->buffer + conn->head : NULL;
+
+	*request = &conn->request;
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+void rtsp_consume(rtsp_conn_t *conn) {
+	size_t used = conn->head + conn->request.body.len;
+
+	// move what belongs to next request(s) at the beginning
+	if (used < conn->len) memmove(conn->buffer, conn->buffer + used, conn->len - used);
+	conn->len -= used;
+	conn->scanned = conn->head = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+bool rtsp_view_is(rtsp_view_t view, const char *str) {
+	return view.len == strlen(str) && same(view.data, str, view.len);
+}
+
+/*---------------------------------------------------------------------------*/
+bool rtsp_view_has(rtsp_view_t view, const char *str) {
+	return find(view, str) != NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+bool rtsp_param(rtsp_view_t view, const char *name, rtsp_view_t *value) {
+	const char *p = view.data, *end = view.data + view.len;
+	size_t len = strlen(name);
+
+	while (p < end) {
+		const char *next = p;
+		while (next < end && *next != ';' && *next != ',') next++;
+
+		rtsp_view_t item = trim(p, next);
+		if (item.len > len && item.data[len] == '=' && same(item.data, name, len)) {
+			*value = trim(item.data + len + 1, item.data + item.len);
+			return true;
+		}
+
+		p = next + 1;
+	}
+
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+bool rtsp_field(rtsp_view_t view, const char *name, rtsp_view_t *value) {
+	const char *p = view.data, *end = view.data + view.len;
+	size_t len = strlen(name);
+
+	// name must be the whole beginning of a line, so that it is not found inside another one
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		if (!eol) eol = end;
+
+		if ((size_t) (eol - p) > len && p[len] == ':' && same(p, name, len)) {
+			*value = trim(p + len + 1, eol);
+			return true;
+		}
+
+		p = eol + 1;
+	}
+
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+uint32_t rtsp_uint(rtsp_view_t view) {
+	uint32_t value = 0;
+	for (size_t i = 0; i < view.len && isdigit((unsigned char) view.data[i]); i++) value = value * 10 + view.data[i] - '0';
+	return value;
+}
+
+/*---------------------------------------------------------------------------*/
+double rtsp_double(rtsp_view_t view) {
+	char number[32];
+	rtsp_copy(view, number, sizeof(number));
+	return strtod(number, NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+size_t rtsp_copy(rtsp_view_t view, char *dst, size_t size) {
+	size_t len = view.len < size ? view.len : size - 1;
+	if (len) memcpy(dst, view.data, len);
+	dst[len] = '\0';
+	return len;
+}
+
+/*---------------------------------------------------------------------------*/
+size_t rtsp_base64(rtsp_view_t view, void *dst, size_t size) {
+	uint8_t *out = dst;
+	uint32_t bits = 0;
+	size_t len = 0;
+	int count = 0;
+
+	for (size_t i = 0; i < view.len && len < size; i++) {
+		char c = view.data[i];
+		int v;
+
+		if (c >= 'A' && c <= 'Z') v = c - 'A';
+		else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+		else if (c >= '0' && c <= '9') v = c - '0' + 52;
+		else if (c == '+') v = 62;
+		else if (c == '/') v = 63;
+		else break;
+
+		bits = (bits << 6) | v;
+		if ((count += 6) >= 8) {
+			count -= 8;
+			out[len++] = bits >> count;
+		}
+	}
+
+	return len;
+}
+
+/*---------------------------------------------------------------------------*/
+void rtsp_response_init(rtsp_response_t *resp, const char *status) {
+	resp->len = snprintf(resp->data, sizeof(resp->data), "%s\r\n", status);
+}
+
+/*---------------------------------------------------------------------------*/
+void rtsp_response_add(rtsp_response_t *resp, const char *name, const char *fmt, ...) {
+	size_t avail = sizeof(resp->data) - resp->len;
+	va_list args;
+	int len;
+
+	len = snprintf(resp->data + resp->len, avail, "%s: ", name);
+	va_start(args, fmt);
+	if (len > 0 && (size_t) len < avail) len += vsnprintf(resp->data + resp->len + len, avail - len, fmt, args);
+	va_end(args);
+
+	// a header that does not fit is dropped whole, keeping 2 bytes for final CRLF
+	if (len < 0 || (size_t) len + 2 + 2 >= avail) {
+		resp->data[resp->len] = '\0';
+		return;
+	}
+
+	resp->len += len;
+	resp->len += sprintf(resp->data + resp->len, "\r\n");
+}
+
+/*---------------------------------------------------------------------------*/
+int rtsp_flush(rtsp_conn_t *conn, int sock) {
+	while (conn->output.pos < conn->output.len) {
+		int n = send(sock, conn->output.data + conn->output.pos, conn->output.len - conn->output.pos, 0);
+		if (n < 0) return SOCKET_WOULDBLOCK() ? (int) (conn->output.len - conn->output.pos) : -1;
+		conn->output.pos += n;
+	}
+
+	conn->output.len = conn->output.pos = 0;
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+bool rtsp_response_send(rtsp_response_t *resp, rtsp_conn_t *conn, int sock) {
+	resp->len += sprintf(resp->data + resp->len, "\r\n");
+
+	// a peer that does not read its responses is not worth more memory
+	if (conn->output.len + resp->len > RTSP_OUTPUT_MAX) return false;
+
+	if (conn->output.len + resp->len > conn->output.size) {
+		char *data = realloc(conn->output.data, conn->output.len + resp->len);
+		if (!data) return false;
+		conn->output.data = data;
+		conn->output.size = conn->output.len + resp->len;
+	}
+
+	memcpy(conn->output.data + conn->output.len, resp->data, resp->len);
+	conn->output.len += resp->len;
+
+	return rtsp_flush(conn, sock) >= 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * RAOP : incremental RTSP request parser and response builder
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define RTSP_HEAD_MAX		(16*1024)
+#define RTSP_BODY_MAX		(8*1024*1024)
+#define RTSP_RESPONSE_SIZE	2048
+#define RTSP_OUTPUT_MAX		(64*1024)	// responses not taken by socket yet
+
+// points into the receive buffer, not null-terminated and valid until request is consumed
+typedef struct {
+	const char *data;
+	size_t len;
+} rtsp_view_t;
+
+typedef enum { RTSP_OPTIONS, RTSP_ANNOUNCE, RTSP_SETUP, RTSP_RECORD, RTSP_PAUSE, RTSP_FLUSH,
+			   RTSP_TEARDOWN, RTSP_GET_PARAMETER, RTSP_SET_PARAMETER, RTSP_UNKNOWN } rtsp_method_t;
+
+// only headers we care about are indexed, others are skipped
+typedef enum { RTSP_CSEQ, RTSP_CONTENT_LENGTH, RTSP_CONTENT_TYPE, RTSP_TRANSPORT, RTSP_RTP_INFO,
+			   RTSP_APPLE_CHALLENGE, RTSP_DACP_ID, RTSP_ACTIVE_REMOTE, RTSP_HEADERS } rtsp_header_t;
+
+typedef struct {
+	rtsp_method_t method;
+	rtsp_view_t name;					// method as received
+	rtsp_view_t headers[RTSP_HEADERS];	// empty view when absent
+	rtsp_view_t body;
+} rtsp_request_t;
+
+/*
+ A connection owns a receive buffer that only grows (up to head + body limits)
+ and is kept until freed, so once it has reached its working size, receiving
+ and parsing requests does not allocate. Head is scanned only once whatever
+ the number of reads it takes and requests can be pipelined. Sockets can be
+ non-blocking, responses they don't take at once are queued
+*/
+typedef struct rtsp_conn_s {
+	char *buffer;
+	size_t size, len;
+	size_t scanned;			// bytes already searched for end of head
+	size_t head;			// size of head when complete, 0 otherwise
+	rtsp_request_t request;
+	struct {
+		char *data;
+		size_t size, len, pos;
+	} output;
+} rtsp_conn_t;
+
+void	rtsp_conn_reset(rtsp_conn_t *conn);
+void	rtsp_conn_free(rtsp_conn_t *conn);
+// reads what is available, returns bytes received, 0 when none yet or -1 when closed/failed
+int		rtsp_receive(rtsp_conn_t *conn, int sock);
+// false on malformed request, otherwise *request is NULL until one is complete
+bool	rtsp_next(rtsp_conn_t *conn, rtsp_request_t **request);
+void	rtsp_consume(rtsp_conn_t *conn);
+
+// helpers on views
+bool	rtsp_view_is(rtsp_view_t view, const char *str);
+bool	rtsp_view_has(rtsp_view_t view, const char *str);
+// "name=value" from a ';' or ',' separated list (Transport, RTP-Info)
+bool	rtsp_param(rtsp_view_t view, const char *name, rtsp_view_t *value);
+// "name: value" line in a body (text/parameters), name includes type for SDP (e.g. "a=fmtp")
+bool	rtsp_field(rtsp_view_t view, const char *name, rtsp_view_t *value);
+uint32_t rtsp_uint(rtsp_view_t view);
+double	rtsp_double(rtsp_view_t view);
+size_t	rtsp_copy(rtsp_view_t view, char *dst, size_t size);
+// padding is optional, returns decoded length
+size_t	rtsp_base64(rtsp_view_t view, void *dst, size_t size);
+
+typedef struct {
+	char data[RTSP_RESPONSE_SIZE];
+	size_t len;
+} rtsp_response_t;
+
+void	rtsp_response_init(rtsp_response_t *resp, const char *status);
+void	rtsp_response_add(rtsp_response_t *resp, const char *name, const char *fmt, ...);
+// terminates and sends (or queues) the response, which is then a printable string
+bool	rtsp_response_send(rtsp_response_t *resp, rtsp_conn_t *conn, int sock);
+// sends what is queued, returns bytes still queued or -1 on error
+int		rtsp_flush(rtsp_conn_t *conn, int sock);
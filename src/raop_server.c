@@ -12,14 +12,19 @@
 
 #include "platform.h"
 #include "mdnssvc.h"
-#include "mdnssd.h"
 #include "cross_util.h"
 #include "raop_server.h"
 #include "raop_streamer.h"
+#include "raop_capture.h"
+#include "raop_reactor.h"
+#include "raop_rtsp.h"
+#include "raop_artwork.h"
+#include "raop_dacp.h"
 #include "dmap_parser.h"
 
 #include "cross_net.h"
 #include "cross_log.h"
+#include "raop_log.h"
 
 typedef struct raopsr_s {
 	struct mdns_service *svc;
@@ -34,45 +39,49 @@ typedef struct raopsr_s {
 		bool metadata;
 	} streamer;
 	char *latencies;
-	bool running;
 	bool drift;
 	bool flush;
-	pthread_t thread, search_thread;
+	struct reactor_event_s *listener, *connection;
+	int client;				// RTSP connection, only one at a time
+	rtsp_conn_t conn;
 	unsigned char mac[6];
 	struct {
 		char *aesiv, *aeskey;
 		char *fmtp;
 	} rtsp;
 	struct raopst_s *ht;
+	struct raopst_s *warm;	// parked session, re-used by next SETUP
 	raopsr_cb_t	raop_cb;
 	raop_http_cb_t http_cb;
+	raop_pcm_cb_t pcm_cb;
 	raopsr_metadata_t metadata;
+	struct artwork_s *artwork;
 	bool flushedArtwork;
 	int sequence;
 	struct {
 		char				DACPid[32], id[32];
-		struct in_addr		host;
-		uint16_t				port;
-		struct mdnssd_handle_s *handle;
 	} active_remote;
 	void *owner;
 	struct {
 		uint16_t base, range;
 	} ports;
 	int http_length;
+	char *capture;			// directory where sessions are captured
 } raopsr_t;
 
 extern log_level	raop_loglevel;
 static log_level 	*loglevel = &raop_loglevel;
 
-static void*	rtsp_thread(void *arg);
-static bool 	handle_rtsp(raopsr_t *ctx, int sock);
+static void		rtsp_accept(void *owner, int sock, int events);
+static void		rtsp_io(void *owner, int sock, int events);
+static bool 	handle_rtsp(raopsr_t *ctx, int sock, rtsp_request_t *request);
 
 static char*	rsa_apply(unsigned char *input, int inlen, int *outlen, int mode);
-static int  	base64_pad(char *src, char **padded);
 static void 	event_cb(void *owner, raopst_event_t event);
 static void 	http_cb(void *owner, struct key_data_s *headers, struct key_data_s *response);
-static void* 	search_remote(void *args);
+static void 	pcm_cb(void *owner, int16_t *pcm, size_t frames, uint32_t playtime);
+static void 	stream_metadata(raopsr_t *ctx);
+static void 	session_park(raopsr_t *ctx);
 
 extern char private_key[];
 
@@ -84,7 +93,7 @@ static void on_dmap_string(void *ctx, const char *code, const char *name, const
 struct raopsr_s *raopsr_create(struct in_addr host, struct mdnsd *svr, char *name,
 						char *model, unsigned char mac[6], char *stream_codec, bool stream_metadata,
 						bool drift,	bool flush, char *latencies, void *owner,
-						raopsr_cb_t raop_cb, raop_http_cb_t http_cb,
+						raopsr_cb_t raop_cb, raop_http_cb_t http_cb, raop_pcm_cb_t pcm_cb,
 						unsigned short port_base, unsigned short port_range,
 						int http_length ) {
 	struct raopsr_s *ctx = malloc(sizeof(struct raopsr_s));
@@ -110,6 +119,7 @@ struct raopsr_s *raopsr_create(struct in_addr host, struct mdnsd *svr, char *nam
 	ctx->host = host;
 	ctx->raop_cb = raop_cb;
 	ctx->http_cb = http_cb;
+	ctx->pcm_cb = pcm_cb;
 	ctx->flush = flush;
 	ctx->latencies = strdup(latencies);
 	ctx->owner = owner;
@@ -154,8 +164,18 @@ struct raopsr_s *raopsr_create(struct in_addr host, struct mdnsd *svr, char *nam
 	free(txt[0]);
 	free(id);
 
-	ctx->running = true;
-	pthread_create(&ctx->thread, NULL, &rtsp_thread, ctx);
+	// remotes are found by a directory shared with other servers
+	dacp_open(host);
+
+	// requests need RSA and call owner back, so they are not handled by reactor's workers
+	ctx->client = -1;
+	ctx->listener = reactor_io(ctx->sock, REACTOR_READ | REACTOR_BLOCKING, rtsp_accept, ctx);
+
+	if (!ctx->listener) {
+		LOG_ERROR("Cannot watch RTSP listener");
+		raopsr_delete(ctx);
+		return NULL;
+	}
 
 	return ctx;
 }
@@ -190,11 +210,14 @@ void raopsr_update(struct raopsr_s *ctx, char *name, char *model) {
 void raopsr_delete(struct raopsr_s *ctx) {
 	if (!ctx) return;
 
-	ctx->running = false;
-	pthread_join(ctx->thread, NULL);
+	reactor_remove_all(ctx);
+	if (ctx->client != -1) closesocket(ctx->client);
+	rtsp_conn_free(&ctx->conn);
 
 	raopsr_metadata_free(&ctx->metadata);
+	artwork_release(ctx->artwork);
 	raopst_end(ctx->ht);
+	raopst_end(ctx->warm);
 
 #if WIN
 	shutdown(ctx->sock, SD_BOTH);
@@ -203,13 +226,10 @@ void raopsr_delete(struct raopsr_s *ctx) {
 #endif
 	closesocket(ctx->sock);
 
-	// terminate search, but do not reclaim memory of pthread if never launched
-	if (ctx->active_remote.handle) {
-		mdnssd_close(ctx->active_remote.handle);
-		pthread_join(ctx->search_thread, NULL);
-	}
+	dacp_close();
 
 	NFREE(ctx->streamer.codec);
+	NFREE(ctx->capture);
 	NFREE(ctx->rtsp.aeskey);
 	NFREE(ctx->rtsp.aesiv);
 	NFREE(ctx->rtsp.fmtp);
@@ -221,9 +241,21 @@ void raopsr_delete(struct raopsr_s *ctx) {
 }
 
 
+/*----------------------------------------------------------------------------*/
+void raopsr_artwork(size_t budget, raop_artwork_scale_cb_t scale_cb) {
+	artwork_config(budget, scale_cb);
+}
+
+/*----------------------------------------------------------------------------*/
+void raopsr_capture(struct raopsr_s *ctx, char *dir) {
+	if (!ctx) return;
+	NFREE(ctx->capture);
+	if (dir) ctx->capture = strdup(dir);
+	LOG_INFO("[%p]: capture of next sessions %s %s", ctx, dir ? "in" : "disabled", dir ? dir : "");
+}
+
 /*----------------------------------------------------------------------------*/
 void  raopsr_notify(struct raopsr_s *ctx, raopsr_event_t event, void *param) {
-	struct sockaddr_in addr;
 	char *command = NULL;
 
 	if (!ctx) return;
@@ -249,44 +281,12 @@ void  raopsr_notify(struct raopsr_s *ctx, raopsr_event_t event, void *param) {
 			break;
 	}
 
-	// no command to send to remote or no remote found yet
-	if (!command || !ctx->active_remote.port) {
-
-		NFREE(command);
-
-		return;
-
-	}
-
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
-
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr = ctx->active_remote.host;
-	addr.sin_port = htons(ctx->active_remote.port);
-
-	if (!connect(sock, (struct sockaddr*) &addr, sizeof(addr))) {
-		char *method, *buf, resp[512] = "";
-		int len;
-		key_data_t headers[4] = { {NULL, NULL} };
-
-		(void)!asprintf(&method, "GET /ctrl-int/1/%s HTTP/1.0", command);
-		kd_add(headers, "Active-Remote", ctx->active_remote.id);
-		kd_add(headers, "Connection", "close");
-
-		buf = http_send(sock, method, headers);
-		len = recv(sock, resp, 512, 0);
-		if (len > 0) resp[len-1] = '\0';
-		LOG_INFO("[%p]: sending airplay remote\n%s<== received ==>\n%s", ctx, buf, resp);
-
-		NFREE(method);
-		NFREE(buf);
-		kd_free(headers);
+	// remote might not be known (yet), then command is lost
+	if (command) {
+		int status = dacp_command(ctx->active_remote.DACPid, ctx->active_remote.id, command);
+		LOG_INFO("[%p]: sent %s to airplay remote (%d)", ctx, command, status);
+		free(command);
 	}
-
-	free(command);
-
-	closesocket(sock);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -306,83 +306,96 @@ void raopsr_metadata_copy(raopsr_metadata_t* dst, raopsr_metadata_t* src) {
 }
 
 /*----------------------------------------------------------------------------*/
-static void *rtsp_thread(void *arg) {
-	raopsr_t *ctx = (raopsr_t*) arg;
-	int  sock = -1;
-
-	while (ctx->running) {
-		fd_set rfds;
-		struct timeval timeout = {0, 100*1000};
-		int n;
-		bool res = false;
+static void rtsp_accept(void *owner, int sock, int events) {
+	raopsr_t *ctx = (raopsr_t*) owner;
+	struct sockaddr_in peer;
+	socklen_t addrlen = sizeof(struct sockaddr_in);
 
-		if (sock == -1) {
-			struct sockaddr_in peer;
-			socklen_t addrlen = sizeof(struct sockaddr_in);
-			struct timeval timeout = { 0, 100 * 1000 };
+	int client = accept(sock, (struct sockaddr*) &peer, &addrlen);
+	if (client == -1) return;
 
-			FD_ZERO(&rfds);
-			FD_SET(ctx->sock, &rfds);
+	ctx->peer.s_addr = peer.sin_addr.s_addr;
+	ctx->client = client;
+	LOG_INFO("got RTSP connection %u", client);
 
-			if (select(ctx->sock + 1, &rfds, NULL, NULL, &timeout) > 0) {
-				sock = accept(ctx->sock, (struct sockaddr*)&peer, &addrlen);
-				ctx->peer.s_addr = peer.sin_addr.s_addr;
-			}
+#if WIN
+	u_long mode = 1;
+	ioctlsocket(client, FIONBIO, &mode);
+#else
+	fcntl(client, F_SETFL, fcntl(client, F_GETFL, 0) | O_NONBLOCK);
+#endif
 
-			if (sock != -1 && ctx->running) {
-				LOG_INFO("got RTSP connection %u", sock);
-			} else continue;
-		}
+	// next connection waits in backlog until this one is closed
+	reactor_io_events(ctx->listener, 0);
+	ctx->connection = reactor_io(client, REACTOR_READ | REACTOR_BLOCKING, rtsp_io, ctx);
+}
 
-		FD_ZERO(&rfds);
-		FD_SET(sock, &rfds);
+/*----------------------------------------------------------------------------*/
+static void rtsp_io(void *owner, int sock, int events) {
+	raopsr_t *ctx = (raopsr_t*) owner;
+	rtsp_request_t *request;
+	bool alive = true;
 
-		n = select(sock + 1, &rfds, NULL, NULL, &timeout);
+	if (events & REACTOR_READ) alive = rtsp_receive(&ctx->conn, sock) >= 0;
 
-		if (!n) continue;
+	// there might be more than one request (or none) in what has been received
+	while (alive && (alive = rtsp_next(&ctx->conn, &request)) && request) {
+		alive = handle_rtsp(ctx, sock, request);
+		rtsp_consume(&ctx->conn);
+	}
 
-		if (n > 0) res = handle_rtsp(ctx, sock);
+	// what socket could not take is sent when it's writable
+	int pending = alive ? rtsp_flush(&ctx->conn, sock) : -1;
 
-		if (n < 0 || !res) {
-			closesocket(sock);
-			LOG_INFO("RTSP close %u", sock);
-			sock = -1;
-		}
+	if (pending >= 0) {
+		reactor_io_events(ctx->connection, REACTOR_READ | (pending ? REACTOR_WRITE : 0));
+		return;
 	}
 
-	if (sock != -1) closesocket(sock);
+	reactor_remove(ctx->connection);
+	closesocket(sock);
+	LOG_INFO("RTSP close %u", sock);
 
-	return NULL;
+	ctx->connection = NULL;
+	ctx->client = -1;
+	rtsp_conn_reset(&ctx->conn);
+	reactor_io_events(ctx->listener, REACTOR_READ);
 }
 
+/*----------------------------------------------------------------------------*/
+static void capture_parameter(struct raopst_s *ht, rtsp_view_t type, rtsp_view_t body) {
+	if (rtsp_view_is(type, "application/x-dmap-tagged")) {
+		raopst_capture_event(ht, CAPTURE_METADATA, body.data, body.len);
+	} else if (rtsp_view_has(type, "image/")) {
+		// image itself is not needed and might not even fit
+		uint8_t size[4];
+		capture_put(size, body.len, 4);
+		raopst_capture_event(ht, CAPTURE_ARTWORK, size, sizeof(size));
+	} else if (body.len) {
+		raopst_capture_event(ht, CAPTURE_PARAMETER, body.data, body.len);
+	}
+}
 
 /*----------------------------------------------------------------------------*/
-static bool handle_rtsp(raopsr_t *ctx, int sock)
+static bool handle_rtsp(raopsr_t *ctx, int sock, rtsp_request_t *request)
 {
-	char *buf = NULL, *body = NULL, method[16] = "";
-	key_data_t headers[64], resp[16] = { {NULL, NULL} };
-	int len;
+	rtsp_view_t *headers = request->headers, body = request->body, value;
+	rtsp_response_t resp;
 	char *response = NULL;
 
-	if (!http_parse(sock, method, NULL, NULL, headers, &body, &len)) {
-		NFREE(body);
-		kd_free(headers);
-		return false;
-	}
-
-	if (strcmp(method, "OPTIONS")) {
-		LOG_INFO("[%p]: received %s", ctx, method);
+	if (request->method != RTSP_OPTIONS) {
+		LOG_INFO("[%p]: received %.*s", ctx, (int) request->name.len, request->name.data);
 	}
 
-	if ((buf = kd_lookup(headers, "Apple-Challenge")) != NULL) {
-		char *buf_pad, *p, *data_b64 = NULL, data[32];
+	rtsp_response_init(&resp, "RTSP/1.0 200 OK");
 
-		LOG_INFO("[%p]: challenge %s", ctx, buf);
+	if (headers[RTSP_APPLE_CHALLENGE].len) {
+		char *p, *data_b64 = NULL, data[32];
 
-		// need to pad the base64 string as apple device don't
-		base64_pad(buf, &buf_pad);
+		LOG_INFO("[%p]: challenge %.*s", ctx, (int) headers[RTSP_APPLE_CHALLENGE].len, headers[RTSP_APPLE_CHALLENGE].data);
 
-		p = data + min(base64_decode(buf_pad, data), 32-10);
+		// apple devices don't pad base64 strings, decoder does not need it
+		p = data + min((int) rtsp_base64(headers[RTSP_APPLE_CHALLENGE], data, sizeof(data)), 32-10);
 		p = (char*) memcpy(p, &ctx->host, 4) + 4;
 		p = (char*) memcpy(p, ctx->mac, 6) + 6;
 		memset(p, 0, 32 - (p - data));
@@ -393,117 +406,115 @@ static bool handle_rtsp(raopsr_t *ctx, int sock)
 		// remove padding as well (seems to be optional now)
 		for (n = strlen(data_b64) - 1; n > 0 && data_b64[n] == '='; data_b64[n--] = '\0');
 
-		kd_add(resp, "Apple-Response", data_b64);
+		rtsp_response_add(&resp, "Apple-Response", "%s", data_b64);
 
 		NFREE(p);
-		NFREE(buf_pad);
 		NFREE(data_b64);
 	}
 
-	if (!strcmp(method, "OPTIONS")) {
-		kd_add(resp, "Public", "ANNOUNCE, SETUP, RECORD, PAUSE, FLUSH, TEARDOWN, OPTIONS, GET_PARAMETER, SET_PARAMETER");
-	} else if (!strcmp(method, "ANNOUNCE") && body) {
-		char *padded, *p;
-
+	if (request->method == RTSP_OPTIONS) {
+		rtsp_response_add(&resp, "Public", "ANNOUNCE, SETUP, RECORD, PAUSE, FLUSH, TEARDOWN, OPTIONS, GET_PARAMETER, SET_PARAMETER");
+	} else if (request->method == RTSP_ANNOUNCE && body.len) {
 		NFREE(ctx->rtsp.aeskey);
 		NFREE(ctx->rtsp.aesiv);
 		NFREE(ctx->rtsp.fmtp);
 
-		if ((p = strcasestr(body, "rsaaeskey")) != NULL) {
-			unsigned char *aeskey;
-			int len, outlen;
+		if (rtsp_field(body, "a=rsaaeskey", &value)) {
+			unsigned char aeskey[512];
+			int len, outlen = 0;
 
-			p = strextract(p, ":", "\r\n");
-			base64_pad(p, &padded);
-			aeskey = malloc(strlen(padded));
-			len = base64_decode(padded, aeskey);
+			len = rtsp_base64(value, aeskey, sizeof(aeskey));
 			ctx->rtsp.aeskey = rsa_apply(aeskey, len, &outlen, RSA_MODE_KEY);
 
-			NFREE(p);
-			NFREE(aeskey);
-			NFREE(padded);
+			// AES-128 only, streamer uses 16 bytes whatever it got
+			if (ctx->rtsp.aeskey && outlen != 16) {
+				LOG_ERROR("[%p]: AES key has wrong length %d", ctx, outlen);
+				NFREE(ctx->rtsp.aeskey);
+				response = "RTSP/1.0 400 Bad Request";
+			}
 		}
 
-		if ((p = strcasestr(body, "aesiv")) != NULL) {
-			p = strextract(p, ":", "\r\n");
-			base64_pad(p, &padded);
-			ctx->rtsp.aesiv = malloc(strlen(padded));
-			base64_decode(padded, ctx->rtsp.aesiv);
+		if (rtsp_field(body, "a=aesiv", &value)) {
+			uint8_t aesiv[32];
 
-			NFREE(p);
-			NFREE(padded);
+			// decode more than needed to catch a longer one
+			if (rtsp_base64(value, aesiv, sizeof(aesiv)) == 16) {
+				ctx->rtsp.aesiv = malloc(16);
+				if (ctx->rtsp.aesiv) memcpy(ctx->rtsp.aesiv, aesiv, 16);
+			} else {
+				LOG_ERROR("[%p]: AES IV has wrong length", ctx);
+				response = "RTSP/1.0 400 Bad Request";
+			}
 		}
 
-		if ((p = strcasestr(body, "fmtp")) != NULL) {
-			p = strextract(p, ":", "\r\n");
-			ctx->rtsp.fmtp = strdup(p);
-			NFREE(p);
+		if (rtsp_field(body, "a=fmtp", &value)) {
+			ctx->rtsp.fmtp = strndup(value.data, value.len);
 		}
 
-		// on announce, search remote
-		if ((buf = kd_lookup(headers, "DACP-ID")) != NULL) strcpy(ctx->active_remote.DACPid, buf);
-		if ((buf = kd_lookup(headers, "Active-Remote")) != NULL) strcpy(ctx->active_remote.id, buf);
-
-		ctx->active_remote.handle = mdnssd_init(false, ctx->host, true);
-		pthread_create(&ctx->search_thread, NULL, &search_remote, ctx);
+		// remote is resolved by directory when a command is sent
+		rtsp_copy(headers[RTSP_DACP_ID], ctx->active_remote.DACPid, sizeof(ctx->active_remote.DACPid));
+		rtsp_copy(headers[RTSP_ACTIVE_REMOTE], ctx->active_remote.id, sizeof(ctx->active_remote.id));
 
-	} else if (!strcmp(method, "SETUP") && ((buf = kd_lookup(headers, "Transport")) != NULL)) {
-		char *p;
+	} else if (request->method == RTSP_SETUP && headers[RTSP_TRANSPORT].len) {
 		raopst_resp_t ht;
 		short unsigned tport = 0, cport = 0;
 
-		if ((p = strcasestr(buf, "timing_port")) != NULL) sscanf(p, "%*[^=]=%hu", &tport);
-		if ((p = strcasestr(buf, "control_port")) != NULL) sscanf(p, "%*[^=]=%hu", &cport);
+		if (rtsp_param(headers[RTSP_TRANSPORT], "timing_port", &value)) tport = rtsp_uint(value);
+		if (rtsp_param(headers[RTSP_TRANSPORT], "control_port", &value)) cport = rtsp_uint(value);
 
-		ht = raopst_init(ctx->host, ctx->peer, ctx->streamer.codec, ctx->streamer.metadata, ctx->drift, true, ctx->latencies,
-							ctx->rtsp.aeskey, ctx->rtsp.aesiv, ctx->rtsp.fmtp,
-							cport, tport, ctx, event_cb, http_cb, ctx->ports.base,
-							ctx->ports.range, ctx->http_length);
+		// a session left without TEARDOWN is dead, but can be re-used like a torn down one
+		session_park(ctx);
+
+		if (!ctx->warm || !raopst_reuse(ctx->warm, ctx->peer, ctx->rtsp.aeskey, ctx->rtsp.aesiv, ctx->rtsp.fmtp, cport, tport, &ht)) {
+			raopst_end(ctx->warm);
+			ht = raopst_init(ctx->host, ctx->peer, ctx->streamer.codec, ctx->streamer.metadata, ctx->drift, true, ctx->latencies,
+								ctx->rtsp.aeskey, ctx->rtsp.aesiv, ctx->rtsp.fmtp,
+								cport, tport, ctx, event_cb, http_cb, ctx->pcm_cb ? pcm_cb : NULL, ctx->ports.base,
+								ctx->ports.range, ctx->http_length);
+		}
+
+		ctx->warm = NULL;
 
 		ctx->hport = ht.hport;
 		ctx->ht = ht.ctx;
 		ctx->flushedArtwork = true;
 
-		if ((cport * tport * ht.cport * ht.tport * ht.aport * ht.hport) != 0 && ht.ctx) {
-			char *transport;
-			(void) !asprintf(&transport, "RTP/AVP/UDP;unicast;mode=record;control_port=%u;timing_port=%u;server_port=%u", ht.cport, ht.tport, ht.aport);
+		if (ctx->ht && ctx->capture) {
+			char *path;
+			(void) !asprintf(&path, "%s/raop-%hu-%u%s", ctx->capture, ctx->port, (uint32_t) time(NULL), CAPTURE_EXT);
+			raopst_capture(ctx->ht, path);
+			free(path);
+		}
+
+		if ((cport * tport * ht.cport * ht.tport * ht.aport * (ctx->pcm_cb ? 1 : ht.hport)) != 0 && ht.ctx) {
 			LOG_DEBUG("[%p]: http=(%hu) audio=(%hu:%hu), timing=(%hu:%hu), control=(%hu:%hu)", ctx, ht.hport, 0, ht.aport, tport, ht.tport, cport, ht.cport);
-			kd_add(resp, "Transport", transport);
-			kd_add(resp, "Session", "DEADBEEF");
-			free(transport);
+			rtsp_response_add(&resp, "Transport", "RTP/AVP/UDP;unicast;mode=record;control_port=%u;timing_port=%u;server_port=%u", ht.cport, ht.tport, ht.aport);
+			rtsp_response_add(&resp, "Session", "DEADBEEF");
 		} else {
 			response = "RTSP/1.0 500 Internal Error";
 			LOG_INFO("[%p]: cannot start session, missing ports", ctx);
 		}
 
-	} else if (strcmp(method, "RECORD") == 0) {
+	} else if (request->method == RTSP_RECORD) {
 		unsigned short seqno = 0;
 		unsigned rtptime = 0;
-		char *p;
 
 		if (atoi(ctx->latencies)) {
-			char latency[6];
-			snprintf(latency, 6, "%u", (atoi(ctx->latencies) * 44100) / 1000);
-			kd_add(resp, "Audio-Latency", latency);
+			rtsp_response_add(&resp, "Audio-Latency", "%u", (atoi(ctx->latencies) * 44100) / 1000);
 		}
 
-		if ((buf = kd_lookup(headers, "RTP-Info")) != NULL) {
-			if ((p = strcasestr(buf, "seq")) != NULL) sscanf(p, "%*[^=]=%hu", &seqno);
-			if ((p = strcasestr(buf, "rtptime")) != NULL) sscanf(p, "%*[^=]=%u", &rtptime);
-		}
+		if (rtsp_param(headers[RTSP_RTP_INFO], "seq", &value)) seqno = rtsp_uint(value);
+		if (rtsp_param(headers[RTSP_RTP_INFO], "rtptime", &value)) rtptime = rtsp_uint(value);
 
 		if (ctx->ht) raopst_record(ctx->ht, seqno, rtptime);
 		ctx->raop_cb(ctx->owner, RAOP_STREAM, (uint32_t) ctx->hport);
 
-	}  else if (!strcmp(method, "FLUSH")) {
+	}  else if (request->method == RTSP_FLUSH) {
 		unsigned short seqno = 0;
 		unsigned rtptime = 0;
-		char *p;
 
-		if ((buf = kd_lookup(headers, "RTP-Info")) != NULL) {
-			if ((p = strcasestr(buf, "seq")) != NULL) sscanf(p, "%*[^=]=%hu", &seqno);
-			if ((p = strcasestr(buf, "rtptime")) != NULL) sscanf(p, "%*[^=]=%u", &rtptime);
-        }
+		if (rtsp_param(headers[RTSP_RTP_INFO], "seq", &value)) seqno = rtsp_uint(value);
+		if (rtsp_param(headers[RTSP_RTP_INFO], "rtptime", &value)) rtptime = rtsp_uint(value);
 
 		// only send FLUSH if useful (discards frames above buffer head and top)
 		if (ctx->ht && raopst_flush(ctx->ht, seqno, rtptime, true, !ctx->flush)) {
@@ -513,35 +524,33 @@ static bool handle_rtsp(raopsr_t *ctx, int sock)
 
 		// flag that we have received a flush and artwork might be outdated
 		ctx->flushedArtwork = true;
-	}  else if (!strcmp(method, "TEARDOWN")) {
+	}  else if (request->method == RTSP_TEARDOWN) {
 
+		if (ctx->ht) raopst_capture_event(ctx->ht, CAPTURE_TEARDOWN, NULL, 0);
 		ctx->raop_cb(ctx->owner, RAOP_STOP);
 		raopsr_metadata_free(&ctx->metadata);
-		raopst_end(ctx->ht);
-
-		ctx->ht = NULL;
+		artwork_release(ctx->artwork);
+		ctx->artwork = NULL;
+		session_park(ctx);
 		ctx->hport = -1;
 
-		// need to make sure no search is on-going and reclaim pthread memory
-		if (ctx->active_remote.handle) mdnssd_close(ctx->active_remote.handle);
-		pthread_join(ctx->search_thread, NULL);
 		memset(&ctx->active_remote, 0, sizeof(ctx->active_remote));
 
 		NFREE(ctx->rtsp.aeskey);
 		NFREE(ctx->rtsp.aesiv);
 		NFREE(ctx->rtsp.fmtp);
 
-	} else if (!strcmp(method, "SET_PARAMETER")) {
-		char *p;
+	} else if (request->method == RTSP_SET_PARAMETER) {
+		// volume, progress, metadata and artwork are captured for replay even when not used
+		if (ctx->ht) capture_parameter(ctx->ht, headers[RTSP_CONTENT_TYPE], body);
 
-		if (body && (p = strcasestr(body, "volume")) != NULL) {
-			double volume;
+		if (body.len && rtsp_field(body, "volume", &value)) {
+			double volume = rtsp_double(value);
 
-			sscanf(p, "%*[^:]:%lf", &volume);
 			LOG_INFO("[%p]: SET PARAMETER volume %lf", ctx, volume);
 			volume = (volume == -144.0) ? 0 : (1 + volume / 30);
 			ctx->raop_cb(ctx->owner, RAOP_VOLUME, volume);
-		} else if (((p = kd_lookup(headers, "Content-Type")) != NULL) && !strcasecmp(p, "application/x-dmap-tagged")) {
+		} else if (rtsp_view_is(headers[RTSP_CONTENT_TYPE], "application/x-dmap-tagged")) {
 			dmap_settings settings = {
 				NULL, NULL, NULL, NULL,	NULL, NULL,	NULL, on_dmap_string, NULL,
 				NULL
@@ -551,48 +560,47 @@ static bool handle_rtsp(raopsr_t *ctx, int sock)
 			char* artwork = (!ctx->flushedArtwork && ctx->metadata.artwork) ? strdup(ctx->metadata.artwork) : NULL;
 			raopsr_metadata_free(&ctx->metadata);
 			ctx->metadata.artwork = artwork;
+			if (!artwork) {
+				artwork_release(ctx->artwork);
+				ctx->artwork = NULL;
+			}
 			settings.ctx = &ctx->metadata;
 
-			if (!dmap_parse(&settings, body, len)) {
+			if (!dmap_parse(&settings, body.data, body.len)) {
 				ctx->raop_cb(ctx->owner, RAOP_METADATA, &ctx->metadata);
-				if (ctx->streamer.metadata) raopst_metadata(ctx->ht, &ctx->metadata);
+				if (ctx->streamer.metadata) stream_metadata(ctx);
 				LOG_INFO("[%p]: received metadata\n\tartist: %s\n\talbum:  %s\n\ttitle:  %s",
 					ctx, ctx->metadata.artist,ctx->metadata.album, ctx->metadata.title);
 			}
-		} else if (body && ((p = kd_lookup(headers, "Content-Type")) != NULL) && strcasestr(p, "image/jpeg")) {
-				static uint32_t count;
-				char buffer[16];
-				sprintf(buffer, "/%x.jpg", (ctx->metadata.title ? hash32(ctx->metadata.title) : 0) + count++);
+		} else if (body.len && rtsp_view_has(headers[RTSP_CONTENT_TYPE], "image/jpeg")) {
+				// same image is stored once, whatever the number of tracks and servers using it
+				struct artwork_s *artwork = artwork_get((uint8_t*) body.data, body.len, "image/jpeg");
+				artwork_release(ctx->artwork);
+				ctx->artwork = artwork;
 				NFREE(ctx->metadata.artwork);
-				ctx->metadata.artwork = http_pico_add_source(buffer, "image/jpeg", (uint8_t*) body, len, 120);
-				LOG_INFO("[%p]: received JPEG image of %d bytes", ctx, len);
+				ctx->metadata.artwork = artwork_url(artwork, false);
+				LOG_INFO("[%p]: received JPEG image of %zu bytes", ctx, body.len);
 				ctx->flushedArtwork = false;
-				ctx->raop_cb(ctx->owner, RAOP_ARTWORK, &ctx->metadata, body, len);
-				raopst_metadata(ctx->ht, &ctx->metadata);
+				ctx->raop_cb(ctx->owner, RAOP_ARTWORK, &ctx->metadata, body.data, body.len);
+				stream_metadata(ctx);
 		}
 	} else {
 		response = "RTSP/1.0 501 Not Implemented";
-    	LOG_ERROR("[%p]: unknown/unhandled method %s", ctx, method);
+		LOG_ERROR("[%p]: unknown/unhandled method %.*s", ctx, (int) request->name.len, request->name.data);
 	}
 
-	// don't need to free "buf" because kd_lookup return a pointer, not a strdup
-
-	kd_add(resp, "Audio-Jack-Status", "connected; type=analog");
-	kd_add(resp, "CSeq", kd_lookup(headers, "CSeq"));
+	rtsp_response_add(&resp, "Audio-Jack-Status", "connected; type=analog");
+	if (headers[RTSP_CSEQ].len) rtsp_response_add(&resp, "CSeq", "%.*s", (int) headers[RTSP_CSEQ].len, headers[RTSP_CSEQ].data);
 
-	if (!response) buf = http_send(sock, "RTSP/1.0 200 OK", resp);
-	else buf = http_send(sock, response, NULL);
+	// errors are sent without headers
+	if (response) rtsp_response_init(&resp, response);
+	bool sent = rtsp_response_send(&resp, &ctx->conn, sock);
 
-	if (strcmp(method, "OPTIONS")) {
-		LOG_INFO("[%p]: responding:\n%s", ctx, buf ? buf : "<void>");
+	if (request->method != RTSP_OPTIONS) {
+		LOG_INFO("[%p]: responding:\n%s", ctx, resp.data);
 	}
 
-	NFREE(body);
-	NFREE(buf);
-	kd_free(resp);
-	kd_free(headers);
-
-	return true;
+	return sent;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -606,7 +614,7 @@ static void event_cb(void *owner, raopst_event_t event) {
 			if (ctx->metadata.title) ctx->raop_cb(ctx->owner, RAOP_METADATA, &ctx->metadata);
 			break;
 		default:
-			LOG_ERROR("[%p]: unknown hairtunes event", ctx, event);
+			LOG_ERROR("[%p]: unknown hairtunes event %d", ctx, event);
 			break;
 	}
 }
@@ -619,34 +627,34 @@ static void http_cb(void *owner, struct key_data_s *headers, struct key_data_s *
 }
 
 /*----------------------------------------------------------------------------*/
-bool search_remote_cb(mdnssd_service_t *slist, void *cookie, bool *stop) {
-	mdnssd_service_t *s;
-	raopsr_t *ctx = (raopsr_t*) cookie;
-
-	// see if we have found an active remote for our ID
-	for (s = slist; s; s = s->next) {
-		if (strcasestr(s->name, ctx->active_remote.DACPid)) {
-			ctx->active_remote.host = s->addr;
-			ctx->active_remote.port = s->port;
-			LOG_INFO("[%p]: found ActiveRemote for %s at %s:%u", ctx, ctx->active_remote.DACPid,
-								inet_ntoa(ctx->active_remote.host), ctx->active_remote.port);
-			*stop = true;
-			break;
-		}
-	}
+static void pcm_cb(void *owner, int16_t *pcm, size_t frames, uint32_t playtime) {
+	raopsr_t *ctx = (raopsr_t*) owner;
+	ctx->pcm_cb(ctx->owner, pcm, frames, playtime);
+}
 
-	// let caller clear list
-	return false;
+/*----------------------------------------------------------------------------*/
+// keep session aside so that next SETUP does not have to create one
+static void session_park(raopsr_t *ctx) {
+	if (!ctx->ht) return;
+
+	raopst_park(ctx->ht);
+	raopst_end(ctx->warm);
+	ctx->warm = ctx->ht;
+	ctx->ht = NULL;
 }
 
 /*----------------------------------------------------------------------------*/
-static void* search_remote(void *args) {
-	raopsr_t *ctx = (raopsr_t*) args;
+static void stream_metadata(raopsr_t *ctx) {
+	raopsr_metadata_t metadata = ctx->metadata;
 
-	mdnssd_query(ctx->active_remote.handle, "_dacp._tcp.local", false, 0, &search_remote_cb, (void*) ctx);
-	return NULL;
-}
+	if (!ctx->ht) return;
 
+	// ICY StreamURL points to scaled artwork, if any
+	char *artwork = artwork_url(ctx->artwork, true);
+	if (artwork) metadata.artwork = artwork;
+	raopst_metadata(ctx->ht, &metadata);
+	NFREE(artwork);
+}
 
 /*----------------------------------------------------------------------------*/
 static char *rsa_apply(unsigned char *input, int inlen, int *outlen, int mode) {
@@ -699,17 +707,6 @@ static char *rsa_apply(unsigned char *input, int inlen, int *outlen, int mode) {
 }
 
 /*----------------------------------------------------------------------------*/
-static int  base64_pad(char *src, char **padded) {
-	int n = strlen(src) + strlen(src) % 4;
-
-	*padded = malloc(n + 1);
-	memset(*padded, '=', n);
-	memcpy(*padded, src, strlen(src));
-	(*padded)[n] = '\0';
-
-	return strlen(*padded);
-}
-
 static void on_dmap_string(void *ctx, const char *code, const char *name, const char *buf, size_t len) {
 	raopsr_metadata_t *metadata = (raopsr_metadata_t *) ctx;
 
@@ -22,17 +22,35 @@ typedef struct raopsr_metadata_s {
 typedef enum { RAOP_STREAM, RAOP_PLAY, RAOP_FLUSH, RAOP_PAUSE, RAOP_STOP, RAOP_VOLUME, RAOP_METADATA, RAOP_ARTWORK } raopsr_event_t ;
 typedef void (*raopsr_cb_t)(void *owner, raopsr_event_t event, ...);
 typedef void (*raop_http_cb_t)(void *owner, struct key_data_s *headers, struct key_data_s *response);
+// 16 bits stereo 44.1kHz, playtime is local time (ms, see gettime_ms) when first sample shall be
+// played or 0 for silence when paused, pcm is only valid during the call
+typedef void (*raop_pcm_cb_t)(void *owner, int16_t *pcm, size_t frames, uint32_t playtime);
+typedef bool (*raop_artwork_scale_cb_t)(const uint8_t *image, size_t len, uint8_t **scaled, size_t *scaled_len);
 
 // set http_length to -3 for chunked-encoding, 0 for no content-length or to a positive value
+// latencies is "<rtp>:<http>[:f][:p|:x][:a]" in ms, 'f' fills gaps with silence. A slow HTTP client
+// loses its oldest queued audio, unless 'p' holds reading frames for all or 'x' disconnects it. With
+// 'a', HTTP prefill and resend deadline adapt to the network, using the latencies as ceilings
+// stream_codec is the default output, HTTP clients can request another format by URL extension
+// (.pcm, .wav, .flac, .mp3) or Accept header, each format is encoded once for all its listeners
+// when pcm_cb is set, there is no HTTP server, decoded audio is given to it ~100ms before its
+// playtime (codec is unused) and RAOP_STREAM has port 0. It can block to pace the stream
 struct raopsr_s* raopsr_create(struct in_addr host, struct mdnsd *svr, char *name,
 						  char *model, unsigned char mac[6], char *stream_codec, bool stream_metadata,
 						  bool drift, bool flush, char *latencies, void *owner,
-						  raopsr_cb_t raop_cb, raop_http_cb_t http_cb,
+						  raopsr_cb_t raop_cb, raop_http_cb_t http_cb, raop_pcm_cb_t pcm_cb,
 						  unsigned short port_base, unsigned short port_range,
 						  int http_length);
 void	raopsr_update(struct raopsr_s *ctx, char *name, char *model);
 void  	raopsr_delete(struct raopsr_s *ctx);
 void	raopsr_notify(struct raopsr_s *ctx, raopsr_event_t event, void *param);
+// capture sessions set up from now on in dir (NULL to stop), see raopst_replay
+// WARNING: a capture contains the session's AES key and IV IN CLEAR, so the audio of the whole
+// session can be decrypted from it. Files are created readable by owner only, keep them private
+void	raopsr_capture(struct raopsr_s *ctx, char *dir);
+// artwork is stored once per content for all servers, budget (bytes) is what is kept for images
+// no session uses anymore. When set, scale_cb makes once per image (malloc'ed) what ICY points to
+void	raopsr_artwork(size_t budget, raop_artwork_scale_cb_t scale_cb);
 
 void	raopsr_metadata_free(raopsr_metadata_t* data);
 void	raopsr_metadata_copy(raopsr_metadata_t* dst, raopsr_metadata_t *src);
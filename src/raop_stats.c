@@ -0,0 +1,230 @@
+/*
+ * RAOP : formatting of streamer statistics
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+
+#include "raop_stats.h"
+
+typedef struct {
+	char *data;
+	size_t len, size;
+} text_t;
+
+/*---------------------------------------------------------------------------*/
+static void append(text_t *text, const char *fmt, ...) {
+	va_list args;
+	int len;
+
+	if (!text->data) return;
+
+	va_start(args, fmt);
+	len = vsnprintf(text->data + text->len, text->size - text->len, fmt, args);
+	va_end(args);
+
+	if (len < 0) return;
+
+	// not enough room, grow and do it again
+	if (text->len + len >= text->size) {
+		text->size = (text->len + len + 1) * 2;
+		text->data = realloc(text->data, text->size);
+		if (!text->data) return;
+		va_start(args, fmt);
+		vsnprintf(text->data + text->len, text->size - text->len, fmt, args);
+		va_end(args);
+	}
+
+	text->len += len;
+}
+
+/*---------------------------------------------------------------------------*/
+static void append_array(text_t *text, const uint32_t *values, int count) {
+	append(text, "[");
+	for (int i = 0; i < count; i++) append(text, "%s%u", i ? "," : "", values[i]);
+	append(text, "]");
+}
+
+/*---------------------------------------------------------------------------*/
+static void append_time(text_t *text, const char *name, raopst_time_t *time) {
+	append(text, "\"%s\":{\"count\":%u,\"avg\":%u,\"max\":%u}", name, time->count, time->avg, time->max);
+}
+
+/*---------------------------------------------------------------------------*/
+static void append_lock_time(text_t *text, const char *name, uint32_t count, uint64_t total, uint32_t max, const uint32_t *histogram) {
+	append(text, "\"%s\":{\"avg\":%u,\"max\":%u,\"histogram\":", name, count ? (uint32_t) (total / count) : 0, max);
+	append_array(text, histogram, RAOP_LOCK_BUCKETS);
+	append(text, "}");
+}
+
+/*---------------------------------------------------------------------------*/
+char *stats_json(raopst_stats_t *stats, raop_lock_stats_t *locks) {
+	text_t text = { malloc(2048), 0, 2048 };
+
+	append(&text, "{\"buffer\":{\"level\":%d,\"latency\":%u,\"histogram\":", stats->buffer.level, stats->buffer.latency);
+	append_array(&text, stats->buffer.histogram, RAOPST_FILL_BUCKETS);
+	append(&text, "},\"frames\":{\"received\":%u,\"late\":%u,\"duplicate\":%u,\"silent\":%u,\"filled\":%u,"
+			"\"missing\":%u,\"requested\":%u,\"recovered\":%u,\"abandoned\":%u},",
+			stats->frames.received, stats->frames.late, stats->frames.duplicate, stats->frames.silent, stats->frames.filled,
+			stats->frames.missing, stats->frames.requested, stats->frames.recovered, stats->frames.abandoned);
+	append(&text, "\"drift\":{\"locked\":%s,\"ppm\":%.2f,\"correction\":%.2f,\"adjusted\":%" PRId64 ",\"corrections\":%u},",
+			stats->drift.locked ? "true" : "false", stats->drift.ppm, stats->drift.correction,
+			stats->drift.adjusted, stats->drift.corrections);
+	append(&text, "\"ntp\":{\"accepted\":%u,\"rejected\":%u,\"rtt_min\":%u,\"rtt_last\":%u,\"jitter\":%.0f,\"histogram\":",
+			stats->ntp.accepted, stats->ntp.rejected, stats->ntp.rtt_min, stats->ntp.rtt_last, stats->ntp.jitter);
+	append_array(&text, stats->ntp.histogram, RAOPST_RTT_BUCKETS);
+	append(&text, "},\"stages\":{");
+	append_time(&text, "fetch", &stats->stages.fetch);
+	append(&text, ",");
+	append_time(&text, "encode", &stats->stages.encode);
+	append(&text, ",");
+	append_time(&text, "send", &stats->stages.send);
+	append(&text, "},\"http\":{\"clients\":%u,\"stalls\":%u,\"dropped\":%u},",
+			stats->http.clients, stats->http.stalls, stats->http.dropped);
+	append(&text, "\"adaptive\":{\"enabled\":%s,\"prefill\":%u,\"target\":%u,\"deadline\":%u,\"jitter\":%.1f,"
+			"\"late\":%d,\"burst\":%u,\"recovery\":%u,\"decisions\":%u}",
+			stats->adaptive.enabled ? "true" : "false", stats->adaptive.prefill, stats->adaptive.target,
+			stats->adaptive.deadline, stats->adaptive.jitter, stats->adaptive.late, stats->adaptive.burst,
+			stats->adaptive.recovery, stats->adaptive.decisions);
+
+	// only sites that have been used while profiling
+	if (locks) {
+		append(&text, ",\"locks\":[");
+		for (int i = 0; i < locks->count; i++) {
+			raop_lock_site_t *site = locks->sites + i;
+			append(&text, "%s{\"site\":\"%s:%d\",\"count\":%u,\"contended\":%u,", i ? "," : "",
+					site->func, site->line, site->count, site->contended);
+			append_lock_time(&text, "wait", site->count, site->wait_total, site->wait_max, site->wait);
+			append(&text, ",");
+			append_lock_time(&text, "hold", site->count, site->hold_total, site->hold_max, site->hold);
+			append(&text, "}");
+		}
+		append(&text, "]");
+	}
+
+	append(&text, "}\n");
+
+	return text.data;
+}
+
+/*---------------------------------------------------------------------------*/
+// buckets must be cumulative and last one is +Inf, labels are "" or end with a ','
+static void append_buckets(text_t *text, const char *name, const char *labels, const uint32_t *values, int count, double unit) {
+	uint64_t total = 0;
+
+	for (int i = 0; i < count; i++) {
+		total += values[i];
+		// bucket n (n > 0) is [unit*2^(n-1), unit*2^n)
+		if (i < count - 1) append(text, "%s_bucket{%sle=\"%g\"} %" PRIu64 "\n", name, labels, unit * (1 << i), total);
+	}
+	append(text, "%s_bucket{%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, total);
+}
+
+/*---------------------------------------------------------------------------*/
+static void append_histogram(text_t *text, const char *name, const uint32_t *values, int count, double unit) {
+	append(text, "# TYPE %s histogram\n", name);
+	append_buckets(text, name, "", values, count, unit);
+}
+
+/*---------------------------------------------------------------------------*/
+char *stats_openmetrics(raopst_stats_t *stats, raop_lock_stats_t *locks) {
+	text_t text = { malloc(4096), 0, 4096 };
+	struct {
+		char *kind;
+		uint32_t value;
+	} frames[] = { { "received", stats->frames.received }, { "late", stats->frames.late }, { "duplicate", stats->frames.duplicate },
+				   { "silent", stats->frames.silent }, { "filled", stats->frames.filled }, { "missing", stats->frames.missing },
+				   { "requested", stats->frames.requested }, { "recovered", stats->frames.recovered }, { "abandoned", stats->frames.abandoned } };
+	struct {
+		char *stage;
+		raopst_time_t *time;
+	} stages[] = { { "fetch", &stats->stages.fetch }, { "encode", &stats->stages.encode }, { "send", &stats->stages.send } };
+
+	append(&text, "# TYPE raop_buffer_level gauge\nraop_buffer_level %d\n", stats->buffer.level);
+	append(&text, "# TYPE raop_latency_seconds gauge\nraop_latency_seconds %g\n", stats->buffer.latency / 1E3);
+	// fill is an integer, so bucket [2^(n-1), 2^n) is le 2^n - 1 (and 0 is empty)
+	append(&text, "# TYPE raop_buffer_fill histogram\n");
+	uint64_t total = 0;
+	for (int i = 0; i < RAOPST_FILL_BUCKETS; i++) {
+		total += stats->buffer.histogram[i];
+		if (i < RAOPST_FILL_BUCKETS - 1) append(&text, "raop_buffer_fill_bucket{le=\"%u\"} %" PRIu64 "\n", (1u << i) - 1, total);
+	}
+	append(&text, "raop_buffer_fill_bucket{le=\"+Inf\"} %" PRIu64 "\n", total);
+
+	append(&text, "# TYPE raop_frames counter\n");
+	for (size_t i = 0; i < sizeof(frames) / sizeof(*frames); i++) {
+		append(&text, "raop_frames_total{kind=\"%s\"} %u\n", frames[i].kind, frames[i].value);
+	}
+
+	append(&text, "# TYPE raop_drift_locked gauge\nraop_drift_locked %d\n", stats->drift.locked);
+	append(&text, "# TYPE raop_drift_ppm gauge\nraop_drift_ppm %.2f\n", stats->drift.ppm);
+	append(&text, "# TYPE raop_drift_correction_ppm gauge\nraop_drift_correction_ppm %.2f\n", stats->drift.correction);
+	append(&text, "# TYPE raop_drift_adjusted_samples gauge\nraop_drift_adjusted_samples %" PRId64 "\n", stats->drift.adjusted);
+	append(&text, "# TYPE raop_drift_corrections counter\nraop_drift_corrections_total %u\n", stats->drift.corrections);
+
+	append(&text, "# TYPE raop_ntp_exchanges counter\n");
+	append(&text, "raop_ntp_exchanges_total{result=\"accepted\"} %u\n", stats->ntp.accepted);
+	append(&text, "raop_ntp_exchanges_total{result=\"rejected\"} %u\n", stats->ntp.rejected);
+	append(&text, "# TYPE raop_ntp_rtt_min_seconds gauge\nraop_ntp_rtt_min_seconds %g\n", stats->ntp.rtt_min / 1E6);
+	append(&text, "# TYPE raop_ntp_jitter_seconds gauge\nraop_ntp_jitter_seconds %g\n", stats->ntp.jitter / 1E6);
+	append_histogram(&text, "raop_ntp_rtt_seconds", stats->ntp.histogram, RAOPST_RTT_BUCKETS, 250E-6);
+
+	append(&text, "# TYPE raop_stage_avg_seconds gauge\n");
+	for (size_t i = 0; i < sizeof(stages) / sizeof(*stages); i++) {
+		append(&text, "raop_stage_avg_seconds{stage=\"%s\"} %g\n", stages[i].stage, stages[i].time->avg / 1E6);
+	}
+	append(&text, "# TYPE raop_stage_max_seconds gauge\n");
+	for (size_t i = 0; i < sizeof(stages) / sizeof(*stages); i++) {
+		append(&text, "raop_stage_max_seconds{stage=\"%s\"} %g\n", stages[i].stage, stages[i].time->max / 1E6);
+	}
+
+	append(&text, "# TYPE raop_http_clients gauge\nraop_http_clients %u\n", stats->http.clients);
+	append(&text, "# TYPE raop_http_stalls counter\nraop_http_stalls_total %u\n", stats->http.stalls);
+	append(&text, "# TYPE raop_http_dropped counter\nraop_http_dropped_total %u\n", stats->http.dropped);
+
+	if (stats->adaptive.enabled) {
+		append(&text, "# TYPE raop_adaptive_prefill_seconds gauge\n");
+		append(&text, "raop_adaptive_prefill_seconds{state=\"effective\"} %g\n", stats->adaptive.prefill / 1E3);
+		append(&text, "raop_adaptive_prefill_seconds{state=\"target\"} %g\n", stats->adaptive.target / 1E3);
+		append(&text, "# TYPE raop_adaptive_deadline_seconds gauge\nraop_adaptive_deadline_seconds %g\n", stats->adaptive.deadline / 1E3);
+		append(&text, "# TYPE raop_adaptive_jitter_seconds gauge\nraop_adaptive_jitter_seconds %g\n", stats->adaptive.jitter / 1E3);
+		append(&text, "# TYPE raop_adaptive_late_seconds gauge\nraop_adaptive_late_seconds %g\n", stats->adaptive.late / 1E3);
+		append(&text, "# TYPE raop_adaptive_burst_frames gauge\nraop_adaptive_burst_frames %u\n", stats->adaptive.burst);
+		append(&text, "# TYPE raop_adaptive_recovery_seconds gauge\nraop_adaptive_recovery_seconds %g\n", stats->adaptive.recovery / 1E3);
+		append(&text, "# TYPE raop_adaptive_decisions counter\nraop_adaptive_decisions_total %u\n", stats->adaptive.decisions);
+	}
+
+	if (locks && locks->count) {
+		char labels[128];
+
+		append(&text, "# TYPE raop_lock_acquired counter\n");
+		for (int i = 0; i < locks->count; i++) {
+			append(&text, "raop_lock_acquired_total{site=\"%s:%d\"} %u\n", locks->sites[i].func, locks->sites[i].line, locks->sites[i].count);
+		}
+		append(&text, "# TYPE raop_lock_contended counter\n");
+		for (int i = 0; i < locks->count; i++) {
+			append(&text, "raop_lock_contended_total{site=\"%s:%d\"} %u\n", locks->sites[i].func, locks->sites[i].line, locks->sites[i].contended);
+		}
+		append(&text, "# TYPE raop_lock_wait_seconds histogram\n");
+		for (int i = 0; i < locks->count; i++) {
+			snprintf(labels, sizeof(labels), "site=\"%s:%d\",", locks->sites[i].func, locks->sites[i].line);
+			append_buckets(&text, "raop_lock_wait_seconds", labels, locks->sites[i].wait, RAOP_LOCK_BUCKETS, 1E-6);
+		}
+		append(&text, "# TYPE raop_lock_hold_seconds histogram\n");
+		for (int i = 0; i < locks->count; i++) {
+			snprintf(labels, sizeof(labels), "site=\"%s:%d\",", locks->sites[i].func, locks->sites[i].line);
+			append_buckets(&text, "raop_lock_hold_seconds", labels, locks->sites[i].hold, RAOP_LOCK_BUCKETS, 1E-6);
+		}
+	}
+	append(&text, "# EOF\n");
+
+	return text.data;
+}
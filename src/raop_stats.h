@@ -0,0 +1,20 @@
+/*
+ * RAOP : formatting of streamer statistics
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include "raop_streamer.h"
+#include "raop_lock.h"
+
+#define STATS_JSON_MIME			"application/json"
+#define STATS_OPENMETRICS_MIME	"application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+// returned strings must be freed by caller, locks can be NULL
+char*	stats_json(raopst_stats_t *stats, raop_lock_stats_t *locks);
+char*	stats_openmetrics(raopst_stats_t *stats, raop_lock_stats_t *locks);
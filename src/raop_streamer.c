@@ -12,35 +12,51 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <ctype.h>
+#include <math.h>
 
 #include <pthread.h>
-#include <openssl/aes.h>
+#include <openssl/evp.h>
 
 #include "platform.h"
+#if !WIN
+#include <fcntl.h>
+#endif
 #include "raop_server.h"
 #include "raop_streamer.h"
 #include "encoder.h"
+#include "raop_encoder.h"
+#include "resampler.h"
+#include "raop_clock.h"
+#include "raop_resend.h"
+#include "raop_jitter.h"
+#include "raop_capture.h"
+#include "raop_stats.h"
+#include "raop_reactor.h"
+#include "raop_lock.h"
 #include "alac.h"
 
 #include "cross_net.h"
 #include "cross_log.h"
+#include "raop_log.h"
+#include "raop_trace.h"
 #include "cross_util.h"
 
 #define NTP2MS(ntp) ((((ntp) >> 10) * 1000L) >> 22)
 #define MS2NTP(ms) (((((uint64_t) (ms)) << 22) / 1000) << 10)
+#define NTP2US(ntp) (((ntp) >> 32) * 1000000 + ((((ntp) & 0xffffffff) * 1000000) >> 32))
 #define NTP2TS(ntp, rate) ((((ntp) >> 16) * (rate)) >> 16)
 #define TS2NTP(ts, rate)  (((((uint64_t) (ts)) << 16) / (rate)) << 16)
 #define MS2TS(ms, rate) ((((uint64_t) (ms)) * (rate)) / 1000)
 #define TS2MS(ts, rate) NTP2MS(TS2NTP(ts,rate))
 
-#define GAP_THRES	8
-#define GAP_COUNT	20
+// clock gap is absorbed by resampling over that period, within a ppm limit
+#define DRIFT_HORIZON	10000		// ms
+#define DRIFT_MAX_PPM	1000
 
 extern log_level 	raop_loglevel;
 static log_level 	*loglevel = &raop_loglevel;
 
-// #define __RTP_STORE
-
 // default buffer size
 #define BUFFER_FRAMES 2048
 #define MAX_PACKET    2048
@@ -49,42 +65,125 @@ static log_level 	*loglevel = &raop_loglevel;
 #define RTP_SYNC 0x01
 #define NTP_SYNC 0x02
 
-#define RESEND_TO	150
+#define RESEND_DEADLINE	1000	// ms, when playtime of a missing frame is not known yet
+#define ADAPTIVE_PREFILL	1000	// ms, prefill ceiling in adaptive mode when no http latency is set
 
 #define ICY_LEN_MAX	 (255*16+1)
 
+// bounded HTTP output queue (encoded data not yet accepted by the socket)
+#define HTTP_QUEUE_SIZE		(256*1024)
+#define HTTP_QUEUE_FRAMES	1024
+#define HTTP_QUEUE_HIGH		((HTTP_QUEUE_SIZE * 3) / 4)
+
+// configured codec plus formats requested by HTTP clients, each encoded once
+#define HTTP_FORMATS	4
+#define HTTP_CLIENTS	4
+#define HTTP_HEAD_MAX	8192
+
+#define SINK_LEAD		100		// ms, how early frames are given to a PCM sink
+
+#if WIN
+#define SOCKET_WOULDBLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+#define SOCKET_WOULDBLOCK() (errno == EAGAIN || errno == EWOULDBLOCK)
+#endif
+
 enum { DATA, CONTROL, TIMING };
 
 typedef uint16_t seq_t;
 typedef struct audio_buffer_entry {   // decoded audio packets
 	bool ready, missed;
-	uint32_t rtptime, last_resend;
+	uint32_t rtptime;
 	int16_t *data;
 	int len;
 } abuf_t;
+
+typedef struct http_queue_s {	// encoded frames waiting for HTTP socket
+	uint8_t *buffer;
+	size_t size, head, fill;
+	size_t lens[HTTP_QUEUE_FRAMES];
+	int first, count;
+} http_queue_t;
+
+typedef struct bytes_s {
+	uint8_t *buffer;
+	size_t size, len, pos;
+} bytes_t;
+
+// what to do when an HTTP client does not read fast enough
+typedef enum { HTTP_DROP = 0, HTTP_PAUSE, HTTP_CLOSE } http_policy_t;
+
+typedef struct http_stream_s {	// one output format, shared by all clients requesting it
+	char *codec;
+	struct encoder_s *encoder;
+	struct raopenc_s *job;
+	size_t icy_interval;
+	uint8_t *cache;				// last CACHE_SIZE bytes, for re-send and late listeners
+	size_t count;
+	bool active;				// fed with frames since first request (until flush)
+	bool headed;				// codec has a stream header that decoders need (flac, wav)
+	bytes_t header;				// first encoded data since restart, it starts with that header
+} http_stream_t;
+
+typedef struct http_client_s {
+	int sock;
+	struct reactor_event_s *event;
+	http_stream_t *stream;
+	http_queue_t queue;
+	bytes_t frame, wire;		// popped frame and its HTTP (chunk/ICY) formatted version
+	struct {
+		bool active;
+		size_t remain;
+		uint32_t version;
+	} icy;
+	bool ready, stalled;
+	enum { HTTP_HEAD, HTTP_REQUEST, HTTP_SERVE } state;	// changed with ab_mutex, request is served by a job
+	bytes_t head;				// request head being received
+	int events;					// what reactor waits for
+	bool catchup;				// sent from cache up to live data, not queued to yet
+	size_t cursor;				// next byte of cache to send when catching up
+	bool closing;				// one-shot answer, closed once sent
+} http_client_t;
+
+// formats that can be requested by URL extension (or name) or by Accept header
+static const struct {
+	char *name, *mime, *codec;
+} http_formats[] = {
+	{ "pcm", "audio/l16", "pcm" },
+	{ "wav", "audio/wav", "wav" },
+	{ "wav", "audio/x-wav", "wav" },
+	{ "flac", "audio/flac", "flc" },
+	{ "flc", "audio/x-flac", "flc" },
+	{ "mp3", "audio/mpeg", "mp3:320" },
+	{ NULL, NULL, NULL }
+};
  
 typedef struct raopst_s {
-#ifdef __RTP_STORE
-	FILE *rtpIN, *rtpOUT, *httpOUT;
-#endif
 	bool running;
+	bool parked;			// between sessions, sockets are kept but nothing is processed
 	unsigned char aesiv[16];
-	AES_KEY aes;
+	EVP_CIPHER_CTX *cipher;	// key is set once, IV is reset for each packet
 	bool decrypt, range;
 	int frame_size;
 	int in_frames, out_frames;
 	struct in_addr host, peer;
 	struct sockaddr_in rtp_host;
-	struct encoder_s* encoder;
+	http_stream_t streams[HTTP_FORMATS];	// first one is the configured codec
+	http_client_t clients[HTTP_CLIENTS];
 	struct {
 		unsigned short rport, lport;
 		int sock;
 	} rtp_sockets[3]; 					 // data, control, timing
 	struct timing_s {
 		bool drift;
-		uint64_t local, remote, rtp_remote;
-		uint32_t count, gap_count;
-		int64_t gap_sum, gap_adjust;
+		uint64_t rtp_remote;
+		uint32_t next;			// when to send next timing request
+		struct raopclk_s *clock;
+		bool locked;
+		uint64_t reference;		// local time (us) from which gap is measured
+		int64_t gap_adjust;		// in samples, added (or removed) by resampler
+		double ratio;			// resampling ratio, only accessed with ab_mutex
+		raopclk_status_t status;	// last clock status, for statistics
 	} timing;
 	struct {
 		uint32_t 	rtp, time;
@@ -93,22 +192,42 @@ typedef struct raopst_s {
 	} synchro;
 	int latency;			// rtp hold depth in samples
 	int delay;              // http startup silence fill frames
-	uint32_t resent_frames;	// total recovered frames
+	struct resend_s *resend;	// missing frames and their resend requests
+	struct {
+		struct jitter_s *estimator;	// only in adaptive mode
+		uint32_t prefill;		// frames, in effect (changed at flush or while silent)
+		uint32_t deadline;		// ms, resend deadline in effect
+	} adaptive;
 	uint32_t silent_frames;	// total silence frames
 	uint32_t silence_count;	// counter for startup silence frames
 	uint32_t filled_frames;    // silence frames in current silence episode
 	bool http_fill;         // fill when missing or just wait
 	bool pause;				// set when pause and silent frames must be produced
-	int skip;				// number of frames to skip to keep sync alignement
+	bool warm;				// flushed while playing, HTTP and encoders are kept until next packet
+	struct resampler_s *resampler;
 	abuf_t audio_buffer[BUFFER_FRAMES];
 	int http_listener;
+	unsigned short http_port;
 	seq_t ab_read, ab_write;
-	pthread_mutex_t ab_mutex;
-	pthread_t http_thread, rtp_thread;
+	raop_lock_t ab_mutex;
+	pthread_t sink_thread;
+	struct rtp_owner_s {
+		struct raopst_s *ctx;
+		struct reactor_event_s *timer;
+	} rtp;					// RTP events have their own owner so that they run in parallel with HTTP ones
+	struct reactor_event_s *http_timer;
+	struct notify_owner_s {
+		struct raopst_s *ctx;
+		struct reactor_event_s *job;
+		bool play;
+	} notify;				// owner's callback might block, so it's done by a job
+	struct request_owner_s {
+		struct raopst_s *ctx;
+		struct reactor_event_s *job;
+	} request;				// same for HTTP requests, responses are then sent by http_step
 	struct {
-		bool enabled, active;
-		size_t interval, remain;
-		bool  updated;
+		bool enabled;
+		uint32_t version;	// bumped on metadata change, each client tracks what it sent
 	} icy;
 	raopsr_metadata_t metadata;
 	char *silence_frame;
@@ -119,10 +238,36 @@ typedef struct raopst_s {
 	raopst_cb_t event_cb;
 	raop_http_cb_t http_cb;
 	void *owner;
-	uint8_t *http_cache;
-	size_t http_count;
+	uint32_t http_frames;	// frames given to encoders since (re)start
+	uint32_t http_queued, stages_logged;	// for logging
 	int http_length;
 	bool close_socket;
+	struct {
+		http_policy_t policy;
+		uint32_t dropped, stalls;
+	} output;
+	struct {
+		raop_timing_t fetch, send;	// encode is measured by encoder's stage
+	} timing_stages;
+	struct {
+		uint32_t fill[RAOPST_FILL_BUCKETS], rtt[RAOPST_RTT_BUCKETS];
+		uint32_t received, late, duplicate, filled, corrections;
+	} stats;				// what is not already counted elsewhere
+	struct capture_s *capture;
+	struct {
+		char *codec, *latencies, *fmtp;
+		unsigned char aeskey[16];
+	} session;				// what is needed to re-create the session from a capture
+	struct {
+		bool active;
+		uint64_t now, out;	// virtual clock and when next frame can be output, in us
+	} replay;
+	struct {
+		raop_pcm_cb_t cb;	// when set, audio goes there instead of HTTP
+		int16_t *buffer;
+		size_t size;
+		bool thread;
+	} sink;
 } raopst_t;
 
 #define BUFIDX(seqno) ((seq_t)(seqno) % BUFFER_FRAMES)
@@ -130,17 +275,45 @@ static void 	buffer_alloc(abuf_t *audio_buffer, int size);
 static void 	buffer_release(abuf_t *audio_buffer);
 static void 	buffer_reset(abuf_t *audio_buffer);
 
-static bool 	rtp_request_resend(raopst_t *ctx, seq_t first, seq_t last);
+static bool 	rtp_request_resend(void *arg, seq_t first, seq_t last);
 static bool 	rtp_request_timing(raopst_t *ctx);
-static void*	rtp_thread_func(void *arg);
-
-static void*	http_thread_func(void *arg);
-static bool 	handle_http(raopst_t *ctx, int sock);
+static void		rtp_read(void *owner, int sock, int events);
+static uint32_t	rtp_tick(void *owner);
+
+static void		http_accept(void *owner, int sock, int events);
+static void		http_io(void *owner, int sock, int events);
+static uint32_t	http_tick(void *owner);
+static uint32_t	http_step(raopst_t *ctx);
+static uint32_t	notify_job(void *owner);
+static uint32_t	http_request_job(void *owner);
+static void*	sink_thread_func(void *arg);
+static bool 	handle_http(raopst_t *ctx, http_client_t *client);
+static bool 	http_enqueue(raopst_t *ctx, http_client_t *client, uint8_t *data, size_t bytes);
+static bool 	http_drain(raopst_t *ctx, http_client_t *client);
+static void 	http_queue_reset(http_client_t *client);
+static bool		stream_open(http_stream_t *stream, char *codec, int frame_size);
+static void		streams_restart(raopst_t *ctx);
+static void		adaptive_update(raopst_t *ctx);
 
 static int	  	seq_order(seq_t a, seq_t b);
 
+static void		rtp_process(raopst_t *ctx, char *packet, ssize_t plen);
+static bool		decrypt_init(raopst_t *ctx, char *aeskey, char *aesiv);
+static void		capture_session(raopst_t *ctx);
+
 /*---------------------------------------------------------------------------*/
-static alac_file* alac_init(int fmtp[32]) {
+// time seen by the RTP side and jitter buffer, virtual when replaying a capture
+static uint64_t clock_us(raopst_t *ctx) {
+	return ctx->replay.active ? ctx->replay.now : gettime_us();
+}
+
+/*---------------------------------------------------------------------------*/
+static uint32_t clock_ms(raopst_t *ctx) {
+	return ctx->replay.active ? ctx->replay.now / 1000 : gettime_ms();
+}
+
+/*---------------------------------------------------------------------------*/
+static alac_file* alac_init(int fmtp[12]) {
 	int sample_size = fmtp[3];
 
 	if (sample_size != 16) {
@@ -151,7 +324,7 @@ static alac_file* alac_init(int fmtp[32]) {
 	alac_file* alac = create_alac(sample_size, 2);
 
 	if (!alac) {
-		LOG_ERROR("cannot create alac codec", NULL);
+		LOG_ERROR("cannot create alac codec");
 		return NULL;
 	}
 
@@ -172,19 +345,122 @@ static alac_file* alac_init(int fmtp[32]) {
 }
 
 /*---------------------------------------------------------------------------*/
-raopst_resp_t raopst_init(struct in_addr host, struct in_addr peer, char *codec, bool metadata,
+static bool stream_open(http_stream_t *stream, char *codec, int frame_size) {
+	stream->encoder = encoder_create(codec, 44100, 2, 2, 0, &stream->icy_interval);
+	if (!stream->encoder) return false;
+
+	// encoding is done by a separated stage, out of HTTP thread
+	stream->job = raopenc_create(stream->encoder, frame_size * 4);
+	stream->cache = malloc(CACHE_SIZE);
+
+	if (!stream->job || !stream->cache) {
+		raopenc_delete(stream->job);
+		encoder_delete(stream->encoder);
+		NFREE(stream->cache);
+		memset(stream, 0, sizeof(http_stream_t));
+		return false;
+	}
+
+	stream->codec = strdup(codec);
+	stream->headed = !strncasecmp(codec, "flc", 3) || !strncasecmp(codec, "wav", 3);
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called with ab_mutex locked, encoders will re-open and caches are emptied
+static void streams_restart(raopst_t *ctx) {
+	ctx->http_frames = 0;
+	resampler_reset(ctx->resampler);
+	for (int i = 0; i < HTTP_FORMATS; i++) {
+		if (!ctx->streams[i].job) continue;
+		ctx->streams[i].count = 0;
+		raopenc_restart(ctx->streams[i].job);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called with ab_mutex locked, buffered audio is dropped and HTTP clients are closed
+static void session_restart(raopst_t *ctx) {
+	buffer_reset(ctx->audio_buffer);
+	resend_reset(ctx->resend);
+	ctx->state = RTP_WAIT;
+	ctx->warm = false;
+	ctx->synchro.first = false;
+	ctx->http_ready = false;
+	ctx->close_socket = true;
+	ctx->ab_read = ctx->ab_write + 1;
+	streams_restart(ctx);
+	// formats will be re-activated by new requests
+	for (int i = 0; i < HTTP_FORMATS; i++) ctx->streams[i].active = false;
+}
+
+/*---------------------------------------------------------------------------*/
+// find (or create) the stream for requested format, defaulting to configured one
+static http_stream_t *stream_select(raopst_t *ctx, char *resource, char *accept) {
+	char *name, *ext, *codec = NULL;
+	char mime[128];
+
+	// use extension of last path element or that element itself (ignore query)
+	resource[strcspn(resource, "?")] = '\0';
+	name = strrchr(resource, '/');
+	name = name ? name + 1 : resource;
+	if ((ext = strrchr(name, '.')) != NULL) name = ext + 1;
+
+	// mime types are case-insensitive
+	strncpy(mime, accept ? accept : "", sizeof(mime) - 1);
+	mime[sizeof(mime) - 1] = '\0';
+	for (char *p = mime; *p; p++) *p = tolower((unsigned char) *p);
+
+	// URL wins over Accept header
+	for (int i = 0; !codec && http_formats[i].name; i++) if (!strcasecmp(name, http_formats[i].name)) codec = http_formats[i].codec;
+	for (int i = 0; !codec && http_formats[i].name; i++) if (strstr(mime, http_formats[i].mime)) codec = http_formats[i].codec;
+
+	if (!codec) return ctx->streams;
+
+	// configured codec already has the requested format (with its own options)
+	size_t len = strcspn(codec, ":");
+	if (!strncasecmp(ctx->streams[0].codec, codec, len) && strcspn(ctx->streams[0].codec, ":") == len) return ctx->streams;
+
+	for (int i = 1; i < HTTP_FORMATS; i++) {
+		http_stream_t *stream = ctx->streams + i;
+
+		if (stream->codec && !strcmp(stream->codec, codec)) return stream;
+		if (stream->codec) continue;
+
+		// lazily start that encoder, it will be fed from now on
+		if (stream_open(stream, codec, ctx->frame_size)) {
+			LOG_INFO("[%p]: starting %s encoder", ctx, codec);
+			return stream;
+		}
+
+		LOG_WARN("[%p]: can't create %s encoder", ctx, codec);
+		break;
+	}
+
+	return ctx->streams;
+}
+
+/*---------------------------------------------------------------------------*/
+// offline streamer has no socket and no thread, it is fed by a capture replay
+static raopst_resp_t streamer_init(struct in_addr host, struct in_addr peer, char *codec, bool metadata,
 								bool drift, bool range, char *latencies,
 								char *aeskey, char *aesiv, char *fmtpstr,
 								short unsigned pCtrlPort, short unsigned pTimingPort,
 								void *owner,
-								raopst_cb_t event_cb, raop_http_cb_t http_cb,
+								raopst_cb_t event_cb, raop_http_cb_t http_cb, raop_pcm_cb_t pcm_cb,
 								unsigned short port_base, unsigned short port_range,
-								int http_length) {
+								int http_length, bool offline) {
 	char *arg, *p;
 	int fmtp[12];
 	bool rc = true;
-	raopst_t *ctx = calloc(1, sizeof(raopst_t));
 	raopst_resp_t resp = { 0, 0, 0, 0, NULL };
+
+	if (!fmtpstr) {
+		LOG_ERROR("no fmtp, can't start session", NULL);
+		return resp;
+	}
+
+	raopst_t *ctx = calloc(1, sizeof(raopst_t));
 	struct {
 		unsigned short count, offset;
 	} port = { 0 };
@@ -193,48 +469,56 @@ raopst_resp_t raopst_init(struct in_addr host, struct in_addr peer, char *codec,
 
 	if (!ctx) return resp;
 	
-	ctx->http_cache = malloc(CACHE_SIZE);
 	ctx->http_length = http_length;
 	ctx->host = host;
 	ctx->peer = peer;
 	ctx->rtp_host.sin_family = AF_INET;
 	ctx->rtp_host.sin_addr.s_addr = INADDR_ANY;
-	pthread_mutex_init(&ctx->ab_mutex, 0);
+	raop_lock_init(&ctx->ab_mutex);
 	ctx->first_seqno = -1;
 
-	// create the encoder
-	ctx->encoder = encoder_create(codec, 44100, 2, 2, 0, &ctx->icy.interval);
+	for (int i = 0; i < HTTP_CLIENTS; i++) ctx->clients[i].sock = -1;
 
 	ctx->icy.enabled = metadata;
 	ctx->latency = atoi(latencies);
 	ctx->latency = (ctx->latency * 44100) / 1000;
 	if (strstr(latencies, ":f")) ctx->http_fill = true;
+	// like blocking sockets did, a slow client loses audio by default but does not hold the others
+	if (strstr(latencies, ":p")) ctx->output.policy = HTTP_PAUSE;
+	else if (strstr(latencies, ":x")) ctx->output.policy = HTTP_CLOSE;
 	ctx->event_cb = event_cb;
 	ctx->http_cb = http_cb;
+	ctx->sink.cb = pcm_cb;
 	ctx->owner = owner;
 	ctx->timing.drift = drift;
+	ctx->timing.ratio = 1;
+	ctx->timing.clock = raopclk_create();
+	ctx->resend = resend_create(BUFFER_FRAMES);
+	ctx->capture = capture_create();
 	ctx->range = range;
+	ctx->http_listener = -1;
+	for (int i = 0; i < 3; i++) ctx->rtp_sockets[i].sock = -1;
 
 	// write pointer = last written, read pointer = next to read so fill = w-r+1
 	ctx->ab_read = ctx->ab_write + 1;
 
-#ifdef __RTP_STORE
-	ctx->rtpIN = fopen("airplay.rtpin", "wb");
-	ctx->rtpOUT = fopen("airplay.rtpout", "wb");
-	ctx->httpOUT = fopen("airplay.httpout", "wb");
-#endif
-
 	ctx->rtp_sockets[CONTROL].rport = pCtrlPort;
 	ctx->rtp_sockets[TIMING].rport = pTimingPort;
 
-	if (aesiv && aeskey) {
-		memcpy(ctx->aesiv, aesiv, 16);
-		AES_set_decrypt_key((unsigned char*) aeskey, 128, &ctx->aes);
-		ctx->decrypt = true;
+	if (aesiv && aeskey && !decrypt_init(ctx, aeskey, aesiv)) {
+		LOG_ERROR("[%p]: cannot set AES key", ctx);
+		rc = false;
 	}
 
+	ctx->session.latencies = strdup(latencies);
+	ctx->session.fmtp = strdup(fmtpstr);
+
+	// parse a copy, caller's fmtp is compared when session is re-used
+	char *fmtp_copy = strdup(fmtpstr);
 	memset(fmtp, 0, sizeof(fmtp));
-	for (int i = 0; (arg = strsep(&fmtpstr, " \t")); i++) fmtp[i] = atoi(arg);
+	p = fmtp_copy;
+	for (int i = 0; i < 12 && (arg = strsep(&p, " \t")); i++) fmtp[i] = atoi(arg);
+	free(fmtp_copy);
 
 	ctx->frame_size = fmtp[1];
 	ctx->silence_frame = (char*) calloc(ctx->frame_size, 4);
@@ -243,12 +527,34 @@ raopst_resp_t raopst_init(struct in_addr host, struct in_addr peer, char *codec,
 		ctx->delay = (ctx->delay * 44100) / (ctx->frame_size * 1000);
 	}
 
+	// configured latencies become ceilings of what adaptive mode can choose
+	if (strstr(latencies, ":a")) {
+		uint32_t prefill = p && atoi(p + 1) ? atoi(p + 1) : ADAPTIVE_PREFILL;
+		ctx->adaptive.estimator = jitter_create(ctx->frame_size, prefill, ctx->latency ? (ctx->latency * 1000) / 44100 : RESEND_DEADLINE);
+		rc &= ctx->adaptive.estimator != NULL;
+		if (ctx->adaptive.estimator) adaptive_update(ctx);
+	}
+
 	// alac decoder
 	ctx->alac_codec = alac_init(fmtp);
 	rc &= ctx->alac_codec != NULL;
 
+	// drift is compensated by resampling decoded audio
+	ctx->resampler = resampler_create(ctx->frame_size);
+	rc &= ctx->resampler != NULL && ctx->timing.clock != NULL && ctx->resend != NULL && ctx->capture != NULL;
+
+	// configured codec is always available, others are created when requested (PCM sink and replay need none)
+	ctx->session.codec = strdup(codec ? codec : "");
+	if (!pcm_cb && !offline) rc &= stream_open(ctx->streams, codec, ctx->frame_size);
+
 	buffer_alloc(ctx->audio_buffer, ctx->frame_size*4);
 
+	if (offline) {
+		resp.ctx = rc ? ctx : NULL;
+		if (!rc) raopst_end(ctx);
+		return resp;
+	}
+
 	for (int i = 0; rc && i < 3; i++) {
 		do {
 			ctx->rtp_sockets[i].lport = port_base + ((port.offset + port.count++) % port_range);
@@ -260,28 +566,49 @@ raopst_resp_t raopst_init(struct in_addr host, struct in_addr peer, char *codec,
 		LOG_INFO("[%p]: UDP port-%d %hu", ctx, i, ctx->rtp_sockets[i].lport);
 	}
 
-	// create http port and start listening
-	do {
-		resp.hport = port_base + ((port.offset + port.count++) % port_range);
-		ctx->http_listener = bind_socket(ctx->host, &resp.hport, SOCK_STREAM);
-	} while (ctx->http_listener < 0 && port.count < port_range);
+	// create http port and start listening, unless audio goes to a PCM sink
+	if (!ctx->sink.cb) {
+		do {
+			resp.hport = port_base + ((port.offset + port.count++) % port_range);
+			ctx->http_listener = bind_socket(ctx->host, &resp.hport, SOCK_STREAM);
+		} while (ctx->http_listener < 0 && port.count < port_range);
+
+		int i = 128*1024;
+		setsockopt(ctx->http_listener, SOL_SOCKET, SO_SNDBUF, (void*) &i, sizeof(i));
+		rc &= ctx->http_listener > 0;
+		rc &= listen(ctx->http_listener, HTTP_CLIENTS) == 0;
+		ctx->http_port = resp.hport;
 
-	int i = 128*1024;
-	setsockopt(ctx->http_listener, SOL_SOCKET, SO_SNDBUF, (void*) &i, sizeof(i));
-	rc &= ctx->http_listener > 0;
-	rc &= listen(ctx->http_listener, 1) == 0;
+		LOG_INFO("[%p]: HTTP listening port %hu", ctx, resp.hport);
+	}
 
 	resp.cport = ctx->rtp_sockets[CONTROL].lport;
 	resp.tport = ctx->rtp_sockets[TIMING].lport;
 	resp.aport = ctx->rtp_sockets[DATA].lport;
 
-	LOG_INFO("[%p]: HTTP listening port %hu", ctx, resp.hport);
-
 	if (rc) {
 		ctx->running = true;
-		pthread_create(&ctx->rtp_thread, NULL, rtp_thread_func, (void *) ctx);
-		pthread_create(&ctx->http_thread, NULL, http_thread_func, (void *) ctx);
-	} else {
+		ctx->rtp.ctx = ctx;
+		ctx->timing.next = gettime_ms();
+
+		// timers first as socket callbacks use them
+		ctx->notify.ctx = ctx;
+		ctx->notify.job = reactor_job(notify_job, &ctx->notify);
+		ctx->rtp.timer = reactor_timer(0, rtp_tick, &ctx->rtp);
+		rc &= ctx->notify.job && ctx->rtp.timer;
+		for (int i = 0; rc && i < 3; i++) rc &= reactor_io(ctx->rtp_sockets[i].sock, REACTOR_READ, rtp_read, &ctx->rtp) != NULL;
+
+		if (rc && ctx->sink.cb) {
+			rc = ctx->sink.thread = !pthread_create(&ctx->sink_thread, NULL, sink_thread_func, (void *) ctx);
+		} else if (rc) {
+			ctx->request.ctx = ctx;
+			ctx->request.job = reactor_job(http_request_job, &ctx->request);
+			ctx->http_timer = reactor_timer(REACTOR_NEVER, http_tick, ctx);
+			rc &= ctx->request.job && ctx->http_timer && reactor_io(ctx->http_listener, REACTOR_READ, http_accept, ctx);
+		}
+	}
+
+	if (!rc) {
 		raopst_end(ctx);
 		ctx = NULL;
 	}
@@ -291,14 +618,178 @@ raopst_resp_t raopst_init(struct in_addr host, struct in_addr peer, char *codec,
 	return resp;
 }
 
+/*---------------------------------------------------------------------------*/
+raopst_resp_t raopst_init(struct in_addr host, struct in_addr peer, char *codec, bool metadata,
+								bool drift, bool range, char *latencies,
+								char *aeskey, char *aesiv, char *fmtpstr,
+								short unsigned pCtrlPort, short unsigned pTimingPort,
+								void *owner,
+								raopst_cb_t event_cb, raop_http_cb_t http_cb, raop_pcm_cb_t pcm_cb,
+								unsigned short port_base, unsigned short port_range,
+								int http_length) {
+	return streamer_init(host, peer, codec, metadata, drift, range, latencies, aeskey, aesiv, fmtpstr,
+						 pCtrlPort, pTimingPort, owner, event_cb, http_cb, pcm_cb, port_base, port_range, http_length, false);
+}
+
+/*---------------------------------------------------------------------------*/
+static void capture_session(raopst_t *ctx) {
+	uint8_t session[512], *p = session + 5;
+	char *strings[] = { ctx->session.codec, ctx->session.latencies, ctx->session.fmtp };
+
+	// flags, http length, aes key/iv then codec, latencies and fmtp strings
+	session[0] = ctx->timing.drift | (ctx->range << 1) | (ctx->icy.enabled << 2) | (ctx->decrypt << 3);
+	capture_put(session + 1, (uint32_t) ctx->http_length, 4);
+	memcpy(p, ctx->session.aeskey, 16);
+	memcpy(p + 16, ctx->aesiv, 16);
+	p += 32;
+
+	for (int i = 0; i < 3; i++) {
+		size_t len = strlen(strings[i]) + 1;
+		if (p + len > session + sizeof(session)) return;
+		memcpy(p, strings[i], len);
+		p += len;
+	}
+
+	capture_write(ctx->capture, CAPTURE_SESSION, 0, clock_us(ctx), session, p - session);
+
+	// started in the middle of a session, replay must start where we are
+	if (ctx->state != RTP_WAIT || ctx->first_seqno != -1) {
+		uint8_t record[6];
+
+		capture_put(record, ctx->state == RTP_PLAY ? (seq_t) (ctx->ab_write + 1) : ctx->first_seqno, 2);
+		capture_put(record + 2, ctx->state == RTP_PLAY || ctx->first_seqno != -1, 4);
+		capture_write(ctx->capture, CAPTURE_RECORD, 0, clock_us(ctx), record, sizeof(record));
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+bool raopst_capture(struct raopst_s *ctx, char *path) {
+	if (!path) {
+		capture_stop(ctx->capture);
+		LOG_INFO("[%p]: capture stopped", ctx);
+		return true;
+	}
+
+	if (!capture_start(ctx->capture, path)) {
+		LOG_ERROR("[%p]: can't open capture %s", ctx, path);
+		return false;
+	}
+
+	raop_lock(&ctx->ab_mutex);
+	capture_session(ctx);
+	raop_unlock(&ctx->ab_mutex);
+
+	LOG_INFO("[%p]: capturing to %s", ctx, path);
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+void raopst_capture_event(struct raopst_s *ctx, int type, const void *data, size_t len) {
+	// a record can't be larger, what is beyond is not needed for replay
+	capture_write(ctx->capture, type, 0, clock_us(ctx), data, min(len, UINT16_MAX));
+}
+
 /*---------------------------------------------------------------------------*/
 void raopst_metadata(struct raopst_s *ctx, raopsr_metadata_t *metadata) {
-	pthread_mutex_lock(&ctx->ab_mutex);
+	raop_lock(&ctx->ab_mutex);
 	// free previous metadata if we have not been able to send them yet
 	raopsr_metadata_free(&ctx->metadata);
 	raopsr_metadata_copy(&ctx->metadata, metadata);
-	ctx->icy.updated = true;
-	pthread_mutex_unlock(&ctx->ab_mutex);
+	ctx->icy.version++;
+	raop_unlock(&ctx->ab_mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+void raopst_resend_stats(struct raopst_s *ctx, struct resend_stats_s *stats) {
+	raop_lock(&ctx->ab_mutex);
+	*stats = resend_stats(ctx->resend);
+	raop_unlock(&ctx->ab_mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+void raopst_lock_stats(struct raopst_s *ctx, struct raop_lock_stats_s *stats) {
+	raop_lock(&ctx->ab_mutex);
+	raop_lock_stats(&ctx->ab_mutex, stats);
+	raop_unlock(&ctx->ab_mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+static raopst_time_t stats_time(raop_timing_t *timing) {
+	raopst_time_t time = { timing->count, timing->count ? timing->total / timing->count : 0, timing->max };
+	return time;
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called with ab_mutex locked
+static void stats_snapshot(raopst_t *ctx, raopst_stats_t *stats) {
+	resend_stats_t resend = resend_stats(ctx->resend);
+	raop_timing_t encode = { 0 };
+
+	memset(stats, 0, sizeof(raopst_stats_t));
+
+	stats->buffer.level = ctx->ab_write - ctx->ab_read + 1;
+	stats->buffer.latency = (ctx->latency * 1000) / 44100;
+	memcpy(stats->buffer.histogram, ctx->stats.fill, sizeof(ctx->stats.fill));
+
+	stats->frames.received = ctx->stats.received;
+	stats->frames.late = ctx->stats.late;
+	stats->frames.duplicate = ctx->stats.duplicate;
+	stats->frames.silent = ctx->silent_frames;
+	stats->frames.filled = ctx->stats.filled;
+	stats->frames.missing = resend.missing;
+	stats->frames.requested = resend.requested;
+	stats->frames.recovered = resend.recovered;
+	stats->frames.abandoned = resend.abandoned;
+
+	stats->drift.locked = ctx->timing.status.locked;
+	stats->drift.ppm = ctx->timing.status.ppm;
+	stats->drift.correction = (ctx->timing.ratio - 1) * 1E6;
+	stats->drift.adjusted = ctx->timing.gap_adjust;
+	stats->drift.corrections = ctx->stats.corrections;
+
+	stats->ntp.accepted = ctx->timing.status.accepted;
+	stats->ntp.rejected = ctx->timing.status.rejected;
+	stats->ntp.rtt_min = ctx->timing.status.rtt_min;
+	stats->ntp.rtt_last = ctx->timing.status.rtt_last;
+	stats->ntp.jitter = ctx->timing.status.jitter;
+	memcpy(stats->ntp.histogram, ctx->stats.rtt, sizeof(ctx->stats.rtt));
+
+	// all formats are encoded for each frame
+	for (int i = 0; i < HTTP_FORMATS; i++) {
+		if (!ctx->streams[i].job) continue;
+		raop_timing_t timing = raopenc_timing(ctx->streams[i].job);
+		encode.count = max(encode.count, timing.count);
+		encode.total += timing.total;
+		encode.max = max(encode.max, timing.max);
+	}
+
+	stats->stages.fetch = stats_time(&ctx->timing_stages.fetch);
+	stats->stages.encode = stats_time(&encode);
+	stats->stages.send = stats_time(&ctx->timing_stages.send);
+
+	for (int i = 0; i < HTTP_CLIENTS; i++) if (ctx->clients[i].ready) stats->http.clients++;
+	stats->http.stalls = ctx->output.stalls;
+	stats->http.dropped = ctx->output.dropped;
+
+	if (ctx->adaptive.estimator) {
+		jitter_status_t status = jitter_status(ctx->adaptive.estimator);
+		stats->adaptive.enabled = true;
+		stats->adaptive.prefill = (ctx->adaptive.prefill * ctx->frame_size * 1000) / 44100;
+		stats->adaptive.target = status.prefill;
+		stats->adaptive.deadline = ctx->adaptive.deadline;
+		stats->adaptive.jitter = status.jitter;
+		stats->adaptive.late = status.late;
+		stats->adaptive.burst = status.burst;
+		stats->adaptive.recovery = status.recovery;
+		stats->adaptive.decisions = status.decisions;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+void raopst_get_stats(struct raopst_s *ctx, raopst_stats_t *stats) {
+	raop_lock(&ctx->ab_mutex);
+	stats_snapshot(ctx, stats);
+	raop_unlock(&ctx->ab_mutex);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -307,65 +798,211 @@ void raopst_end(raopst_t *ctx) {
 
 	if (ctx->running) {
 		ctx->running = false;
-		pthread_join(ctx->rtp_thread, NULL);
-		pthread_join(ctx->http_thread, NULL);
+		reactor_remove_all(&ctx->rtp);
+		reactor_remove_all(ctx);
+		reactor_remove_all(&ctx->notify);
+		reactor_remove_all(&ctx->request);
+		if (ctx->sink.thread) pthread_join(ctx->sink_thread, NULL);
 	}
 
-	shutdown_socket(ctx->http_listener);
+	for (int i = 0; i < HTTP_CLIENTS; i++) if (ctx->clients[i].sock != -1) shutdown_socket(ctx->clients[i].sock);
+
+	if (ctx->http_listener > 0) shutdown_socket(ctx->http_listener);
 	for (int i = 0; i < 3; i++) if (ctx->rtp_sockets[i].sock > 0) closesocket(ctx->rtp_sockets[i].sock);
 
 	delete_alac(ctx->alac_codec);
-	encoder_delete(ctx->encoder);
+	EVP_CIPHER_CTX_free(ctx->cipher);
+	resampler_delete(ctx->resampler);
+	raopclk_delete(ctx->timing.clock);
+	capture_delete(ctx->capture);
+	jitter_delete(ctx->adaptive.estimator);
+	NFREE(ctx->session.codec);
+	NFREE(ctx->session.latencies);
+	NFREE(ctx->session.fmtp);
+
+	if (ctx->resend) {
+		resend_stats_t stats = resend_stats(ctx->resend);
+		LOG_INFO("[%p]: resend missing:%u requested:%u (retried:%u in %u requests) recovered:%u abandoned:%u", ctx, stats.missing,
+				 stats.requested, stats.retried, stats.requests, stats.recovered, stats.abandoned);
+		resend_delete(ctx->resend);
+	}
 
-	pthread_mutex_destroy(&ctx->ab_mutex);
+	for (int i = 0; i < HTTP_FORMATS; i++) {
+		http_stream_t *stream = ctx->streams + i;
+		raopenc_delete(stream->job);
+		if (stream->encoder) encoder_delete(stream->encoder);
+		NFREE(stream->cache);
+		NFREE(stream->codec);
+		NFREE(stream->header.buffer);
+	}
+
+	for (int i = 0; i < HTTP_CLIENTS; i++) {
+		http_client_t *client = ctx->clients + i;
+		free(client->queue.buffer);
+		free(client->frame.buffer);
+		free(client->wire.buffer);
+		free(client->head.buffer);
+	}
+
+	raop_lock_destroy(&ctx->ab_mutex);
 	buffer_release(ctx->audio_buffer);
 	free(ctx->silence_frame);
-	free(ctx->http_cache);
+	free(ctx->sink.buffer);
 	raopsr_metadata_free(&ctx->metadata);
 	free(ctx);
-
-#ifdef __RTP_STORE
-	fclose(ctx->rtpIN);
-	fclose(ctx->rtpOUT);
-	fclose(ctx->httpOUT);
-#endif
 }
 
 /*---------------------------------------------------------------------------*/
 bool raopst_flush(raopst_t *ctx, unsigned short seqno, unsigned int rtptime, bool exit_locked, bool silence) {
-	pthread_mutex_lock(&ctx->ab_mutex);
+	uint8_t event[7];
+
+	capture_put(event, seqno, 2);
+	capture_put(event + 2, rtptime, 4);
+	event[6] = silence;
+	capture_write(ctx->capture, CAPTURE_FLUSH, 0, clock_us(ctx), event, sizeof(event));
+
+	raop_lock(&ctx->ab_mutex);
 
 	ctx->first_seqno = seqno;
 	bool flushed = true;
 
-	if (silence) {
-		ctx->pause = true;
-	} else if (ctx->state == RTP_PLAY) {
+	if (silence && ctx->state == RTP_PLAY) {
+		// warm flush: drop what was buffered but keep HTTP clients fed with silence by same encoders
 		buffer_reset(ctx->audio_buffer);
-		ctx->state = RTP_WAIT;
-		ctx->synchro.first = false;
-		ctx->http_ready = false;
-		ctx->close_socket = true;
-		ctx->http_count = 0;
+		resend_reset(ctx->resend);
 		ctx->ab_read = ctx->ab_write + 1;
-		encoder_close(ctx->encoder);
+		ctx->state = RTP_WAIT;
+		ctx->warm = true;
+		ctx->pause = false;
+	} else if (silence) {
+		ctx->pause = true;
+	} else if (ctx->state == RTP_PLAY) {
+		session_restart(ctx);
 	} else {
 		flushed = false;
 	}
 
 	LOG_INFO("[%p]: FLUSH packets below %hu - %u", ctx, seqno, rtptime);
 
-	if (!exit_locked || !flushed) pthread_mutex_unlock(&ctx->ab_mutex);
+	if (!exit_locked || !flushed) raop_unlock(&ctx->ab_mutex);
 	return flushed;
 }
 
+/*---------------------------------------------------------------------------*/
+void raopst_park(raopst_t *ctx) {
+	capture_stop(ctx->capture);
+
+	raop_lock(&ctx->ab_mutex);
+	session_restart(ctx);
+	ctx->parked = true;
+	ctx->pause = false;
+	ctx->first_seqno = -1;
+	raopsr_metadata_free(&ctx->metadata);
+	ctx->icy.version++;
+	raop_unlock(&ctx->ab_mutex);
+
+	// HTTP clients are closed now, not when next frame comes
+	if (ctx->http_timer) reactor_timer_delay(ctx->http_timer, 0);
+
+	LOG_INFO("[%p]: session parked", ctx);
+}
+
+/*---------------------------------------------------------------------------*/
+bool raopst_reuse(raopst_t *ctx, struct in_addr peer, char *aeskey, char *aesiv, char *fmtpstr,
+				  short unsigned pCtrlPort, short unsigned pTimingPort, raopst_resp_t *resp) {
+	alac_file *alac_codec = NULL;
+
+	// no fmtp is a sender error, let a new session report it
+	if (!fmtpstr) return false;
+
+	// decoder only needs to change with fmtp, but frame size is used everywhere
+	if (!ctx->session.fmtp || strcmp(fmtpstr, ctx->session.fmtp)) {
+		char *fmtp_copy = strdup(fmtpstr), *p = fmtp_copy, *arg;
+		int fmtp[12] = { 0 };
+
+		for (int i = 0; i < 12 && (arg = strsep(&p, " \t")); i++) fmtp[i] = atoi(arg);
+		free(fmtp_copy);
+
+		if (fmtp[1] != ctx->frame_size || (alac_codec = alac_init(fmtp)) == NULL) {
+			LOG_INFO("[%p]: can't re-use session for fmtp %s", ctx, fmtpstr);
+			return false;
+		}
+	}
+
+	raop_lock(&ctx->ab_mutex);
+
+	// a parked session is not decoding, so a failed key can't hurt (it's discarded)
+	ctx->decrypt = false;
+	if (aesiv && aeskey && !decrypt_init(ctx, aeskey, aesiv)) {
+		raop_unlock(&ctx->ab_mutex);
+		if (alac_codec) delete_alac(alac_codec);
+		LOG_ERROR("[%p]: cannot set AES key, can't re-use session", ctx);
+		return false;
+	}
+
+	if (alac_codec) {
+		delete_alac(ctx->alac_codec);
+		ctx->alac_codec = alac_codec;
+		free(ctx->session.fmtp);
+		ctx->session.fmtp = strdup(fmtpstr);
+	}
+
+	ctx->peer = peer;
+	ctx->rtp_sockets[CONTROL].rport = pCtrlPort;
+	ctx->rtp_sockets[TIMING].rport = pTimingPort;
+
+	// new peer has a new clock
+	raopclk_reset(ctx->timing.clock);
+	ctx->timing.locked = false;
+	ctx->timing.rtp_remote = ctx->timing.reference = 0;
+	ctx->timing.gap_adjust = 0;
+	ctx->timing.ratio = 1;
+	ctx->timing.next = gettime_ms();
+	memset(&ctx->synchro, 0, sizeof(ctx->synchro));
+
+	// when not configured, latency is given by the sender's first sync packet
+	ctx->latency = (atoi(ctx->session.latencies) * 44100) / 1000;
+
+	ctx->state = RTP_WAIT;
+	ctx->silence = false;
+	ctx->silence_count = ctx->filled_frames = 0;
+	ctx->parked = false;
+
+	// network conditions of previous peer are meaningless
+	if (ctx->adaptive.estimator) {
+		jitter_reset(ctx->adaptive.estimator);
+		ctx->adaptive.prefill = 0;
+		adaptive_update(ctx);
+	}
+
+	raop_unlock(&ctx->ab_mutex);
+
+	// timing requests can start now
+	reactor_timer_delay(ctx->rtp.timer, 0);
+
+	resp->cport = ctx->rtp_sockets[CONTROL].lport;
+	resp->tport = ctx->rtp_sockets[TIMING].lport;
+	resp->aport = ctx->rtp_sockets[DATA].lport;
+	resp->hport = ctx->http_port;
+	resp->ctx = ctx;
+
+	LOG_INFO("[%p]: session re-used", ctx);
+	return true;
+}
+
 /*---------------------------------------------------------------------------*/
 void raopst_flush_release(raopst_t *ctx) {
-	pthread_mutex_unlock(&ctx->ab_mutex);
+	raop_unlock(&ctx->ab_mutex);
 }
 
 /*---------------------------------------------------------------------------*/
 void raopst_record(raopst_t *ctx, unsigned short seqno, unsigned rtptime) {
+	uint8_t event[6];
+
+	capture_put(event, seqno, 2);
+	capture_put(event + 2, rtptime, 4);
+	capture_write(ctx->capture, CAPTURE_RECORD, 0, clock_us(ctx), event, sizeof(event));
+
 	ctx->first_seqno = (seqno || rtptime) ? seqno : -1;
 	ctx->state = RTP_WAIT;
 	LOG_INFO("[%p]: record %hu - %u", ctx, seqno, rtptime);
@@ -398,24 +1035,91 @@ static int seq_order(seq_t a, seq_t b) {
 }
 
 /*---------------------------------------------------------------------------*/
-static void alac_decode(raopst_t *ctx, int16_t *dest, char *buf, int len, int *outsize) {
-	unsigned char packet[MAX_PACKET];
-	unsigned char iv[16];
-	int aeslen;
+// key schedule is done once per session, without padding as tail is clear
+static bool decrypt_init(raopst_t *ctx, char *aeskey, char *aesiv) {
+	memcpy(ctx->aesiv, aesiv, 16);
+	memcpy(ctx->session.aeskey, aeskey, 16);
+
+	if (!ctx->cipher && (ctx->cipher = EVP_CIPHER_CTX_new()) == NULL) return false;
+
+	ctx->decrypt = EVP_DecryptInit_ex(ctx->cipher, EVP_aes_128_cbc(), NULL, (unsigned char*) aeskey, NULL) &&
+				   EVP_CIPHER_CTX_set_padding(ctx->cipher, 0);
+
+	return ctx->decrypt;
+}
+
+/*---------------------------------------------------------------------------*/
+// returns false when packet is truncated or malformed
+static bool alac_decode(raopst_t *ctx, int16_t *dest, char *buf, int len, int *outsize) {
 	assert(len<=MAX_PACKET);
 
+	// decrypted in place, a tail that is not a whole block is clear
 	if (ctx->decrypt) {
-		aeslen = len & ~0xf;
-		memcpy(iv, ctx->aesiv, sizeof(iv));
-		AES_cbc_encrypt((unsigned char*)buf, packet, aeslen, &ctx->aes, iv, AES_DECRYPT);
-		memcpy(packet+aeslen, buf+aeslen, len-aeslen);
-		decode_frame(ctx->alac_codec, packet, dest, outsize);
-	} else decode_frame(ctx->alac_codec, (unsigned char*) buf, dest, outsize);
+		int n;
+		if (!EVP_DecryptInit_ex(ctx->cipher, NULL, NULL, NULL, ctx->aesiv) ||
+			!EVP_DecryptUpdate(ctx->cipher, (unsigned char*) buf, &n, (unsigned char*) buf, len & ~0xf)) return false;
+	}
+
+	return decode_frame(ctx->alac_codec, (unsigned char*) buf, len, dest, outsize) == 0;
+}
+
+/*---------------------------------------------------------------------------*/
+// histogram buckets are 0 below unit then doubling, last one is open
+static int stats_bucket(uint32_t value, uint32_t unit, int count) {
+	int n = 0;
+	for (value /= unit; value && n < count - 1; value >>= 1) n++;
+	return n;
+}
+
+/*---------------------------------------------------------------------------*/
+// local time when a frame is expected to be sent
+static uint32_t frame_playtime(raopst_t *ctx, uint32_t rtptime) {
+	// watch out for 32 bits overflow
+	return ctx->synchro.time + (((int32_t)(rtptime - ctx->synchro.rtp)) * 1000) / 44100;
+}
+
+/*---------------------------------------------------------------------------*/
+// latest time a missing frame is still worth receiving
+static uint32_t frame_deadline(raopst_t *ctx, uint32_t rtptime, uint32_t now) {
+	bool synced = ctx->synchro.status == (RTP_SYNC | NTP_SYNC);
+
+	// in adaptive mode, don't ask longer than what answers have been taking
+	if (ctx->adaptive.estimator) {
+		uint32_t deadline = now + ctx->adaptive.deadline;
+		if (synced && (int32_t) (frame_playtime(ctx, rtptime) - deadline) < 0) return frame_playtime(ctx, rtptime);
+		return deadline;
+	}
+
+	if (synced) return frame_playtime(ctx, rtptime);
+	return now + (ctx->latency ? (ctx->latency * 1000) / 44100 : RESEND_DEADLINE);
+}
+
+/*---------------------------------------------------------------------------*/
+// prefill (in frames) wanted by estimator
+static uint32_t adaptive_target(raopst_t *ctx) {
+	uint32_t prefill = jitter_status(ctx->adaptive.estimator).prefill;
+	return (prefill * 44100 + ctx->frame_size * 1000 - 1) / (ctx->frame_size * 1000);
+}
+
+/*---------------------------------------------------------------------------*/
+// resend deadline is applied at once, prefill waits for a flush or for silence
+static void adaptive_update(raopst_t *ctx) {
+	jitter_status_t status = jitter_status(ctx->adaptive.estimator);
+
+	ctx->adaptive.deadline = status.deadline;
+	if (!ctx->adaptive.prefill) ctx->adaptive.prefill = adaptive_target(ctx);
+
+	LOG_INFO("[%p]: adaptive prefill:%ums (%u frames, %u in effect) deadline:%ums [jitter:%.1fms late:%dms burst:%u recovery:%ums lost:%u]",
+			 ctx, status.prefill, adaptive_target(ctx), ctx->adaptive.prefill, status.deadline,
+			 status.jitter, status.late, status.burst, status.recovery, status.lost);
 }
 
 /*---------------------------------------------------------------------------*/
 static void buffer_put_packet(raopst_t* ctx, seq_t seqno, unsigned rtptime, bool first, char* data, int len) {
-	pthread_mutex_lock(&ctx->ab_mutex);
+	uint32_t now = clock_ms(ctx), waited;
+	bool arrival = false;
+
+	raop_lock(&ctx->ab_mutex);
 
 	/* if we have received a RECORD with a seqno, then this is the first allowed rtp sequence number 
 	 * and we are in RTP_WAIT state. If seqno was 0, then we are waiting for a flush that will tell 
@@ -427,22 +1131,24 @@ static void buffer_put_packet(raopst_t* ctx, seq_t seqno, unsigned rtptime, bool
 
 	// if we have a pending first seqno and we are below, always ignore it
 	if (ctx->first_seqno != -1 && seq_order(seqno, ctx->first_seqno)) {
-		pthread_mutex_unlock(&ctx->ab_mutex);
+		raop_unlock(&ctx->ab_mutex);
 		return;
 	}
 
 	if (ctx->state == RTP_WAIT) {
 		ctx->ab_write = seqno - 1;
 		ctx->ab_read = ctx->ab_write + 1;
-		ctx->skip = 0;
 		ctx->silence = true;
 		ctx->synchro.first = false;
-		ctx->resent_frames = ctx->silent_frames = 0;
-		ctx->http_count = 0;
+		ctx->silent_frames = 0;
+		resend_reset(ctx->resend);
+		if (ctx->adaptive.estimator) jitter_restart(ctx->adaptive.estimator);
+		// after a warm flush, HTTP stream continues so encoders must not restart
+		if (!ctx->warm) streams_restart(ctx);
+		ctx->warm = false;
 		if (ctx->first_seqno != -1) {
 			ctx->state = RTP_PLAY;
 			ctx->first_seqno = -1;
-			encoder_open(ctx->encoder);
 			LOG_INFO("[%p]: 1st accepted packet:%d, now playing", ctx, seqno);
 		} else {
 			ctx->state = RTP_STREAM;
@@ -457,7 +1163,7 @@ static void buffer_put_packet(raopst_t* ctx, seq_t seqno, unsigned rtptime, bool
 		}
 		ctx->state = RTP_PLAY;
 		ctx->first_seqno = -1;
-		encoder_open(ctx->encoder);
+		streams_restart(ctx);
 		LOG_INFO("[%p]: done waiting for FLUSH with packet:%d, now playing starting:%hu", ctx, seqno, ctx->ab_read);
 	}
 
@@ -475,11 +1181,11 @@ static void buffer_put_packet(raopst_t* ctx, seq_t seqno, unsigned rtptime, bool
 	double test_ratio = test_packet.count ? (double)test_packet.failed / test_packet.count : 0.0;
 	if (test_ratio > TEST_PACKET * 1.025) test_packet.active = false;
 	else if (test_ratio < TEST_PACKET * 0.975) test_packet.active = true;
-	if (test_packet.active && ctx->http_count) {
+	if (test_packet.active && ctx->http_frames) {
 		if ((rand() % (10 - test_packet.last)) && test_packet.last < 10) {
 			test_packet.last++;
 			test_packet.failed++;
-			pthread_mutex_unlock(&ctx->ab_mutex);
+			raop_unlock(&ctx->ab_mutex);
 			return;
 		}
 		test_packet.last = 0;
@@ -495,6 +1201,7 @@ static void buffer_put_packet(raopst_t* ctx, seq_t seqno, unsigned rtptime, bool
 	if (seqno == (uint16_t) (ctx->ab_write + 1)) {
 		// expected packet
 		ctx->ab_write = seqno;
+		arrival = true;
 		LOG_SDEBUG("[%p]: packet expected seqno:%hu rtptime:%u (W:%hu R:%hu)", ctx, seqno, rtptime, ctx->ab_write, ctx->ab_read);
 	} else if (seq_order(ctx->ab_write, seqno)) {
 		// newer than expected
@@ -510,20 +1217,35 @@ static void buffer_put_packet(raopst_t* ctx, seq_t seqno, unsigned rtptime, bool
 			ctx->ab_read = seqno - ctx->delay + 1;		
 		}
 		// don't bother requesting for resend if we are not playing yet (packet might be old garbage)
-		if (ctx->state == RTP_PLAY && rtp_request_resend(ctx, ctx->ab_write + 1, seqno-1)) {
-			uint32_t now = gettime_ms();
+		// nor for silly ranges (happens in case of network large blackouts)
+		if (ctx->state == RTP_PLAY && (seq_t) (seqno - ctx->ab_write - 1) <= BUFFER_FRAMES / 2) {
+			if (ctx->adaptive.estimator) jitter_loss(ctx->adaptive.estimator, seqno - ctx->ab_write - 1);
 			for (seq_t i = ctx->ab_write + 1; seq_order(i, seqno); i++) {
-				ctx->audio_buffer[BUFIDX(i)].rtptime = rtptime - (seqno-i)*ctx->frame_size;
-				ctx->audio_buffer[BUFIDX(i)].last_resend = now;
+				uint32_t frame_rtptime = rtptime - (seqno-i)*ctx->frame_size;
+				ctx->audio_buffer[BUFIDX(i)].rtptime = frame_rtptime;
+				resend_missing(ctx->resend, i, frame_deadline(ctx, frame_rtptime, now), now);
 			}
 		}
 		LOG_DEBUG("[%p]: packet newer seqno:%hu rtptime:%u (W:%hu R:%hu)", ctx, seqno, rtptime, ctx->ab_write, ctx->ab_read);
 		ctx->ab_write = seqno;
+		arrival = true;
 	} else if (seq_order(ctx->ab_read, seqno + 1)) {
-		// recovered packet, not yet sent
-		LOG_DEBUG("[%p]: packet recovered seqno:%hu rtptime:%u (W:%hu R:%hu)", ctx, seqno, rtptime, ctx->ab_write, ctx->ab_read);
+		if (abuf->ready) {
+			// already have it (resent twice or resent after all)
+			ctx->stats.duplicate++;
+			abuf = NULL;
+		} else {
+			// recovered packet, not yet sent
+			LOG_DEBUG("[%p]: packet recovered seqno:%hu rtptime:%u (W:%hu R:%hu)", ctx, seqno, rtptime, ctx->ab_write, ctx->ab_read);
+		}
+	} else if (abuf->missed) {
+		// played as silence, so it really was too late
+		ctx->stats.late++;
+		LOG_INFO("[%p]: packet too late seqno:%hu rtptime:%u (W:%hu R:%hu)", ctx, seqno, rtptime, ctx->ab_write, ctx->ab_read);
+		abuf = NULL;
 	} else {
-		if (abuf->missed) LOG_INFO("[%p]: packet too late seqno:%hu rtptime:%u (W:%hu R:%hu)", ctx, seqno, rtptime, ctx->ab_write, ctx->ab_read);
+		// was already played
+		ctx->stats.duplicate++;
 		abuf = NULL;
 	}
 
@@ -531,250 +1253,289 @@ static void buffer_put_packet(raopst_t* ctx, seq_t seqno, unsigned rtptime, bool
 		LOG_INFO("[%p]: fill [level:%hu] [W:%hu R:%hu]", ctx, ctx->ab_write - ctx->ab_read + 1, ctx->ab_write, ctx->ab_read);
 	}
 
+	resend_received(ctx->resend, seqno, now, &waited);
+
+	// only what is played counts for adaptive decisions
+	if (ctx->adaptive.estimator && ctx->state == RTP_PLAY) {
+		bool synced = ctx->synchro.status == (RTP_SYNC | NTP_SYNC);
+		if (arrival) jitter_arrival(ctx->adaptive.estimator, rtptime, now, synced ? frame_playtime(ctx, rtptime) : 0);
+		if (waited) jitter_recovered(ctx->adaptive.estimator, waited);
+	}
+
+	// a frame that can't be decoded is played as silence, but must still have its time
+	if (abuf && !alac_decode(ctx, abuf->data, data, len, &abuf->len)) {
+		LOG_WARN("[%p]: malformed frame seqno:%hu (%d bytes)", ctx, seqno, len);
+		abuf->rtptime = rtptime;
+		abuf->ready = false;
+		abuf = NULL;
+	}
+
 	if (abuf) {
-		alac_decode(ctx, abuf->data, data, len, &abuf->len);
+		RAOP_TRACE(decoded, seqno, rtptime);
+		ctx->stats.received++;
 		abuf->ready = true;
 		abuf->missed = false;
 		// this is the local rtptime when this frame is expected to play
 		abuf->rtptime = rtptime;
-#ifdef __RTP_STORE
-		fwrite(data, len, 1, ctx->rtpIN);
-		fwrite(abuf->data, abuf->len, 1, ctx->rtpOUT);
-#endif
 		bool silence = ctx->silence ? !memcmp(abuf->data, ctx->silence_frame, abuf->len) : false;
 
 		// just discard all silences frames at the beginning (might be an iOS flush + silence)
 		if (silence && ctx->ab_write - ctx->ab_read > 1) ctx->audio_buffer[BUFIDX(ctx->ab_read++)].ready = false;
 
 		if (ctx->state == RTP_PLAY && ctx->silence && !silence) {
-			ctx->event_cb(ctx->owner, RAOP_STREAMER_PLAY);
+			// owner is not called back from here (nor with ab_mutex locked), except when replaying
+			if (ctx->notify.job) {
+				ctx->notify.play = true;
+				reactor_timer_delay(ctx->notify.job, 0);
+			} else ctx->event_cb(ctx->owner, RAOP_STREAMER_PLAY);
 			ctx->silence = false;
 			// if we have some metadata, just do a refresh (case of FLUSH not sending metadata)
-			if (ctx->metadata.title) ctx->icy.updated = true;
+			if (ctx->metadata.title) ctx->icy.version++;
 		}
 	}
 
-	pthread_mutex_unlock(&ctx->ab_mutex);
+	raop_unlock(&ctx->ab_mutex);
 }
 
 /*---------------------------------------------------------------------------*/
-static void *rtp_thread_func(void *arg) {
-	fd_set fds;
-	int i, sock = -1;
-	int count = 0;
-	bool ntp_sent;
-	raopst_t *ctx = (raopst_t*) arg;
+// local time (ms) when remote clock will be at a given NTP time
+static uint32_t remote2local(raopst_t *ctx, uint64_t ntp) {
+	uint64_t now = clock_us(ctx);
+	int64_t delta = (int64_t) (NTP2US(ntp) - now) - raopclk_offset(ctx->timing.clock, now);
+	return clock_ms(ctx) + delta / 1000;
+}
 
-	for (i = 0; i < 3; i++) {
-		if (ctx->rtp_sockets[i].sock > sock) sock = ctx->rtp_sockets[i].sock;
-		// send synchro requests 3 times
-		ntp_sent = rtp_request_timing(ctx);
-	}
+/*---------------------------------------------------------------------------*/
+// timing and resend requests, returns when it must be called again (ms)
+static uint32_t rtp_tick(void *owner) {
+	raopst_t *ctx = ((struct rtp_owner_s*) owner)->ctx;
 
-	while (ctx->running) {
-		ssize_t plen;
-		char type, packet[MAX_PACKET];
-		socklen_t rtp_client_len = sizeof(struct sockaddr_storage);
-		int idx = 0;
-		char *pktp = packet;
-		struct timeval timeout = {0, 50*1000};
+	// nobody to talk to until session is re-used
+	if (ctx->parked) return REACTOR_NEVER;
 
-		FD_ZERO(&fds);
-		for (i = 0; i < 3; i++)	{ FD_SET(ctx->rtp_sockets[i].sock, &fds); }
+	// timing requests are paced by clock recovery (can't send until we know peer's address)
+	uint32_t now = gettime_ms();
+	if ((int32_t) (now - ctx->timing.next) >= 0 && rtp_request_timing(ctx)) {
+		ctx->timing.next = now + raopclk_interval(ctx->timing.clock);
+	}
 
-		if (select(sock + 1, &fds, NULL, NULL, &timeout) <= 0) continue;
+	// send due resend requests, need to wake-up often when some are pending
+	raop_lock(&ctx->ab_mutex);
+	resend_poll(ctx->resend, now, raopclk_status(ctx->timing.clock).rtt_min / 1000, ctx->ab_read, rtp_request_resend, ctx);
+	bool pending = resend_pending(ctx->resend);
+	if (ctx->adaptive.estimator && ctx->state == RTP_PLAY && jitter_decide(ctx->adaptive.estimator, clock_ms(ctx))) adaptive_update(ctx);
+	raop_unlock(&ctx->ab_mutex);
+
+	int32_t wait = ctx->timing.next - now;
+	if (pending) return 10;
+	return wait > 0 ? wait : 50;
+}
 
-		for (i = 0; i < 3; i++)
-			if (FD_ISSET(ctx->rtp_sockets[i].sock, &fds)) idx = i;
+/*---------------------------------------------------------------------------*/
+static void rtp_read(void *owner, int sock, int events) {
+	raopst_t *ctx = ((struct rtp_owner_s*) owner)->ctx;
+	char packet[MAX_PACKET];
+	socklen_t rtp_client_len = sizeof(struct sockaddr_storage);
+	int idx = 0;
 
-		plen = recvfrom(ctx->rtp_sockets[idx].sock, packet, sizeof(packet), 0, (struct sockaddr*) &ctx->rtp_host, &rtp_client_len);
+	for (int i = 0; i < 3; i++) if (ctx->rtp_sockets[i].sock == sock) idx = i;
 
-		if (!ntp_sent) {
-			LOG_WARN("[%p]: NTP request not sent yet", ctx);
-			ntp_sent = rtp_request_timing(ctx);
-		}
+	ssize_t plen = recvfrom(sock, packet, sizeof(packet), 0, (struct sockaddr*) &ctx->rtp_host, &rtp_client_len);
 
-		if (plen < 0) continue;
+	// late packets of previous session are just drained
+	if (plen >= 0 && !ctx->parked) {
 		assert(plen <= MAX_PACKET);
+		capture_write(ctx->capture, CAPTURE_PACKET, idx, clock_us(ctx), packet, plen);
+		rtp_process(ctx, packet, plen);
+	}
 
-		type = packet[1] & ~0x80;
-		pktp = packet;
+	// a gap might have been found or timing might be due
+	reactor_timer_delay(ctx->rtp.timer, rtp_tick(owner));
+}
 
-		switch (type) {
-			seq_t seqno;
-			unsigned rtptime;
+/*---------------------------------------------------------------------------*/
+static void rtp_process(raopst_t *ctx, char *packet, ssize_t plen) {
+	char type = packet[1] & ~0x80;
+	char *pktp = packet;
 
-			// re-sent packet
-			case 0x56: {
-				pktp += 4;
-				plen -= 4;
-			}
+	// shortest is a data packet header, others are checked by type
+	if (plen < 12) return;
 
-			// data packet
-			case 0x60: {
-				seqno = ntohs(*(uint16_t*)(pktp+2));
-				rtptime = ntohl(*(uint32_t*)(pktp+4));
+	switch (type) {
+		seq_t seqno;
+		unsigned rtptime;
 
-				// adjust pointer and length
-				pktp += 12;
-				plen -= 12;
+		// re-sent packet
+		case 0x56: {
+			pktp += 4;
+			plen -= 4;
+		}
 
-				LOG_SDEBUG("[%p]: seqno:%hu rtp:%u (type: %x, first: %u)", ctx, seqno, rtptime, type, packet[1] & 0x80);
+		// data packet
+		case 0x60: {
+			seqno = ntohs(*(uint16_t*)(pktp+2));
+			rtptime = ntohl(*(uint32_t*)(pktp+4));
 
-				// check if packet contains enough content to be reasonable
-				if (plen < 16) break;
+			// adjust pointer and length
+			pktp += 12;
+			plen -= 12;
 
-				if ((packet[1] & 0x80) && (type != 0x56)) {
-					LOG_INFO("[%p]: 1st audio packet received %hu", ctx, seqno);
-				}
+			LOG_SDEBUG("[%p]: seqno:%hu rtp:%u (type: %x, first: %u)", ctx, seqno, rtptime, type, packet[1] & 0x80);
 
-				buffer_put_packet(ctx, seqno, rtptime, packet[1] & 0x80, pktp, plen);
-				break;
+			// check if packet contains enough content to be reasonable
+			if (plen < 16) break;
+
+			if ((packet[1] & 0x80) && (type != 0x56)) {
+				LOG_INFO("[%p]: 1st audio packet received %hu", ctx, seqno);
 			}
 
-			// sync packet
-			case 0x54: {
-				uint32_t rtp_now_latency = ntohl(*(uint32_t*)(pktp+4));
-				uint32_t rtp_now = ntohl(*(uint32_t*)(pktp+16));
+			RAOP_TRACE(received, seqno, rtptime);
+			buffer_put_packet(ctx, seqno, rtptime, packet[1] & 0x80, pktp, plen);
+			break;
+		}
 
-				pthread_mutex_lock(&ctx->ab_mutex);
+		// sync packet
+		case 0x54: {
+			if (plen < 20) break;
 
-				// memorize that remote timing for when NTP adjustment arrives
-				ctx->timing.rtp_remote = (((uint64_t)ntohl(*(uint32_t*)(pktp + 8))) << 32) + ntohl(*(uint32_t*)(pktp + 12));
+			uint32_t rtp_now_latency = ntohl(*(uint32_t*)(pktp+4));
+			uint32_t rtp_now = ntohl(*(uint32_t*)(pktp+16));
 
-				// re-align timestamp and expected local playback time
-				if (!ctx->latency) ctx->latency = rtp_now - rtp_now_latency;
-				ctx->synchro.rtp = rtp_now - ctx->latency;
+			raop_lock(&ctx->ab_mutex);
 
-				// now we are synced on RTP frames
-				if ((ctx->synchro.status & RTP_SYNC) == 0) {
-					ctx->synchro.status |= RTP_SYNC;
-					LOG_INFO("[%p]: 1st RTP packet received", ctx);
-				}
+			// memorize that remote timing for when NTP adjustment arrives
+			ctx->timing.rtp_remote = (((uint64_t)ntohl(*(uint32_t*)(pktp + 8))) << 32) + ntohl(*(uint32_t*)(pktp + 12));
 
-				// 1st sync packet received (signals a restart of playback)
-				if (packet[0] & 0x10) {
-					ctx->synchro.first = true;
-					LOG_INFO("[%p]: 1st sync packet received", ctx);
-				}
+			// re-align timestamp and expected local playback time
+			if (!ctx->latency) ctx->latency = rtp_now - rtp_now_latency;
+			ctx->synchro.rtp = rtp_now - ctx->latency;
 
-				// we can't adjust timing if we don't have NTP
-				if (ctx->synchro.status & NTP_SYNC) {
-					ctx->synchro.time = ctx->timing.local + (uint32_t)NTP2MS(ctx->timing.rtp_remote - ctx->timing.remote);
-					LOG_DEBUG("[%p]: sync packet rtp_latency:%u rtp:%u remote ntp:%" PRIx64 ", local time % u(now: % u)",
-						ctx, rtp_now_latency, rtp_now, ctx->timing.rtp_remote, ctx->synchro.time, gettime_ms());
-				} else {
-					LOG_INFO("[%p]: NTP not acquired yet", ctx);
-				}
+			// now we are synced on RTP frames
+			if ((ctx->synchro.status & RTP_SYNC) == 0) {
+				ctx->synchro.status |= RTP_SYNC;
+				LOG_INFO("[%p]: 1st RTP packet received", ctx);
+			}
 
-				pthread_mutex_unlock(&ctx->ab_mutex);
+			// 1st sync packet received (signals a restart of playback)
+			if (packet[0] & 0x10) {
+				ctx->synchro.first = true;
+				LOG_INFO("[%p]: 1st sync packet received", ctx);
+			}
 
-				if (!count--) {
-					rtp_request_timing(ctx);
-					count = 3;
-				}
-				break;
+			// we can't adjust timing if we don't have NTP
+			if (ctx->synchro.status & NTP_SYNC) {
+				ctx->synchro.time = remote2local(ctx, ctx->timing.rtp_remote);
+				LOG_DEBUG("[%p]: sync packet rtp_latency:%u rtp:%u remote ntp:%" PRIx64 ", local time %u(now: %u)",
+					ctx, rtp_now_latency, rtp_now, ctx->timing.rtp_remote, ctx->synchro.time, clock_ms(ctx));
+			} else {
+				LOG_INFO("[%p]: NTP not acquired yet", ctx);
 			}
 
-			// NTP timing packet
-			case 0x53: {
-				uint64_t expected;
-				int64_t delta = 0;
-				uint32_t reference   = ntohl(*(uint32_t*)(pktp+12)); // only low 32 bits in our case
-				uint64_t remote 	  =(((uint64_t) ntohl(*(uint32_t*)(pktp+16))) << 32) + ntohl(*(uint32_t*)(pktp+20));
-				uint32_t roundtrip   = gettime_ms() - reference;
-
-				// better discard sync packets when roundtrip is suspicious and get another one
-				if (roundtrip > 100) {
-					LOG_WARN("[%p]: discarding NTP roundtrip of %u ms", ctx, roundtrip);
-					break;
-				}
+			raop_unlock(&ctx->ab_mutex);
+			break;
+		}
 
-				/*
-				  The expected elapsed remote time should be exactly the same as
-				  elapsed local time between the two request, corrected by the
-				  drifting
-				*/
-				expected = ctx->timing.remote + MS2NTP(reference - ctx->timing.local);
-
-				ctx->timing.remote = remote;
-				ctx->timing.local = reference;
-				ctx->timing.count++;
-
-				if (!ctx->timing.drift && (ctx->synchro.status & NTP_SYNC)) {
-					delta = NTP2MS((int64_t) expected - (int64_t) ctx->timing.remote);
-					ctx->timing.gap_sum += delta;
-
-					pthread_mutex_lock(&ctx->ab_mutex);
-
-					/*
-					 if expected time is more than remote, then our time is
-					 running faster and we are transmitting frames too quickly,
-					 so we'll run out of frames, need to add one
-					*/
-					if (ctx->timing.gap_sum > GAP_THRES && ctx->timing.gap_count++ > GAP_COUNT) {
-						LOG_INFO("[%p]: Sending packets too fast %" PRId64 " [W:% hu R : % hu]", ctx, ctx->timing.gap_sum, ctx->ab_write, ctx->ab_read);
-						ctx->ab_read--;
-						ctx->audio_buffer[BUFIDX(ctx->ab_read)].ready = 1;
-						ctx->timing.gap_sum -= GAP_THRES;
-						ctx->timing.gap_adjust -= GAP_THRES;
-					/*
-					 if expected time is less than remote, then our time is
-					 running slower and we are transmitting frames too slowly,
-					 so we'll overflow frames buffer, need to remove one
-					*/
-					} else if (ctx->timing.gap_sum < -GAP_THRES && ctx->timing.gap_count++ > GAP_COUNT) {
-						if (seq_order(ctx->ab_read, ctx->ab_write)) {
-							ctx->audio_buffer[BUFIDX(ctx->ab_read)].ready = 0;
-							ctx->ab_read++;
-						} else ctx->skip++;
-						ctx->timing.gap_sum += GAP_THRES;
-						ctx->timing.gap_adjust += GAP_THRES;
-						LOG_INFO("[%p]: Sending packets too slow %" PRId64 " (skip: % d)[W:% hu R : % hu]", ctx, ctx->timing.gap_sum, ctx->skip, ctx->ab_write, ctx->ab_read);
-					}
-
-					if (llabs(ctx->timing.gap_sum) < 8) ctx->timing.gap_count = 0;
-
-					pthread_mutex_unlock(&ctx->ab_mutex);
-				}
+		// NTP timing packet
+		case 0x53: {
+			if (plen < 32) break;
 
-				// re-adjust the synchro time in case it could not have been done by first RTP because NTP was missing
-				ctx->synchro.time = ctx->timing.local + (uint32_t)NTP2MS(ctx->timing.rtp_remote - ctx->timing.remote);
+			uint64_t now = clock_us(ctx);
+			uint64_t reference = (((uint64_t) ntohl(*(uint32_t*)(pktp+8))) << 32) + ntohl(*(uint32_t*)(pktp+12));
+			uint64_t received = (((uint64_t) ntohl(*(uint32_t*)(pktp+16))) << 32) + ntohl(*(uint32_t*)(pktp+20));
+			uint64_t sent = (((uint64_t) ntohl(*(uint32_t*)(pktp+24))) << 32) + ntohl(*(uint32_t*)(pktp+28));
+			uint64_t remote = NTP2US(received);
+			uint32_t roundtrip = now - reference;
 
-				// now we are synced on NTP (mutex not needed)
-				if ((ctx->synchro.status & NTP_SYNC) == 0) {
-					LOG_INFO("[%p]: 1st NTP packet received", ctx);
-					ctx->synchro.status |= NTP_SYNC;
-				}
+			ctx->stats.rtt[stats_bucket(roundtrip, 250, RAOPST_RTT_BUCKETS)]++;
 
-				LOG_DEBUG("[%p]: Timing references local:%" PRIu64 ", remote: %" PRIx64 " (delta : %" PRId64 ", sum : %" PRId64 ", adjust : %" PRId64 ", gaps : % d)",
-						  ctx, ctx->timing.local, ctx->timing.remote, delta, ctx->timing.gap_sum, ctx->timing.gap_adjust, ctx->timing.gap_count);
+			// better discard sync packets when roundtrip is suspicious and get another one
+			if (roundtrip > 100*1000) {
+				LOG_WARN("[%p]: discarding NTP roundtrip of %u ms", ctx, roundtrip / 1000);
 				break;
 			}
-		}
-	}
 
-	LOG_INFO("[%p]: terminating", ctx);
+			// use mid-point of the exchange, minus remote processing when sender tells it
+			if (sent > received && NTP2US(sent) - remote < roundtrip) {
+				roundtrip -= NTP2US(sent) - remote;
+				remote = (remote + NTP2US(sent)) / 2;
+			}
 
-	return NULL;
+			if (!raopclk_add(ctx->timing.clock, reference + roundtrip / 2, remote, roundtrip)) {
+				LOG_DEBUG("[%p]: rejected NTP exchange (roundtrip:%u us)", ctx, roundtrip);
+				break;
+			}
+
+			raop_lock(&ctx->ab_mutex);
+
+			raopclk_status_t clock = raopclk_status(ctx->timing.clock);
+			ctx->timing.status = clock;
+
+			if (clock.locked != ctx->timing.locked) {
+				LOG_INFO("[%p]: clock %s (%.1f ppm, jitter %.0f us)", ctx, clock.locked ? "locked" : "unlocked", clock.ppm, clock.jitter);
+				ctx->timing.locked = clock.locked;
+			}
+
+			if (!ctx->timing.drift && (ctx->synchro.status & NTP_SYNC)) {
+				/*
+				 if remote clock is slower, then our time is running faster and
+				 we are transmitting frames too quickly, so we'll run out of
+				 frames and need to add samples (ratio > 1). Otherwise we are
+				 too slow and need to remove some. Measured drift is applied
+				 directly and the gap accumulated since reference, minus what
+				 resampler already did, is absorbed over DRIFT_HORIZON
+				*/
+				double gap = raopclk_offset(ctx->timing.clock, ctx->timing.reference) - raopclk_offset(ctx->timing.clock, now);
+				double ppm;
+
+				gap -= (ctx->timing.gap_adjust * 1E6) / 44100;
+				ppm = -clock.ppm + (gap * 1000) / DRIFT_HORIZON;
+				ppm = min(max(ppm, -DRIFT_MAX_PPM), DRIFT_MAX_PPM);
+
+				if (fabs(ppm - (ctx->timing.ratio - 1) * 1E6) >= 10) {
+					LOG_INFO("[%p]: drift correction %.1f ppm (drift:%.1f ppm, gap:%.2f ms) [W:%hu R:%hu]", ctx, ppm, clock.ppm, gap / 1000, ctx->ab_write, ctx->ab_read);
+				}
+
+				if (ctx->timing.ratio != 1 + ppm / 1E6) ctx->stats.corrections++;
+				ctx->timing.ratio = 1 + ppm / 1E6;
+			}
+
+			// now we are synced on NTP
+			if ((ctx->synchro.status & NTP_SYNC) == 0) {
+				LOG_INFO("[%p]: 1st NTP packet received", ctx);
+				ctx->synchro.status |= NTP_SYNC;
+				ctx->timing.reference = now;
+			}
+
+			// re-adjust the synchro time as it could not have been done by first RTP when NTP was missing
+			ctx->synchro.time = remote2local(ctx, ctx->timing.rtp_remote);
+			double ratio = ctx->timing.ratio;
+
+			raop_unlock(&ctx->ab_mutex);
+
+			LOG_DEBUG("[%p]: Timing exchange roundtrip:%u us (min:%u), offset:%" PRId64 ", drift:%.2f ppm, jitter:%.0f us (accepted:%u, rejected:%u), ratio:%.6f",
+					  ctx, roundtrip, clock.rtt_min, raopclk_offset(ctx->timing.clock, now), clock.ppm, clock.jitter, clock.accepted, clock.rejected, ratio);
+			break;
+		}
+	}
 }
 
 /*---------------------------------------------------------------------------*/
 static bool rtp_request_timing(raopst_t *ctx) {
 	unsigned char req[32];
-	uint32_t now = gettime_ms();
+	uint64_t now = clock_us(ctx);
 	int i;
 	struct sockaddr_in host;
 
-	LOG_DEBUG("[%p]: timing request now:%u (port: %hu)", ctx, now, ctx->rtp_sockets[TIMING].rport);
+	LOG_DEBUG("[%p]: timing request now:%" PRIu64 " (port: %hu)", ctx, now, ctx->rtp_sockets[TIMING].rport);
 
 	req[0] = 0x80;
 	req[1] = 0x52|0x80;
 	*(uint16_t*)(req+2) = htons(7);
 	*(uint32_t*)(req+4) = htonl(0);  // dummy
 	for (i = 0; i < 16; i++) req[i+8] = 0;
-	*(uint32_t*)(req+24) = 0;
-	*(uint32_t*)(req+28) = htonl(now); // this is not a real NTP, but a 32 ms counter in the low part of the NTP
+	// this is not a real NTP, but our us counter that sender echoes back
+	*(uint32_t*)(req+24) = htonl(now >> 32);
+	*(uint32_t*)(req+28) = htonl(now);
 
 	if (ctx->peer.s_addr != INADDR_ANY) {
 		host.sin_family = AF_INET;
@@ -794,13 +1555,11 @@ static bool rtp_request_timing(raopst_t *ctx) {
 }
 
 /*---------------------------------------------------------------------------*/
-static bool rtp_request_resend(raopst_t *ctx, seq_t first, seq_t last) {
+static bool rtp_request_resend(void *arg, seq_t first, seq_t last) {
+	raopst_t *ctx = (raopst_t*) arg;
 	unsigned char req[8];    // *not* a standard RTCP NACK
 
-	// do not request silly ranges (happens in case of network large blackouts)
-	if (seq_order(last, first) || last - first > BUFFER_FRAMES / 2) return false;
-
-	ctx->resent_frames += (seq_t) (last - first) + 1;
+	if (ctx->rtp_host.sin_addr.s_addr == INADDR_ANY) return false;
 
 	LOG_DEBUG("resend request [W:%hu R:%hu first=%hu last=%hu]", ctx->ab_write, ctx->ab_read, first, last);
 
@@ -819,27 +1578,49 @@ static bool rtp_request_resend(raopst_t *ctx, seq_t first, seq_t last) {
 	return true;
 }
 
+/*---------------------------------------------------------------------------*/
+// prefill can only change while audio is silent, returns true when silence was added or frame skipped
+static bool adaptive_silence(raopst_t *ctx, abuf_t *frame) {
+	uint32_t target = adaptive_target(ctx);
+
+	if (target == ctx->adaptive.prefill || memcmp(frame->data, ctx->silence_frame, frame->len)) return false;
+
+	LOG_INFO("[%p]: prefill %u => %u frames while silent", ctx, ctx->adaptive.prefill, target);
+
+	// all silence is added at once, but silent frames are skipped one at a time
+	if (target > ctx->adaptive.prefill) {
+		ctx->silence_count = target - ctx->adaptive.prefill;
+		ctx->adaptive.prefill = target;
+	} else {
+		frame->ready = false;
+		ctx->adaptive.prefill--;
+		ctx->ab_read++;
+	}
+
+	return true;
+}
+
 /*---------------------------------------------------------------------------*/
 // get the next frame, when available. return 0 if underrun/stream reset.
-static short *_buffer_get_frame(raopst_t *ctx, size_t *bytes) {
-	// no frame (even silence) when not playing and not synchronized
-	if (ctx->state != RTP_PLAY || ctx->synchro.status != (RTP_SYNC | NTP_SYNC)) return NULL;
+// playtime is 0 for silence that is not part of the stream
+static short *_buffer_get_frame(raopst_t *ctx, size_t *bytes, uint32_t *playtime) {
+	// no frame (even silence) when not synchronized or not playing, unless warm flushed
+	if (ctx->synchro.status != (RTP_SYNC | NTP_SYNC) || (ctx->state != RTP_PLAY && !ctx->warm)) return NULL;
 
-	// send silence if required to create enough buffering (want countdown to happen)
-	if ((ctx->silence_count && ctx->silence_count--) || ctx->pause)	{
+	if (ctx->warm) {
 		*bytes = ctx->frame_size * 4;
+		*playtime = 0;
 		return (short*) ctx->silence_frame;
 	}
 
-	// skip frames if we are running late and skip could not be done in SYNC
-	while (ctx->skip && seq_order(ctx->ab_read, ctx->ab_write)) {
-		ctx->audio_buffer[BUFIDX(ctx->ab_read)].ready = 0;
-		ctx->ab_read++;
-		ctx->skip--;
-		LOG_INFO("[%p]: Sending packets too slow (skip: %d) [W:%hu R:%hu]", ctx, ctx->skip, ctx->ab_write, ctx->ab_read);
+	// send silence if required to create enough buffering (want countdown to happen)
+	if ((ctx->silence_count && ctx->silence_count--) || ctx->pause)	{
+		*bytes = ctx->frame_size * 4;
+		*playtime = 0;
+		return (short*) ctx->silence_frame;
 	}
 
-	uint32_t now = gettime_ms();
+	uint32_t now = clock_ms(ctx);
 	short buf_fill = ctx->ab_write - ctx->ab_read + 1;
 
 	// in case of overrun, just reset read pointer to a sane value
@@ -851,31 +1632,20 @@ static short *_buffer_get_frame(raopst_t *ctx, size_t *bytes) {
 
 	abuf_t* curframe = ctx->audio_buffer + BUFIDX(ctx->ab_read);
 
-	// try to request resend missing packet in order, explore up to 64 frames
-	for (int step = max(buf_fill / 64, 1), i = 0, first = 0; seq_order(ctx->ab_read + i, ctx->ab_write); i += step) {
-		abuf_t* frame = ctx->audio_buffer + BUFIDX(ctx->ab_read + i);
-
-		// stop when we reach a ready frame or a recent pending resend
-		if (first && (frame->ready || now - frame->last_resend <= RESEND_TO)) {
-			if (!rtp_request_resend(ctx, first, ctx->ab_read + i - 1)) break;
-			first = 0;
-			i += step - 1;
-		} else if (!frame->ready && now - frame->last_resend > RESEND_TO) {
-			if (!first) first = ctx->ab_read + i;
-			frame->last_resend = now;
-		}
+	// there must be a frame left when a silent one is skipped
+	if (ctx->adaptive.estimator && buf_fill > 1 && curframe->ready && adaptive_silence(ctx, curframe)) {
+		return _buffer_get_frame(ctx, bytes, playtime);
 	}
 
 	// use and update previous frame when buffer is empty (previous is always valid)
 	if (!buf_fill) curframe->rtptime = ctx->audio_buffer[BUFIDX(ctx->ab_read - 1)].rtptime + ctx->frame_size;
 
-	// watch out for 32 bits overflow
-	uint32_t playtime = ctx->synchro.time + (((int32_t)(curframe->rtptime - ctx->synchro.rtp)) * 1000) / 44100;
-	LOG_SDEBUG("playtime %u %d [W:%hu R:%hu] %d", playtime, playtime - now, ctx->ab_write, ctx->ab_read, curframe->ready);
+	*playtime = frame_playtime(ctx, curframe->rtptime);
+	LOG_SDEBUG("playtime %u %d [W:%hu R:%hu] %d", *playtime, *playtime - now, ctx->ab_write, ctx->ab_read, curframe->ready);
 
 	// wait if frame is not ready and we have time or if we have no frame and are not allowed to fill
-	if (!curframe->ready && (now < playtime || (!buf_fill && !ctx->http_fill))) {
-		LOG_SDEBUG("[%p]: waiting (fill:%hd, W:%hu R:%hu) now:%u, playtime:%u, wait:%d", ctx, buf_fill, ctx->ab_write, ctx->ab_read, now, playtime, playtime - now);
+	if (!curframe->ready && (now < *playtime || (!buf_fill && !ctx->http_fill))) {
+		LOG_SDEBUG("[%p]: waiting (fill:%hd, W:%hu R:%hu) now:%u, playtime:%u, wait:%d", ctx, buf_fill, ctx->ab_write, ctx->ab_read, now, *playtime, *playtime - now);
 		return NULL;
 	}
 
@@ -886,16 +1656,19 @@ static short *_buffer_get_frame(raopst_t *ctx, size_t *bytes) {
 		// when silence is inserted at the top, need to move write pointer as well
 		ctx->ab_write++;
 		ctx->filled_frames++;
+		ctx->stats.filled++;
 		curframe->ready = 0;
 	} else if (!curframe->ready) {
 		ctx->silent_frames++;
 		curframe->missed = true;
+		resend_cancel(ctx->resend, ctx->ab_read);
+		if (ctx->adaptive.estimator) jitter_lost(ctx->adaptive.estimator);
 	} else {
 		LOG_SDEBUG("[%p]: prepared frame (fill:%hd, W:%hu R:%hu)", ctx, buf_fill - 1, ctx->ab_write, ctx->ab_read);
 	}
 
 	if (!curframe->ready) {
-		LOG_DEBUG("[%p]: created zero frame at %d (W:%hu R:%hu)", ctx, now - playtime, ctx->ab_write, ctx->ab_read);
+		LOG_DEBUG("[%p]: created zero frame at %d (W:%hu R:%hu)", ctx, now - *playtime, ctx->ab_write, ctx->ab_read);
 		memset(curframe->data, 0, ctx->frame_size * 4);
 		*bytes = ctx->frame_size * 4;
 	} else {
@@ -906,200 +1679,732 @@ static short *_buffer_get_frame(raopst_t *ctx, size_t *bytes) {
 	// a bit of logging from time to time or when we have a network blackout
 	if (!(ctx->out_frames++ & 0xfff) || (!(ctx->out_frames & 0x3f) && buf_fill >= 25 && ctx->state == RTP_PLAY) || ctx->filled_frames > 100) {
 		LOG_INFO("[%p]: drain [level:%hd gap:%d] [W:%hu R:%hu] [R:%u S:%u F:%u]",
-					ctx, buf_fill-1, playtime - now, ctx->ab_write, ctx->ab_read,
-					ctx->resent_frames, ctx->silent_frames, ctx->filled_frames);
+					ctx, buf_fill-1, *playtime - now, ctx->ab_write, ctx->ab_read,
+					resend_stats(ctx->resend).requested, ctx->silent_frames, ctx->filled_frames);
 		ctx->filled_frames = 0;
 	}
 
+	ctx->stats.fill[stats_bucket(max(buf_fill, 0), 1, RAOPST_FILL_BUCKETS)]++;
+	RAOP_TRACE(played, ctx->ab_read, curframe->rtptime);
 	ctx->ab_read++;
 	return curframe->data;
 }
 
 /*---------------------------------------------------------------------------*/
-int send_data(bool chunked, int sock, const void *data, int size, int flags) {
-	if (!chunked) return send(sock, data, size, flags);
+// next frame to be output, with clock drift absorbed (nothing is done when ratio is 1)
+static int16_t *fetch_frame(raopst_t *ctx, size_t *bytes, uint32_t *playtime) {
+	int16_t *pcm = _buffer_get_frame(ctx, bytes, playtime);
+	size_t frames;
 
-	char chunk[16];
-	itoa(size, chunk, 16);
-	strcat(chunk, "\r\n");
+	if (!pcm) return NULL;
 
-	send(sock, chunk, strlen(chunk), flags);
-	size = send(sock, data, size, flags);
-	send(sock, "\r\n", 2, flags);
+	pcm = resampler_process(ctx->resampler, pcm, *bytes / 4, ctx->timing.ratio, &frames);
+	ctx->timing.gap_adjust += (int64_t) frames - *bytes / 4;
+	*bytes = frames * 4;
 
-	return size;
+	return pcm;
 }
 
 /*---------------------------------------------------------------------------*/
-static void *http_thread_func(void *arg) {
-	int frame_count = 0;
-	raopst_t *ctx = (raopst_t*) arg;
-	int sock = -1;
-	struct timeval timeout = { 0, 0 };
+static void socket_nonblocking(int sock) {
+#if WIN
+	u_long mode = 1;
+	ioctlsocket(sock, FIONBIO, &mode);
+#else
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
 
-	while (ctx->running) {
-		fd_set rfds;
+/*---------------------------------------------------------------------------*/
+static uint8_t *bytes_reserve(bytes_t *bytes, size_t len) {
+	if (bytes->len + len > bytes->size) {
+		bytes->size = bytes->len + len;
+		bytes->buffer = realloc(bytes->buffer, bytes->size);
+	}
+	return bytes->buffer + bytes->len;
+}
 
-		if (sock == -1) {
-			struct timeval timeout = {0, 50*1000};
+/*---------------------------------------------------------------------------*/
+static void bytes_add(bytes_t *bytes, const void *data, size_t len) {
+	memcpy(bytes_reserve(bytes, len), data, len);
+	bytes->len += len;
+}
 
-			FD_ZERO(&rfds);
-			FD_SET(ctx->http_listener, &rfds);
+/*---------------------------------------------------------------------------*/
+static bool queue_push(http_queue_t *queue, uint8_t *data, size_t len) {
+	if (queue->count == HTTP_QUEUE_FRAMES || queue->fill + len > queue->size) return false;
 
-			if (select(ctx->http_listener + 1, &rfds, NULL, NULL, &timeout) > 0) {
-				sock = accept(ctx->http_listener, NULL, NULL);
-			}
+	size_t tail = (queue->head + queue->fill) % queue->size;
+	size_t space = min(len, queue->size - tail);
+
+	memcpy(queue->buffer + tail, data, space);
+	memcpy(queue->buffer, data + space, len - space);
+	queue->lens[(queue->first + queue->count++) % HTTP_QUEUE_FRAMES] = len;
+	queue->fill += len;
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+// pop oldest frame into bytes (or just drop it when NULL)
+static size_t queue_pop(http_queue_t *queue, bytes_t *bytes) {
+	if (!queue->count) return 0;
+
+	size_t len = queue->lens[queue->first];
+
+	if (bytes) {
+		size_t space = min(len, queue->size - queue->head);
+		uint8_t *p = bytes_reserve(bytes, len);
+		memcpy(p, queue->buffer + queue->head, space);
+		memcpy(p + space, queue->buffer, len - space);
+		bytes->len += len;
+	}
+
+	queue->head = (queue->head + len) % queue->size;
+	queue->fill -= len;
+	queue->first = (queue->first + 1) % HTTP_QUEUE_FRAMES;
+	queue->count--;
+
+	return len;
+}
+
+/*---------------------------------------------------------------------------*/
+static void http_queue_reset(http_client_t *client) {
+	client->queue.head = client->queue.fill = 0;
+	client->queue.first = client->queue.count = 0;
+	client->wire.len = client->wire.pos = 0;
+	client->stalled = false;
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called with ab_mutex locked
+static bool http_queue_full(http_client_t *client) {
+	// what's left to catch-up with is as good as queued
+	if (client->catchup && client->stream->count >= client->cursor + HTTP_QUEUE_HIGH) return true;
+	return client->queue.fill >= HTTP_QUEUE_HIGH || client->queue.count >= HTTP_QUEUE_FRAMES - 1;
+}
 
-			if (sock != -1 && ctx->running) {
-				int on = 1;
-				setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
-				LOG_INFO("[%p]: got HTTP connection %u", ctx, sock);
-			} else continue;
+/*---------------------------------------------------------------------------*/
+static void http_close(raopst_t *ctx, http_client_t *client) {
+	LOG_INFO("[%p]: HTTP close %u", ctx, client->sock);
+	reactor_remove(client->event);
+	closesocket(client->sock);
+	client->sock = -1;
+	client->ready = client->catchup = client->closing = false;
+	client->state = HTTP_HEAD;
+	client->head.len = 0;
+	client->events = 0;
+	client->event = NULL;
+	client->stream = NULL;
+	http_queue_reset(client);
+}
+
+/*---------------------------------------------------------------------------*/
+// must be called with ab_mutex locked, returns false if the client must be dropped
+static bool http_enqueue(raopst_t *ctx, http_client_t *client, uint8_t *data, size_t bytes) {
+	bool stalled = false, keep = true;
+
+	switch (ctx->output.policy) {
+	case HTTP_DROP:
+		// make room by discarding oldest frames that have not been formatted yet
+		while (!queue_push(&client->queue, data, bytes) && queue_pop(&client->queue, NULL)) {
+			ctx->output.dropped++;
+			stalled = true;
+		}
+		break;
+	case HTTP_CLOSE:
+		keep = !http_queue_full(client) && queue_push(&client->queue, data, bytes);
+		stalled = !keep;
+		break;
+	case HTTP_PAUSE:
+		// caller does not read frames when full, so this should always succeed
+		if (!queue_push(&client->queue, data, bytes)) {
+			ctx->output.dropped++;
+			stalled = true;
+		}
+		break;
+	}
+
+	if (stalled && !client->stalled) {
+		ctx->output.stalls++;
+		LOG_WARN("[%p]: HTTP client %u too slow (queued:%zu, dropped:%u, policy:%d)", ctx, client->sock, client->queue.fill, ctx->output.dropped, ctx->output.policy);
+	}
+
+	client->stalled = stalled;
+	return keep;
+}
+
+/*---------------------------------------------------------------------------*/
+static void http_format_add(raopst_t *ctx, http_client_t *client, const void *data, size_t len) {
+	if (ctx->http_length == -3) {
+		char chunk[16];
+		sprintf(chunk, "%zx\r\n", len);
+		bytes_add(&client->wire, chunk, strlen(chunk));
+		bytes_add(&client->wire, data, len);
+		bytes_add(&client->wire, "\r\n", 2);
+	} else {
+		bytes_add(&client->wire, data, len);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+// build what goes on the wire for one encoded frame (chunks and ICY metadata)
+static void http_format(raopst_t *ctx, http_client_t *client, uint8_t *data, size_t bytes) {
+	client->wire.len = client->wire.pos = 0;
+
+	// check if ICY sending is active (len < ICY_INTERVAL)
+	if (client->icy.active && bytes > client->icy.remain) {
+		int len_16 = 0;
+		char buffer[ICY_LEN_MAX];
+
+		raop_lock(&ctx->ab_mutex);
+
+		if (client->icy.version != ctx->icy.version && ctx->metadata.title) {
+			char *format;
+
+			// there is room for 1 extra byte at the beginning for length
+			if (ctx->metadata.artwork) format = "NStreamTitle='%s%s%s';StreamURL='%s';";
+			else format = "NStreamTitle='%s%s%s';";
+			// too long metadata is truncated to what ICY can carry (255 blocks of 16)
+			int len = snprintf(buffer, ICY_LEN_MAX - 15, format, ctx->metadata.artist ? ctx->metadata.artist : "",
+							 ctx->metadata.artist ? " - " : "",
+							 ctx->metadata.title, ctx->metadata.artwork) - 1;
+			len = min(len, ICY_LEN_MAX - 17);
+			LOG_INFO("[%p]: ICY update %s", ctx, buffer + 1);
+			len_16 = (len + 15) / 16;
+			memset(buffer + len + 1, 0, len_16 * 16 - len);
 		}
 
-		FD_ZERO(&rfds);
-		FD_SET(sock, &rfds);
+		client->icy.version = ctx->icy.version;
 
-		int n = select(sock + 1, &rfds, NULL, NULL, &timeout);
-		bool res = true;
+		raop_unlock(&ctx->ab_mutex);
 
-		pthread_mutex_lock(&ctx->ab_mutex);
+		buffer[0] = len_16;
 
-		if (n > 0) {
-			res = handle_http(ctx, sock);
-			ctx->http_ready = res;
+		// remaining data first, then icy data
+		size_t offset = client->icy.remain;
+		if (offset) http_format_add(ctx, client, data, offset);
+		http_format_add(ctx, client, buffer, len_16 * 16 + 1);
 
-			// only send silence when it's the first GET (or after a flush)
-			if (!ctx->http_count) {
-				// send just the right amount of silence (ab_xxx are always accurate)
-				short buf_fill = ctx->ab_write - ctx->ab_read + 1;
-				if (buf_fill >= 0) ctx->silence_count = ctx->delay - min(ctx->delay, buf_fill);
-				else ctx->silence_count = 0;
+		data += offset;
+		bytes -= offset;
+		client->icy.remain = client->stream->icy_interval;
 
-				LOG_INFO("[%p]: sending %d silence frames", ctx, ctx->silence_count);
-			}
+		LOG_SDEBUG("[%p]: ICY checked %zu", ctx, client->icy.remain);
+	}
+
+	http_format_add(ctx, client, data, bytes);
+
+	// update remaining count with desired length
+	if (client->icy.active) client->icy.remain -= bytes;
+}
+
+/*---------------------------------------------------------------------------*/
+// next piece of cached data for a client catching up with live data, false once it has
+static bool http_catchup(raopst_t *ctx, http_client_t *client) {
+	if (!client->catchup) return false;
+
+	raop_lock(&ctx->ab_mutex);
+
+	http_stream_t *stream = client->stream;
+	size_t bytes = 0;
+
+	// cache has been restarted or overwritten meanwhile, then what is gone is lost
+	if (stream->count < client->cursor) {
+		client->cursor = stream->count;
+	} else if (stream->count - client->cursor > CACHE_SIZE) {
+		LOG_WARN("[%p]: HTTP client %u too slow to catch-up, skipping %zu bytes", ctx, client->sock, stream->count - client->cursor - CACHE_SIZE);
+		client->cursor = stream->count - CACHE_SIZE;
+		ctx->output.stalls++;
+	}
+
+	// pieces don't wrap around cache, they are formatted like frames
+	if (client->cursor < stream->count) {
+		size_t pos = client->cursor % CACHE_SIZE;
+		bytes = min(stream->count - client->cursor, min(CACHE_SIZE - pos, 16384));
+		client->frame.len = 0;
+		bytes_add(&client->frame, stream->cache + pos, bytes);
+		client->cursor += bytes;
+	}
+
+	// live data is queued to this client from now on
+	if (client->cursor == stream->count) client->catchup = false;
+
+	raop_unlock(&ctx->ab_mutex);
+
+	return bytes != 0;
+}
+
+/*---------------------------------------------------------------------------*/
+// send as much as the (non-blocking) socket accepts, returns false on error or when done
+static bool http_drain(raopst_t *ctx, http_client_t *client) {
+	bytes_t *wire = &client->wire;
+
+	while (true) {
+		// format next frame when everything has been sent
+		if (wire->pos == wire->len) {
+			client->frame.len = 0;
+			if (!http_catchup(ctx, client) && !queue_pop(&client->queue, &client->frame)) break;
+			http_format(ctx, client, client->frame.buffer, client->frame.len);
+		}
+
+		ssize_t sent = send(client->sock, (void*) (wire->buffer + wire->pos), wire->len - wire->pos, 0);
+
+		if (sent < 0) {
+			if (SOCKET_WOULDBLOCK()) break;
+			LOG_WARN("[%p]: HTTP send() error (queued:%zu): %s", ctx, client->queue.fill, strerror(errno));
+			return false;
+		}
+
+		wire->pos += sent;
+		if (wire->pos == wire->len) RAOP_TRACE(http_sent, client->sock, wire->len);
+	}
+
+	return !client->closing || wire->pos != wire->len;
+}
+
+/*---------------------------------------------------------------------------*/
+// takes what client has sent, returns false when it has gone or sent too much
+static bool http_read(raopst_t *ctx, http_client_t *client) {
+	char buffer[1024];
+	int n;
+
+	while ((n = recv(client->sock, buffer, sizeof(buffer), 0)) > 0) {
+		// once served, whatever client sends is ignored
+		if (client->state != HTTP_HEAD) continue;
+
+		if (client->head.len + n >= HTTP_HEAD_MAX) {
+			LOG_WARN("[%p]: HTTP request head of %u too large", ctx, client->sock);
+			return false;
 		}
 
+		// kept null-terminated
+		bytes_add(&client->head, buffer, n);
+		*bytes_reserve(&client->head, 1) = '\0';
+	}
+
+	if (n == 0 || !SOCKET_WOULDBLOCK()) return false;
+
+	// request is complete, it's for the job now and socket is not read meanwhile
+	if (client->state == HTTP_HEAD && client->head.len && strstr((char*) client->head.buffer, "\r\n\r\n")) {
+		raop_lock(&ctx->ab_mutex);
+		client->state = HTTP_REQUEST;
+		raop_unlock(&ctx->ab_mutex);
+		reactor_timer_delay(ctx->request.job, 0);
+	}
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+// request line and headers of a complete head, which is modified
+static bool http_head_parse(char *head, char *method, char *resource, char *proto, key_data_t *headers, int size) {
+	int count = 0;
+
+	headers[0].key = NULL;
+	if (sscanf(head, "%15s %255s %15s", method, resource, proto) != 3) return false;
+
+	// an empty line ends the head
+	for (char *line = head, *eol; (eol = strstr(line, "\r\n")) != NULL && eol != line; line = eol + 2) {
+		char *value = strchr(line, ':');
+
+		*eol = '\0';
+		if (line == head || !value || value > eol) continue;
+
+		*value++ = '\0';
+		value += strspn(value, " \t");
+		if (count < size - 1 && kd_add(headers, line, value)) count++;
+	}
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+// response goes first in what is sent to the client, returns it for logging
+static char *http_response(http_client_t *client, char *status, key_data_t *resp) {
+	char *head = kd_dump(resp), *str = NULL;
+
+	(void) !asprintf(&str, "%s\r\n%s\r\n", status, head ? head : "");
+	bytes_add(&client->wire, str, strlen(str));
+	NFREE(head);
+
+	return str;
+}
+
+/*---------------------------------------------------------------------------*/
+static void http_accept(void *owner, int sock, int events) {
+	raopst_t *ctx = (raopst_t*) owner;
+	http_client_t *client = NULL;
+
+	for (int i = 0; !client && i < HTTP_CLIENTS; i++) if (ctx->clients[i].sock == -1) client = ctx->clients + i;
+	sock = accept(sock, NULL, NULL);
+
+	if (sock != -1 && client) {
+		int on = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+		socket_nonblocking(sock);
+		if (!client->queue.buffer) {
+			client->queue.size = HTTP_QUEUE_SIZE;
+			client->queue.buffer = malloc(HTTP_QUEUE_SIZE);
+		}
+		client->sock = sock;
+		client->state = HTTP_HEAD;
+		client->head.len = 0;
+		client->events = REACTOR_READ;
+		client->event = reactor_io(sock, REACTOR_READ, http_io, ctx);
+		http_queue_reset(client);
+		LOG_INFO("[%p]: got HTTP connection %u", ctx, sock);
+	} else if (sock != -1) {
+		LOG_WARN("[%p]: too many HTTP clients, rejecting %u", ctx, sock);
+		closesocket(sock);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void http_io(void *owner, int sock, int events) {
+	raopst_t *ctx = (raopst_t*) owner;
+
+	for (int i = 0; i < HTTP_CLIENTS; i++) {
+		http_client_t *client = ctx->clients + i;
+		if (client->sock != sock || !(events & REACTOR_READ) || http_read(ctx, client)) continue;
+		raop_lock(&ctx->ab_mutex);
+		http_close(ctx, client);
+		raop_unlock(&ctx->ab_mutex);
+	}
+
+	reactor_timer_delay(ctx->http_timer, http_step(ctx));
+}
+
+/*---------------------------------------------------------------------------*/
+// serve complete requests, that might call owner back
+static uint32_t http_request_job(void *owner) {
+	raopst_t *ctx = ((struct request_owner_s*) owner)->ctx;
+
+	for (int i = 0; i < HTTP_CLIENTS; i++) {
+		http_client_t *client = ctx->clients + i;
+
+		raop_lock(&ctx->ab_mutex);
+		bool request = client->state == HTTP_REQUEST;
+		raop_unlock(&ctx->ab_mutex);
+
+		// http_step does not touch that client until it's handed back
+		if (!request) continue;
+
+		http_queue_reset(client);
+		bool res = handle_http(ctx, client);
+
+		raop_lock(&ctx->ab_mutex);
+		// nothing to send, so it's closed by http_step
+		if (!res) client->closing = true;
+		client->state = HTTP_SERVE;
+		raop_unlock(&ctx->ab_mutex);
+	}
+
+	reactor_timer_delay(ctx->http_timer, 0);
+	return REACTOR_NEVER;
+}
+
+/*---------------------------------------------------------------------------*/
+static uint32_t http_tick(void *owner) {
+	return http_step((raopst_t*) owner);
+}
+
+/*---------------------------------------------------------------------------*/
+// serve requests, feed encoders and move encoded data to clients, returns when to come back (ms)
+static uint32_t http_step(raopst_t *ctx) {
+	uint32_t timeout;
+	int count = 0;
+	int states[HTTP_CLIENTS];
+
+	raop_lock(&ctx->ab_mutex);
+
+	bool hold = false;
+	ctx->http_ready = false;
+
+	for (int i = 0; i < HTTP_CLIENTS; i++) {
+		http_client_t *client = ctx->clients + i;
+
+		// a client whose request is being served belongs to the job
+		states[i] = client->state;
+		if (client->sock == -1 || client->state == HTTP_REQUEST) continue;
+
 		// terminate connection if required by HTTP peer
-		if (n < 0 || !res || ctx->close_socket) {
-			LOG_INFO("HTTP close %u", sock);
-			closesocket(sock);
-			sock = -1;
-			ctx->close_socket = ctx->http_ready = false;
+		if (ctx->close_socket) {
+			http_close(ctx, client);
+			continue;
 		}
 
-		int16_t* pcm;
-		size_t bytes;
+		count++;
+		ctx->http_ready |= client->ready;
 
-		// wait for session to be ready before sending (no need for mutex)
-		if (ctx->http_ready && (pcm = _buffer_get_frame(ctx, &bytes)) != NULL) {
-			size_t frames = bytes / 4;
-			uint8_t* data = encoder_encode(ctx->encoder, pcm, frames, &bytes);
+		// when pausing on backpressure, don't take frames until slowest client has caught up
+		bool full = client->ready && ctx->output.policy == HTTP_PAUSE && http_queue_full(client);
 
-			if (bytes) {
-				uint32_t space, gap = gettime_ms();
-				int offset;
+		if (full && !client->stalled) {
+			ctx->output.stalls++;
+			LOG_WARN("[%p]: HTTP client %u too slow, holding reader (queued:%zu)", ctx, client->sock, client->queue.fill);
+		}
 
-#ifdef __RTP_STORE
-				fwrite(inbuf, len, 1, ctx->httpOUT);
-#endif
-				// store data for a potential re-send
-				space = min(bytes, CACHE_SIZE - (ctx->http_count % CACHE_SIZE));
-				memcpy(ctx->http_cache + (ctx->http_count % CACHE_SIZE), data, space);
-				memcpy(ctx->http_cache, data + space, bytes - space);
-				ctx->http_count += bytes;
-
-				// check if ICY sending is active (len < ICY_INTERVAL)
-				if (ctx->icy.active && bytes > ctx->icy.remain) {
-					int len_16 = 0;
-					char buffer[ICY_LEN_MAX];
-
-					if (ctx->icy.updated) {
-						char *format;
-
-						// there is room for 1 extra byte at the beginning for length
-						if (ctx->metadata.artwork) format = "NStreamTitle='%s%s%s';StreamURL='%s';";
-						else format = "NStreamTitle='%s%s%s';";
-						int len = sprintf(buffer, format, ctx->metadata.artist,
-										 ctx->metadata.artist ? " - " : "",
-										 ctx->metadata.title, ctx->metadata.artwork) - 1;
-						LOG_INFO("[%p]: ICY update %s", ctx, buffer + 1);
-						len_16 = (len + 15) / 16;
-						memset(buffer + len + 1, 0, len_16 * 16 - len);
-						ctx->icy.updated = false;
-						raopsr_metadata_free(&ctx->metadata);
-					}
-
-					buffer[0] = len_16;
-
-					// release mutex here as send might take a while
-					pthread_mutex_unlock(&ctx->ab_mutex);
-
-					// send remaining data first
-					offset = ctx->icy.remain;
-					if (offset) send_data(ctx->http_length == -3, sock, data, offset, 0);
-					bytes -= offset;
-
-					// then send icy data
-					send_data(ctx->http_length == -3, sock, buffer, len_16 * 16 + 1, 0);
-					ctx->icy.remain = ctx->icy.interval;
-
-					LOG_SDEBUG("[%p]: ICY checked %u", ctx, ctx->icy.remain);
-				} else {
-					offset = 0;
-					pthread_mutex_unlock(&ctx->ab_mutex);
-				}
+		client->stalled = full;
+		hold |= full;
+	}
 
-				LOG_SDEBUG("[%p]: HTTP sent frame count:%u bytes:%u (W:%hu R:%hu)", ctx, frame_count++, bytes + offset, ctx->ab_write, ctx->ab_read);
-				ssize_t sent = send_data(ctx->http_length == -3, sock, data + offset , bytes, 0);
+	ctx->close_socket = false;
 
-				// update remaining count with desired length
-				if (ctx->icy.active) ctx->icy.remain -= bytes;
+	// all active encoders must have room as they all take the same frame
+	bool room = true;
+	for (int i = 0; i < HTTP_FORMATS; i++) {
+		if (ctx->streams[i].active && raopenc_full(ctx->streams[i].job)) room = false;
+	}
 
-				gap = gettime_ms() - gap;
+	int16_t* pcm;
+	size_t bytes;
+	uint32_t playtime;
+	uint64_t now = gettime_us();
 
-				if (gap > 100) {
-					LOG_WARN("[%p]: spent %u ms in send for %u bytes (sent %zd)!", ctx, gap, bytes, sent);
-				}
+	// wait for session to be ready and for encoder stage to have room
+	if (ctx->http_ready && !hold && room && (pcm = fetch_frame(ctx, &bytes, &playtime)) != NULL) {
+		raop_timing_add(&ctx->timing_stages.fetch, gettime_us() - now);
+		for (int i = 0; i < HTTP_FORMATS; i++) {
+			if (ctx->streams[i].active) raopenc_put(ctx->streams[i].job, pcm, bytes);
+		}
+		ctx->http_frames++;
 
-				if (sent != bytes) {
-					LOG_WARN("[%p]: HTTP send() unexpected response: %li (data=%i): %s", ctx, (long int) sent, bytes, strerror(errno));
+		// no wait if we have more to send (catch-up) or just 1 frame in pause mode
+		timeout = ctx->pause ? (ctx->frame_size*1000)/44100 : 0;
+	} else if (count) {
+		// nothing to send, so probably can wait 2 frame unless paused
+		timeout = (2*ctx->frame_size*1000)/44100;
+	} else {
+		// nobody to serve, wait for connections
+		timeout = REACTOR_NEVER;
+	}
+
+	// collect what encoder stages have produced (stale data of inactive ones is dropped)
+	for (int i = 0; i < HTTP_FORMATS; i++) {
+		http_stream_t *stream = ctx->streams + i;
+		uint8_t *data;
+
+		if (!stream->job) continue;
+
+		while ((data = raopenc_get(stream->job, &bytes)) != NULL) {
+			uint32_t space;
+
+			// keep stream header aside for listeners joining once it has left the cache
+			if (!stream->count && stream->headed) {
+				if (bytes > stream->header.size) {
+					stream->header.buffer = realloc(stream->header.buffer, bytes);
+					stream->header.size = bytes;
 				}
-			} else pthread_mutex_unlock(&ctx->ab_mutex);
+				memcpy(stream->header.buffer, data, bytes);
+				stream->header.len = bytes;
+			}
 
-			// no wait if we have more to send (catch-up) or just 1 frame in pause mode
-			timeout.tv_usec = ctx->pause ? (ctx->frame_size*1000000)/44100 : 0;
-		} else {
-			// nothing to send, so probably can wait 2 frame unless paused
-			timeout.tv_usec = (2*ctx->frame_size*1000000)/44100;
-			pthread_mutex_unlock(&ctx->ab_mutex);
+			// store data for a potential re-send or a late listener
+			space = min(bytes, CACHE_SIZE - (stream->count % CACHE_SIZE));
+			memcpy(stream->cache + (stream->count % CACHE_SIZE), data, space);
+			memcpy(stream->cache, data + space, bytes - space);
+			stream->count += bytes;
+			RAOP_TRACE(http_encoded, stream->count, bytes);
+
+			// queue it to every listener, socket will take it when it can
+			for (int j = 0; j < HTTP_CLIENTS; j++) {
+				http_client_t *client = ctx->clients + j;
+				if (client->stream != stream || !client->ready || client->catchup) continue;
+				if (!http_enqueue(ctx, client, data, bytes)) http_close(ctx, client);
+			}
+
+			LOG_SDEBUG("[%p]: HTTP queued %s frame count:%u bytes:%zu (W:%hu R:%hu)", ctx, stream->codec, ctx->http_queued++, bytes, ctx->ab_write, ctx->ab_read);
+		}
+
+		// don't wait too long for frames being encoded
+		if (raopenc_pending(stream->job)) timeout = min(timeout, 2);
+	}
+
+	raop_unlock(&ctx->ab_mutex);
+
+	// send whatever the sockets can take now, never block
+	bool writable = false;
+	now = gettime_us();
+	for (int i = 0; i < HTTP_CLIENTS; i++) {
+		http_client_t *client = ctx->clients + i;
+		bool pending = false;
+
+		if (client->sock == -1) continue;
+
+		if (states[i] == HTTP_SERVE) {
+			if (!http_drain(ctx, client)) {
+				raop_lock(&ctx->ab_mutex);
+				http_close(ctx, client);
+				raop_unlock(&ctx->ab_mutex);
+				continue;
+			}
+			pending = client->queue.count || client->wire.pos != client->wire.len || client->catchup;
 		}
+
+		// only wake-up on writability when there is something pending, don't read while job has the request
+		int events = (states[i] != HTTP_REQUEST ? REACTOR_READ : 0) | (pending ? REACTOR_WRITE : 0);
+		if (events != client->events) {
+			client->events = events;
+			reactor_io_events(client->event, events);
+		}
+
+		writable |= client->ready && !pending;
 	}
+	if (count) raop_timing_add(&ctx->timing_stages.send, gettime_us() - now);
+
+	// catching up is paced by clients, so wait for one to be writable (but not more than a frame)
+	if (!timeout && !writable) timeout = (ctx->frame_size*1000)/44100;
+
+	// a bit of logging of stages from time to time
+	if (ctx->timing_stages.fetch.count && !(ctx->timing_stages.fetch.count & 0xfff) && ctx->timing_stages.fetch.count != ctx->stages_logged) {
+		raop_timing_t encode = raopenc_timing(ctx->streams[0].job);
+		ctx->stages_logged = ctx->timing_stages.fetch.count;
+		LOG_INFO("[%p]: stages avg/max us [fetch:%u/%u] [encode:%u/%u] [send:%u/%u]", ctx,
+				 (uint32_t) (ctx->timing_stages.fetch.total / ctx->timing_stages.fetch.count), ctx->timing_stages.fetch.max,
+				 encode.count ? (uint32_t) (encode.total / encode.count) : 0, encode.max,
+				 ctx->timing_stages.send.count ? (uint32_t) (ctx->timing_stages.send.total / ctx->timing_stages.send.count) : 0, ctx->timing_stages.send.max);
+	}
+
+	return timeout;
+}
+
+/*---------------------------------------------------------------------------*/
+static uint32_t notify_job(void *owner) {
+	raopst_t *ctx = ((struct notify_owner_s*) owner)->ctx;
 
-	if (sock != -1) shutdown_socket(sock);
+	raop_lock(&ctx->ab_mutex);
+	bool play = ctx->notify.play;
+	ctx->notify.play = false;
+	raop_unlock(&ctx->ab_mutex);
+
+	if (play) ctx->event_cb(ctx->owner, RAOP_STREAMER_PLAY);
+	return REACTOR_NEVER;
+}
+
+/*---------------------------------------------------------------------------*/
+// audio is given straight to the PCM sink, which can block as jitter buffer is
+// not locked while it runs
+static void *sink_thread_func(void *arg) {
+	raopst_t *ctx = (raopst_t*) arg;
+	uint32_t frame_ms = (ctx->frame_size * 1000) / 44100;
+
+	while (ctx->running) {
+		uint32_t playtime;
+		size_t bytes;
+		uint64_t now = gettime_us();
+
+		raop_lock(&ctx->ab_mutex);
+
+		int16_t *pcm = fetch_frame(ctx, &bytes, &playtime);
+
+		// callback runs unlocked so it needs its own copy
+		if (pcm) {
+			raop_timing_add(&ctx->timing_stages.fetch, gettime_us() - now);
+			if (bytes > ctx->sink.size) {
+				ctx->sink.size = bytes;
+				ctx->sink.buffer = realloc(ctx->sink.buffer, bytes);
+			}
+			memcpy(ctx->sink.buffer, pcm, bytes);
+		}
+
+		raop_unlock(&ctx->ab_mutex);
+
+		// nothing to play, wait for half a frame
+		if (!pcm) {
+			usleep(frame_ms * 500);
+			continue;
+		}
+
+		// don't run too far ahead of playtime, silence has none so just go at frame pace
+		int32_t ahead = playtime ? (int32_t) (playtime - gettime_ms()) - SINK_LEAD : (int32_t) frame_ms;
+		for (; ahead > 0 && ctx->running; ahead -= 50) usleep(min(ahead, 50) * 1000);
+
+		now = gettime_us();
+		ctx->sink.cb(ctx->owner, ctx->sink.buffer, bytes / 4, playtime);
+		raop_timing_add(&ctx->timing_stages.send, gettime_us() - now);
+	}
 
 	LOG_INFO("[%p]: terminating", ctx);
 	return NULL;
 }
 
 /*----------------------------------------------------------------------------*/
-static bool handle_http(raopst_t *ctx, int sock) {
-	char *body = NULL, method[16] = "", proto[16] = "", *str, *head = NULL;
+static bool http_stats(raopst_t *ctx, http_client_t *client, char *resource, char *accept) {
+	key_data_t resp[8] = { { NULL, NULL } };
+	bool openmetrics = !strcmp(resource, "/metrics") || (accept && strcasestr(accept, "openmetrics"));
+	raopst_stats_t stats;
+	raop_lock_stats_t locks;
+	char *body, *str;
+
+	// both under the same lock so that they are consistent
+	raop_lock(&ctx->ab_mutex);
+	stats_snapshot(ctx, &stats);
+	raop_lock_stats(&ctx->ab_mutex, &locks);
+	raop_unlock(&ctx->ab_mutex);
+
+	body = openmetrics ? stats_openmetrics(&stats, &locks) : stats_json(&stats, &locks);
+	if (!body) return false;
+
+	kd_add(resp, "Server", "HairTunes");
+	kd_add(resp, "Content-Type", openmetrics ? STATS_OPENMETRICS_MIME : STATS_JSON_MIME);
+	kd_vadd(resp, "Content-Length", "%zu", strlen(body));
+	kd_add(resp, "Connection", "close");
+
+	str = http_response(client, "HTTP/1.0 200 OK", resp);
+	bytes_add(&client->wire, body, strlen(body));
+	client->closing = true;
+
+	LOG_INFO("[%p]: responding: %s", ctx, str);
+
+	NFREE(str);
+	free(body);
+	kd_free(resp);
+
+	return true;
+}
+
+/*----------------------------------------------------------------------------*/
+static bool handle_http(raopst_t *ctx, http_client_t *client) {
+	char method[16] = "", resource[256] = "", proto[16] = "", *str, *head = NULL;
 	key_data_t headers[64], resp[16] = { { NULL, NULL } };
 	size_t offset = 0;
-	int len;
 
-	if (!http_parse(sock, method, NULL, proto, headers, &body, &len)) return false;
+	bool parsed = http_head_parse((char*) client->head.buffer, method, resource, proto, headers, 64);
+	client->head.len = 0;
+
+	if (!parsed) {
+		LOG_WARN("[%p]: malformed HTTP request from %u", ctx, client->sock);
+		return false;
+	}
+
 	bool HTTP_11 = strstr(proto, "HTTP/1.1") != NULL;
 
 	if (*loglevel >= lINFO) {
 		char *p = kd_dump(headers);
-		LOG_INFO("[%p]: received %s %s\n%s", ctx, method, proto, p);
+		LOG_INFO("[%p]: received %s %s %s\n%s", ctx, method, resource, proto, p);
 		NFREE(p);
 	}
 
+	raop_lock(&ctx->ab_mutex);
+	client->ready = client->catchup = false;
+	raop_unlock(&ctx->ab_mutex);
+
+	// statistics are a one-shot answer, not a listener
+	if (!strcmp(resource, "/stats") || !strcmp(resource, "/metrics")) {
+		bool res = http_stats(ctx, client, resource, kd_lookup(headers, "Accept"));
+		kd_free(headers);
+		return res;
+	}
+
+	raop_lock(&ctx->ab_mutex);
+
+	// each client picks its format, encoders are shared
+	http_stream_t *stream = stream_select(ctx, resource, kd_lookup(headers, "Accept"));
+	client->stream = stream;
+
 	kd_add(resp, "Server", "HairTunes");
-	kd_add(resp, "Content-Type", encoder_mimetype(ctx->encoder));
+	kd_add(resp, "Content-Type", encoder_mimetype(stream->encoder));
 
 	// is there a range request (chromecast non-compliance to HTTP !!!)
 	if (ctx->range && ((str = kd_lookup(headers, "Range")) != NULL)) {
@@ -1110,18 +2415,22 @@ static bool handle_http(raopst_t *ctx, int sock) {
 #endif	
 		if (offset) {
 			// try to find the position in the memorized data
-			offset = (ctx->http_count && ctx->http_count > CACHE_SIZE) ? min(offset, ctx->http_count - CACHE_SIZE - 1) : 0;
+			offset = (stream->count && stream->count > CACHE_SIZE) ? min(offset, stream->count - CACHE_SIZE - 1) : 0;
 			head = (ctx->http_length == -3 && HTTP_11) ? "HTTP/1.1 206 Partial Content" : "HTTP/1.0 206 Partial Content";
-			kd_vadd(resp, "Content-Range", "bytes %zu-%zu/*", offset, ctx->http_count);
+			kd_vadd(resp, "Content-Range", "bytes %zu-%zu/*", offset, stream->count);
 		}
 	}
 
 	// check if add ICY metadata is needed (only on live stream)
 	if (ctx->icy.enabled &&	((str = kd_lookup(headers, "Icy-MetaData")) != NULL) && atoi(str)) {
-		kd_vadd(resp, "icy-metaint", "%u", ctx->icy.interval);
-		ctx->icy.remain = ctx->icy.interval;
-		ctx->icy.active = true;
-	} else ctx->icy.active = false;
+		kd_vadd(resp, "icy-metaint", "%u", stream->icy_interval);
+		client->icy.remain = stream->icy_interval;
+		// whatever has been set already is news for this client
+		client->icy.version = ctx->icy.version - 1;
+		client->icy.active = true;
+	} else client->icy.active = false;
+
+	raop_unlock(&ctx->ab_mutex);
 
 	// let owner modify HTTP response if needed
 	if (ctx->http_cb) ctx->http_cb(ctx->owner, headers, resp);
@@ -1131,54 +2440,207 @@ static bool handle_http(raopst_t *ctx, int sock) {
 		if (value && (!strcasecmp(value, "close") || !strcasecmp(value,"keep-alive"))) kd_add(resp, "Connection", value);
 		else kd_add(resp, "Connection", "close");
 		kd_add(resp, "Transfer-Encoding", "chunked");
-		str = http_send(sock, head ? head : "HTTP/1.1 200 OK", resp);
+		str = http_response(client, head ? head : "HTTP/1.1 200 OK", resp);
 	} else {
 		// content-length is only for current payload, so ignore it with range 
 		if (ctx->http_length > 0 && !offset) kd_vadd(resp, "Content-Length", "%d", ctx->http_length);
 		kd_add(resp, "Connection", "close");
-		str = http_send(sock, head ? head : "HTTP/1.0 200 OK", resp);
+		str = http_response(client, head ? head : "HTTP/1.0 200 OK", resp);
 	}
 
 	LOG_INFO("[%p]: responding: %s", ctx, str);
 
-	NFREE(body);
 	NFREE(str);
 	kd_free(resp);
 	kd_free(headers);
 
 	// nothing else to do if this is a HEAD request
-	if (strstr(method, "HEAD")) return false;
+	if (strstr(method, "HEAD")) {
+		client->closing = true;
+		return true;
+	}
 
-	// need to re-send the range or restart from as far as possible on simple GET
-	if (offset || (ctx->http_count && ctx->http_count <= CACHE_SIZE)) {
-		size_t count = 0;
+	raop_lock(&ctx->ab_mutex);
+
+	// from now on, this format is encoded (until flush)
+	stream->active = true;
 
-		LOG_INFO("[%p] re-sending bytes %zu-%zu", ctx, offset, ctx->http_count);
+	// cache does not start with stream header anymore, so send it first (not for ranges)
+	if (!offset && stream->count > CACHE_SIZE && stream->header.len) {
+		http_enqueue(ctx, client, stream->header.buffer, stream->header.len);
+	}
+
+	// need to re-send the range or restart from as far as possible on simple GET
+	if (offset || (stream->count && stream->count <= CACHE_SIZE)) {
+		LOG_INFO("[%p] re-sending bytes %zu-%zu", ctx, offset, stream->count);
 		ctx->silence_count = 0;
-		while (count != ctx->http_count - offset) {
-			size_t bytes = ctx->icy.active ? ctx->icy.remain : 16384;
-			int sent;
+		client->cursor = offset;
+		client->catchup = true;
+	}
 
-			bytes = min(bytes, ctx->http_count - offset - count);
-			sent = send_data(ctx->http_length == -3, sock, ctx->http_cache + ((offset + count) % CACHE_SIZE), bytes, 0);
+	// only send silence when it's the first GET (or after a flush)
+	if (!ctx->http_frames) {
+		// send just the right amount of silence (ab_xxx are always accurate)
+		short buf_fill = ctx->ab_write - ctx->ab_read + 1;
+		int delay = ctx->delay;
+		// a flush is where adaptive prefill can always change
+		if (ctx->adaptive.estimator) delay = ctx->adaptive.prefill = adaptive_target(ctx);
+		if (buf_fill >= 0) ctx->silence_count = delay - min(delay, buf_fill);
+		else ctx->silence_count = 0;
+
+		LOG_INFO("[%p]: sending %d silence frames", ctx, ctx->silence_count);
+	}
 
-			if (sent < 0) {
-				LOG_ERROR("[%p]: error re-sending range %u", ctx, offset);
-				break;
-			}
+	client->ready = true;
 
-			count += sent;
+	raop_unlock(&ctx->ab_mutex);
 
-			// send ICY data if needed
-			if (ctx->icy.active) {
-				ctx->icy.remain -= sent;
-				if (!ctx->icy.remain) {
-					send_data(ctx->http_length == -3, sock, "", 1, 0);
-					ctx->icy.remain = ctx->icy.interval;
-				}
-			}
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+static void replay_event(void *owner, raopst_event_t event) {
+}
+
+/*---------------------------------------------------------------------------*/
+static raopst_t *replay_session(capture_record_t *record) {
+	char *strings[3];
+	struct in_addr any = { INADDR_ANY };
+
+	if (record->len < 37) return NULL;
+
+	uint8_t *p = record->data + 37;
+
+	// flags, http length, aes key/iv then codec, latencies and fmtp strings
+	for (int i = 0; i < 3; i++) {
+		uint8_t *end = memchr(p, '\0', record->data + record->len - p);
+		if (!end) return NULL;
+		strings[i] = (char*) p;
+		p = end + 1;
+	}
+
+	uint8_t flags = record->data[0];
+	bool decrypt = flags & 0x08;
+
+	raopst_resp_t resp = streamer_init(any, any, strings[0], flags & 0x04, flags & 0x01, flags & 0x02, strings[1],
+									   decrypt ? (char*) record->data + 5 : NULL, decrypt ? (char*) record->data + 21 : NULL,
+									   strings[2], 0, 0, NULL, replay_event, NULL, NULL, 0, 0, (int32_t) capture_get(record->data + 1, 4), true);
+
+	if (resp.ctx) {
+		resp.ctx->replay.active = true;
+		resp.ctx->replay.now = resp.ctx->replay.out = record->time;
+	}
+
+	return resp.ctx;
+}
+
+/*---------------------------------------------------------------------------*/
+static uint32_t replay_output(raopst_t *ctx, FILE *out) {
+	uint32_t frames = 0;
+
+	raop_lock(&ctx->ab_mutex);
+
+	// resend scheduling runs as well (nothing is sent) so that its statistics are meaningful
+	resend_poll(ctx->resend, clock_ms(ctx), raopclk_status(ctx->timing.clock).rtt_min / 1000, ctx->ab_read, rtp_request_resend, ctx);
+
+	// don't run ahead of virtual time, like an HTTP client reading in real time
+	while ((int64_t) (ctx->replay.out - ctx->replay.now) <= 0) {
+		size_t bytes;
+		uint32_t playtime;
+		int16_t *pcm = fetch_frame(ctx, &bytes, &playtime);
+
+		if (!pcm) {
+			// underrun, next frame can go as soon as it is there
+			ctx->replay.out = ctx->replay.now;
+			break;
 		}
+
+		if (out) fwrite(pcm, bytes, 1, out);
+		ctx->replay.out += ((uint64_t) bytes / 4) * 1000000 / 44100;
+		frames++;
 	}
 
+	raop_unlock(&ctx->ab_mutex);
+
+	return frames;
+}
+
+/*---------------------------------------------------------------------------*/
+bool raopst_replay(char *path, FILE *out) {
+	struct capture_s *cap = capture_open(path);
+	capture_record_t record;
+	raopst_t *ctx = NULL;
+	uint32_t records = 0, frames = 0;
+	uint64_t start = gettime_us();
+
+	if (!cap) {
+		LOG_ERROR("can't open capture %s", path);
+		return false;
+	}
+
+	while (capture_read(cap, &record)) {
+		// only first session is replayed
+		if (record.type == CAPTURE_SESSION) {
+			if (!ctx && (ctx = replay_session(&record)) == NULL) break;
+			continue;
+		}
+
+		if (!ctx) continue;
+
+		// move virtual time and output what would have been output until then
+		ctx->replay.now = record.time;
+		frames += replay_output(ctx, out);
+		records++;
+
+		// records that are too short are ignored, not replayed with garbage
+		switch (record.type) {
+		case CAPTURE_PACKET:
+			if (record.len <= MAX_PACKET) rtp_process(ctx, (char*) record.data, record.len);
+			break;
+		case CAPTURE_RECORD:
+			if (record.len >= 6) raopst_record(ctx, capture_get(record.data, 2), capture_get(record.data + 2, 4));
+			break;
+		case CAPTURE_FLUSH:
+			if (record.len >= 7) raopst_flush(ctx, capture_get(record.data, 2), capture_get(record.data + 2, 4), false, record.data[6]);
+			break;
+		case CAPTURE_PARAMETER: {
+			// first line is enough
+			int n = 0;
+			while (n < record.len && record.data[n] != '\r' && record.data[n] != '\n') n++;
+			LOG_INFO("[%p]: parameter %.*s", ctx, n, record.data);
+			break;
+		}
+		case CAPTURE_METADATA:
+			LOG_INFO("[%p]: metadata of %hu bytes", ctx, record.len);
+			break;
+		case CAPTURE_ARTWORK:
+			if (record.len >= 4) LOG_INFO("[%p]: artwork of %u bytes", ctx, (uint32_t) capture_get(record.data, 4));
+			break;
+		default:
+			break;
+		}
+
+		// nothing after a TEARDOWN belongs to that session
+		if (record.type == CAPTURE_TEARDOWN) {
+			LOG_INFO("[%p]: teardown", ctx);
+			break;
+		}
+	}
+
+	capture_delete(cap);
+
+	if (!ctx) {
+		LOG_ERROR("no session in capture %s", path);
+		return false;
+	}
+
+	// play what is left in the buffer
+	for (uint64_t end = ctx->replay.now + ((uint64_t) ctx->latency * 1000000) / 44100 + 1000000; ctx->replay.now < end; ctx->replay.now += 10000) {
+		frames += replay_output(ctx, out);
+	}
+
+	LOG_INFO("[%p]: replayed %u records in %u ms, %u frames (silent:%u)", ctx, records, (uint32_t) ((gettime_us() - start) / 1000), frames, ctx->silent_frames);
+	raopst_end(ctx);
+
 	return true;
 }
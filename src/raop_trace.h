@@ -0,0 +1,32 @@
+/*
+ * RAOP : static tracepoints of audio packets lifecycle
+ *
+ * (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+/*
+ Probes are USDT (provider "libraop") when built with RAOP_USDT and sys/sdt.h
+ exists, otherwise they are compiled out. Each carries the RTP sequence number
+ and rtptime of the packet, except HTTP ones that have no packet anymore. A
+ disabled USDT probe is a single nop, see tools/raop_latency.bt for a user.
+
+ client   : chunk, encoded, encrypted, sent, resent
+ streamer : received, decoded, played, http_encoded (count, bytes),
+            http_sent (socket, bytes)
+*/
+
+#if defined(RAOP_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RAOP_TRACE(probe, a, b) DTRACE_PROBE2(libraop, probe, a, b)
+#endif
+#endif
+
+#ifndef RAOP_TRACE
+#define RAOP_TRACE(probe, a, b) do { } while (0)
+#endif
@@ -0,0 +1,200 @@
+/*
+ *  Asynchronous resampler for 16 bits stereo, used to absorb clock drift
+ *
+ *  Windowed-sinc interpolation with a table of filter phases, linearly
+ *  interpolated between phases. Samples are kept interleaved and taps are
+ *  duplicated so that one vector accumulates both channels at once
+ *
+ *  (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <pthread.h>
+
+#include "resampler.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define RESAMPLER_SSE
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RESAMPLER_NEON
+#endif
+
+#define TAPS		16				// must be a multiple of 2 (vector is 2 stereo samples)
+#define PHASE_BITS	8
+#define PHASES		(1 << PHASE_BITS)
+#define FRAC_BITS	32
+#define ONE			((uint64_t) 1 << FRAC_BITS)
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+typedef struct resampler_s {
+	float *buffer;			// interleaved history + new samples
+	size_t fill, size;		// in frames
+	uint64_t pos;			// position of next output in buffer, 32.32 fixed point
+	int16_t *out;
+	size_t max_frames;
+} resampler_t;
+
+// stereo duplicated coefficients of each phase and difference with next phase
+static float coefs[PHASES][2 * TAPS], deltas[PHASES][2 * TAPS];
+static pthread_once_t coefs_once = PTHREAD_ONCE_INIT;
+
+/*---------------------------------------------------------------------------*/
+static void coefs_init(void) {
+	double h[PHASES + 1][TAPS];
+
+	for (int p = 0; p <= PHASES; p++) {
+		double sum = 0;
+
+		// interpolated point is between taps TAPS/2 - 1 and TAPS/2, at p/PHASES
+		for (int k = 0; k < TAPS; k++) {
+			double x = k - (TAPS / 2 - 1) - (double) p / PHASES;
+			double sinc = x ? sin(M_PI * x) / (M_PI * x) : 1;
+			double w = 0.42 + 0.5 * cos(M_PI * x / (TAPS / 2)) + 0.08 * cos(2 * M_PI * x / (TAPS / 2));
+			h[p][k] = fabs(x) < TAPS / 2 ? sinc * w : 0;
+			sum += h[p][k];
+		}
+
+		// unity gain at DC for every phase
+		for (int k = 0; k < TAPS; k++) h[p][k] /= sum;
+	}
+
+	for (int p = 0; p < PHASES; p++) {
+		for (int k = 0; k < TAPS; k++) {
+			coefs[p][2*k] = coefs[p][2*k + 1] = (float) h[p][k];
+			deltas[p][2*k] = deltas[p][2*k + 1] = (float) (h[p + 1][k] - h[p][k]);
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+// filter one stereo output sample from TAPS interleaved input samples
+static inline void filter(const float *x, const float *h, const float *d, float w, float out[2]) {
+#if defined(RESAMPLER_SSE)
+	__m128 acc = _mm_setzero_ps(), vw = _mm_set1_ps(w);
+	for (int k = 0; k < 2 * TAPS; k += 4) {
+		__m128 c = _mm_add_ps(_mm_loadu_ps(h + k), _mm_mul_ps(vw, _mm_loadu_ps(d + k)));
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + k), c));
+	}
+	// lanes are L,R,L,R
+	acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+	_mm_storel_pi((__m64*) out, acc);
+#elif defined(RESAMPLER_NEON)
+	float32x4_t acc = vdupq_n_f32(0);
+	for (int k = 0; k < 2 * TAPS; k += 4) {
+		float32x4_t c = vmlaq_n_f32(vld1q_f32(h + k), vld1q_f32(d + k), w);
+		acc = vmlaq_f32(acc, vld1q_f32(x + k), c);
+	}
+	vst1_f32(out, vadd_f32(vget_low_f32(acc), vget_high_f32(acc)));
+#else
+	float l = 0, r = 0;
+	for (int k = 0; k < 2 * TAPS; k += 2) {
+		l += x[k] * (h[k] + w * d[k]);
+		r += x[k + 1] * (h[k + 1] + w * d[k + 1]);
+	}
+	out[0] = l;
+	out[1] = r;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+static inline int16_t clip16(float v) {
+	v += v >= 0 ? 0.5f : -0.5f;
+	if (v > 32767) return 32767;
+	if (v < -32768) return -32768;
+	return (int16_t) v;
+}
+
+/*---------------------------------------------------------------------------*/
+struct resampler_s *resampler_create(size_t max_frames) {
+	resampler_t *resampler = calloc(1, sizeof(resampler_t));
+	if (!resampler) return NULL;
+
+	pthread_once(&coefs_once, coefs_init);
+
+	// worst case is a few extra frames, ratio is never far from 1
+	resampler->max_frames = max_frames;
+	resampler->size = TAPS + max_frames;
+	resampler->buffer = malloc(resampler->size * 2 * sizeof(float));
+	resampler->out = malloc((max_frames + max_frames / 64 + 4) * 2 * sizeof(int16_t));
+
+	if (!resampler->buffer || !resampler->out) {
+		resampler_delete(resampler);
+		return NULL;
+	}
+
+	resampler_reset(resampler);
+	return resampler;
+}
+
+/*---------------------------------------------------------------------------*/
+void resampler_delete(struct resampler_s *resampler) {
+	if (!resampler) return;
+	free(resampler->buffer);
+	free(resampler->out);
+	free(resampler);
+}
+
+/*---------------------------------------------------------------------------*/
+void resampler_reset(struct resampler_s *resampler) {
+	// silent history so that first output is first input sample
+	resampler->fill = TAPS / 2 - 1;
+	resampler->pos = 0;
+	memset(resampler->buffer, 0, resampler->fill * 2 * sizeof(float));
+}
+
+/*---------------------------------------------------------------------------*/
+int16_t *resampler_process(struct resampler_s *resampler, int16_t *in, size_t frames, double ratio, size_t *out_frames) {
+	uint64_t step = (uint64_t) (ONE / ratio + 0.5);
+	size_t n = 0, limit = resampler->max_frames + resampler->max_frames / 64 + 4;
+	float *buffer = resampler->buffer;
+
+	if (frames > resampler->max_frames) frames = resampler->max_frames;
+
+	// append new samples after history
+	for (size_t i = 0; i < frames * 2; i++) buffer[resampler->fill * 2 + i] = in[i];
+	resampler->fill += frames;
+
+	// produce while all taps are available
+	while (n < limit && (resampler->pos >> FRAC_BITS) + TAPS <= resampler->fill) {
+		size_t index = resampler->pos >> FRAC_BITS;
+		uint32_t frac = (uint32_t) resampler->pos;
+		int16_t *out = resampler->out + n++ * 2;
+
+		if (!frac) {
+			// exactly on an input sample (always the case with no drift)
+			out[0] = clip16(buffer[(index + TAPS / 2 - 1) * 2]);
+			out[1] = clip16(buffer[(index + TAPS / 2 - 1) * 2 + 1]);
+		} else {
+			float v[2];
+			// phase and position between that phase and next one
+			int phase = frac >> (FRAC_BITS - PHASE_BITS);
+			float w = (float) (frac & ((1 << (FRAC_BITS - PHASE_BITS)) - 1)) / (1 << (FRAC_BITS - PHASE_BITS));
+			filter(buffer + index * 2, coefs[phase], deltas[phase], w, v);
+			out[0] = clip16(v[0]);
+			out[1] = clip16(v[1]);
+		}
+
+		resampler->pos += step;
+	}
+
+	// discard what is not needed anymore
+	size_t used = resampler->pos >> FRAC_BITS;
+	if (used > resampler->fill) used = resampler->fill;
+	memmove(buffer, buffer + used * 2, (resampler->fill - used) * 2 * sizeof(float));
+	resampler->fill -= used;
+	resampler->pos -= (uint64_t) used << FRAC_BITS;
+
+	*out_frames = n;
+	return resampler->out;
+}
@@ -0,0 +1,24 @@
+/*
+ *  Asynchronous resampler for 16 bits stereo, used to absorb clock drift
+ *
+ *  (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ ratio is output rate over input rate and is expected to stay very close to 1
+ (a few hundred ppm), it can change between calls. Output is delayed by half
+ the filter length and returned buffer is valid until next call
+*/
+struct resampler_s*	resampler_create(size_t max_frames);
+void				resampler_delete(struct resampler_s *resampler);
+void				resampler_reset(struct resampler_s *resampler);
+int16_t*			resampler_process(struct resampler_s *resampler, int16_t *in, size_t frames, double ratio, size_t *out_frames);
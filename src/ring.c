@@ -0,0 +1,112 @@
+/*
+ *  Lock-free single producer / single consumer ring of variable size records
+ *
+ *  (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+#define RECORD_HDR	sizeof(uint32_t)
+
+/*---------------------------------------------------------------------------*/
+bool ring_init(ring_t *ring, size_t size) {
+	// size must be a power of 2 for masking to work
+	for (ring->size = 1024; ring->size < size; ring->size <<= 1);
+	ring->mask = ring->size - 1;
+	ring->head = ring->tail = 0;
+	ring->buffer = malloc(ring->size);
+	return ring->buffer != NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+void ring_free(ring_t *ring) {
+	free(ring->buffer);
+	ring->buffer = NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+void ring_reset(ring_t *ring) {
+	ring->head = ring->tail = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static void ring_write(ring_t *ring, uint32_t pos, const void *data, uint32_t len) {
+	uint32_t offset = pos & ring->mask;
+	uint32_t space = ring->size - offset;
+
+	if (len <= space) {
+		memcpy(ring->buffer + offset, data, len);
+	} else {
+		memcpy(ring->buffer + offset, data, space);
+		memcpy(ring->buffer, (uint8_t*) data + space, len - space);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void ring_read(ring_t *ring, uint32_t pos, void *data, uint32_t len) {
+	uint32_t offset = pos & ring->mask;
+	uint32_t space = ring->size - offset;
+
+	if (len <= space) {
+		memcpy(data, ring->buffer + offset, len);
+	} else {
+		memcpy(data, ring->buffer + offset, space);
+		memcpy((uint8_t*) data + space, ring->buffer, len - space);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+bool ring_putv(ring_t *ring, const void *head, uint32_t hlen, const void *data, uint32_t len) {
+	uint32_t tail = ring_load(&ring->tail);
+	uint32_t total = hlen + len;
+
+	if (ring->size - (ring->head - tail) < RECORD_HDR + total) return false;
+
+	ring_write(ring, ring->head, &total, RECORD_HDR);
+	if (hlen) ring_write(ring, ring->head + RECORD_HDR, head, hlen);
+	if (len) ring_write(ring, ring->head + RECORD_HDR + hlen, data, len);
+
+	// publish only once record is complete
+	ring_store(&ring->head, ring->head + RECORD_HDR + total);
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+bool ring_put(ring_t *ring, const void *data, uint32_t len) {
+	return ring_putv(ring, NULL, 0, data, len);
+}
+
+/*---------------------------------------------------------------------------*/
+uint32_t ring_peek(ring_t *ring) {
+	uint32_t len;
+
+	if (ring_load(&ring->head) == ring->tail) return 0;
+	ring_read(ring, ring->tail, &len, RECORD_HDR);
+
+	return len;
+}
+
+/*---------------------------------------------------------------------------*/
+uint32_t ring_get(ring_t *ring, void *data) {
+	uint32_t len;
+
+	if (ring_load(&ring->head) == ring->tail) return 0;
+	ring_read(ring, ring->tail, &len, RECORD_HDR);
+
+	// NULL data means discard record
+	if (data) ring_read(ring, ring->tail + RECORD_HDR, data, len);
+	ring_store(&ring->tail, ring->tail + RECORD_HDR + len);
+
+	return len;
+}
+
+/*---------------------------------------------------------------------------*/
+uint32_t ring_used(ring_t *ring) {
+	return ring_load(&ring->head) - ring_load(&ring->tail);
+}
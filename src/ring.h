@@ -0,0 +1,44 @@
+/*
+ *  Lock-free single producer / single consumer ring of variable size records
+ *
+ *  (c) Philippe, philippe_44@outlook.com
+ *
+ * See LICENSE
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(_MSC_VER)
+// volatile has acquire/release semantic with MSVC (x86 and /volatile:ms)
+#define ring_load(p) (*(volatile uint32_t*) (p))
+#define ring_store(p, v) (*(volatile uint32_t*) (p) = (v))
+#else
+#define ring_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ring_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+typedef struct ring_s {
+	uint8_t *buffer;
+	uint32_t size, mask;
+	uint32_t head, tail;	// free-running, head is owned by producer, tail by consumer
+} ring_t;
+
+/*
+ Records are stored with their length so a consumer always gets back what the
+ producer has put, in one piece. Only one thread may put and one thread may get
+ (can be a different one), ring_reset must only be used when both are idle.
+ Records cannot be empty as ring_peek returns 0 when there is nothing to get
+*/
+bool		ring_init(ring_t *ring, size_t size);
+void		ring_free(ring_t *ring);
+void		ring_reset(ring_t *ring);
+bool		ring_put(ring_t *ring, const void *data, uint32_t len);
+bool		ring_putv(ring_t *ring, const void *head, uint32_t hlen, const void *data, uint32_t len);
+uint32_t	ring_peek(ring_t *ring);
+uint32_t	ring_get(ring_t *ring, void *data);
+uint32_t	ring_used(ring_t *ring);
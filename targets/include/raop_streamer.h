@@ -21,15 +21,81 @@ typedef enum { RAOP_STREAMER_PLAY } raopst_event_t;
 
 typedef	void (*raopst_cb_t)(void *owner, raopst_event_t event);
 
+struct resend_stats_s;	// see raop_resend.h
+struct raop_lock_stats_s;	// see raop_lock.h
+
+#define RAOPST_FILL_BUCKETS	12	// 0 is empty, then [2^(n-1), 2^n) frames and last is open
+#define RAOPST_RTT_BUCKETS	10	// 0 is below 250us, then [250*2^(n-1), 250*2^n) us and last is open
+
+typedef struct {
+	uint32_t count, avg, max;	// in us
+} raopst_time_t;
+
+typedef struct raopst_stats_s {
+	struct {
+		short level;
+		uint32_t latency;							// in ms, configured or given by sender (0 until known)
+		uint32_t histogram[RAOPST_FILL_BUCKETS];	// level each time a frame is taken
+	} buffer;
+	struct {
+		uint32_t received, late, duplicate, silent, filled;
+		uint32_t missing, requested, recovered, abandoned;	// resends
+	} frames;
+	struct {
+		bool locked;
+		double ppm, correction;		// measured drift and correction applied
+		int64_t adjusted;			// samples added (or removed) by resampler
+		uint32_t corrections;
+	} drift;
+	struct {
+		uint32_t accepted, rejected;
+		uint32_t rtt_min, rtt_last;	// in us
+		double jitter;
+		uint32_t histogram[RAOPST_RTT_BUCKETS];
+	} ntp;
+	struct {
+		raopst_time_t fetch, encode, send;	// per frame, encode is for all formats
+	} stages;
+	struct {
+		uint32_t clients, stalls, dropped;
+	} http;
+	struct {
+		bool enabled;
+		uint32_t prefill, target, deadline;	// in ms, prefill in effect and wanted
+		double jitter;						// in ms
+		int32_t late;						// in ms, worst arrival after playtime
+		uint32_t burst, recovery, decisions;	// burst in frames, recovery in ms
+	} adaptive;
+} raopst_stats_t;
+
 raopst_resp_t 	raopst_init(struct in_addr host, struct in_addr peer, char *codec, bool metadata,
 							bool drift, bool range, char *latencies,
 							char *aeskey, char *aesiv, char *fmtpstr,
 							short unsigned pCtrlPort, short unsigned pTimingPort,
-							void *owner, raopst_cb_t event_cb, raop_http_cb_t http_cb,
+							void *owner, raopst_cb_t event_cb, raop_http_cb_t http_cb, raop_pcm_cb_t pcm_cb,
 							unsigned short port_base, unsigned short port_range,
 							int http_length);
 void			 	raopst_end(struct raopst_s *ctx);
+// stop session but keep sockets, encoders and buffers, so that it can be re-used
+void				raopst_park(struct raopst_s *ctx);
+// restart a parked session for a new peer on the same ports, fails if fmtp has another frame size
+// (then session must be ended). Statistics add up across re-used sessions
+bool				raopst_reuse(struct raopst_s *ctx, struct in_addr peer, char *aeskey, char *aesiv, char *fmtpstr,
+								 short unsigned pCtrlPort, short unsigned pTimingPort, raopst_resp_t *resp);
+// with silence, a playing session keeps its HTTP clients and encoders and sends silence until next packet
 bool 				raopst_flush(struct raopst_s *ctx, unsigned short seqno, unsigned rtptime, bool exit_locked, bool silence);
 void 				raopst_flush_release(struct raopst_s *ctx);
 void 				raopst_record(struct raopst_s *ctx, unsigned short seqno, unsigned rtptime);
 void 				raopst_metadata(struct raopst_s *ctx, raopsr_metadata_t *metadata);
+void				raopst_resend_stats(struct raopst_s *ctx, struct resend_stats_s *stats);
+// buffer mutex wait and hold times per call site, once enabled by raop_lock_profile()
+void				raopst_lock_stats(struct raopst_s *ctx, struct raop_lock_stats_s *stats);
+// snapshot also served on HTTP port as JSON on /stats or OpenMetrics on /metrics
+void				raopst_get_stats(struct raopst_s *ctx, raopst_stats_t *stats);
+// start (or stop when path is NULL) capturing all received RTP packets and RTSP events
+bool				raopst_capture(struct raopst_s *ctx, char *path);
+// RTSP requests handled by server only (type is a capture_type_t of raop_capture.h)
+void				raopst_capture_event(struct raopst_s *ctx, int type, const void *data, size_t len);
+// re-create a session from a capture and run it as fast as possible with a virtual clock,
+// output audio (before encoding) is written to out if not NULL
+bool				raopst_replay(char *path, FILE *out);
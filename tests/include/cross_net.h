@@ -0,0 +1,21 @@
+/*
+ * Stand-in for crosstools' cross_net.h, only what tested modules need
+ */
+
+#pragma once
+
+#include <time.h>
+#include "platform.h"
+
+static inline uint64_t gettime_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline uint32_t gettime_ms(void) {
+	return gettime_us() / 1000;
+}
+
+int	bind_socket(struct in_addr host, unsigned short *port, int mode);
+int	shutdown_socket(int sd);
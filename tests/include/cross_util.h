@@ -0,0 +1,19 @@
+/*
+ * Stand-in for crosstools' cross_util.h, only what tested modules need
+ */
+
+#pragma once
+
+#include "platform.h"
+
+typedef struct key_data_s {
+	char *key, *data;
+} key_data_t;
+
+#define NFREE(p) if (p) { free(p); p = NULL; }
+
+char*	kd_lookup(key_data_t *kd, char *key);
+bool	kd_add(key_data_t *kd, char *key, char *value);
+bool	kd_vadd(key_data_t *kd, char *key, char *fmt, ...);
+char*	kd_dump(key_data_t *kd);
+void	kd_free(key_data_t *kd);
@@ -0,0 +1,18 @@
+/*
+ * Stand-in for libcodecs' encoder.h
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct encoder_s;
+
+struct encoder_s*	encoder_create(char *codec, int rate, int channels, int sample_size, int bitrate, size_t *icy_interval);
+void				encoder_delete(struct encoder_s *encoder);
+bool				encoder_open(struct encoder_s *encoder);
+void				encoder_close(struct encoder_s *encoder);
+uint8_t*			encoder_encode(struct encoder_s *encoder, int16_t *pcm, size_t frames, size_t *bytes);
+char*				encoder_mimetype(struct encoder_s *encoder);
@@ -0,0 +1,8 @@
+/*
+ * Stand-in for libmdns' mdnssvc.h
+ */
+
+#pragma once
+
+struct mdnsd;
+struct mdns_service;
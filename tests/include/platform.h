@@ -0,0 +1,37 @@
+/*
+ * Stand-in for crosstools' platform.h, only what tested modules need
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+
+#define LINUX 1
+#define WIN 0
+#define OSX 0
+#define FREEBSD 0
+
+#define VALGRIND_MAKE_MEM_DEFINED(a, b)
+#define closesocket close
+
+char*	itoa(int value, char *str, int radix);
+
+#ifndef min
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+#endif
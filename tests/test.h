@@ -0,0 +1,23 @@
+/*
+ * Minimal checks shared by tests, a test returns the number of failures
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		failures++; \
+		fprintf(stderr, "%s:%d: check failed: %s ", __FILE__, __LINE__, #cond); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+	} \
+} while (0)
+
+#define TEST_END() do { \
+	fprintf(stderr, "%s: %s (%d failures)\n", __FILE__, failures ? "FAILED" : "passed", failures); \
+	return failures ? 1 : 0; \
+} while (0)
@@ -0,0 +1,224 @@
+/*
+ * ALAC: what the encoder produces is decoded to the very same samples (normal,
+ * fast and uncompressed packets, full and partial frames), frames with fields
+ * out of range are rejected and corrupted or random frames never make the
+ * decoder go out of its buffers (run with sanitizers)
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "test.h"
+#include "alac.h"
+#include "alac_enc.h"
+
+#define PACKETS	64
+
+static uint32_t seed = 1;
+
+// deterministic whatever the libc
+static uint32_t rnd(void) {
+	seed = seed * 1664525 + 1013904223;
+	return seed >> 8;
+}
+
+// music-like (two tones and a bit of noise), silence, full scale noise and a clipped square
+static void synth(int16_t *pcm, int frames, int packet) {
+	for (int i = 0; i < frames; i++) {
+		int n = packet * frames + i;
+		int32_t l, r;
+
+		switch (packet % 8) {
+		case 3:
+			l = r = 0;
+			break;
+		case 5:
+			l = (int16_t) rnd();
+			r = (int16_t) rnd();
+			break;
+		case 7:
+			l = (n / 50) & 1 ? 32767 : -32768;
+			r = -l - 1;
+			break;
+		default:
+			l = 12000 * sin(n * 0.031) + 6000 * sin(n * 0.0071) + (int) (rnd() % 512) - 256;
+			r = 10000 * sin(n * 0.029 + 1) + (int) (rnd() % 256) - 128;
+			break;
+		}
+
+		pcm[2 * i] = l;
+		pcm[2 * i + 1] = r;
+	}
+}
+
+static alac_file *decoder(int frames, int sample_size, int channels, int mult, int history, int kmodifier) {
+	alac_file *alac = create_alac(sample_size, channels);
+
+	alac->setinfo_max_samples_per_frame = frames;
+	alac->setinfo_7a = 0;
+	alac->setinfo_sample_size = sample_size;
+	alac->setinfo_rice_historymult = mult;
+	alac->setinfo_rice_initialhistory = history;
+	alac->setinfo_rice_kmodifier = kmodifier;
+	alac->setinfo_7f = 2;
+	alac->setinfo_80 = 255;
+	alac->setinfo_82 = 0;
+	alac->setinfo_86 = 0;
+	alac->setinfo_8a_rate = 44100;
+	allocate_buffers(alac);
+
+	return alac;
+}
+
+// frames are msb first
+static void put_field(uint8_t *frame, int pos, int bits, uint32_t value) {
+	for (int i = 0; i < bits; i++, pos++) {
+		int bit = (value >> (bits - 1 - i)) & 1;
+		frame[pos / 8] = (frame[pos / 8] & ~(0x80 >> (pos % 8))) | (bit << (7 - pos % 8));
+	}
+}
+
+static void round_trip(int frames, bool fast) {
+	struct alacenc_s *enc = alacenc_create(frames, fast);
+	alac_file *alac = decoder(frames, 16, 2, 40, 10, 14);
+	int16_t *pcm = malloc(frames * 4), *out = malloc(frames * 4);
+	uint8_t *packet = malloc(alacenc_max_size(frames));
+	int verbatim = 0;
+
+	for (int p = 0; p < PACKETS; p++) {
+		// last one is a partial frame, size is then in the packet
+		int n = p == PACKETS - 1 ? frames / 3 : frames, size;
+
+		synth(pcm, n, p);
+		size_t len = alacenc_encode(enc, (uint8_t*) pcm, n, packet);
+
+		CHECK(len && len <= alacenc_max_size(n), "packet %d of %zu bytes", p, len);
+		if (len >= (size_t) n * 4) verbatim++;
+
+		memset(out, 0x55, frames * 4);
+		CHECK(decode_frame(alac, packet, len, out, &size) == 0, "frames:%d fast:%d packet %d not decoded", frames, fast, p);
+		CHECK(size == n * 4, "frames:%d fast:%d packet %d has %d bytes", frames, fast, p, size);
+		CHECK(!memcmp(pcm, out, n * 4), "frames:%d fast:%d packet %d differs", frames, fast, p);
+	}
+
+	// noise does not compress, so it must have been sent uncompressed
+	CHECK(verbatim, "frames:%d fast:%d no uncompressed packet", frames, fast);
+	CHECK(!alacenc_encode(enc, (uint8_t*) pcm, frames + 1, packet), "more frames than created for");
+
+	free(packet);
+	free(out);
+	free(pcm);
+	delete_alac(alac);
+	alacenc_delete(enc);
+}
+
+static void out_of_range(void) {
+	struct alacenc_s *enc = alacenc_create(352, false);
+	alac_file *alac = decoder(352, 16, 2, 40, 10, 14), *generic = decoder(352, 16, 2, 40, 10, 15);
+	int16_t pcm[352 * 2], out[352 * 2];
+	uint8_t packet[2048], bad[2048];
+	int size;
+
+	synth(pcm, 352, 0);
+	size_t len = alacenc_encode(enc, (uint8_t*) pcm, 352, packet);
+
+	// after 23 bits of header come interlacing shift (8), weight (8) then channel 1 type (4) and quantitization (4)
+	memcpy(bad, packet, len);
+	put_field(bad, 23 + 16 + 4, 4, 0);
+	CHECK(decode_frame(alac, bad, len, out, &size) == -1 && !size, "null quantitization accepted");
+	CHECK(decode_frame(generic, bad, len, out, &size) == -1 && !size, "null quantitization accepted (generic)");
+
+	memcpy(bad, packet, len);
+	put_field(bad, 23, 8, 40);
+	put_field(bad, 31, 8, 1);
+	CHECK(decode_frame(alac, bad, len, out, &size) == -1 && !size, "interlacing shift of 40 accepted");
+	CHECK(decode_frame(generic, bad, len, out, &size) == -1 && !size, "interlacing shift of 40 accepted (generic)");
+
+	// still fine when in range
+	memcpy(bad, packet, len);
+	put_field(bad, 23, 8, 31);
+	CHECK(decode_frame(alac, bad, len, out, &size) == 0, "interlacing shift of 31 refused");
+
+	alac_file *kzero = decoder(352, 16, 2, 40, 10, 0);
+	CHECK(decode_frame(kzero, packet, len, out, &size) == -1 && !size, "null kmodifier accepted");
+	delete_alac(kzero);
+
+	alac_file *size32 = decoder(352, 32, 2, 40, 10, 14);
+	CHECK(decode_frame(size32, packet, len, out, &size) == -1 && !size, "32 bits samples accepted");
+	delete_alac(size32);
+
+	delete_alac(generic);
+	delete_alac(alac);
+	alacenc_delete(enc);
+}
+
+static void corrupted(void) {
+	struct { int frames, size, channels, mult, history, kmodifier; } formats[] = {
+		{ 352, 16, 2, 40, 10, 14 },			// specialised
+		{ 352, 16, 2, 32, 8, 12 },			// specialised, other rice
+		{ 4096, 16, 2, 40, 10, 14 },		// specialised, large
+		{ 352, 16, 1, 40, 10, 14 },			// generic
+		{ 352, 24, 2, 40, 10, 14 },			// generic
+		{ 352, 24, 1, 255, 255, 16 },
+	};
+	struct alacenc_s *enc = alacenc_create(352, false), *fast = alacenc_create(352, true);
+	int16_t pcm[352 * 2];
+	uint8_t packet[4096], bad[4096];
+	// large enough for anything one of the decoders can write
+	int32_t *out = malloc(4096 * 2 * 4);
+
+	for (size_t f = 0; f < sizeof(formats) / sizeof(*formats); f++) {
+		alac_file *alac = decoder(formats[f].frames, formats[f].size, formats[f].channels, formats[f].mult,
+								  formats[f].history, formats[f].kmodifier);
+		int max = formats[f].frames * formats[f].channels * (formats[f].size / 8);
+
+		for (int p = 0; p < 400; p++) {
+			size_t len;
+			int size, rc;
+
+			synth(pcm, 352, p);
+			if (p % 4 == 3) {
+				// random bytes
+				len = rnd() % sizeof(bad);
+				for (size_t i = 0; i < len; i++) bad[i] = rnd();
+			} else {
+				// flipped bits, truncated or extended with garbage
+				len = alacenc_encode(p & 1 ? fast : enc, (uint8_t*) pcm, 352, packet);
+				memcpy(bad, packet, len);
+				for (int n = rnd() % 8; n >= 0; n--) bad[rnd() % len] ^= 1 << (rnd() % 8);
+				if (p % 5 == 0) len = rnd() % len;
+				else if (p % 7 == 0) for (; len < 1500; len++) bad[len] = rnd();
+			}
+
+			rc = decode_frame(alac, bad, len, out, &size);
+			CHECK(rc == 0 || rc == -1, "returned %d", rc);
+			CHECK(rc == 0 ? size >= 0 && size <= max : size == 0, "format %zu packet %d rc:%d size:%d", f, p, rc, size);
+		}
+
+		delete_alac(alac);
+	}
+
+	free(out);
+	alacenc_delete(fast);
+	alacenc_delete(enc);
+}
+
+int main(void) {
+	// decoder's scalar and SIMD code
+	for (int level = ALAC_SIMD_NONE; level <= ALAC_SIMD_WIDE; level++) {
+		if (alac_simd(level) != level) continue;
+		round_trip(352, false);
+		round_trip(352, true);
+		round_trip(4096, false);
+		round_trip(4096, true);
+	}
+	alac_simd(ALAC_SIMD_AUTO);
+
+	out_of_range();
+	corrupted();
+
+	TEST_END();
+}
@@ -0,0 +1,93 @@
+/*
+ * ALAC SIMD: predictor and de-interlacing give the very same bits at every
+ * SIMD level the cpu has as the scalar code, on deterministic inputs that go
+ * through all their variants (number of coefficients, shifts, sizes). The
+ * decoder is included so that these can be called directly
+ */
+
+#include "test.h"
+#include "../src/alac.c"
+
+static uint32_t seed = 1;
+
+static uint32_t rnd(void) {
+	seed = seed * 1664525 + 1013904223;
+	return seed >> 8;
+}
+
+// mostly small residuals (like real ones) with a few large ones
+static int32_t residual(int bits) {
+	uint32_t r = rnd();
+	int32_t v = r % 64 ? (int32_t) (rnd() % 2048) - 1024 : (int32_t) rnd();
+	return SIGN_EXTENDED32(v, bits);
+}
+
+static int predictor(int level, int runs) {
+	static int32_t error[4096], out[2][4096];
+	int16_t coefs[2][32];
+	int sizes[] = { 16, 17, 20, 21, 24, 25, 32 };
+
+	for (int run = 0; run < runs; run++) {
+		int num = run % 32;
+		int quant = 1 + rnd() % 15;
+		int bits = sizes[rnd() % (sizeof(sizes) / sizeof(*sizes))];
+		// short ones as well, around what fixed versions need
+		int size = run % 4 ? 1 + rnd() % 4096 : 1 + rnd() % (num + 4);
+
+		for (int i = 0; i < size; i++) error[i] = residual(bits);
+		for (int i = 0; i < num; i++) coefs[0][i] = coefs[1][i] = (int16_t) (rnd() % 1024) - 256;
+		memset(out, 0, sizeof(out));
+
+		alac_simd(ALAC_SIMD_NONE);
+		predictor_decompress_fir_adapt(error, out[0], size, bits, coefs[0], num, quant);
+		alac_simd(level);
+		predictor_decompress_fir_adapt(error, out[1], size, bits, coefs[1], num, quant);
+
+		if (memcmp(out[0], out[1], sizeof(out[0])) || memcmp(coefs[0], coefs[1], num * sizeof(int16_t))) {
+			CHECK(0, "level %d coefs:%d quant:%d bits:%d size:%d", level, num, quant, bits, size);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int deinterlace(int level, int runs) {
+	static int32_t a[4096], b[4096];
+	static int16_t out[2][4096 * 2];
+
+	for (int run = 0; run < runs; run++) {
+		int shift = run % 32, weight = run % 3 ? rnd() % 256 : 0;
+		int size = 1 + rnd() % 4096;
+
+		// 17 bits side channel
+		for (int i = 0; i < size; i++) a[i] = residual(17), b[i] = residual(17);
+
+		alac_simd(ALAC_SIMD_NONE);
+		deinterlace_16(a, b, out[0], 2, size, shift, weight);
+		alac_simd(level);
+		deinterlace_16(a, b, out[1], 2, size, shift, weight);
+
+		if (memcmp(out[0], out[1], size * 4)) {
+			CHECK(0, "level %d shift:%d weight:%d size:%d", level, shift, weight, size);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int main(void) {
+	CHECK(alac_simd(ALAC_SIMD_NONE) == ALAC_SIMD_NONE, "scalar can't be forced");
+
+	for (int level = ALAC_SIMD_BASE; level <= ALAC_SIMD_WIDE; level++) {
+		if (alac_simd(level) != level) {
+			fprintf(stderr, "%s: SIMD level %d not available\n", __FILE__, level);
+			continue;
+		}
+		predictor(level, 4000);
+		deinterlace(level, 2000);
+	}
+
+	TEST_END();
+}
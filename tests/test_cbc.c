@@ -0,0 +1,83 @@
+/*
+ * Batch AES-128-CBC: every packet must be what OpenSSL gives for a CBC chain
+ * starting from its key's IV (trailing partial block left clear), whatever
+ * the mix of lengths and keys in a batch. Built with and without CBC_NO_SIMD
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+
+#include "test.h"
+#include "raop_cbc.h"
+
+#define PACKETS	37
+
+static void reference(uint8_t *key, uint8_t *iv, uint8_t *data, int len, bool encrypt) {
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	int blocks = len & ~15, out;
+
+	EVP_CipherInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, iv, encrypt);
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+	if (blocks) EVP_CipherUpdate(ctx, data, &out, data, blocks);
+	EVP_CIPHER_CTX_free(ctx);
+}
+
+int main(void) {
+	uint8_t keys[2][16], ivs[2][16];
+	struct cbc_key_s *cbc[2];
+	cbc_packet_t packets[PACKETS];
+	uint8_t *clear[PACKETS], *expected[PACKETS];
+	int which[PACKETS];
+
+	srand(1);
+	for (int k = 0; k < 2; k++) {
+		for (int i = 0; i < 16; i++) keys[k][i] = rand(), ivs[k][i] = rand();
+		cbc[k] = cbc_create(keys[k], ivs[k]);
+		CHECK(cbc[k] != NULL, "cannot create key %d", k);
+	}
+
+	// FIPS-197 / SP800-38A known answer, CBC-AES128.Encrypt first block
+	uint8_t nist_key[16] = { 0x2b,0x7e,0x15,0x16,0x28,0xae,0xd2,0xa6,0xab,0xf7,0x15,0x88,0x09,0xcf,0x4f,0x3c };
+	uint8_t nist_iv[16] = { 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15 };
+	uint8_t nist_pt[16] = { 0x6b,0xc1,0xbe,0xe2,0x2e,0x40,0x9f,0x96,0xe9,0x3d,0x7e,0x11,0x73,0x93,0x17,0x2a };
+	uint8_t nist_ct[16] = { 0x76,0x49,0xab,0xac,0x81,0x19,0xb2,0x46,0xce,0xe9,0x8e,0x9b,0x12,0xe9,0x19,0x7d };
+	struct cbc_key_s *nist = cbc_create(nist_key, nist_iv);
+	cbc_packet_t one = { nist, nist_pt, 16 };
+	cbc_encrypt(&one, 1);
+	CHECK(!memcmp(nist_pt, nist_ct, 16), "known answer mismatch");
+	cbc_delete(nist);
+
+	// lengths of all kinds, including empty, less than a block and RAOP sizes
+	for (int i = 0; i < PACKETS; i++) {
+		int len = i < 8 ? i * 5 : (i % 3 ? 1408 + i : rand() % 2000);
+		which[i] = rand() & 1;
+		clear[i] = malloc(len + 1);
+		expected[i] = malloc(len + 1);
+		for (int j = 0; j < len; j++) clear[i][j] = rand();
+		memcpy(expected[i], clear[i], len);
+		reference(keys[which[i]], ivs[which[i]], expected[i], len, true);
+		packets[i] = (cbc_packet_t) { cbc[which[i]], malloc(len + 1), len };
+		memcpy(packets[i].data, clear[i], len);
+	}
+
+	cbc_encrypt(packets, PACKETS);
+	for (int i = 0; i < PACKETS; i++) {
+		CHECK(!memcmp(packets[i].data, expected[i], packets[i].len), "packet %d (len %d) encryption differs", i, packets[i].len);
+	}
+
+	cbc_decrypt(packets, PACKETS);
+	for (int i = 0; i < PACKETS; i++) {
+		CHECK(!memcmp(packets[i].data, clear[i], packets[i].len), "packet %d (len %d) decryption differs", i, packets[i].len);
+		free(packets[i].data);
+		free(clear[i]);
+		free(expected[i]);
+	}
+
+	for (int k = 0; k < 2; k++) cbc_delete(cbc[k]);
+	cbc_delete(NULL);
+
+	TEST_END();
+}
@@ -0,0 +1,73 @@
+/*
+ * Lock profiling: sites are counted separately, the last slot only collects
+ * sites that don't fit and profiling can be toggled while locks are used
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "test.h"
+#include "raop_lock.h"
+
+static raop_lock_t lock;
+static bool running = true;
+
+static void *thread_toggle(void *arg) {
+	for (int i = 0; __atomic_load_n(&running, __ATOMIC_RELAXED); i++) raop_lock_profile(i & 1);
+	return NULL;
+}
+
+static void *thread_lock(void *arg) {
+	for (int i = 0; i < 100000; i++) {
+		raop_lock(&lock);
+		raop_unlock(&lock);
+	}
+	return NULL;
+}
+
+#define SITE(n) static void site_##n(void) { raop_lock(&lock); raop_unlock(&lock); }
+SITE(0) SITE(1) SITE(2) SITE(3) SITE(4) SITE(5) SITE(6) SITE(7) SITE(8) SITE(9)
+SITE(10) SITE(11) SITE(12) SITE(13) SITE(14) SITE(15) SITE(16) SITE(17)
+
+int main(void) {
+	void (*sites[])(void) = { site_0, site_1, site_2, site_3, site_4, site_5, site_6, site_7, site_8,
+							  site_9, site_10, site_11, site_12, site_13, site_14, site_15, site_16, site_17 };
+	raop_lock_stats_t stats;
+	int n = sizeof(sites) / sizeof(*sites);
+
+	raop_lock_init(&lock);
+	raop_lock_profile(true);
+
+	for (int i = 0; i < n; i++) for (int j = 0; j <= i; j++) sites[i]();
+
+	raop_lock(&lock);
+	raop_lock_stats(&lock, &stats);
+	raop_unlock(&lock);
+
+	CHECK(stats.count == RAOP_LOCK_SITES, "%d sites", stats.count);
+
+	// each real site has its own counts, the others slot has only those that don't fit
+	for (int i = 0; i < RAOP_LOCK_SITES - 1; i++) {
+		CHECK(strcmp(stats.sites[i].func, "(others)"), "slot %d is others", i);
+		CHECK(stats.sites[i].count == (uint32_t) i + 1, "slot %d count %u", i, stats.sites[i].count);
+	}
+
+	raop_lock_site_t *others = stats.sites + RAOP_LOCK_SITES - 1;
+	uint32_t expected = 1;		// the one taken to read statistics
+	for (int i = RAOP_LOCK_SITES - 1; i < n; i++) expected += i + 1;
+	CHECK(!strcmp(others->func, "(others)") && !others->line, "last slot is %s:%d", others->func, others->line);
+	CHECK(others->count == expected, "others count %u instead of %u", others->count, expected);
+
+	// toggling at runtime while contending (run with thread sanitizer as well)
+	pthread_t toggle, threads[2];
+	pthread_create(&toggle, NULL, thread_toggle, NULL);
+	for (int i = 0; i < 2; i++) pthread_create(threads + i, NULL, thread_lock, NULL);
+	for (int i = 0; i < 2; i++) pthread_join(threads[i], NULL);
+	__atomic_store_n(&running, false, __ATOMIC_RELAXED);
+	pthread_join(toggle, NULL);
+
+	raop_lock_destroy(&lock);
+
+	TEST_END();
+}
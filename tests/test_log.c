@@ -0,0 +1,131 @@
+/*
+ * Asynchronous logger: output must be the same as synchronous logging,
+ * strings are bounded by their precision, long messages are not cut and
+ * nothing is lost with several threads unless a ring is full
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "test.h"
+#include "cross_log.h"
+#include "raop_log.h"
+
+static log_level level = lSDEBUG;
+static log_level *loglevel = &level;
+
+static struct {
+	pthread_mutex_t mutex;
+	char data[1 << 20];
+	size_t len;
+	int lines;
+} out = { PTHREAD_MUTEX_INITIALIZER };
+
+void logprint(const char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	pthread_mutex_lock(&out.mutex);
+	out.len += vsnprintf(out.data + out.len, sizeof(out.data) - out.len, fmt, args);
+	out.lines++;
+	pthread_mutex_unlock(&out.mutex);
+	va_end(args);
+}
+
+const char *logtime(void) {
+	return "[time]";
+}
+
+static void out_reset(void) {
+	out.len = out.lines = 0;
+	out.data[0] = '\0';
+}
+
+// message without its timestamp (which differs between sync and async)
+static const char *message(const char *line) {
+	const char *p = strchr(line, ']');
+	return p ? p + 2 : line;
+}
+
+static const char *volatile null;
+
+static void log_all(const char *slice, int len) {
+	LOG_INFO("ints %d %u %ld %lld %zu %x %hhd %c %jd %5d|%-5d|", -1, 3u, 1234567890L, -5LL, (size_t) 77, 255, 300, 'Q', (intmax_t) -9, 42, 7);
+	LOG_INFO("floats %5.2f %e %Lf", 3.14159, 1e-3, (long double) 1.5);
+	LOG_INFO("strings %s|%10s|%-4s|%.2s|%.*s|%*s|%s", "str", "right", "l", "cut", len, slice, 6, "w", null);
+	LOG_WARN("percent %% %p", (void*) 0x1234);
+	LOG_ERROR("plain");
+}
+
+static void *thread_log(void *arg) {
+	for (int i = 0; i < 1000; i++) LOG_DEBUG("thread %ld message %d", (long) (intptr_t) arg, i);
+	return NULL;
+}
+
+int main(void) {
+	char sync[4096], *slice, *big;
+	int len = 5;
+
+	// a slice that is not terminated, overread is caught by sanitizer
+	slice = malloc(len);
+	memcpy(slice, "RTSP/", len);
+
+	log_all(slice, len);
+	strcpy(sync, out.data);
+	out_reset();
+
+	CHECK(raoplog_start(64 * 1024), "cannot start logger");
+	log_all(slice, len);
+	raoplog_stop();
+
+	CHECK(strstr(sync, "|RTSP/|") != NULL, "slice not bounded by precision");
+
+	for (char *s = sync, *a = out.data; *s || *a; ) {
+		char *s_end = strchr(s, '\n'), *a_end = strchr(a, '\n');
+		if (!s_end || !a_end) {
+			CHECK(s_end == a_end, "different line count");
+			break;
+		}
+		*s_end = *a_end = '\0';
+		CHECK(!strcmp(message(s), message(a)), "\n  sync:  %s\n  async: %s", message(s), message(a));
+		s = s_end + 1;
+		a = a_end + 1;
+	}
+
+	free(slice);
+
+	// a message longer than a record is written whole
+	big = malloc(8192);
+	memset(big, 'x', 8191);
+	big[8191] = '\0';
+	out_reset();
+	raoplog_start(64 * 1024);
+	LOG_INFO("dump:\n%s", big);
+	raoplog_stop();
+	CHECK(strstr(out.data, big) != NULL, "long message has been cut");
+	free(big);
+
+	// several threads, ring large enough for everything
+	pthread_t threads[4];
+	out_reset();
+	raoplog_start(1 << 20);
+	for (intptr_t i = 0; i < 4; i++) pthread_create(threads + i, NULL, thread_log, (void*) i);
+	for (int i = 0; i < 4; i++) pthread_join(threads[i], NULL);
+	raoplog_stop();
+	CHECK(out.lines == 4000, "got %d lines", out.lines);
+	CHECK(raoplog_dropped() == 0, "dropped %u", raoplog_dropped());
+
+	// small rings drop but never block, and every message is accounted for
+	out_reset();
+	raoplog_start(1024);
+	for (intptr_t i = 0; i < 4; i++) pthread_create(threads + i, NULL, thread_log, (void*) i);
+	for (int i = 0; i < 4; i++) pthread_join(threads[i], NULL);
+	raoplog_stop();
+	CHECK(raoplog_dropped() > 0, "nothing dropped with a small ring");
+	CHECK(strstr(out.data, "logger dropped") != NULL, "drops not reported");
+
+	TEST_END();
+}
@@ -0,0 +1,139 @@
+/*
+ * Reactor: callbacks of one owner never overlap, whatever threads run them, and
+ * jobs that block (more of them than job threads) don't hold workers' timers
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "test.h"
+#include "cross_log.h"
+#include "cross_net.h"
+#include "raop_reactor.h"
+
+log_level raop_loglevel = lWARN;
+
+/*---------------------------------------------------------------------------*/
+void logprint(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+const char *logtime(void) { return "[time]"; }
+
+/*---------------------------------------------------------------------------*/
+int bind_socket(struct in_addr host, unsigned short *port, int mode) {
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr = host, .sin_port = htons(*port) };
+	socklen_t len = sizeof(addr);
+	int sock = socket(AF_INET, mode, 0);
+
+	if (sock < 0 || bind(sock, (struct sockaddr*) &addr, sizeof(addr)) || getsockname(sock, (struct sockaddr*) &addr, &len)) {
+		if (sock >= 0) close(sock);
+		return -1;
+	}
+
+	*port = ntohs(addr.sin_port);
+	return sock;
+}
+
+/*---------------------------------------------------------------------------*/
+typedef struct {
+	int inside, overlaps;
+	int ticks, jobs;
+} owner_t;
+
+static void enter(owner_t *owner) {
+	if (__atomic_fetch_add(&owner->inside, 1, __ATOMIC_SEQ_CST)) __atomic_fetch_add(&owner->overlaps, 1, __ATOMIC_SEQ_CST);
+}
+
+static void leave(owner_t *owner) {
+	__atomic_fetch_sub(&owner->inside, 1, __ATOMIC_SEQ_CST);
+}
+
+/*---------------------------------------------------------------------------*/
+static uint32_t tick(void *arg) {
+	owner_t *owner = arg;
+	enter(owner);
+	__atomic_fetch_add(&owner->ticks, 1, __ATOMIC_SEQ_CST);
+	leave(owner);
+	return 5;
+}
+
+/*---------------------------------------------------------------------------*/
+static uint32_t slow_job(void *arg) {
+	owner_t *owner = arg;
+	enter(owner);
+	usleep(300 * 1000);
+	__atomic_fetch_add(&owner->jobs, 1, __ATOMIC_SEQ_CST);
+	leave(owner);
+	return REACTOR_NEVER;
+}
+
+/*---------------------------------------------------------------------------*/
+static void slow_read(void *arg, int sock, int events) {
+	owner_t *owner = arg;
+	char byte;
+	enter(owner);
+	recv(sock, &byte, 1, 0);
+	usleep(20 * 1000);
+	__atomic_fetch_add(&owner->jobs, 1, __ATOMIC_SEQ_CST);
+	leave(owner);
+}
+
+/*---------------------------------------------------------------------------*/
+int main(void) {
+	owner_t fast = { 0 }, blocked[REACTOR_JOBS + 1] = { { 0 } }, mixed = { 0 };
+	struct reactor_event_s *jobs[REACTOR_JOBS + 1];
+
+	struct reactor_event_s *timer = reactor_timer(0, tick, &fast);
+	CHECK(timer, "no timer");
+
+	// more blocking jobs than job threads, timer of another owner keeps its pace
+	for (int i = 0; i <= REACTOR_JOBS; i++) {
+		jobs[i] = reactor_job(slow_job, blocked + i);
+		reactor_timer_delay(jobs[i], 0);
+	}
+
+	usleep(200 * 1000);
+	int ticks = __atomic_load_n(&fast.ticks, __ATOMIC_SEQ_CST);
+	CHECK(ticks >= 10, "timer ran %d times while jobs were blocked", ticks);
+
+	usleep(600 * 1000);
+	for (int i = 0; i <= REACTOR_JOBS; i++) {
+		CHECK(blocked[i].jobs == 1, "job %d ran %d times", i, blocked[i].jobs);
+		reactor_remove(jobs[i]);
+	}
+
+	// a blocking socket callback and a timer of the same owner never overlap
+	struct in_addr lo = { htonl(INADDR_LOOPBACK) };
+	unsigned short port = 0;
+	int sock = bind_socket(lo, &port, SOCK_DGRAM);
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr = lo, .sin_port = htons(port) };
+
+	struct reactor_event_s *io = reactor_io(sock, REACTOR_READ | REACTOR_BLOCKING, slow_read, &mixed);
+	struct reactor_event_s *mixed_timer = reactor_timer(0, tick, &mixed);
+	CHECK(io && mixed_timer, "no events");
+
+	for (int i = 0; i < 10; i++) {
+		sendto(sock, "", 1, 0, (struct sockaddr*) &addr, sizeof(addr));
+		usleep(10 * 1000);
+	}
+
+	usleep(300 * 1000);
+	reactor_remove_all(&mixed);
+	CHECK(mixed.jobs == 10, "socket callback ran %d times", mixed.jobs);
+	CHECK(mixed.ticks > 0, "timer did not run");
+	CHECK(!mixed.overlaps && !fast.overlaps, "callbacks overlapped %d times", mixed.overlaps + fast.overlaps);
+	close(sock);
+
+	// last event stops threads
+	reactor_remove(timer);
+
+	TEST_END();
+}
@@ -0,0 +1,230 @@
+/*
+ * Capture replay: replay.rcap (an encrypted session with a resent packet,
+ * RTSP parameters, a truncated record and packets after TEARDOWN) must give
+ * back exactly the audio that was encoded. Run with "--write <file>" to
+ * re-create that capture, a fresh one is also made and replayed each time
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include <openssl/evp.h>
+
+#include "test.h"
+#include "cross_log.h"
+#include "cross_util.h"
+#include "raop_streamer.h"
+#include "raop_capture.h"
+#include "alac_enc.h"
+
+#define FRAMES		352
+#define PACKETS		200
+#define AFTER		10			// packets after TEARDOWN
+#define SEQNO		65500		// both seqno and rtptime wrap
+#define RTPTIME		0xfffff000
+#define START		10000000ULL	// us
+#define FRAME_US	(FRAMES * 1000000ULL / 44100)
+
+log_level raop_loglevel = lWARN;
+
+static const uint8_t key[16] = "0123456789abcdef", iv[16] = "fedcba9876543210";
+
+/*---------------------------------------------------------------------------*/
+// what the streamer needs from elsewhere but does not use when replaying
+void logprint(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+const char *logtime(void) { return "[time]"; }
+char *itoa(int value, char *str, int radix) { sprintf(str, radix == 16 ? "%x" : "%d", value); return str; }
+int bind_socket(struct in_addr host, unsigned short *port, int mode) { return -1; }
+int shutdown_socket(int sd) { return 0; }
+char *kd_lookup(key_data_t *kd, char *key) { return NULL; }
+bool kd_add(key_data_t *kd, char *key, char *value) { return false; }
+bool kd_vadd(key_data_t *kd, char *key, char *fmt, ...) { return false; }
+char *kd_dump(key_data_t *kd) { return NULL; }
+void kd_free(key_data_t *kd) { }
+struct encoder_s *encoder_create(char *codec, int rate, int channels, int sample_size, int bitrate, size_t *icy_interval) { return NULL; }
+void encoder_delete(struct encoder_s *encoder) { }
+bool encoder_open(struct encoder_s *encoder) { return false; }
+void encoder_close(struct encoder_s *encoder) { }
+uint8_t *encoder_encode(struct encoder_s *encoder, int16_t *pcm, size_t frames, size_t *bytes) { *bytes = 0; return NULL; }
+char *encoder_mimetype(struct encoder_s *encoder) { return ""; }
+void raopsr_metadata_free(raopsr_metadata_t *data) { memset(data, 0, sizeof(*data)); }
+void raopsr_metadata_copy(raopsr_metadata_t *dst, raopsr_metadata_t *src) { memset(dst, 0, sizeof(*dst)); }
+
+/*---------------------------------------------------------------------------*/
+// integers only so that it's the same everywhere
+static void synth(int16_t *pcm, int packet) {
+	for (int i = 0; i < FRAMES; i++) {
+		int n = packet * FRAMES + i;
+		pcm[2 * i] = (n % 200 - 100) * 150;
+		pcm[2 * i + 1] = ((n * 7) % 331 - 165) * 90;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void put32(uint8_t *p, uint32_t v) {
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+/*---------------------------------------------------------------------------*/
+static void put_ntp(uint8_t *p, uint64_t us) {
+	put32(p, us / 1000000);
+	put32(p + 4, ((us % 1000000) << 32) / 1000000);
+}
+
+/*---------------------------------------------------------------------------*/
+static size_t data_packet(uint8_t *packet, struct alacenc_s *enc, int n) {
+	int16_t pcm[FRAMES * 2];
+	int len;
+
+	synth(pcm, n);
+	packet[0] = 0x80;
+	packet[1] = n ? 0x60 : 0xe0;
+	*(uint16_t*) (packet + 2) = htons((uint16_t) (SEQNO + n));
+	put32(packet + 4, RTPTIME + n * FRAMES);
+	put32(packet + 8, 0x1234);
+
+	size_t size = alacenc_encode(enc, (uint8_t*) pcm, FRAMES, packet + 12);
+
+	// only whole blocks are encrypted, with same iv for all packets
+	EVP_CIPHER_CTX *cipher = EVP_CIPHER_CTX_new();
+	EVP_EncryptInit_ex(cipher, EVP_aes_128_cbc(), NULL, key, iv);
+	EVP_CIPHER_CTX_set_padding(cipher, 0);
+	EVP_EncryptUpdate(cipher, packet + 12, &len, packet + 12, size & ~0xf);
+	EVP_CIPHER_CTX_free(cipher);
+
+	return size + 12;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool write_capture(const char *path) {
+	struct capture_s *cap = capture_create();
+	struct alacenc_s *enc = alacenc_create(FRAMES, false);
+	uint8_t record[2048], *p;
+	uint64_t now = START;
+
+	if (!capture_start(cap, path)) return false;
+
+	// drift (no correction), decrypt, http length then key, iv, codec, latencies and fmtp
+	record[0] = 0x01 | 0x08;
+	capture_put(record + 1, 0, 4);
+	memcpy(record + 5, key, 16);
+	memcpy(record + 21, iv, 16);
+	p = record + 37;
+	p += sprintf((char*) p, "flc") + 1;
+	p += sprintf((char*) p, "1000:0") + 1;
+	p += sprintf((char*) p, "96 %d 0 16 40 10 14 2 255 0 0 44100", FRAMES) + 1;
+	capture_write(cap, CAPTURE_SESSION, 0, now, record, p - record);
+
+	capture_put(record, SEQNO, 2);
+	capture_put(record + 2, RTPTIME, 4);
+	capture_write(cap, CAPTURE_RECORD, 0, now, record, 6);
+
+	capture_write(cap, CAPTURE_PARAMETER, 0, now, "volume: -20.000000\r\n", 20);
+
+	// truncated, must be ignored
+	capture_write(cap, CAPTURE_FLUSH, 0, now, record, 3);
+
+	// timing answer, remote clock is ours
+	memset(record, 0, 32);
+	record[0] = 0x80;
+	record[1] = 0xd3;
+	put32(record + 8, START >> 32);
+	put32(record + 12, START & 0xffffffff);
+	put_ntp(record + 16, START + 500);
+	put_ntp(record + 24, START + 500);
+	capture_write(cap, CAPTURE_PACKET, 2, now += 1000, record, 32);
+
+	// first frame plays in 1s
+	memset(record, 0, 20);
+	record[0] = 0x90;
+	record[1] = 0xd4;
+	put32(record + 4, RTPTIME - 44100);
+	put_ntp(record + 8, now += 1000);
+	put32(record + 16, RTPTIME);
+	capture_write(cap, CAPTURE_PACKET, 1, now, record, 20);
+
+	for (int n = 0; n < PACKETS + AFTER; n++) {
+		now += FRAME_US;
+
+		if (n == PACKETS / 2) {
+			// metadata, artwork and a resent packet in the middle
+			capture_write(cap, CAPTURE_METADATA, 0, now, "mlit", 4);
+			capture_put(record, 100000, 4);
+			capture_write(cap, CAPTURE_ARTWORK, 0, now, record, 4);
+			size_t len = data_packet(record + 4, enc, n - 5);
+			record[0] = 0x80;
+			record[1] = 0xd6;
+			capture_write(cap, CAPTURE_PACKET, 1, now, record, len + 4);
+		}
+
+		if (n == PACKETS) capture_write(cap, CAPTURE_TEARDOWN, 0, now, NULL, 0);
+
+		size_t len = data_packet(record, enc, n);
+		capture_write(cap, CAPTURE_PACKET, 0, now, record, len);
+	}
+
+	capture_delete(cap);
+	alacenc_delete(enc);
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+static void check_replay(const char *path) {
+	char *out;
+	size_t size;
+	FILE *file = open_memstream(&out, &size);
+
+	CHECK(raopst_replay((char*) path, file), "%s can't be replayed", path);
+	fclose(file);
+
+	// resampler keeps a few frames of history (nothing comes after TEARDOWN)
+	CHECK(size <= PACKETS * FRAMES * 4 && size >= (PACKETS * FRAMES - 16) * 4, "%s gives %zu bytes instead of %d", path, size, PACKETS * FRAMES * 4);
+
+	for (int n = 0; n < PACKETS; n++) {
+		int16_t pcm[FRAMES * 2];
+		size_t len = min(sizeof(pcm), size - min(size, n * sizeof(pcm)));
+		synth(pcm, n);
+		if (memcmp(out + n * sizeof(pcm), pcm, len)) {
+			CHECK(false, "%s packet %d differs", path, n);
+			break;
+		}
+	}
+
+	free(out);
+}
+
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[]) {
+	char path[] = "/tmp/test_replay_XXXXXX";
+	struct stat st;
+
+	if (argc == 3 && !strcmp(argv[1], "--write")) return write_capture(argv[2]) ? 0 : 1;
+
+	// committed capture
+	check_replay("replay.rcap");
+
+	// a new one, that must be private
+	close(mkstemp(path));
+	chmod(path, 0644);
+	CHECK(write_capture(path), "can't write %s", path);
+	CHECK(!stat(path, &st) && (st.st_mode & 0777) == 0600, "capture mode is %o", st.st_mode & 0777);
+	check_replay(path);
+	unlink(path);
+
+	CHECK(!raopst_replay("/nonexistent.rcap", NULL), "replayed a missing file");
+
+	TEST_END();
+}
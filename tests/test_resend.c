@@ -0,0 +1,48 @@
+/*
+ * Resend scheduler: each request of a missing frame is sent within one wheel
+ * tick of its due time, even when it falls in the middle of a slot
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "test.h"
+#include "raop_resend.h"
+
+#define TICK		8		// wheel tick of raop_resend.c
+#define INTERVAL	40		// first retry interval, rtt is 0
+#define ATTEMPTS	5
+
+static uint32_t now, sent[ATTEMPTS + 1];
+static int count;
+
+/*---------------------------------------------------------------------------*/
+static bool send(void *owner, uint16_t first, uint16_t last) {
+	CHECK(first == 10 && last == 10, "asked for %u-%u", first, last);
+	if (count <= ATTEMPTS) sent[count] = now;
+	count++;
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+int main(void) {
+	struct resend_s *rs = resend_create(64);
+	CHECK(rs, "no scheduler");
+
+	// first request is at 3, so every retry is due in the middle of a slot
+	resend_missing(rs, 10, 10000, 0);
+	for (now = 3; now < 2000; now++) resend_poll(rs, now, 0, 0, send, NULL);
+
+	CHECK(count == ATTEMPTS, "%d requests sent", count);
+	for (int i = 1; i < count && i < ATTEMPTS; i++) {
+		uint32_t due = sent[i - 1] + (INTERVAL << (i - 1));
+		CHECK(sent[i] >= due && sent[i] <= due + TICK, "request %d sent at %u, due at %u", i, sent[i], due);
+	}
+
+	resend_stats_t stats = resend_stats(rs);
+	CHECK(stats.requested == ATTEMPTS && stats.abandoned == 1 && !resend_pending(rs),
+		  "requested %u, abandoned %u, pending %d", stats.requested, stats.abandoned, resend_pending(rs));
+
+	resend_delete(rs);
+	TEST_END();
+}
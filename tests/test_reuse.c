@@ -0,0 +1,125 @@
+/*
+ * Session re-use: when latency is not configured, each peer gives its own with
+ * its first sync packet and a re-used session must not keep previous one's
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "test.h"
+#include "cross_log.h"
+#include "cross_util.h"
+#include "raop_streamer.h"
+
+#define FMTP	"96 352 0 16 40 10 14 2 255 0 0 44100"
+
+log_level raop_loglevel = lWARN;
+
+/*---------------------------------------------------------------------------*/
+// what the streamer needs from elsewhere but does not use with a PCM sink
+void logprint(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+const char *logtime(void) { return "[time]"; }
+char *itoa(int value, char *str, int radix) { sprintf(str, radix == 16 ? "%x" : "%d", value); return str; }
+int shutdown_socket(int sd) { return close(sd); }
+char *kd_lookup(key_data_t *kd, char *key) { return NULL; }
+bool kd_add(key_data_t *kd, char *key, char *value) { return false; }
+bool kd_vadd(key_data_t *kd, char *key, char *fmt, ...) { return false; }
+char *kd_dump(key_data_t *kd) { return NULL; }
+void kd_free(key_data_t *kd) { }
+struct encoder_s *encoder_create(char *codec, int rate, int channels, int sample_size, int bitrate, size_t *icy_interval) { return NULL; }
+void encoder_delete(struct encoder_s *encoder) { }
+bool encoder_open(struct encoder_s *encoder) { return false; }
+void encoder_close(struct encoder_s *encoder) { }
+uint8_t *encoder_encode(struct encoder_s *encoder, int16_t *pcm, size_t frames, size_t *bytes) { *bytes = 0; return NULL; }
+char *encoder_mimetype(struct encoder_s *encoder) { return ""; }
+void raopsr_metadata_free(raopsr_metadata_t *data) { memset(data, 0, sizeof(*data)); }
+void raopsr_metadata_copy(raopsr_metadata_t *dst, raopsr_metadata_t *src) { memset(dst, 0, sizeof(*dst)); }
+
+/*---------------------------------------------------------------------------*/
+int bind_socket(struct in_addr host, unsigned short *port, int mode) {
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr = host, .sin_port = htons(*port) };
+	socklen_t len = sizeof(addr);
+	int sock = socket(AF_INET, mode, 0);
+
+	if (sock < 0 || bind(sock, (struct sockaddr*) &addr, sizeof(addr)) || getsockname(sock, (struct sockaddr*) &addr, &len)) {
+		if (sock >= 0) close(sock);
+		return -1;
+	}
+
+	*port = ntohs(addr.sin_port);
+	return sock;
+}
+
+static void pcm_cb(void *owner, int16_t *pcm, size_t frames, uint32_t playtime) { }
+static void event_cb(void *owner, raopst_event_t event) { }
+
+/*---------------------------------------------------------------------------*/
+static void put32(uint8_t *p, uint32_t v) {
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+/*---------------------------------------------------------------------------*/
+// first sync packet of a peer that plays frames latency (ms) after they are sent
+static uint32_t sync_latency(struct raopst_s *ctx, int sock, unsigned short cport, uint32_t latency) {
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr = { htonl(INADDR_LOOPBACK) }, .sin_port = htons(cport) };
+	uint8_t packet[20] = { 0x90, 0xd4 };
+	raopst_stats_t stats;
+
+	put32(packet + 4, 100000 - (latency * 44100) / 1000);
+	put32(packet + 16, 100000);
+	sendto(sock, packet, sizeof(packet), 0, (struct sockaddr*) &addr, sizeof(addr));
+
+	// packet is processed by reactor
+	for (int i = 0; i < 100; i++) {
+		raopst_get_stats(ctx, &stats);
+		if (stats.buffer.latency) break;
+		usleep(10 * 1000);
+	}
+
+	return stats.buffer.latency;
+}
+
+/*---------------------------------------------------------------------------*/
+int main(void) {
+	struct in_addr lo = { htonl(INADDR_LOOPBACK) };
+	unsigned short ports[2] = { 0, 0 };
+	int peers[2] = { bind_socket(lo, ports, SOCK_DGRAM), bind_socket(lo, ports + 1, SOCK_DGRAM) };
+	raopst_stats_t stats;
+
+	CHECK(peers[0] >= 0 && peers[1] >= 0, "no peer sockets");
+
+	raopst_resp_t resp = raopst_init(lo, lo, "", false, false, false, "0:0", NULL, NULL, FMTP, ports[0], ports[0],
+									 NULL, event_cb, NULL, pcm_cb, 0, 0, 0);
+	CHECK(resp.ctx, "no session");
+	if (!resp.ctx) TEST_END();
+
+	uint32_t latency = sync_latency(resp.ctx, peers[0], resp.cport, 2000);
+	CHECK(latency == 2000, "first peer latency is %u ms", latency);
+
+	// second peer has its own latency
+	raopst_park(resp.ctx);
+	CHECK(raopst_reuse(resp.ctx, lo, NULL, NULL, FMTP, ports[1], ports[1], &resp), "session not re-used");
+
+	raopst_get_stats(resp.ctx, &stats);
+	CHECK(stats.buffer.latency == 0, "re-used session starts with %u ms latency", stats.buffer.latency);
+
+	latency = sync_latency(resp.ctx, peers[1], resp.cport, 500);
+	CHECK(latency == 500, "second peer latency is %u ms", latency);
+
+	raopst_end(resp.ctx);
+	for (int i = 0; i < 2; i++) close(peers[i]);
+
+	TEST_END();
+}
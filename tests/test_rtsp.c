@@ -0,0 +1,197 @@
+/*
+ * RTSP parser: requests split at any byte or pipelined are parsed the same,
+ * limits are enforced and body fields are only matched as whole line names
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "test.h"
+#include "raop_rtsp.h"
+
+static const char announce[] =
+	"ANNOUNCE rtsp://192.168.1.2/123 RTSP/1.0\r\n"
+	"CSeq: 3\r\n"
+	"Content-Type: application/sdp\r\n"
+	"content-length: 88\r\n"
+	"X-Apple-Session-ID: 1234\r\n"
+	"DACP-ID: ABCDEF\r\n"
+	"\r\n"
+	"v=0\r\n"
+	"a=x-aesiv-comment:none\r\n"
+	"a=fmtp:96 352 0 16 40 10 14 2 255 0 0 44100\r\n"
+	"a=aesiv:AAEC\r\n";
+
+static const char setup[] =
+	"SETUP rtsp://192.168.1.2/123 RTSP/1.0\r\n"
+	"Transport: RTP/AVP/UDP;unicast;interleaved=0-1;mode=record;control_port=6001;timing_port=6002\r\n"
+	"CSeq: 4\r\n"
+	"\r\n";
+
+// reads what is there, last bytes are kept as a string in tail
+static size_t drain(int sock, char *tail) {
+	char buffer[4096];
+	size_t got = 0;
+	ssize_t n;
+
+	while ((n = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+		got += n;
+		if (!tail) continue;
+		size_t keep = n < 63 ? n : 63;
+		size_t old = strlen(tail);
+		if (old + keep > 63) memmove(tail, tail + old + keep - 63, 63 - keep), old = 63 - keep;
+		memcpy(tail + old, buffer + n - keep, keep);
+		tail[old + keep] = '\0';
+	}
+
+	return got;
+}
+
+static void check_announce(rtsp_request_t *request) {
+	rtsp_view_t value;
+
+	CHECK(request->method == RTSP_ANNOUNCE, "method %d", request->method);
+	CHECK(rtsp_view_is(request->headers[RTSP_CSEQ], "3"), "cseq");
+	CHECK(request->body.len == 88, "body %zu", request->body.len);
+	CHECK(rtsp_view_is(request->headers[RTSP_DACP_ID], "ABCDEF"), "dacp-id");
+
+	CHECK(rtsp_field(request->body, "a=fmtp", &value) && rtsp_view_is(value, "96 352 0 16 40 10 14 2 255 0 0 44100"), "fmtp");
+	// not inside another name, not without type
+	CHECK(rtsp_field(request->body, "a=aesiv", &value) && rtsp_view_is(value, "AAEC"), "aesiv");
+	CHECK(!rtsp_field(request->body, "aesiv", &value), "aesiv found without type");
+	CHECK(!rtsp_field(request->body, "a=x", &value), "prefix of a name matched");
+}
+
+static void feed(int sock, const char *data, size_t len) {
+	CHECK(send(sock, data, len, 0) == (ssize_t) len, "send");
+}
+
+int main(void) {
+	rtsp_conn_t conn = { 0 };
+	rtsp_request_t *request;
+	rtsp_view_t value;
+	int sv[2];
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+
+	// split at every possible point
+	for (size_t split = 1; split < sizeof(announce) - 1; split++) {
+		feed(sv[0], announce, split);
+		CHECK(rtsp_receive(&conn, sv[1]) == (int) split, "receive");
+		CHECK(rtsp_next(&conn, &request) && !request, "complete at %zu", split);
+		feed(sv[0], announce + split, sizeof(announce) - 1 - split);
+		rtsp_receive(&conn, sv[1]);
+		CHECK(rtsp_next(&conn, &request) && request, "incomplete at %zu", split);
+		if (request) check_announce(request);
+		rtsp_consume(&conn);
+		CHECK(conn.len == 0, "left %zu", conn.len);
+	}
+
+	// pipelined
+	feed(sv[0], setup, sizeof(setup) - 1);
+	feed(sv[0], announce, sizeof(announce) - 1);
+	rtsp_receive(&conn, sv[1]);
+	CHECK(rtsp_next(&conn, &request) && request && request->method == RTSP_SETUP, "first pipelined");
+	if (request) {
+		CHECK(rtsp_param(request->headers[RTSP_TRANSPORT], "control_port", &value) && rtsp_uint(value) == 6001, "control_port");
+		CHECK(rtsp_param(request->headers[RTSP_TRANSPORT], "timing_port", &value) && rtsp_uint(value) == 6002, "timing_port");
+		CHECK(!rtsp_param(request->headers[RTSP_TRANSPORT], "port", &value), "partial param name");
+	}
+	rtsp_consume(&conn);
+	CHECK(rtsp_next(&conn, &request) && request, "second pipelined");
+	if (request) check_announce(request);
+	rtsp_consume(&conn);
+
+	// body much larger than buffer, that grows once head is parsed
+	char head[128], *image = malloc(100000);
+	for (int i = 0; i < 100000; i++) image[i] = i;
+	int len = sprintf(head, "SET_PARAMETER rtsp://x RTSP/1.0\r\nContent-Type: image/jpeg\r\nCSeq: 9\r\nContent-Length: 100000\r\n\r\n");
+	feed(sv[0], head, len);
+	rtsp_receive(&conn, sv[1]);
+	CHECK(rtsp_next(&conn, &request) && !request, "incomplete image");
+	for (int sent = 0; sent < 100000; sent += 10000) {
+		feed(sv[0], image + sent, 10000);
+		while (rtsp_receive(&conn, sv[1]) <= 0);
+	}
+	while (rtsp_next(&conn, &request) && !request) rtsp_receive(&conn, sv[1]);
+	CHECK(request && request->body.len == 100000 && !memcmp(request->body.data, image, 100000), "image body");
+	CHECK(request && rtsp_view_is(request->headers[RTSP_CSEQ], "9") && rtsp_view_is(request->headers[RTSP_CONTENT_TYPE], "image/jpeg"), "headers after growth");
+	rtsp_consume(&conn);
+	free(image);
+
+	// body fields
+	rtsp_view_t params = { "progress: 1/2/3\r\nX-volume: -3\r\nvolume: -20.5\r\n", 47 };
+	CHECK(rtsp_field(params, "volume", &value) && rtsp_double(value) == -20.5, "volume");
+	CHECK(rtsp_field(params, "VOLUME", &value), "field names are case insensitive");
+	params.len = 20;
+	CHECK(!rtsp_field(params, "volume", &value), "volume found in X-volume or past view");
+
+	// base64 without padding and exact lengths
+	uint8_t iv[32];
+	CHECK(rtsp_base64((rtsp_view_t) { "AAECAwQFBgcICQoLDA0ODw", 22 }, iv, sizeof(iv)) == 16 && iv[15] == 15, "base64 iv");
+	CHECK(rtsp_base64((rtsp_view_t) { "AAECAwQFBgcICQoLDA0ODxAR", 24 }, iv, sizeof(iv)) == 18, "base64 longer");
+
+	// malformed and too large
+	feed(sv[0], "GARBAGE\r\n\r\n", 11);
+	rtsp_receive(&conn, sv[1]);
+	CHECK(!rtsp_next(&conn, &request), "no request line accepted");
+	rtsp_conn_reset(&conn);
+
+	char *big = malloc(RTSP_HEAD_MAX);
+	memset(big, 'x', RTSP_HEAD_MAX);
+	feed(sv[0], "OPTIONS * RTSP/1.0\r\n", 20);
+	feed(sv[0], big, RTSP_HEAD_MAX);
+	while (conn.len < RTSP_HEAD_MAX + 20 && rtsp_receive(&conn, sv[1]) > 0);
+	CHECK(!rtsp_next(&conn, &request), "head over limit accepted");
+	free(big);
+	rtsp_conn_reset(&conn);
+
+	const char *huge = "SET_PARAMETER * RTSP/1.0\r\nContent-Length: 99999999\r\n\r\n";
+	feed(sv[0], huge, strlen(huge));
+	rtsp_receive(&conn, sv[1]);
+	CHECK(!rtsp_next(&conn, &request), "body over limit accepted");
+
+	// responses drop what does not fit but stay terminated
+	rtsp_response_t resp;
+	rtsp_response_init(&resp, "RTSP/1.0 200 OK");
+	rtsp_response_add(&resp, "CSeq", "%d", 3);
+	char *long_value = calloc(1, RTSP_RESPONSE_SIZE);
+	memset(long_value, 'y', RTSP_RESPONSE_SIZE - 1);
+	rtsp_response_add(&resp, "Long", "%s", long_value);
+	free(long_value);
+	CHECK(rtsp_response_send(&resp, &conn, sv[0]), "send response");
+	CHECK(!strcmp(resp.data, "RTSP/1.0 200 OK\r\nCSeq: 3\r\n\r\n"), "response %s", resp.data);
+	CHECK(rtsp_flush(&conn, sv[0]) == 0, "response left queued");
+	CHECK(drain(sv[1], NULL) == resp.len, "response not received");
+
+	// what a full socket does not take is queued, then sent in order when it can
+	static char fill[4096];
+	size_t filled = 0, got = 0;
+	ssize_t n;
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+	while ((n = send(sv[0], fill, sizeof(fill), 0)) > 0) filled += n;
+
+	rtsp_response_init(&resp, "RTSP/1.0 200 OK");
+	rtsp_response_add(&resp, "CSeq", "%d", 4);
+	CHECK(rtsp_response_send(&resp, &conn, sv[0]), "queue response");
+	CHECK(rtsp_flush(&conn, sv[0]) == (int) resp.len, "queued %d bytes", rtsp_flush(&conn, sv[0]));
+
+	char tail[64] = "";
+	int left;
+	do {
+		got += drain(sv[1], tail);
+		left = rtsp_flush(&conn, sv[0]);
+	} while (left > 0);
+	got += drain(sv[1], tail);
+	CHECK(left == 0 && got == filled + resp.len, "received %zu bytes of %zu", got, filled + resp.len);
+	CHECK(!strcmp(tail, resp.data), "response not last");
+
+	rtsp_conn_free(&conn);
+	close(sv[0]);
+	close(sv[1]);
+
+	TEST_END();
+}